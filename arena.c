@@ -0,0 +1,63 @@
+#include "arena.h"
+#include "bufpool.h"
+#include "metrics.h"
+#include <stdlib.h>
+
+static BufferPool block_pool;
+
+void arena_pool_init(void) {
+    buffer_pool_init(&block_pool, ARENA_SIZE, ARENA_POOL_KEEP);
+}
+
+void arena_pool_destroy(void) {
+    buffer_pool_destroy(&block_pool);
+}
+
+void arena_init(Arena* arena) {
+    arena->base = NULL;
+    arena->size = 0;
+    arena->used = 0;
+    arena->overflow = NULL;
+}
+
+void arena_destroy(Arena* arena) {
+    arena_reset(arena);
+}
+
+void* arena_alloc(Arena* arena, int size) {
+    if (arena->base == NULL) {
+        arena->base = (char*)buffer_pool_get(&block_pool);
+        arena->size = arena->base != NULL ? ARENA_SIZE : 0;
+    }
+
+    int start = (arena->used + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    if (start + size <= arena->size) {
+        arena->used = start + size;
+        return arena->base + start;
+    }
+
+    // Out of room: take it from the heap and count it, since in steady state
+    // this should not happen.
+    ArenaOverflow* block = (ArenaOverflow*)malloc(ARENA_ALIGN + size);
+    if (block == NULL) {
+        return NULL;
+    }
+    metric_inc(METRIC_HEAP_ALLOCS);
+    block->next = arena->overflow;
+    arena->overflow = block;
+    return (char*)block + ARENA_ALIGN;
+}
+
+void arena_reset(Arena* arena) {
+    while (arena->overflow != NULL) {
+        ArenaOverflow* block = arena->overflow;
+        arena->overflow = block->next;
+        free(block);
+    }
+    if (arena->base != NULL) {
+        buffer_pool_put(&block_pool, arena->base);
+        arena->base = NULL;
+        arena->size = 0;
+    }
+    arena->used = 0;
+}
@@ -0,0 +1,33 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+// Bump allocator for scratch memory that lives only while one batch of frames
+// is processed: decoded messages, formatted lines, command responses. Nothing
+// is freed individually; arena_reset releases everything at once. The block
+// comes from a shared pool on the first allocation and goes back on reset,
+// so an arena costs nothing between batches. Requests that do not fit fall
+// back to the heap until the next reset.
+
+#define ARENA_SIZE (32 * 1024)
+#define ARENA_ALIGN 16
+#define ARENA_POOL_KEEP 64          // Free blocks kept for reuse
+
+typedef struct ArenaOverflow {
+    struct ArenaOverflow* next;
+} ArenaOverflow;
+
+typedef struct {
+    char* base;                 // NULL between batches
+    int size;
+    int used;
+    ArenaOverflow* overflow;  // Heap blocks handed out since the last reset
+} Arena;
+
+void arena_pool_init(void);
+void arena_pool_destroy(void);
+void arena_init(Arena* arena);
+void arena_destroy(Arena* arena);
+void* arena_alloc(Arena* arena, int size);
+void arena_reset(Arena* arena);
+
+#endif // ARENA_H
@@ -1,184 +1,505 @@
 #include "auth.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <windows.h>
+#include "probes.h"
+#include "textproc.h"
 
-int register_user(const char* username, const char* password) {
-    FILE* file;
-    User user;
-    
-    printf("Registering user: %s\n", username);
-    
-    // Check if user exists
-    file = fopen(USERS_FILE, "r");
-    if (file != NULL) {
-        while (fscanf(file, "%s %s", user.username, user.password) != EOF) {
-            printf("Checking against existing user: %s\n", user.username);
-            if (strcmp(user.username, username) == 0) {
-                fclose(file);
-                printf("User already exists: %s\n", username);
-                return AUTH_USER_EXISTS;
-            }
-        }
-        fclose(file);
+#define USER_INDEX_MIN_CAPACITY 1024
+#define USER_LINE_MAX 128
+
+static CRITICAL_SECTION users_lock;     // Guards the index and appends to USERS_FILE
+static UserSnapshotHeader* index_header = NULL;  // Followed by the slots
+static UserSlot* index_slots = NULL;
+static void* mapped_view = NULL;        // Set while the index is the snapshot's copy-on-write pages
+static int index_dirty = 0;             // Changed since the last snapshot
+
+static unsigned int hash_name(const char* name) {
+    unsigned int hash = 2166136261u;
+    while (*name) {
+        hash = (hash ^ (unsigned char)*name++) * 16777619u;
+    }
+    return hash;
+}
+
+static size_t index_bytes(int capacity) {
+    return sizeof(UserSnapshotHeader) + (size_t)capacity * sizeof(UserSlot);
+}
+
+static void index_release(void) {
+    if (mapped_view != NULL) {
+        UnmapViewOfFile(mapped_view);
+        mapped_view = NULL;
     } else {
-        printf("User file doesn't exist yet, will be created\n");
+        free(index_header);
     }
-    
-    // Add new user
-    file = fopen(USERS_FILE, "a");
-    if (file == NULL) {
-        printf("Failed to open users file for writing\n");
-        return AUTH_FAILED;
+    index_header = NULL;
+    index_slots = NULL;
+}
+
+// An empty heap index covering no part of the log.
+static int index_create(int capacity) {
+    UserSnapshotHeader* header = calloc(1, index_bytes(capacity));
+    if (header == NULL) {
+        return -1;
     }
-    
-    fprintf(file, "%s %s\n", username, password);
-    fclose(file);
-    printf("User registered: %s\n", username);
-    return AUTH_SUCCESS;
+    index_release();
+    header->magic = USER_SNAPSHOT_MAGIC;
+    header->version = USER_SNAPSHOT_VERSION;
+    header->capacity = capacity;
+    index_header = header;
+    index_slots = (UserSlot*)(header + 1);
+    return 0;
 }
 
-int authenticate_user(const char* username, const char* password) {
-    FILE* file = fopen(USERS_FILE, "r");
-    User user;
-    
-    printf("Authenticating user: %s\n", username);
-    
-    if (file == NULL) {
-        printf("User file not found\n");
-        return AUTH_FAILED;
+// The live slot for 'name', or NULL.
+static UserSlot* index_find(const char* name) {
+    unsigned int hash = hash_name(name);
+    int mask = index_header->capacity - 1;
+
+    for (int i = hash & mask; index_slots[i].state != USER_EMPTY; i = (i + 1) & mask) {
+        if (index_slots[i].state == USER_LIVE && index_slots[i].hash == hash &&
+            strcmp(index_slots[i].user.username, name) == 0) {
+            return &index_slots[i];
+        }
+    }
+    return NULL;
+}
+
+static void index_place(const User* user, unsigned int hash) {
+    int mask = index_header->capacity - 1;
+    int i = hash & mask;
+
+    while (index_slots[i].state == USER_LIVE) {
+        i = (i + 1) & mask;
     }
-    
-    while (fscanf(file, "%s %s", user.username, user.password) != EOF) {
-        printf("Checking against: %s %s\n", user.username, user.password);
-        if (strcmp(user.username, username) == 0 && 
-            strcmp(user.password, password) == 0) {
-            fclose(file);
-            printf("Authentication successful for: %s\n", username);
-            return AUTH_SUCCESS;
+    if (index_slots[i].state == USER_REMOVED) {
+        index_header->removed--;
+    }
+    index_slots[i].hash = hash;
+    index_slots[i].state = USER_LIVE;
+    index_slots[i].user = *user;
+    index_header->count++;
+}
+
+// Rehash into a heap table with room to spare; drops the tombstones.
+static int index_resize(void) {
+    UserSnapshotHeader* old_header = index_header;
+    UserSlot* old_slots = index_slots;
+    void* old_view = mapped_view;
+    int capacity = USER_INDEX_MIN_CAPACITY;
+
+    while (capacity < (old_header->count + 1) * 2) {
+        capacity *= 2;
+    }
+    UserSnapshotHeader* header = calloc(1, index_bytes(capacity));
+    if (header == NULL) {
+        return -1;
+    }
+    *header = *old_header;
+    header->capacity = capacity;
+    header->count = 0;
+    header->removed = 0;
+    index_header = header;
+    index_slots = (UserSlot*)(header + 1);
+    mapped_view = NULL;
+    for (int i = 0; i < old_header->capacity; i++) {
+        if (old_slots[i].state == USER_LIVE) {
+            index_place(&old_slots[i].user, old_slots[i].hash);
         }
     }
-    
-    fclose(file);
-    printf("Authentication failed for: %s\n", username);
-    return AUTH_FAILED;
+
+    if (old_view != NULL) {
+        UnmapViewOfFile(old_view);
+    } else {
+        free(old_header);
+    }
+    return 0;
 }
 
-int update_username(const char* old_username, const char* password, const char* new_username) {
-    FILE* file = fopen(USERS_FILE, "r");
-    FILE* temp = fopen("temp_users.txt", "w");
+static void index_set(const char* name, const char* password) {
+    UserSlot* slot = index_find(name);
     User user;
-    int found = 0;
-    
-    if (file == NULL || temp == NULL) {
-        if (temp != NULL) fclose(temp);
-        if (file != NULL) fclose(file);
-        return AUTH_FAILED;
+
+    if (slot != NULL) {
+        snprintf(slot->user.password, MAX_PASSWORD_LEN, "%s", password);
+        return;
+    }
+    if ((index_header->count + index_header->removed + 1) * 4 > index_header->capacity * 3 &&
+        index_resize() != 0) {
+        return;
+    }
+    snprintf(user.username, MAX_USERNAME_LEN, "%s", name);
+    snprintf(user.password, MAX_PASSWORD_LEN, "%s", password);
+    index_place(&user, hash_name(user.username));
+}
+
+static void index_remove(const char* name) {
+    UserSlot* slot = index_find(name);
+
+    if (slot != NULL) {
+        slot->state = USER_REMOVED;
+        index_header->count--;
+        index_header->removed++;
+    }
+}
+
+static void apply_line(const char* line) {
+    char name[MAX_USERNAME_LEN];
+    char password[MAX_PASSWORD_LEN];
+
+    int fields = sscanf(line, "%31s %31s", name, password);
+    if (fields == 2) {
+        index_set(name, password);
+    } else if (fields == 1) {
+        index_remove(name);
+    }
+}
+
+// Apply the complete lines of the log past log_offset. A line still being
+// appended by another process is left for the next call.
+static void replay_log(void) {
+    FILE* file = fopen(USERS_FILE, "rb");
+    char line[USER_LINE_MAX];
+
+    if (file == NULL) {
+        return;
     }
-    
-    // Check if new username already exists
-    rewind(file);
-    while (fscanf(file, "%s %s", user.username, user.password) != EOF) {
-        if (strcmp(user.username, new_username) == 0) {
-            fclose(file);
-            fclose(temp);
-            remove("temp_users.txt");
-            return AUTH_USER_EXISTS;
+    long offset = (long)index_header->log_offset;
+    fseek(file, offset, SEEK_SET);
+    while (fgets(line, sizeof(line), file) != NULL) {
+        int length = (int)strlen(line);
+        if (line[length - 1] != '\n') {
+            if (feof(file)) {
+                break;
+            }
+            // Too long to be an account; skip the rest of it.
+            int c;
+            while ((c = fgetc(file)) != EOF && c != '\n') {
+                length++;
+            }
+            if (c == EOF) {
+                break;
+            }
+            offset += length + 1;
+            continue;
         }
+        apply_line(line);
+        offset += length;
     }
-    
-    // Update the username
-    rewind(file);
-    while (fscanf(file, "%s %s", user.username, user.password) != EOF) {
-        if (strcmp(user.username, old_username) == 0 && 
-            strcmp(user.password, password) == 0) {
-            fprintf(temp, "%s %s\n", new_username, user.password);
-            found = 1;
-        } else {
-            fprintf(temp, "%s %s\n", user.username, user.password);
+
+    if (offset != index_header->log_offset) {
+        index_header->log_offset = offset;
+        index_header->tail_length = offset < USER_LOG_TAIL ? (int)offset : USER_LOG_TAIL;
+        fseek(file, offset - index_header->tail_length, SEEK_SET);
+        if (fread(index_header->log_tail, 1, index_header->tail_length, file) != (size_t)index_header->tail_length) {
+            index_header->tail_length = 0;
         }
+        index_dirty = 1;
     }
-    
     fclose(file);
-    fclose(temp);
-    
-    if (!found) {
-        remove("temp_users.txt");
-        return AUTH_FAILED;
+}
+
+static long long log_size(void) {
+    WIN32_FILE_ATTRIBUTE_DATA data;
+
+    if (!GetFileAttributesEx(USERS_FILE, GetFileExInfoStandard, &data)) {
+        return 0;
     }
-    
-    remove(USERS_FILE);
-    rename("temp_users.txt", USERS_FILE);
-    
-    return AUTH_SUCCESS;
+    return ((long long)data.nFileSizeHigh << 32) | data.nFileSizeLow;
 }
 
-int update_password(const char* username, const char* old_password, const char* new_password) {
-    FILE* file = fopen(USERS_FILE, "r");
-    FILE* temp = fopen("temp_users.txt", "w");
-    User user;
-    int found = 0;
-    
-    if (file == NULL || temp == NULL) {
-        if (temp != NULL) fclose(temp);
-        if (file != NULL) fclose(file);
-        return AUTH_FAILED;
+// Bring the index up to date with the log. A log shorter than the part
+// already applied was rewritten by hand, so it is read again from the start.
+static void catch_up(void) {
+    long long size = log_size();
+
+    if (size == index_header->log_offset) {
+        return;
     }
-    
-    while (fscanf(file, "%s %s", user.username, user.password) != EOF) {
-        if (strcmp(user.username, username) == 0 && 
-            strcmp(user.password, old_password) == 0) {
-            fprintf(temp, "%s %s\n", user.username, new_password);
-            found = 1;
-        } else {
-            fprintf(temp, "%s %s\n", user.username, user.password);
+    if (size < index_header->log_offset) {
+        printf("%s was rewritten, reloading all accounts\n", USERS_FILE);
+        if (index_create(USER_INDEX_MIN_CAPACITY) != 0) {
+            return;
         }
+        index_dirty = 1;
+    }
+    replay_log();
+}
+
+// Does the log still start with the part the snapshot was taken from?
+// Only the last bytes of that part are compared.
+static int snapshot_matches_log(const UserSnapshotHeader* header) {
+    char tail[USER_LOG_TAIL];
+    int matches = 0;
+
+    if (header->log_offset > log_size()) {
+        return 0;
+    }
+    if (header->tail_length == 0) {
+        return header->log_offset == 0;
+    }
+    FILE* file = fopen(USERS_FILE, "rb");
+    if (file == NULL) {
+        return 0;
+    }
+    if (fseek(file, (long)(header->log_offset - header->tail_length), SEEK_SET) == 0 &&
+        fread(tail, 1, header->tail_length, file) == (size_t)header->tail_length) {
+        matches = memcmp(tail, header->log_tail, header->tail_length) == 0;
     }
-    
     fclose(file);
-    fclose(temp);
-    
-    if (!found) {
-        remove("temp_users.txt");
+    return matches;
+}
+
+// Map the snapshot copy-on-write and use it as the index as it is. Pages are
+// read in as lookups touch them, so this costs the same for any number of
+// accounts.
+static int load_snapshot(void) {
+    HANDLE file = CreateFile(USERS_SNAPSHOT, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+    LARGE_INTEGER size;
+
+    if (file == INVALID_HANDLE_VALUE) {
+        return -1;
+    }
+    if (!GetFileSizeEx(file, &size) || size.QuadPart < (LONGLONG)sizeof(UserSnapshotHeader)) {
+        CloseHandle(file);
+        return -1;
+    }
+    HANDLE mapping = CreateFileMapping(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+    void* view = mapping != NULL ? MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0) : NULL;
+    if (mapping != NULL) {
+        CloseHandle(mapping);
+    }
+    CloseHandle(file);
+    if (view == NULL) {
+        return -1;
+    }
+
+    UserSnapshotHeader* header = view;
+    if (header->magic != USER_SNAPSHOT_MAGIC || header->version != USER_SNAPSHOT_VERSION ||
+        header->capacity < 1 || (header->capacity & (header->capacity - 1)) != 0 ||
+        (LONGLONG)index_bytes(header->capacity) != size.QuadPart ||
+        header->tail_length < 0 || header->tail_length > USER_LOG_TAIL ||
+        !snapshot_matches_log(header)) {
+        printf("Ignoring %s: it does not match %s\n", USERS_SNAPSHOT, USERS_FILE);
+        UnmapViewOfFile(view);
+        return -1;
+    }
+    index_release();
+    mapped_view = view;
+    index_header = header;
+    index_slots = (UserSlot*)(header + 1);
+    return 0;
+}
+
+// Load the accounts. Returns the number of users.
+int auth_init(void) {
+    LARGE_INTEGER frequency, start, end;
+
+    InitializeCriticalSection(&users_lock);
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&start);
+
+    int from_snapshot = load_snapshot() == 0;
+    if (!from_snapshot && index_create(USER_INDEX_MIN_CAPACITY) != 0) {
+        fprintf(stderr, "Could not allocate the user index\n");
+        return -1;
+    }
+    long long covered = index_header->log_offset;
+    catch_up();
+
+    QueryPerformanceCounter(&end);
+    printf("Loaded %d users from %s in %.2f ms (%lld log bytes replayed)\n", index_header->count,
+           from_snapshot ? USERS_SNAPSHOT : USERS_FILE,
+           (double)(end.QuadPart - start.QuadPart) * 1000.0 / frequency.QuadPart,
+           index_header->log_offset - covered);
+    return index_header->count;
+}
+
+// Write the index out if it changed. The snapshot is replaced in one step,
+// so a crash while writing leaves the previous one.
+int auth_snapshot(void) {
+    int result = 0;
+
+    EnterCriticalSection(&users_lock);
+    if (!index_dirty) {
+        LeaveCriticalSection(&users_lock);
+        return 0;
+    }
+
+    // A mapped file cannot be replaced, so move the index to the heap first.
+    if (mapped_view != NULL) {
+        size_t bytes = index_bytes(index_header->capacity);
+        UserSnapshotHeader* header = malloc(bytes);
+        if (header == NULL) {
+            LeaveCriticalSection(&users_lock);
+            return -1;
+        }
+        memcpy(header, index_header, bytes);
+        UnmapViewOfFile(mapped_view);
+        mapped_view = NULL;
+        index_header = header;
+        index_slots = (UserSlot*)(header + 1);
+    }
+
+    FILE* file = fopen(USERS_SNAPSHOT ".tmp", "wb");
+    size_t bytes = index_bytes(index_header->capacity);
+    if (file == NULL || fwrite(index_header, 1, bytes, file) != bytes) {
+        result = -1;
+    }
+    if (file != NULL && fclose(file) != 0) {
+        result = -1;
+    }
+    if (result == 0 && !MoveFileEx(USERS_SNAPSHOT ".tmp", USERS_SNAPSHOT, MOVEFILE_REPLACE_EXISTING)) {
+        result = -1;
+    }
+    if (result == 0) {
+        index_dirty = 0;
+    } else {
+        fprintf(stderr, "Could not write %s: %lu\n", USERS_SNAPSHOT, GetLastError());
+        remove(USERS_SNAPSHOT ".tmp");
+    }
+    LeaveCriticalSection(&users_lock);
+    return result;
+}
+
+void auth_shutdown(void) {
+    auth_snapshot();
+    index_release();
+    DeleteCriticalSection(&users_lock);
+}
+
+void auth_for_each_user(void (*visit)(const char* username, void* context), void* context) {
+    EnterCriticalSection(&users_lock);
+    catch_up();
+    for (int i = 0; i < index_header->capacity; i++) {
+        if (index_slots[i].state == USER_LIVE) {
+            visit(index_slots[i].user.username, context);
+        }
+    }
+    LeaveCriticalSection(&users_lock);
+}
+
+// Append records to the log and apply them, along with anything another
+// process appended first. Caller holds users_lock.
+static int append_log(const char* records) {
+    FILE* file = fopen(USERS_FILE, "ab");
+
+    if (file == NULL) {
+        printf("Failed to open users file for writing\n");
         return AUTH_FAILED;
     }
-    
-    remove(USERS_FILE);
-    rename("temp_users.txt", USERS_FILE);
-    
-    return AUTH_SUCCESS;
+    int failed = fputs(records, file) == EOF;
+    failed |= fclose(file) != 0;
+    catch_up();
+    return failed ? AUTH_FAILED : AUTH_SUCCESS;
 }
 
-int delete_account(const char* username, const char* password) {
-    FILE* file = fopen(USERS_FILE, "r");
-    FILE* temp = fopen("temp_users.txt", "w");
-    User user;
-    int found = 0;
-    
-    if (file == NULL || temp == NULL) {
-        if (temp != NULL) fclose(temp);
-        if (file != NULL) fclose(file);
+// Names and passwords are stored as words on a line of the log, and names
+// are shown to other users, so neither may hold control bytes, escapes or
+// invalid UTF-8.
+static int valid_field(const char* text) {
+    if (*text == '\0' || strchr(text, ' ') != NULL) {
+        return 0;
+    }
+    return text_is_clean(text, USER_LINE_MAX);
+}
+
+// The live account 'username' if 'password' is its password.
+static UserSlot* check_password(const char* username, const char* password) {
+    UserSlot* slot = index_find(username);
+    return slot != NULL && strcmp(slot->user.password, password) == 0 ? slot : NULL;
+}
+
+int register_user(const char* username, const char* password) {
+    char record[USER_LINE_MAX];
+    int result;
+
+    printf("Registering user: %s\n", username);
+    if (!valid_field(username) || !valid_field(password)) {
         return AUTH_FAILED;
     }
-    
-    while (fscanf(file, "%s %s", user.username, user.password) != EOF) {
-        if (strcmp(user.username, username) == 0 && 
-            strcmp(user.password, password) == 0) {
-            found = 1;
-        } else {
-            fprintf(temp, "%s %s\n", user.username, user.password);
-        }
+
+    EnterCriticalSection(&users_lock);
+    catch_up();
+    if (index_find(username) != NULL) {
+        LeaveCriticalSection(&users_lock);
+        printf("User already exists: %s\n", username);
+        return AUTH_USER_EXISTS;
     }
-    
-    fclose(file);
-    fclose(temp);
-    
+    snprintf(record, sizeof(record), "%s %s\n", username, password);
+    result = append_log(record);
+    LeaveCriticalSection(&users_lock);
+
+    if (result == AUTH_SUCCESS) {
+        printf("User registered: %s\n", username);
+    }
+    return result;
+}
+
+int authenticate_user(const char* username, const char* password) {
+    printf("Authenticating user: %s\n", username);
+    PROBE_AUTH_START(username);
+
+    EnterCriticalSection(&users_lock);
+    catch_up();
+    int found = check_password(username, password) != NULL;
+    LeaveCriticalSection(&users_lock);
+
     if (!found) {
-        remove("temp_users.txt");
+        printf("Authentication failed for: %s\n", username);
+        PROBE_AUTH_FINISH(username, AUTH_FAILED);
         return AUTH_FAILED;
     }
-    
-    remove(USERS_FILE);
-    rename("temp_users.txt", USERS_FILE);
-    
+    printf("Authentication successful for: %s\n", username);
+    PROBE_AUTH_FINISH(username, AUTH_SUCCESS);
     return AUTH_SUCCESS;
 }
+
+int update_username(const char* old_username, const char* password, const char* new_username) {
+    char records[2 * USER_LINE_MAX];
+    int result;
+
+    EnterCriticalSection(&users_lock);
+    catch_up();
+    if (!valid_field(new_username)) {
+        result = AUTH_FAILED;
+    } else if (index_find(new_username) != NULL) {
+        result = AUTH_USER_EXISTS;
+    } else if (check_password(old_username, password) == NULL) {
+        result = AUTH_FAILED;
+    } else {
+        snprintf(records, sizeof(records), "%s\n%s %s\n", old_username, new_username, password);
+        result = append_log(records);
+    }
+    LeaveCriticalSection(&users_lock);
+    return result;
+}
+
+int update_password(const char* username, const char* old_password, const char* new_password) {
+    char record[USER_LINE_MAX];
+    int result = AUTH_FAILED;
+
+    EnterCriticalSection(&users_lock);
+    catch_up();
+    if (valid_field(new_password) && check_password(username, old_password) != NULL) {
+        snprintf(record, sizeof(record), "%s %s\n", username, new_password);
+        result = append_log(record);
+    }
+    LeaveCriticalSection(&users_lock);
+    return result;
+}
+
+int delete_account(const char* username, const char* password) {
+    char record[USER_LINE_MAX];
+    int result = AUTH_FAILED;
+
+    EnterCriticalSection(&users_lock);
+    catch_up();
+    if (check_password(username, password) != NULL) {
+        snprintf(record, sizeof(record), "%s\n", username);
+        result = append_log(record);
+    }
+    LeaveCriticalSection(&users_lock);
+    return result;
+}
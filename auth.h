@@ -7,17 +7,60 @@
 #define MAX_USERNAME_LEN 32
 #define MAX_PASSWORD_LEN 32
 #define USERS_FILE "users.txt"
+#define USERS_SNAPSHOT "users.snap"
+#define USER_SNAPSHOT_INTERVAL_MS 60000  // How often a changed index is written out
 
 typedef struct {
     char username[MAX_USERNAME_LEN];
     char password[MAX_PASSWORD_LEN];
 } User;
 
+// Accounts live in a hash table in memory. USERS_FILE is its log: every
+// change is appended as a line, "name password" to set an account and
+// "name" alone to remove one, and the latest line for a name wins. The
+// table is written to USERS_SNAPSHOT from time to time in the same layout
+// as in memory, so startup maps the snapshot and replays only the lines
+// added since, instead of reading the whole log.
+//
+// Before every lookup the log is checked for lines appended by another
+// server running from the same folder.
+
+#define USER_SNAPSHOT_MAGIC 0x50534e55  // "UNSP"
+#define USER_SNAPSHOT_VERSION 1
+#define USER_LOG_TAIL 64                // Log bytes kept to recognise the log a snapshot belongs to
+
+#define USER_EMPTY 0
+#define USER_LIVE 1
+#define USER_REMOVED 2                  // Tombstone, so probe chains stay intact
+
+typedef struct {
+    unsigned int hash;
+    int state;                          // USER_EMPTY, USER_LIVE or USER_REMOVED
+    User user;
+} UserSlot;
+
+// USERS_SNAPSHOT: this header, then 'capacity' UserSlots.
+typedef struct {
+    int magic;
+    int version;
+    int capacity;                       // Power of two
+    int count;                          // USER_LIVE slots
+    int removed;                        // USER_REMOVED slots
+    int tail_length;
+    long long log_offset;               // Bytes of USERS_FILE the table includes
+    char log_tail[USER_LOG_TAIL];       // The last of those bytes
+} UserSnapshotHeader;
+
 // Authentication results
 #define AUTH_SUCCESS 0
 #define AUTH_FAILED 1
 #define AUTH_USER_EXISTS 2
 
+int auth_init(void);
+int auth_snapshot(void);
+void auth_shutdown(void);
+void auth_for_each_user(void (*visit)(const char* username, void* context), void* context);
+
 int register_user(const char* username, const char* password);
 int authenticate_user(const char* username, const char* password);
 int update_username(const char* old_username, const char* password, const char* new_username);
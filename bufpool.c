@@ -0,0 +1,58 @@
+#include "bufpool.h"
+#include "metrics.h"
+#include <stdlib.h>
+
+void buffer_pool_init(BufferPool* pool, int size, int keep) {
+    pool->free_list = NULL;
+    pool->free_count = 0;
+    pool->size = size < (int)sizeof(PooledBuffer) ? (int)sizeof(PooledBuffer) : size;
+    pool->keep = keep;
+    pool->in_use = 0;
+    InitializeCriticalSection(&pool->lock);
+}
+
+// Free the kept buffers. Buffers still handed out are the caller's to free.
+void buffer_pool_destroy(BufferPool* pool) {
+    while (pool->free_list != NULL) {
+        PooledBuffer* buffer = pool->free_list;
+        pool->free_list = buffer->next;
+        free(buffer);
+    }
+    pool->free_count = 0;
+    DeleteCriticalSection(&pool->lock);
+}
+
+void* buffer_pool_get(BufferPool* pool) {
+    EnterCriticalSection(&pool->lock);
+    PooledBuffer* buffer = pool->free_list;
+    if (buffer != NULL) {
+        pool->free_list = buffer->next;
+        pool->free_count--;
+    }
+    LeaveCriticalSection(&pool->lock);
+
+    if (buffer == NULL) {
+        buffer = (PooledBuffer*)malloc(pool->size);
+        if (buffer == NULL) {
+            return NULL;
+        }
+        metric_inc(METRIC_HEAP_ALLOCS);
+    }
+    InterlockedIncrement(&pool->in_use);
+    return buffer;
+}
+
+void buffer_pool_put(BufferPool* pool, void* buffer) {
+    PooledBuffer* pooled = (PooledBuffer*)buffer;
+
+    InterlockedDecrement(&pool->in_use);
+    EnterCriticalSection(&pool->lock);
+    if (pool->free_count < pool->keep) {
+        pooled->next = pool->free_list;
+        pool->free_list = pooled;
+        pool->free_count++;
+        pooled = NULL;
+    }
+    LeaveCriticalSection(&pool->lock);
+    free(pooled);
+}
@@ -0,0 +1,28 @@
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <windows.h>
+
+// Fixed-size buffers shared by all connections, held only while data is in
+// flight, so an idle connection holds none. Returned buffers are kept for
+// reuse up to a limit; the rest go back to the heap.
+
+typedef struct PooledBuffer {
+    struct PooledBuffer* next;
+} PooledBuffer;
+
+typedef struct {
+    PooledBuffer* free_list;
+    int free_count;
+    int size;                   // Bytes in each buffer
+    int keep;                   // Free buffers kept at most
+    volatile LONG in_use;       // Buffers handed out and not yet returned
+    CRITICAL_SECTION lock;
+} BufferPool;
+
+void buffer_pool_init(BufferPool* pool, int size, int keep);
+void buffer_pool_destroy(BufferPool* pool);
+void* buffer_pool_get(BufferPool* pool);    // NULL if the heap is exhausted
+void buffer_pool_put(BufferPool* pool, void* buffer);
+
+#endif // BUFPOOL_H
@@ -11,11 +11,19 @@
 
  #include <stdio.h>
  #include <stdlib.h>
+ #include <stdarg.h>
  #include <string.h>
  #include <winsock2.h>
  #include <ws2tcpip.h>
  #include <windows.h>
  #include "common.h"
+ #include "cmdhash.h"
+ #include "lz.h"
+ #include "discovery.h"
+ 
+ #ifndef ENABLE_VIRTUAL_TERMINAL_PROCESSING
+ #define ENABLE_VIRTUAL_TERMINAL_PROCESSING 0x0004
+ #endif
  
  #pragma comment(lib, "Ws2_32.lib")
  
@@ -23,6 +31,118 @@
  volatile BOOL client_running = TRUE;
  SOCKET connect_socket = INVALID_SOCKET;
  char current_username[32] = "";
+ CRITICAL_SECTION send_mutex;  // Upload threads send while the event loop does
+ int client_capabilities = CAP_COMPRESS | CAP_MULTICAST;  // CAP_* sent to the server at login
+ int console_vt = 0;           // The console understands ANSI escapes
+ 
+ #define FRAME_BUFFER_SIZE ((int)sizeof(FileChunkHeader) + FILE_CHUNK_SIZE + 1)  // Fits a file chunk
+ #define CLIENT_INBOUND_SIZE (2 * FRAME_BUFFER_SIZE)
+ #define READ_BUDGET (256 * 1024)     // Bytes read per wakeup before input gets a turn
+ #define SCROLLBACK_LINES 1000        // Messages kept for /scrollback
+ #define RENDER_INTERVAL_MS 30        // Output is written at most this often
+ #define OUTPUT_BATCH_SIZE (64 * 1024)
+ #define INPUT_QUEUE_LINES 64         // Lines read ahead when stdin is not a console
+ #define MCAST_WINDOW 256             // Broadcasts held while an earlier one is missing
+ #define MCAST_NACK_RETRY_MS 500      // Ask again for a repair that has not come
+ #define MCAST_DATAGRAM_MAX 4096
+ 
+ // Everything shown after login goes through the scrollback: any thread adds
+ // lines, and the event loop writes them to the console in batches, together
+ // with the line being typed, so output never lands in the middle of it.
+ char* scrollback[SCROLLBACK_LINES];
+ int scrollback_count = 0;     // Lines ever added; the newest is at (count - 1) % SCROLLBACK_LINES
+ int rendered = 0;             // Lines written to the console
+ int render_max_lines = SCROLLBACK_LINES;  // A batch longer than this skips its oldest lines
+ CRITICAL_SECTION output_mutex;
+ HANDLE output_event = NULL;   // Set when a line is added
+ char output_batch[OUTPUT_BATCH_SIZE];  // Event loop only
+ int output_length = 0;
+ 
+ // The line being typed. Keystrokes are read by the event loop, not by fgets.
+ char input_line[BUFFER_SIZE];
+ int input_length = 0;
+ int input_shown = 0;          // Characters of prompt and input on the screen
+ char input_prompt[64] = "";
+ int input_masked = 0;         // Show '*' for each character (passwords)
+ int console_input = 0;        // stdin is a console; otherwise stdin_thread reads lines
+ 
+ // Lines read by stdin_thread when input is piped.
+ char input_queue[INPUT_QUEUE_LINES][BUFFER_SIZE];
+ int input_queue_head = 0, input_queue_tail = 0;
+ CRITICAL_SECTION input_mutex;
+ HANDLE stdin_event = NULL;
+ volatile BOOL stdin_closed = FALSE;
+ 
+ // Piped lines collected into one MSG_BATCH frame while the input queue drains.
+ Message batch_msg;            // command counts the entries
+ int batch_length = 0;         // Bytes of batch_msg.content in use
+ int batching = 0;
+ char command_target[WHISPER_TARGETS_MAX + 1];  // Target of the last command, which may not fit Message.target
+ 
+ // Tab completion of whisper targets: the line as it was when the server was asked.
+ char completion_line[BUFFER_SIZE];
+ int completion_length = -1;   // -1 while no answer is awaited
+ 
+ // Broadcasts from the multicast group; the event loop only.
+ typedef struct {
+     long long sequence;      // 0 if the slot is free
+     char* text;              // NULL if there is nothing to show
+     int length;
+ } HeldBroadcast;
+ 
+ SOCKET multicast_socket = INVALID_SOCKET;  // Joined to the group the server named
+ HANDLE multicast_event = NULL;
+ MulticastInfo multicast;
+ HeldBroadcast multicast_window[MCAST_WINDOW];  // By sequence, modulo MCAST_WINDOW
+ long long multicast_next = 0;        // Next broadcast to show; 0 until MSG_MULTICAST_START
+ long long multicast_seen = 0;        // Newest broadcast known to exist
+ unsigned long long multicast_asked_at = 0;  // Last MCAST_NACK
+ 
+ #define MAX_FILE_TRANSFERS 8
+ #define MAX_DOWNLOAD_SIZE (512LL * 1024 * 1024)  // Larger offers are refused without asking
+ 
+ // A file offered with /send, waiting for the server to say where to start.
+ typedef struct {
+     int id;                  // Our id for the offer; 0 if the slot is free
+     char path[MAX_PATH];
+     long long size;
+ } PendingUpload;
+ 
+ // Started by the receive thread once the server accepts an offer.
+ typedef struct {
+     int id;                  // The server's id for the transfer
+     char path[MAX_PATH];
+     long long size;
+     long long offset;
+     int rate;                // Bytes per second allowed by the server
+ } Upload;
+ 
+ // A file being received into FILE_DOWNLOAD_DIR; only the receive thread uses these.
+ typedef struct {
+     int id;                  // The server's id; 0 if the slot is free
+     HANDLE file;
+     char part_path[MAX_PATH];
+     char path[MAX_PATH];
+     long long size;
+ } Download;
+ 
+ PendingUpload pending_uploads[MAX_FILE_TRANSFERS];
+ CRITICAL_SECTION uploads_mutex;  // pending_uploads is filled by the main thread, read by the receive thread
+ int next_upload_id = 1;
+ Download downloads[MAX_FILE_TRANSFERS];
+ 
+ // A file offered to us, waiting for the user to accept or decline it.
+ typedef struct {
+     int id;                  // The server's id for the transfer
+     long long size;
+     char sender[32];
+     char name[FILE_NAME_MAX];
+ } FileOffer;
+ 
+ // Asked about one at a time, oldest first; only the event loop uses these.
+ FileOffer offers[MAX_FILE_TRANSFERS];
+ int offer_head = 0;
+ int offer_count = 0;
  
  // Handler for Ctrl+C to allow graceful termination.
  BOOL WINAPI ConsoleHandler(DWORD signal) {
@@ -45,167 +165,1410 @@
      return 0;
  }
  
+ // Wait until the socket can take more data. After login the socket is
+ // non-blocking, so a full send buffer shows up as WSAEWOULDBLOCK.
+ int wait_writable(SOCKET socket) {
+     fd_set writable;
+     struct timeval timeout = { 1, 0 };
+     FD_ZERO(&writable);
+     FD_SET(socket, &writable);
+     return select(0, NULL, &writable, NULL, &timeout) != SOCKET_ERROR;
+ }
+ 
+ // Send one Message to the server, whole: upload threads send too.
+ int send_message(SOCKET socket, Message* msg) {
+     const char* data = (const char*)msg;
+     int remaining = sizeof(Message);
+     EnterCriticalSection(&send_mutex);
+     while (remaining > 0 && client_running) {
+         int sent = send(socket, data, remaining, 0);
+         if (sent == SOCKET_ERROR) {
+             if (WSAGetLastError() != WSAEWOULDBLOCK || !wait_writable(socket)) {
+                 break;
+             }
+             continue;
+         }
+         data += sent;
+         remaining -= sent;
+     }
+     LeaveCriticalSection(&send_mutex);
+     return remaining == 0 ? (int)sizeof(Message) : SOCKET_ERROR;
+ }
+ 
+ // Receive exactly 'length' bytes. Returns the byte count, 0 on close, or SOCKET_ERROR.
+ int recv_all(SOCKET socket, char* buffer, int length) {
+     int received = 0;
+     while (received < length) {
+         int result = recv(socket, buffer + received, length - received, 0);
+         if (result <= 0) {
+             return result;
+         }
+         received += result;
+     }
+     return received;
+ }
+ 
+ // Undo FRAME_COMPRESSED: the payload holds the original length and lz.c data.
+ // Returns 1, or SOCKET_ERROR if the data cannot be decompressed.
+ int inflate_payload(FrameHeader* header, char* payload, int stored, int size) {
+     int length, produced = -1;
+     char* packed = (char*)malloc(stored);
+ 
+     if (packed != NULL && stored >= (int)sizeof(int)) {
+         memcpy(packed, payload, stored);
+         memcpy(&length, packed, sizeof(int));
+         produced = lz_decompress(packed + sizeof(int), stored - (int)sizeof(int), payload, size - 1);
+     }
+     free(packed);
+     if (produced < 0 || produced != length) {
+         fprintf(stderr, "Could not decompress a message from the server; is the client up to date?\n");
+         return SOCKET_ERROR;
+     }
+     payload[produced] = '\0';
+     header->type &= ~FRAME_COMPRESSED;
+     header->length = produced;
+     return 1;
+ }
+ 
+ // Receive one frame from the server. The payload is null-terminated and
+ // truncated to fit 'size'; compressed payloads are expanded.
+ // Returns 1 on success, 0 on close, or SOCKET_ERROR.
+ int recv_frame(SOCKET socket, FrameHeader* header, char* payload, int size) {
+     int result = recv_all(socket, (char*)header, sizeof(FrameHeader));
+     if (result <= 0) {
+         return result;
+     }
+ 
+     int remaining = header->length;
+     int stored = 0;
+     while (remaining > 0) {
+         char discard[256];
+         char* dest = (stored < size - 1) ? payload + stored : discard;
+         int space = (stored < size - 1) ? size - 1 - stored : (int)sizeof(discard);
+         int chunk = remaining < space ? remaining : space;
+ 
+         result = recv_all(socket, dest, chunk);
+         if (result <= 0) {
+             return result;
+         }
+         if (dest == payload + stored) {
+             stored += chunk;
+         }
+         remaining -= chunk;
+     }
+     payload[stored] = '\0';
+     if (header->type & FRAME_COMPRESSED) {
+         return inflate_payload(header, payload, stored, size);
+     }
+     return 1;
+ }
+ 
+ // Answer a server heartbeat.
+ void send_pong(SOCKET socket) {
+     Message pong;
+     ZeroMemory(&pong, sizeof(Message));
+     pong.type = MSG_PONG;
+     send_message(socket, &pong);
+ }
+ 
+ // Add a line to the scrollback; the event loop shows it. Any thread.
+ void add_line(const char* text, int length) {
+     char* line = (char*)malloc(length + 1);
+     if (line == NULL) {
+         return;
+     }
+     memcpy(line, text, length);
+     line[length] = '\0';
+ 
+     EnterCriticalSection(&output_mutex);
+     int slot = scrollback_count % SCROLLBACK_LINES;
+     free(scrollback[slot]);
+     scrollback[slot] = line;
+     scrollback_count++;
+     LeaveCriticalSection(&output_mutex);
+     SetEvent(output_event);
+ }
+ 
+ // printf for everything shown after login.
+ void show(const char* format, ...) {
+     char text[2 * BUFFER_SIZE];
+     va_list args;
+ 
+     va_start(args, format);
+     int length = vsnprintf(text, sizeof(text), format, args);
+     va_end(args);
+     if (length >= (int)sizeof(text)) {
+         length = sizeof(text) - 1;
+     }
+     if (length > 0) {
+         add_line(text, length);
+     }
+ }
+ 
+ int output_pending(void) {
+     EnterCriticalSection(&output_mutex);
+     int pending = scrollback_count != rendered;
+     LeaveCriticalSection(&output_mutex);
+     return pending;
+ }
+ 
+ // Write the batch to the console in one call.
+ void write_output(void) {
+     fwrite(output_batch, 1, output_length, stdout);
+     fflush(stdout);
+     output_length = 0;
+ }
+ 
+ void append_output(const char* text, int length) {
+     while (length > 0) {
+         if (output_length == OUTPUT_BATCH_SIZE) {
+             write_output();
+         }
+         int n = OUTPUT_BATCH_SIZE - output_length < length ? OUTPUT_BATCH_SIZE - output_length : length;
+         memcpy(output_batch + output_length, text, n);
+         output_length += n;
+         text += n;
+         length -= n;
+     }
+ }
+ 
+ // Take the line being typed off the screen.
+ void append_erase_input(void) {
+     if (!console_input) {
+         return;
+     }
+     if (console_vt) {
+         append_output("\r\033[K", 4);
+     } else {
+         append_output("\r", 1);
+         for (int i = 0; i < input_shown; i++) {
+             append_output(" ", 1);
+         }
+         append_output("\r", 1);
+     }
+     input_shown = 0;
+ }
+ 
+ // Put the prompt and the line being typed back on the screen.
+ void append_input(void) {
+     if (!console_input) {
+         return;
+     }
+     append_erase_input();
+     append_output(input_prompt, (int)strlen(input_prompt));
+     if (input_masked) {
+         for (int i = 0; i < input_length; i++) {
+             append_output("*", 1);
+         }
+     } else {
+         append_output(input_line, input_length);
+     }
+     input_shown = (int)strlen(input_prompt) + input_length;
+ }
+ 
+ void redraw_input(void) {
+     append_input();
+     write_output();
+ }
+ 
+ // Write the lines added since the last call. When they arrive faster than
+ // the console can show them, only the newest screenful is written; the rest
+ // stay in the scrollback.
+ void flush_output(void) {
+     append_erase_input();
+     EnterCriticalSection(&output_mutex);
+     int pending = scrollback_count - rendered;
+     if (pending > render_max_lines) {
+         char notice[96];
+         int skipped = pending - render_max_lines;
+         int length = snprintf(notice, sizeof(notice), "[%d messages skipped; /scrollback shows them]\n", skipped);
+         append_output(notice, length);
+         rendered += skipped;
+     }
+     for (; rendered < scrollback_count; rendered++) {
+         const char* line = scrollback[rendered % SCROLLBACK_LINES];
+         append_output(line, (int)strlen(line));
+         append_output("\n", 1);
+     }
+     LeaveCriticalSection(&output_mutex);
+     redraw_input();
+ }
+ 
  // Helper function to clear the console screen
  void clear_screen() {
      system("cls");
-     printf("Chat cleared. You can continue typing.\n");
  }
  
+ // Look a command name up in the generated perfect hash: one hash, one compare.
+ int lookup_command(const char* name) {
+     unsigned int slot = command_hash(name, COMMAND_HASH_SEED) & (COMMAND_HASH_SIZE - 1);
+     if (command_hash_table[slot].name != NULL && strcmp(command_hash_table[slot].name, name) == 0) {
+         return command_hash_table[slot].id;
+     }
+     return CMD_UNKNOWN;
+ }
+ 
+ // A command that needs answers typed at a prompt before it can be sent.
+ // While one is waiting, typed lines go to it instead of the chat, and
+ // messages keep arriving.
+ Message prompt_msg;
+ int prompt_command = CMD_NONE;
+ int prompt_step = 0;
+ char prompt_saved[32];
+ 
+ void ask(const char* question, int masked) {
+     snprintf(input_prompt, sizeof(input_prompt), "%s", question);
+     input_masked = masked;
+ }
+ 
+ // Hold 'msg' back until its questions are answered; see prompt_answers.
+ int begin_prompt(Message* msg, const char* question, int masked) {
+     prompt_msg = *msg;
+     prompt_command = msg->command;
+     prompt_step = 0;
+     ask(question, masked);
+     return 0;
+ }
+ 
+ // /username: ask for the current password; content becomes "new_username current_password".
+ int prompt_username(Message* msg) {
+     return begin_prompt(msg, "Enter your current password: ", 1);
+ }
+ 
+ int answer_username(Message* msg, int step, const char* line) {
+     char new_username[32];
+     (void)step;
+     snprintf(new_username, sizeof(new_username), "%s", msg->content);
+     snprintf(msg->content, BUFFER_SIZE, "%s %.31s", new_username, line);
+     return 1;
+ }
+ 
+ // /password: content becomes "current_password new_password".
+ int prompt_password(Message* msg) {
+     return begin_prompt(msg, "Enter your current password: ", 1);
+ }
+ 
+ int answer_password(Message* msg, int step, const char* line) {
+     if (step == 0) {
+         snprintf(prompt_saved, sizeof(prompt_saved), "%s", line);
+         ask("Enter your new password: ", 1);
+         return 0;
+     }
+     snprintf(msg->content, BUFFER_SIZE, "%s %.31s", prompt_saved, line);
+     return 1;
+ }
+ 
+ // /delete: confirm, then send the password.
+ int prompt_delete(Message* msg) {
+     return begin_prompt(msg, "Are you sure you want to delete your account? (y/n): ", 0);
+ }
+ 
+ int answer_delete(Message* msg, int step, const char* line) {
+     if (step == 0) {
+         if (line[0] != 'y' && line[0] != 'Y') {
+             show("Account deletion cancelled.");
+             return -1;
+         }
+         ask("Enter your password to confirm: ", 1);
+         return 0;
+     }
+     snprintf(msg->content, BUFFER_SIZE, "%s", line);
+     return 1;
+ }
+ 
+ int run_clear(Message* msg) {
+     (void)msg;
+     clear_screen();
+     input_shown = 0;
+     show("Chat cleared. You can continue typing.");
+     return 0; // No need to send to server
+ }
+ 
+ // /scrollback [lines]: show recent messages again, including any skipped
+ // because they arrived faster than they could be shown.
+ int run_scrollback(Message* msg) {
+     int lines = atoi(msg->content);
+ 
+     flush_output();
+     append_erase_input();
+     EnterCriticalSection(&output_mutex);
+     int available = scrollback_count < SCROLLBACK_LINES ? scrollback_count : SCROLLBACK_LINES;
+     if (lines <= 0 || lines > available) {
+         lines = available;
+     }
+     for (int i = scrollback_count - lines; i < scrollback_count; i++) {
+         const char* line = scrollback[i % SCROLLBACK_LINES];
+         append_output(line, (int)strlen(line));
+         append_output("\n", 1);
+     }
+     LeaveCriticalSection(&output_mutex);
+     redraw_input();
+     return 0;
+ }
+ 
+ // Microseconds on the performance counter, for /ping.
+ long long clock_us(void) {
+     LARGE_INTEGER frequency, counter;
+     QueryPerformanceFrequency(&frequency);
+     QueryPerformanceCounter(&counter);
+     return (long long)(counter.QuadPart / frequency.QuadPart * 1000000 +
+                        counter.QuadPart % frequency.QuadPart * 1000000 / frequency.QuadPart);
+ }
+ 
+ // /ping: the server hands our clock back in a MSG_PING_REPLY.
+ int prompt_ping(Message* msg) {
+     snprintf(msg->content, BUFFER_SIZE, "%lld", clock_us());
+     return 1;
+ }
+ 
+ // Show the round trip, split into the server's stages and the rest (the
+ // network both ways and this client).
+ void handle_ping_reply(const char* payload, int length) {
+     PingReply reply;
+ 
+     if (length < (int)sizeof(reply)) {
+         return;
+     }
+     memcpy(&reply, payload, sizeof(reply));
+     long long round_trip = clock_us() - reply.client_time;
+     long long server = (long long)reply.parse + reply.wait + reply.dispatch + reply.write;
+     show("Ping: %.2f ms round trip, %.2f ms in the server "
+          "(parse %d us, wait %d us, handler %d us, queued %d us), %.2f ms network and client",
+          round_trip / 1000.0, server / 1000.0, reply.parse, reply.wait, reply.dispatch, reply.write,
+          (round_trip - server) / 1000.0);
+ }
+ 
+ // /send: offer a file; the upload starts once the server accepts the offer.
+ int prompt_send(Message* msg) {
+     char path[MAX_PATH];
+     LARGE_INTEGER size;
+     PendingUpload* upload;
+ 
+     snprintf(path, sizeof(path), "%s", msg->content);
+     HANDLE file = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+     if (file == INVALID_HANDLE_VALUE) {
+         show("Cannot open %s", path);
+         return 0;
+     }
+     BOOL have_size = GetFileSizeEx(file, &size);
+     CloseHandle(file);
+     if (!have_size || size.QuadPart == 0) {
+         show("Cannot send an empty file.");
+         return 0;
+     }
+ 
+     // An offer the server turned down never gets an answer; its slot is
+     // reused once MAX_FILE_TRANSFERS newer offers have been made.
+     EnterCriticalSection(&uploads_mutex);
+     upload = &pending_uploads[next_upload_id % MAX_FILE_TRANSFERS];
+     upload->id = next_upload_id++;
+     strcpy(upload->path, path);
+     upload->size = size.QuadPart;
+     msg->command = upload->id;
+     LeaveCriticalSection(&uploads_mutex);
+ 
+     const char* name = path;
+     for (const char* c = path; *c != '\0'; c++) {
+         if (*c == '\\' || *c == '/' || *c == ':') {
+             name = c + 1;
+         }
+     }
+     msg->type = MSG_FILE_OFFER;
+     snprintf(msg->content, BUFFER_SIZE, "%lld %.*s", size.QuadPart, FILE_NAME_MAX - 1, name);
+     show("Offering %s (%lld bytes) to %s.", name, size.QuadPart, msg->target);
+     return 1;
+ }
+ 
+ // Extra client-side steps, indexed by command id. Returns 1 to send the message.
+ int (*const command_prompts[CMD_COUNT])(Message* msg) = {
+     [CMD_USERNAME] = prompt_username,
+     [CMD_PASSWORD] = prompt_password,
+     [CMD_DELETE] = prompt_delete,
+     [CMD_CLEAR] = run_clear,
+     [CMD_SEND] = prompt_send,
+     [CMD_SCROLLBACK] = run_scrollback,
+     [CMD_PING] = prompt_ping,
+ };
+ 
+ int answer_file_offer(Message* msg, int step, const char* line);  // With the file transfer handlers below
+ 
+ // The answers to the questions command_prompts ask, indexed by command id.
+ // Returns 1 when the message is complete, 0 after asking something else, or
+ // -1 to drop the command. A file offer from someone else is asked about
+ // under CMD_SEND.
+ int (*const prompt_answers[CMD_COUNT])(Message* msg, int step, const char* line) = {
+     [CMD_USERNAME] = answer_username,
+     [CMD_PASSWORD] = answer_password,
+     [CMD_DELETE] = answer_delete,
+     [CMD_SEND] = answer_file_offer,
+ };
+ 
  // Helper function to process commands
  int process_command(char* input, Message* msg) {
      char cmd[32];
      char args[BUFFER_SIZE];
      args[0] = '\0'; // Initialize args as empty string
+     command_target[0] = '\0';
      
      // Extract command and arguments
-     if (sscanf(input, "/%s %[^\n]", cmd, args) < 1) {
+     if (sscanf(input, "/%31s %[^\n]", cmd, args) < 1) {
          strcpy(cmd, "unknown");
      }
      
      msg->type = MSG_COMMAND;
-     
-     if (strcmp(cmd, "help") == 0) {
-         msg->command = CMD_HELP;
-         return 1;
-     } 
-     else if (strcmp(cmd, "username") == 0) {
-         char new_username[32];
-         char current_password[32];
-         
-         msg->command = CMD_USERNAME;
-         
-         if (sscanf(args, "%s", new_username) != 1) {
-             printf("Usage: /username <new_username>\n");
-             return 0;
+     msg->command = lookup_command(cmd);
+     if (msg->command == CMD_UNKNOWN) {
+         show("Unknown command. Type /help for a list of commands.");
+         return 0;
+     }
+ 
+     // Fill in the arguments according to the command's schema.
+     const CommandInfo* info = &command_info[msg->command];
+     int ok = 1;
+     switch (info->args) {
+         case ARGS_TEXT:
+             strcpy(msg->content, args);
+             break;
+         case ARGS_WORD:
+             ok = sscanf(args, "%31s", msg->content) == 1;
+             break;
+         case ARGS_TARGET_TEXT:
+             ok = sscanf(args, "%255s %[^\n]", command_target, msg->content) == 2;
+             snprintf(msg->target, sizeof(msg->target), "%s", command_target);
+             break;
+     }
+     if (!ok) {
+         show("Usage: /%s %s", info->name, info->usage);
+         return 0;
+     }
+ 
+     if (command_prompts[msg->command] != NULL) {
+         return command_prompts[msg->command](msg);
+     }
+     return !(info->flags & CMDF_LOCAL);
+ }
+ 
+ // Replace anything that could make a received file name escape the download directory.
+ void safe_file_name(char* name) {
+     for (char* c = name; *c != '\0'; c++) {
+         if (*c == '\\' || *c == '/' || *c == ':' || *c == '*' || *c == '?' || *c == '"' ||
+             *c == '<' || *c == '>' || *c == '|' || (unsigned char)*c < ' ') {
+             *c = '_';
          }
-         
-         // Prompt for the current password
-         printf("Enter your current password: ");
-         fgets(current_password, sizeof(current_password), stdin);
-         current_password[strcspn(current_password, "\n")] = 0; // Remove newline
-         
-         // Format: "new_username current_password"
-         snprintf(msg->content, BUFFER_SIZE, "%s %s", new_username, current_password);
-         return 1;
      }
-     else if (strcmp(cmd, "password") == 0) {
-         char current_password[32];
-         char new_password[32];
-         
-         msg->command = CMD_PASSWORD;
-         
-         // Prompt for the current password
-         printf("Enter your current password: ");
-         fgets(current_password, sizeof(current_password), stdin);
-         current_password[strcspn(current_password, "\n")] = 0; // Remove newline
-         
-         // Prompt for the new password
-         printf("Enter your new password: ");
-         fgets(new_password, sizeof(new_password), stdin);
-         new_password[strcspn(new_password, "\n")] = 0; // Remove newline
-         
-         // Format: "current_password new_password"
-         snprintf(msg->content, BUFFER_SIZE, "%s %s", current_password, new_password);
-         return 1;
+     if (name[0] == '.') {
+         name[0] = '_';
      }
-     else if (strcmp(cmd, "delete") == 0) {
-         msg->command = CMD_DELETE;
-         printf("Are you sure you want to delete your account? (y/n): ");
-         char confirm;
-         scanf(" %c", &confirm);
-         getchar(); // Clear newline
-         if (confirm == 'y' || confirm == 'Y') {
-             printf("Enter your password to confirm: ");
-             fgets(msg->content, BUFFER_SIZE, stdin);
-             msg->content[strcspn(msg->content, "\n")] = 0;
-             return 1;
-         } else {
-             printf("Account deletion cancelled.\n");
-             return 0;
+ }
+ 
+ // Thread that uploads a file in MSG_FILE_DATA messages, paced to the rate the server allows.
+ DWORD WINAPI upload_thread(LPVOID lpParam) {
+     Upload* upload = (Upload*)lpParam;
+     Message msg;
+     LARGE_INTEGER position;
+     long long sent = 0;
+     DWORD start = GetTickCount();
+ 
+     HANDLE file = CreateFile(upload->path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                              FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+     position.QuadPart = upload->offset;
+     if (file == INVALID_HANDLE_VALUE || !SetFilePointerEx(file, position, NULL, FILE_BEGIN)) {
+         show("Could not open %s for sending.", upload->path);
+         if (file != INVALID_HANDLE_VALUE) {
+             CloseHandle(file);
          }
+         free(upload);
+         return 0;
      }
-     else if (strcmp(cmd, "shout") == 0) {
-         msg->command = CMD_SHOUT;
-         strcpy(msg->content, args);
-         return 1;
+ 
+     ZeroMemory(&msg, sizeof(Message));
+     msg.type = MSG_FILE_DATA;
+     msg.command = upload->id;
+     while (client_running && upload->offset < upload->size) {
+         DWORD wanted = upload->size - upload->offset < BUFFER_SIZE ? (DWORD)(upload->size - upload->offset) : BUFFER_SIZE;
+         DWORD read = 0;
+         if (!ReadFile(file, msg.content, wanted, &read, NULL) || read != wanted) {
+             show("Reading %s failed; the file may have changed.", upload->path);
+             break;
+         }
+         if (send_message(connect_socket, &msg) == SOCKET_ERROR) {
+             break;
+         }
+         upload->offset += read;
+         sent += read;
+ 
+         // Stay under the rate: sleep whenever we are ahead of it.
+         DWORD due = (DWORD)(sent * 1000 / upload->rate);
+         DWORD elapsed = GetTickCount() - start;
+         if (due > elapsed) {
+             Sleep(due - elapsed);
+         }
      }
-     else if (strcmp(cmd, "whisper") == 0 || strcmp(cmd, "w") == 0) {
-         char target[32];
-         char whisper_msg[BUFFER_SIZE];
-         
-         if (sscanf(args, "%s %[^\n]", target, whisper_msg) == 2) {
-             msg->command = CMD_WHISPER;
-             strcpy(msg->target, target);
-             strcpy(msg->content, whisper_msg);
-             return 1;
-         } else {
-             printf("Usage: /whisper <username> <message>\n");
-             return 0;
+     if (upload->offset == upload->size) {
+         show("Uploaded %s; it is on its way.", upload->path);
+     }
+     CloseHandle(file);
+     free(upload);
+     return 0;
+ }
+ 
+ // MSG_FILE_ACCEPT: "<our id> <transfer id> <offset> <rate>". Start uploading from the offset.
+ void handle_file_accept(const char* payload) {
+     int local_id, id, rate;
+     long long offset;
+     Upload* upload = NULL;
+ 
+     if (sscanf(payload, "%d %d %lld %d", &local_id, &id, &offset, &rate) != 4 || rate <= 0) {
+         return;
+     }
+     EnterCriticalSection(&uploads_mutex);
+     for (int i = 0; i < MAX_FILE_TRANSFERS; i++) {
+         if (pending_uploads[i].id == local_id) {
+             upload = (Upload*)malloc(sizeof(Upload));
+             if (upload != NULL) {
+                 upload->id = id;
+                 strcpy(upload->path, pending_uploads[i].path);
+                 upload->size = pending_uploads[i].size;
+                 upload->offset = offset;
+                 upload->rate = rate;
+             }
+             pending_uploads[i].id = 0;
+             break;
          }
      }
-     else if (strcmp(cmd, "color") == 0) {
-         msg->command = CMD_COLOR;
-         
-         if (strlen(args) == 0) {
-             printf("Available colors: red, green, blue, yellow, magenta, cyan, white\n");
-             printf("Usage: /color <colorname>\n");
+     LeaveCriticalSection(&uploads_mutex);
+     if (upload == NULL) {
+         return;
+     }
+ 
+     if (offset > 0) {
+         show("Resuming %s at %lld of %lld bytes.", upload->path, offset, upload->size);
+     }
+     HANDLE thread = CreateThread(NULL, 0, upload_thread, upload, 0, NULL);
+     if (thread == NULL) {
+         show("Could not create upload thread.");
+         free(upload);
+         return;
+     }
+     CloseHandle(thread);
+ }
+ 
+ // Move a complete download to its final name, never over another file.
+ void finish_download(Download* download) {
+     CloseHandle(download->file);
+     if (MoveFileEx(download->part_path, download->path, 0)) {
+         show("File saved to %s", download->path);
+     } else {
+         show("File received but could not be renamed: %s", download->part_path);
+     }
+     download->id = 0;
+ }
+ 
+ // downloads\<name>, or downloads\<stem> (n)<ext> if a file of that name is
+ // already there. Returns 0 if every name up to (999) is taken.
+ int choose_download_path(const char* name, char* path, int size) {
+     const char* dot = strrchr(name, '.');
+     int stem = dot != NULL && dot != name ? (int)(dot - name) : (int)strlen(name);
+ 
+     snprintf(path, size, "%s\\%s", FILE_DOWNLOAD_DIR, name);
+     for (int n = 1; GetFileAttributes(path) != INVALID_FILE_ATTRIBUTES; n++) {
+         if (n > 999) {
              return 0;
          }
-         
-         strcpy(msg->content, args);
-         return 1;
+         snprintf(path, size, "%s\\%.*s (%d)%s", FILE_DOWNLOAD_DIR, stem, name, n, name + stem);
      }
-     else if (strcmp(cmd, "roll") == 0) {
-         msg->command = CMD_ROLL;
-         return 1;
+     return 1;
+ }
+ 
+ // Open the file for an accepted offer, resuming any partial download of the
+ // same name, and put the offset to start from in 'msg'. Returns 1 to send
+ // it, or -1 if the file cannot be taken.
+ int start_download(FileOffer* offer, Message* msg) {
+     LARGE_INTEGER existing;
+     Download* download = NULL;
+ 
+     for (int i = 0; i < MAX_FILE_TRANSFERS && download == NULL; i++) {
+         if (downloads[i].id == 0) {
+             download = &downloads[i];
+         }
      }
-     else if (strcmp(cmd, "online") == 0) {
-         msg->command = CMD_ONLINE;
-         return 1;
+     if (download == NULL) {
+         show("Cannot take %s now: too many files are already arriving.", offer->name);
+         return -1;
      }
-     else if (strcmp(cmd, "clear") == 0) {
-         msg->command = CMD_CLEAR;
-         clear_screen();
-         return 0; // No need to send to server
+ 
+     safe_file_name(offer->name);
+     CreateDirectory(FILE_DOWNLOAD_DIR, NULL);
+     if (!choose_download_path(offer->name, download->path, sizeof(download->path))) {
+         show("Cannot take %s: too many files of that name in %s.", offer->name, FILE_DOWNLOAD_DIR);
+         return -1;
+     }
+     snprintf(download->part_path, sizeof(download->part_path), "%s.part", download->path);
+     download->file = CreateFile(download->part_path, GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+     if (download->file == INVALID_HANDLE_VALUE || !GetFileSizeEx(download->file, &existing)) {
+         show("Cannot take %s: %s could not be created.", offer->name, download->part_path);
+         if (download->file != INVALID_HANDLE_VALUE) {
+             CloseHandle(download->file);
+         }
+         return -1;
+     }
+     if (existing.QuadPart > offer->size) {
+         // Left over from a different file of the same name.
+         CloseHandle(download->file);
+         download->file = CreateFile(download->part_path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+         existing.QuadPart = 0;
+         if (download->file == INVALID_HANDLE_VALUE) {
+             return -1;
+         }
+     }
+     download->id = offer->id;
+     download->size = offer->size;
+ 
+     if (existing.QuadPart > 0) {
+         show("Receiving %s from %s, resuming at %lld.", offer->name, offer->sender, existing.QuadPart);
+     } else {
+         show("Receiving %s from %s.", offer->name, offer->sender);
+     }
+     snprintf(msg->content, BUFFER_SIZE, "%lld", existing.QuadPart);
+     if (existing.QuadPart == offer->size) {
+         finish_download(download);
+     }
+     return 1;
+ }
+ 
+ // Ask about the oldest waiting offer, unless another question is open.
+ void ask_next_offer(void) {
+     Message msg;
+ 
+     if (prompt_command != CMD_NONE || offer_count == 0) {
+         return;
+     }
+     const FileOffer* offer = &offers[offer_head];
+     show("%s wants to send you %s (%lld bytes).", offer->sender, offer->name, offer->size);
+     ZeroMemory(&msg, sizeof(Message));
+     msg.type = MSG_FILE_ACCEPT;
+     msg.command = offer->id;
+     begin_prompt(&msg, "Accept the file? (y/n): ", 0);
+     prompt_command = CMD_SEND;
+ }
+ 
+ int answer_file_offer(Message* msg, int step, const char* line) {
+     FileOffer offer = offers[offer_head];
+     (void)step;
+ 
+     offer_head = (offer_head + 1) % MAX_FILE_TRANSFERS;
+     offer_count--;
+     if (line[0] != 'y' && line[0] != 'Y') {
+         show("Declined %s from %s.", offer.name, offer.sender);
+         return -1;
+     }
+     return start_download(&offer, msg);
+ }
+ 
+ // MSG_FILE_OFFER: "<id> <size> <sender> <name>". Nothing is written until
+ // the user accepts; an offer that is never accepted just lapses.
+ void handle_file_offer(const char* payload) {
+     FileOffer offer;
+ 
+     if (sscanf(payload, "%d %lld %31s %63[^\n]", &offer.id, &offer.size, offer.sender, offer.name) != 4 ||
+         offer.size < 0) {
+         return;
+     }
+     if (offer.size > MAX_DOWNLOAD_SIZE) {
+         show("%s wants to send you %s (%lld bytes); refused, files over %lld bytes are not accepted.",
+              offer.sender, offer.name, offer.size, MAX_DOWNLOAD_SIZE);
+         return;
+     }
+     if (offer_count == MAX_FILE_TRANSFERS) {
+         show("%s wants to send you %s, but too many offers are waiting.", offer.sender, offer.name);
+         return;
+     }
+     offers[(offer_head + offer_count) % MAX_FILE_TRANSFERS] = offer;
+     offer_count++;
+     ask_next_offer();
+ }
+ 
+ // MSG_FILE_DATA: a FileChunkHeader and the chunk.
+ void handle_file_data(const char* payload, int length) {
+     FileChunkHeader chunk;
+     LARGE_INTEGER position;
+     DWORD written;
+ 
+     if (length < (int)sizeof(FileChunkHeader)) {
+         return;
+     }
+     memcpy(&chunk, payload, sizeof(FileChunkHeader));
+     for (int i = 0; i < MAX_FILE_TRANSFERS; i++) {
+         Download* download = &downloads[i];
+         if (download->id != chunk.id) {
+             continue;
+         }
+         length -= sizeof(FileChunkHeader);
+         position.QuadPart = chunk.offset;
+         if (!SetFilePointerEx(download->file, position, NULL, FILE_BEGIN) ||
+             !WriteFile(download->file, payload + sizeof(FileChunkHeader), (DWORD)length, &written, NULL)) {
+             show("Writing %s failed.", download->part_path);
+             CloseHandle(download->file);
+             download->id = 0;
+         } else if (chunk.offset + length == download->size) {
+             finish_download(download);
+         }
+         return;
+     }
+ }
+ 
+ // Multicast delivery. Broadcasts come from the group the server names in
+ // MSG_MULTICAST and are shown in sequence order; one that went missing is
+ // asked for again over TCP (MCAST_NACK) and arrives as MSG_REPAIR. Until
+ // MSG_MULTICAST_START says where the group takes over from TCP, datagrams
+ // are only held.
+ void join_multicast(const char* payload, int length) {
+     if (length != (int)sizeof(MulticastInfo) || multicast_socket != INVALID_SOCKET) {
+         return;
+     }
+     memcpy(&multicast, payload, sizeof(multicast));
+ 
+     SOCKET s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+     if (s == INVALID_SOCKET) {
+         return;  // Broadcasts keep coming over TCP
+     }
+     BOOL reuse = TRUE;
+     setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+     struct sockaddr_in local;
+     ZeroMemory(&local, sizeof(local));
+     local.sin_family = AF_INET;
+     local.sin_addr.s_addr = htonl(INADDR_ANY);
+     local.sin_port = htons((unsigned short)multicast.port);
+     struct ip_mreq membership;
+     membership.imr_multiaddr.s_addr = multicast.group;
+     membership.imr_interface.s_addr = htonl(INADDR_ANY);
+     if (bind(s, (struct sockaddr*)&local, sizeof(local)) == SOCKET_ERROR ||
+         setsockopt(s, IPPROTO_IP, IP_ADD_MEMBERSHIP, (const char*)&membership, sizeof(membership)) == SOCKET_ERROR ||
+         WSAEventSelect(s, multicast_event, FD_READ) == SOCKET_ERROR) {
+         closesocket(s);
+         return;
+     }
+     multicast_socket = s;
+ 
+     Message msg;
+     ZeroMemory(&msg, sizeof(Message));
+     msg.type = MSG_MULTICAST;
+     msg.command = MCAST_JOINED;
+     send_message(connect_socket, &msg);
+ }
+ 
+ int multicast_held(long long sequence) {
+     return multicast_window[sequence % MCAST_WINDOW].sequence == sequence;
+ }
+ 
+ // Ask for the broadcasts from first to last that have not arrived.
+ void multicast_nack(long long first, long long last) {
+     if (multicast_next == 0) {
+         return;
+     }
+     if (first < multicast_next) {
+         first = multicast_next;
+     }
+     if (last >= multicast_next + MCAST_WINDOW) {
+         last = multicast_next + MCAST_WINDOW - 1;
+     }
+     while (first <= last && multicast_held(first)) {
+         first++;
+     }
+     while (last >= first && multicast_held(last)) {
+         last--;
+     }
+     if (first > last) {
+         return;
+     }
+ 
+     Message msg;
+     ZeroMemory(&msg, sizeof(Message));
+     msg.type = MSG_MULTICAST;
+     msg.command = MCAST_NACK;
+     snprintf(msg.content, BUFFER_SIZE, "%lld %lld", first, last);
+     send_message(connect_socket, &msg);
+     multicast_asked_at = GetTickCount64();
+ }
+ 
+ // Show the held broadcasts that are next in order.
+ void multicast_flush(void) {
+     while (multicast_next != 0 && multicast_held(multicast_next)) {
+         HeldBroadcast* held = &multicast_window[multicast_next % MCAST_WINDOW];
+         if (held->text != NULL) {
+             add_line(held->text, held->length);
+             free(held->text);
+             held->text = NULL;
+         }
+         multicast_next++;
+     }
+ }
+ 
+ // The server has sent broadcasts up to 'sequence'; ask for any new gap.
+ void multicast_heard(long long sequence) {
+     if (sequence > multicast_seen) {
+         long long first = multicast_seen + 1;
+         multicast_seen = sequence;
+         multicast_nack(first, sequence);
+     }
+ }
+ 
+ // A broadcast from the group or a repair. 'text' is NULL for one that is
+ // not to be shown (our own, or one the server no longer has).
+ void multicast_accept(long long sequence, const char* text, int length) {
+     if ((multicast_next != 0 && (sequence < multicast_next || sequence >= multicast_next + MCAST_WINDOW)) ||
+         multicast_held(sequence)) {
+         return;  // Shown already, too far ahead to hold, or a second copy
+     }
+     HeldBroadcast* held = &multicast_window[sequence % MCAST_WINDOW];
+     free(held->text);
+     held->sequence = sequence;
+     held->text = NULL;
+     held->length = 0;
+     if (text != NULL && length > 0 && (held->text = (char*)malloc(length)) != NULL) {
+         memcpy(held->text, text, length);
+         held->length = length;
+     }
+     multicast_heard(sequence - 1);
+     if (sequence > multicast_seen) {
+         multicast_seen = sequence;
+     }
+     multicast_flush();
+ }
+ 
+ // MSG_MULTICAST_START: broadcasts before 'sequence' came over TCP.
+ void multicast_started(long long sequence) {
+     for (int i = 0; i < MCAST_WINDOW; i++) {
+         if (multicast_window[i].sequence < sequence) {
+             free(multicast_window[i].text);
+             multicast_window[i].text = NULL;
+             multicast_window[i].sequence = 0;
+         }
+     }
+     multicast_next = sequence;
+     if (multicast_seen < sequence - 1) {
+         multicast_seen = sequence - 1;
+     }
+     multicast_flush();
+     multicast_nack(multicast_next, multicast_seen);
+ }
+ 
+ // Read the datagrams that have arrived from the group.
+ void read_multicast(void) {
+     static char datagram[MCAST_DATAGRAM_MAX];
+     MulticastHeader header;
+     int received;
+ 
+     while ((received = recvfrom(multicast_socket, datagram, sizeof(datagram), 0, NULL, NULL)) >= (int)sizeof(header)) {
+         memcpy(&header, datagram, sizeof(header));
+         if (header.magic != MULTICAST_MAGIC || header.session != multicast.session) {
+             continue;  // Another server's
+         }
+         if (header.kind == MCAST_HEARTBEAT) {
+             multicast_heard(header.sequence);
+             continue;
+         }
+         if (header.kind != MCAST_DATA || header.colored_length < 0 || header.plain_length < 0 ||
+             (int)sizeof(header) + header.colored_length + header.plain_length > received) {
+             continue;
+         }
+         const char* text = datagram + sizeof(header);
+         int length = header.colored_length;
+         if (client_capabilities & CAP_PLAIN) {
+             text += header.colored_length;
+             length = header.plain_length;
+         }
+         multicast_accept(header.sequence, header.sender_id == multicast.client_id ? NULL : text, length);
+     }
+ }
+ 
+ // A repair that has not come: ask again.
+ void multicast_retry(void) {
+     if (multicast_next != 0 && multicast_seen >= multicast_next &&
+         GetTickCount64() - multicast_asked_at >= MCAST_NACK_RETRY_MS) {
+         multicast_nack(multicast_next, multicast_seen);
+     }
+ }
+ 
+ // Tab: ask the server which online users have names starting with the
+ // last name typed in a /whisper target list. handle_completion() uses the answer.
+ void request_completion(void) {
+     char command[32];
+     int end = 0;
+     Message msg;
+ 
+     input_line[input_length] = '\0';
+     if (prompt_command != CMD_NONE || sscanf(input_line, "/%31s%n", command, &end) != 1 ||
+         lookup_command(command) != CMD_WHISPER || input_line[end] != ' ') {
+         return;
+     }
+     const char* targets = input_line + end + 1;
+     if (strchr(targets, ' ') != NULL) {
+         return;  // Already typing the message
+     }
+     const char* last = strrchr(targets, ',');
+ 
+     ZeroMemory(&msg, sizeof(Message));
+     msg.type = MSG_COMPLETE;
+     snprintf(msg.content, BUFFER_SIZE, "%s", last != NULL ? last + 1 : targets);
+     memcpy(completion_line, input_line, input_length);
+     completion_length = input_length;
+     if (send_message(connect_socket, &msg) == SOCKET_ERROR) {
+         show("Send failed: %d", WSAGetLastError());
+         client_running = FALSE;
+     }
+ }
+ 
+ // MSG_COMPLETE: the prefix asked about, then the matching names. Complete
+ // the name if one user matches, or as far as all of them agree and list
+ // them. An answer for a line that has changed since is ignored.
+ void handle_completion(const char* payload, int length) {
+     const char* names[COMPLETE_MAX_RESULTS];
+     int count = 0;
+ 
+     if (completion_length != input_length || memcmp(completion_line, input_line, input_length) != 0) {
+         completion_length = -1;
+         return;
+     }
+     completion_length = -1;
+ 
+     int prefix_length = (int)strlen(payload);
+     for (int offset = prefix_length + 1; offset < length && count < COMPLETE_MAX_RESULTS;) {
+         names[count++] = payload + offset;
+         offset += (int)strlen(payload + offset) + 1;
+     }
+     if (count == 0) {
+         show("Nobody online has a name starting with '%s'.", payload);
+         return;
+     }
+ 
+     int common = (int)strlen(names[0]);
+     for (int i = 1; i < count; i++) {
+         while (common > prefix_length && strncmp(names[0], names[i], common) != 0) {
+             common--;
+         }
+     }
+     int added = common - prefix_length;
+     if (added > 0 && input_length + added + 1 < BUFFER_SIZE) {
+         memcpy(input_line + input_length, names[0] + prefix_length, added);
+         input_length += added;
+     }
+     if (count == 1 && input_length + 1 < BUFFER_SIZE) {
+         input_line[input_length++] = ' ';
+     } else if (count > 1) {
+         char list[COMPLETE_MAX_RESULTS * 34];
+         int list_length = 0;
+         for (int i = 0; i < count; i++) {
+             list_length += snprintf(list + list_length, sizeof(list) - list_length, "  %s", names[i]);
+         }
+         show("%s", list);
+     }
+     redraw_input();
+ }
+ 
+ // Act on one frame from the server.
+ void handle_frame(FrameHeader* header, const char* data) {
+     static char payload[FRAME_BUFFER_SIZE];
+     int stored = header->length < FRAME_BUFFER_SIZE - 1 ? header->length : FRAME_BUFFER_SIZE - 1;
+ 
+     memcpy(payload, data, stored);
+     payload[stored] = '\0';
+     if ((header->type & FRAME_COMPRESSED) &&
+         inflate_payload(header, payload, stored, FRAME_BUFFER_SIZE) == SOCKET_ERROR) {
+         client_running = FALSE;
+         return;
      }
-     else if (strcmp(cmd, "joke") == 0) {
-         msg->command = CMD_JOKE;
+ 
+     switch (header->type) {
+         case MSG_PING:
+             send_pong(connect_socket);
+             break;
+         case MSG_FILE_OFFER:
+             handle_file_offer(payload);
+             break;
+         case MSG_FILE_ACCEPT:
+             handle_file_accept(payload);
+             break;
+         case MSG_FILE_DATA:
+             handle_file_data(payload, header->length);
+             break;
+         case MSG_PING_REPLY:
+             handle_ping_reply(payload, stored);
+             break;
+         case MSG_MULTICAST:
+             join_multicast(payload, stored);
+             break;
+         case MSG_MULTICAST_START:
+             multicast_started(header->sequence);
+             break;
+         case MSG_REPAIR:
+             multicast_accept(header->sequence, stored > 0 ? payload : NULL, (int)strlen(payload));
+             break;
+         case MSG_COMPLETE:
+             handle_completion(payload, header->length < FRAME_BUFFER_SIZE - 1 ? header->length : FRAME_BUFFER_SIZE - 1);
+             break;
+         default:
+             add_line(payload, (int)strlen(payload));
+             break;
+     }
+ }
+ 
+ // Read what has arrived and handle every complete frame. Stops after
+ // READ_BUDGET bytes so that typing keeps up during a flood; Winsock signals
+ // FD_READ again for whatever is left.
+ void read_from_server(void) {
+     static char inbound[CLIENT_INBOUND_SIZE];
+     static int inbound_length = 0;
+     int budget = READ_BUDGET;
+ 
+     while (budget > 0 && client_running) {
+         int received = recv(connect_socket, inbound + inbound_length, CLIENT_INBOUND_SIZE - inbound_length, 0);
+         if (received == 0) {
+             show("Server closed connection.");
+             client_running = FALSE;
+             return;
+         }
+         if (received == SOCKET_ERROR) {
+             if (WSAGetLastError() != WSAEWOULDBLOCK) {
+                 if (client_running) {
+                     show("recv failed: %d", WSAGetLastError());
+                 }
+                 client_running = FALSE;
+             }
+             return;
+         }
+         inbound_length += received;
+         budget -= received;
+ 
+         int offset = 0;
+         while (inbound_length - offset >= (int)sizeof(FrameHeader) && client_running) {
+             FrameHeader header;
+             memcpy(&header, inbound + offset, sizeof(FrameHeader));
+             if (header.length < 0 || header.length > FRAME_BUFFER_SIZE - 1) {
+                 show("The server sent a frame of %d bytes; disconnecting.", header.length);
+                 client_running = FALSE;
+                 return;
+             }
+             if (inbound_length - offset < (int)sizeof(FrameHeader) + header.length) {
+                 break;
+             }
+             handle_frame(&header, inbound + offset + sizeof(FrameHeader));
+             offset += sizeof(FrameHeader) + header.length;
+         }
+         memmove(inbound, inbound + offset, inbound_length - offset);
+         inbound_length -= offset;
+     }
+ }
+ 
+ // Send the collected batch, if any. Returns 0 if the send failed.
+ int flush_batch(void) {
+     if (batch_msg.command == 0) {
          return 1;
      }
-     else {
-         printf("Unknown command. Type /help for a list of commands.\n");
+     int result = send_message(connect_socket, &batch_msg);
+     batch_msg.command = 0;
+     batch_length = 0;
+     return result != SOCKET_ERROR;
+ }
+ 
+ // Add a chat line (CMD_NONE) or a command to the batch, sending the batch
+ // first if the entry does not fit. Returns 0 if a send failed.
+ int add_to_batch(int command, const char* target, const char* text) {
+     BatchEntry entry;
+     int target_length = (int)strlen(target);
+     int text_length = (int)strlen(text);
+     int room = BUFFER_SIZE - (int)sizeof(BatchEntry) - target_length;
+ 
+     entry.command = (unsigned char)command;
+     entry.target_length = (unsigned char)target_length;
+     entry.text_length = (unsigned short)(text_length < room ? text_length : room);
+     int size = (int)sizeof(BatchEntry) + target_length + entry.text_length;
+     if ((batch_msg.command == BATCH_MAX_ENTRIES || batch_length + size > BUFFER_SIZE) && !flush_batch()) {
          return 0;
      }
+     if (batch_msg.command == 0) {
+         ZeroMemory(&batch_msg, sizeof(Message));
+         batch_msg.type = MSG_BATCH;
+     }
+     memcpy(batch_msg.content + batch_length, &entry, sizeof(entry));
+     memcpy(batch_msg.content + batch_length + sizeof(entry), target, target_length);
+     memcpy(batch_msg.content + batch_length + sizeof(entry) + target_length, text, entry.text_length);
+     batch_length += size;
+     batch_msg.command++;
+     return 1;
  }
  
- // Thread function for receiving messages from the server.
- DWORD WINAPI receive_handler(LPVOID lpParam) {
-     char buffer[BUFFER_SIZE];
-     int recvResult;
-     while (client_running) {
-         ZeroMemory(buffer, BUFFER_SIZE);
-         recvResult = recv(connect_socket, buffer, BUFFER_SIZE - 1, 0);
-         if (recvResult > 0) {
-             buffer[recvResult] = '\0';
-             printf("%s\n", buffer);
-         } else if (recvResult == 0) {
-             printf("Server closed connection.\n");
-             client_running = FALSE;
-             break;
-         } else {
-             if (client_running) {
-                 fprintf(stderr, "recv failed: %d\n", WSAGetLastError());
+ // Send a message for a line the user typed. Chat and commands join the
+ // batch while piped input drains, and a whisper to more users than
+ // Message.target holds always goes in one; anything else is sent after the
+ // batch so the server sees the lines in order. Returns 0 if a send failed.
+ int send_line(Message* msg, const char* target) {
+     if (msg->type == MSG_CHAT || msg->type == MSG_COMMAND) {
+         if (batching || strlen(target) >= sizeof(msg->target)) {
+             return add_to_batch(msg->command, target, msg->content) && (batching || flush_batch());
+         }
+     }
+     return flush_batch() && send_message(connect_socket, msg) != SOCKET_ERROR;
+ }
+ 
+ // Send a line typed by the user: a command, or chat.
+ void handle_line(char* input) {
+     Message msg;
+ 
+     if (prompt_command != CMD_NONE) {
+         int result = prompt_answers[prompt_command](&prompt_msg, prompt_step++, input);
+         if (result != 0) {
+             prompt_command = CMD_NONE;
+             ask("", 0);
+             if (result > 0 && !send_line(&prompt_msg, prompt_msg.target)) {
+                 show("Send failed: %d", WSAGetLastError());
+                 client_running = FALSE;
              }
+             ask_next_offer();
+         }
+         return;
+     }
+     if (strlen(input) == 0) {
+         return;
+     }
+ 
+     ZeroMemory(&msg, sizeof(Message));
+     if (input[0] == '/') {
+         // Check if it's a command
+         if (process_command(input, &msg) && !send_line(&msg, command_target)) {
+             show("Send failed: %d", WSAGetLastError());
              client_running = FALSE;
-             break;
          }
+     } else {
+         // Regular chat message
+         msg.type = MSG_CHAT;
+         snprintf(msg.content, BUFFER_SIZE, "%s", input);
+         if (!send_line(&msg, "")) {
+             show("Send failed: %d", WSAGetLastError());
+             client_running = FALSE;
+             return;
+         }
+ 
+         // Display own message locally
+         show("You: %s", input);
+     }
+ }
+ 
+ // One key press at the console.
+ void handle_key(const KEY_EVENT_RECORD* key) {
+     static WCHAR high_surrogate = 0;
+     WCHAR chars[2];
+     char utf8[8];
+     int count = 0;
+ 
+     switch (key->wVirtualKeyCode) {
+         case VK_RETURN: {
+             char line[BUFFER_SIZE];
+             memcpy(line, input_line, input_length);
+             line[input_length] = '\0';
+             input_length = 0;
+             handle_line(line);
+             redraw_input();
+             return;
+         }
+         case VK_BACK:
+             // Remove a whole UTF-8 character.
+             while (input_length > 0 && ((unsigned char)input_line[--input_length] & 0xC0) == 0x80) {
+             }
+             redraw_input();
+             return;
+         case VK_TAB:
+             request_completion();
+             return;
+         case VK_ESCAPE:
+             // Clear the line; on an empty line, give up on the question being asked.
+             if (input_length == 0 && prompt_command != CMD_NONE) {
+                 prompt_command = CMD_NONE;
+                 ask("", 0);
+                 show("Cancelled.");
+             }
+             input_length = 0;
+             redraw_input();
+             return;
+     }
+ 
+     WCHAR c = key->uChar.UnicodeChar;
+     if (c >= 0xD800 && c < 0xDC00) {
+         high_surrogate = c;
+         return;
      }
+     if (c >= 0xDC00 && c < 0xE000 && high_surrogate != 0) {
+         chars[count++] = high_surrogate;
+     } else if (c < ' ') {
+         return;
+     }
+     high_surrogate = 0;
+     chars[count++] = c;
+     int length = WideCharToMultiByte(CP_UTF8, 0, chars, count, utf8, sizeof(utf8), NULL, NULL);
+     if (length > 0 && input_length + length < BUFFER_SIZE) {
+         memcpy(input_line + input_length, utf8, length);
+         input_length += length;
+         redraw_input();
+     }
+ }
+ 
+ void read_console_input(HANDLE console) {
+     INPUT_RECORD records[64];
+     DWORD available, count;
+ 
+     if (!GetNumberOfConsoleInputEvents(console, &available) || available == 0 ||
+         !ReadConsoleInputW(console, records, 64, &count)) {
+         return;
+     }
+     for (DWORD i = 0; i < count && client_running; i++) {
+         if (records[i].EventType == KEY_EVENT && records[i].Event.KeyEvent.bKeyDown) {
+             for (int n = 0; n < records[i].Event.KeyEvent.wRepeatCount; n++) {
+                 handle_key(&records[i].Event.KeyEvent);
+             }
+         }
+     }
+ }
+ 
+ // When stdin is a file or a pipe, lines are read here and handed to the
+ // event loop.
+ DWORD WINAPI stdin_thread(LPVOID lpParam) {
+     char line[BUFFER_SIZE];
+     (void)lpParam;
+ 
+     while (client_running && fgets(line, sizeof(line), stdin) != NULL) {
+         line[strcspn(line, "\r\n")] = 0; // Remove newline
+         EnterCriticalSection(&input_mutex);
+         while (input_queue_tail - input_queue_head == INPUT_QUEUE_LINES && client_running) {
+             LeaveCriticalSection(&input_mutex);
+             Sleep(10);
+             EnterCriticalSection(&input_mutex);
+         }
+         strcpy(input_queue[input_queue_tail % INPUT_QUEUE_LINES], line);
+         input_queue_tail++;
+         LeaveCriticalSection(&input_mutex);
+         SetEvent(stdin_event);
+     }
+     stdin_closed = TRUE;
+     SetEvent(stdin_event);
      return 0;
  }
  
+ void read_queued_input(void) {
+     char line[BUFFER_SIZE];
+ 
+     batching = 1;
+     EnterCriticalSection(&input_mutex);
+     while (input_queue_head != input_queue_tail && client_running) {
+         strcpy(line, input_queue[input_queue_head % INPUT_QUEUE_LINES]);
+         input_queue_head++;
+         LeaveCriticalSection(&input_mutex);
+         handle_line(line);
+         EnterCriticalSection(&input_mutex);
+     }
+     LeaveCriticalSection(&input_mutex);
+     batching = 0;
+     if (client_running && !flush_batch()) {
+         show("Send failed: %d", WSAGetLastError());
+         client_running = FALSE;
+     }
+ 
+     EnterCriticalSection(&input_mutex);
+     if (stdin_closed && input_queue_head == input_queue_tail) {
+         client_running = FALSE;
+     }
+     LeaveCriticalSection(&input_mutex);
+ }
+ 
+ // Everything after login runs here, on one thread: frames are read as they
+ // arrive, keys as they are pressed, and output is written in batches, at
+ // most one every RENDER_INTERVAL_MS however fast messages come in.
+ void run_event_loop(void) {
+     HANDLE console = GetStdHandle(STD_INPUT_HANDLE);
+     HANDLE net_event = WSACreateEvent();
+     multicast_event = WSACreateEvent();
+     HANDLE stdin_reader = NULL;
+     CONSOLE_SCREEN_BUFFER_INFO screen;
+     DWORD mode;
+     unsigned long long last_render = 0;
+ 
+     // The socket becomes non-blocking here.
+     if (net_event == WSA_INVALID_EVENT || multicast_event == WSA_INVALID_EVENT ||
+         WSAEventSelect(connect_socket, net_event, FD_READ | FD_CLOSE) == SOCKET_ERROR) {
+         fprintf(stderr, "Could not watch the connection: %d\n", WSAGetLastError());
+         return;
+     }
+     console_input = GetConsoleMode(console, &mode);
+     if (!console_input) {
+         stdin_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+         stdin_reader = CreateThread(NULL, 0, stdin_thread, NULL, 0, NULL);
+         if (stdin_reader == NULL) {
+             fprintf(stderr, "Could not create input thread.\n");
+             return;
+         }
+     }
+     // Output redirected to a file gets everything; a console gets a screenful per batch.
+     if (GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &screen)) {
+         render_max_lines = screen.srWindow.Bottom - screen.srWindow.Top;
+         if (render_max_lines < 10) {
+             render_max_lines = 10;
+         }
+     }
+ 
+     HANDLE events[4] = { net_event, console_input ? console : stdin_event, output_event, multicast_event };
+     redraw_input();
+     while (client_running) {
+         DWORD timeout = 250;  // Also notices Ctrl+C
+         unsigned long long now = GetTickCount64();
+         if (output_pending()) {
+             timeout = now - last_render >= RENDER_INTERVAL_MS ? 0 : (DWORD)(last_render + RENDER_INTERVAL_MS - now);
+         }
+         WaitForMultipleObjects(4, events, FALSE, timeout);
+ 
+         // Look at every source each time round, so a busy one cannot starve the others.
+         WSANETWORKEVENTS network;
+         if (WSAEnumNetworkEvents(connect_socket, net_event, &network) == 0 && network.lNetworkEvents != 0) {
+             read_from_server();
+         }
+         if (multicast_socket != INVALID_SOCKET) {
+             if (WSAEnumNetworkEvents(multicast_socket, multicast_event, &network) == 0 && network.lNetworkEvents != 0) {
+                 read_multicast();
+             }
+             multicast_retry();
+         }
+         if (console_input) {
+             if (WaitForSingleObject(console, 0) == WAIT_OBJECT_0) {
+                 read_console_input(console);
+             }
+         } else {
+             read_queued_input();
+         }
+ 
+         now = GetTickCount64();
+         if (now - last_render >= RENDER_INTERVAL_MS && output_pending()) {
+             flush_output();
+             last_render = now;
+         }
+     }
+     flush_output();
+     printf("\n");
+ 
+     if (stdin_reader != NULL) {
+         // Blocked in fgets until stdin has more; it only touches the queue.
+         CloseHandle(stdin_reader);
+     }
+     WSACloseEvent(net_event);
+     if (multicast_socket != INVALID_SOCKET) {
+         closesocket(multicast_socket);
+     }
+     WSACloseEvent(multicast_event);
+ }
+ 
+ 
  // Function to handle authentication
  int authenticate(SOCKET socket) {
-     Message msg, response;
+     Message msg;
+     FrameHeader header;
+     char response[BUFFER_SIZE];
      char username[32], password[32];
      int choice;
      
@@ -225,6 +1588,7 @@
      // Create authentication message
      ZeroMemory(&msg, sizeof(Message));
      msg.type = (choice == 1) ? MSG_AUTH : MSG_REGISTER;
+     msg.command = client_capabilities;
      strcpy(msg.username, username);
      strcpy(msg.content, password);
      
@@ -234,33 +1598,119 @@
      printf("Sending authentication request type: %d for user: %s\n", msg.type, username);
      
      // Send authentication request
-     if (send(socket, (char*)&msg, sizeof(Message), 0) == SOCKET_ERROR) {
+     if (send_message(socket, &msg) == SOCKET_ERROR) {
          fprintf(stderr, "Authentication send failed: %d\n", WSAGetLastError());
          return 0;
      }
      
-     // Wait for server response
-     ZeroMemory(&response, sizeof(Message));
-     
-     int recvResult = recv(socket, (char*)&response, sizeof(Message), 0);
-     if (recvResult > 0) {
-         printf("Server response: %s\n", response.content);
-         return (strstr(response.content, "successful") != NULL);
-     } else {
-         printf("Failed to receive server response\n");
+     // Wait for server response, answering any heartbeats in between
+     while (recv_frame(socket, &header, response, sizeof(response)) > 0) {
+         if (header.type == MSG_PING) {
+             send_pong(socket);
+             continue;
+         }
+         printf("Server response: %s\n", response);
+         return header.type == MSG_AUTH && strstr(response, "successful") != NULL;
      }
      
+     printf("Failed to receive server response\n");
+     client_running = FALSE;
      return 0;
  }
  
+ // Connect to a server given on the command line.
+ SOCKET connect_to_server(const char* serverIP, const char* port) {
+     // Resolve the server address and port.
+     struct addrinfo hints, *result;
+     ZeroMemory(&hints, sizeof(hints));
+     hints.ai_family = AF_INET;         // IPv4
+     hints.ai_socktype = SOCK_STREAM;
+     hints.ai_protocol = IPPROTO_TCP;
+ 
+     int res = getaddrinfo(serverIP, port, &hints, &result);
+     if (res != 0) {
+         fprintf(stderr, "getaddrinfo failed: %d\n", res);
+         return INVALID_SOCKET;
+     }
+ 
+     // Create a TCP socket and connect to the server.
+     SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+     if (s == INVALID_SOCKET) {
+         fprintf(stderr, "socket failed: %ld\n", WSAGetLastError());
+         freeaddrinfo(result);
+         return INVALID_SOCKET;
+     }
+     res = connect(s, result->ai_addr, (int)result->ai_addrlen);
+     freeaddrinfo(result);
+     if (res == SOCKET_ERROR) {
+         fprintf(stderr, "connect failed: %d\n", WSAGetLastError());
+         closesocket(s);
+         return INVALID_SOCKET;
+     }
+     printf("Connected to server at %s:%s\n", serverIP, port);
+     return s;
+ }
+ 
+ // No server given: find the servers on the local network and connect to
+ // the best one, falling back to the next if it does not answer.
+ SOCKET connect_discovered(void) {
+     ServerCandidate candidates[MAX_CANDIDATES];
+ 
+     printf("Looking for servers on the local network...\n");
+     int count = discover_servers(candidates, MAX_CANDIDATES);
+     if (count == 0) {
+         fprintf(stderr, "No servers found. Give the address: client.exe <Server IP> <Port>\n");
+         return INVALID_SOCKET;
+     }
+     for (int i = 0; i < count; i++) {
+         if (candidates[i].rtt_us < 0) {
+             printf("  %-20s %s:%d  no reply, %d/%d users\n", candidates[i].node, inet_ntoa(candidates[i].address.sin_addr),
+                    ntohs(candidates[i].address.sin_port), candidates[i].load, candidates[i].capacity);
+         } else {
+             printf("  %-20s %s:%d  %lld.%03lld ms, %d/%d users\n", candidates[i].node, inet_ntoa(candidates[i].address.sin_addr),
+                    ntohs(candidates[i].address.sin_port), candidates[i].rtt_us / 1000, candidates[i].rtt_us % 1000,
+                    candidates[i].load, candidates[i].capacity);
+         }
+     }
+ 
+     for (int i = 0; i < count; i++) {
+         SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+         if (s == INVALID_SOCKET) {
+             fprintf(stderr, "socket failed: %ld\n", WSAGetLastError());
+             return INVALID_SOCKET;
+         }
+         if (connect(s, (struct sockaddr*)&candidates[i].address, sizeof(candidates[i].address)) == 0) {
+             printf("Connected to %s at %s:%d\n", candidates[i].node, inet_ntoa(candidates[i].address.sin_addr),
+                    ntohs(candidates[i].address.sin_port));
+             return s;
+         }
+         fprintf(stderr, "Could not connect to %s: %d\n", candidates[i].node, WSAGetLastError());
+         closesocket(s);
+     }
+     return INVALID_SOCKET;
+ }
+ 
  int main(int argc, char *argv[]) {
-     if (argc < 3) {
-         fprintf(stderr, "Usage: %s <Server IP> <Port>\n", argv[0]);
+     const char* serverIP = NULL;
+     const char* port = NULL;
+     int plain = 0;
+ 
+     for (int i = 1; i < argc; i++) {
+         if (strcmp(argv[i], "--plain") == 0) {
+             plain = 1;
+         } else if (strcmp(argv[i], "--no-multicast") == 0) {
+             client_capabilities &= ~CAP_MULTICAST;
+         } else if (serverIP == NULL) {
+             serverIP = argv[i];
+         } else if (port == NULL) {
+             port = argv[i];
+         }
+     }
+     if (serverIP != NULL && port == NULL) {
+         fprintf(stderr, "Usage: %s [<Server IP> <Port>] [--plain] [--no-multicast]\n", argv[0]);
          Sleep(5);
          return 1;
      }
-     const char* serverIP = argv[1];
-     const char* port = argv[2];
  
      // Set up the Ctrl+C handler.
      if (!SetConsoleCtrlHandler(ConsoleHandler, TRUE)) {
@@ -269,50 +1719,34 @@
          return 1;
      }
  
+     // Ask for plain text if colors were turned off or the console cannot show them.
+     HANDLE console = GetStdHandle(STD_OUTPUT_HANDLE);
+     DWORD console_mode;
+     console_vt = GetConsoleMode(console, &console_mode) &&
+                  SetConsoleMode(console, console_mode | ENABLE_VIRTUAL_TERMINAL_PROCESSING);
+     if (plain || !console_vt) {
+         client_capabilities |= CAP_PLAIN;
+     }
+ 
+     InitializeCriticalSection(&send_mutex);
+     InitializeCriticalSection(&uploads_mutex);
+     InitializeCriticalSection(&output_mutex);
+     InitializeCriticalSection(&input_mutex);
+     output_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+ 
      if (initialize_winsock() != 0) {
         printf("initialize");
         Sleep(5);
          return 1;
      }
  
-     // Create a TCP socket.
-     connect_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+     connect_socket = serverIP != NULL ? connect_to_server(serverIP, port) : connect_discovered();
      if (connect_socket == INVALID_SOCKET) {
-         fprintf(stderr, "socket failed: %ld\n", WSAGetLastError());
-         Sleep(5);
-         WSACleanup();
-         return 1;
-     }
- 
-     // Resolve the server address and port.
-     struct addrinfo hints, *result;
-     ZeroMemory(&hints, sizeof(hints));
-     hints.ai_family = AF_INET;         // IPv4
-     hints.ai_socktype = SOCK_STREAM;
-     hints.ai_protocol = IPPROTO_TCP;
- 
-     int res = getaddrinfo(serverIP, port, &hints, &result);
-     if (res != 0) {
-         fprintf(stderr, "getaddrinfo failed: %d\n", res);
          Sleep(5);
-         closesocket(connect_socket);
          WSACleanup();
          return 1;
      }
  
-     // Connect to the server.
-     res = connect(connect_socket, result->ai_addr, (int)result->ai_addrlen);
-     freeaddrinfo(result);
-     if (res == SOCKET_ERROR) {
-         fprintf(stderr, "connect failed: %d\n", WSAGetLastError());
-         Sleep(5);
-         
-         closesocket(connect_socket);
-         WSACleanup();
-         return 1;
-     }
-     printf("Connected to server at %s:%s\n", serverIP, port);
- 
      // Authenticate before chatting
      int authenticated = 0;
      while (!authenticated && client_running) {
@@ -331,64 +1765,19 @@
          }
      }
      
-     // Only start receive thread after authentication
-     HANDLE recvThread = NULL;
+     // Only start the event loop after authentication
      if (authenticated) {
          clear_screen();
          printf("Authentication successful. You can now start chatting.\n");
          printf("Type /help to see available commands.\n\n");
-         recvThread = CreateThread(NULL, 0, receive_handler, NULL, 0, NULL);
-         if (recvThread == NULL) {
-             fprintf(stderr, "Could not create receive thread.\n");
-             closesocket(connect_socket);
-             WSACleanup();
-             return 1;
-         }
-         
-         // Main loop for sending messages
-         Message msg;
-         char input[BUFFER_SIZE];
-         while (client_running) {
-             ZeroMemory(&msg, sizeof(Message));
-             ZeroMemory(input, sizeof(input));
-             
-             if (fgets(input, BUFFER_SIZE, stdin) != NULL) {
-                 input[strcspn(input, "\n")] = 0; // Remove newline
-                 
-                 if (strlen(input) > 0) {
-                     // Check if it's a command
-                     if (input[0] == '/') {
-                         if (process_command(input, &msg)) {
-                             if (send(connect_socket, (char*)&msg, sizeof(Message), 0) == SOCKET_ERROR) {
-                                 fprintf(stderr, "Send failed: %d\n", WSAGetLastError());
-                                 break;
-                             }
-                         }
-                     } else {
-                         // Regular chat message
-                         msg.type = MSG_CHAT;
-                         strcpy(msg.content, input);
-                         
-                         if (send(connect_socket, (char*)&msg, sizeof(Message), 0) == SOCKET_ERROR) {
-                             fprintf(stderr, "Send failed: %d\n", WSAGetLastError());
-                             break;
-                         }
-                         
-                         // Display own message locally
-                         printf("You: %s\n", input);
-                     }
-                 }
-             }
-         }
+         run_event_loop();
      }
      
      // Cleanup
      client_running = FALSE;
-     if (recvThread != NULL) {
-         WaitForSingleObject(recvThread, INFINITE);
-         CloseHandle(recvThread);
-     }
      closesocket(connect_socket);
      WSACleanup();
+     DeleteCriticalSection(&send_mutex);
+     DeleteCriticalSection(&uploads_mutex);
      return 0;
  }
@@ -0,0 +1,57 @@
+// Build step: generates cmdhash.h, a perfect hash from command names (and
+// aliases) in COMMAND_LIST to command ids, so the client looks a command up
+// with one hash and one string compare.
+//     cmdgen.exe > cmdhash.h
+#include "common.h"
+
+#define COMMAND_HASH_SIZE 32   // Power of two, comfortably above the number of names
+#define MAX_SEEDS 1000000
+
+typedef struct {
+    const char* name;
+    const char* id;
+} CommandName;
+
+#define COMMAND_NAME(id, name, args, usage, flags, help) { name, #id },
+#define ALIAS_NAME(alias, id) { alias, #id },
+static const CommandName names[] = { COMMAND_LIST(COMMAND_NAME) COMMAND_ALIASES(ALIAS_NAME) };
+#define NAME_COUNT ((int)(sizeof(names) / sizeof(names[0])))
+
+int main(void) {
+    int slots[COMMAND_HASH_SIZE];
+    unsigned int seed;
+
+    // Try seeds until no two names share a slot.
+    for (seed = 1; seed < MAX_SEEDS; seed++) {
+        int collision = 0;
+        memset(slots, -1, sizeof(slots));
+        for (int i = 0; i < NAME_COUNT && !collision; i++) {
+            unsigned int slot = command_hash(names[i].name, seed) & (COMMAND_HASH_SIZE - 1);
+            if (slots[slot] >= 0) {
+                collision = 1;
+            } else {
+                slots[slot] = i;
+            }
+        }
+        if (!collision) {
+            break;
+        }
+    }
+    if (seed == MAX_SEEDS) {
+        fprintf(stderr, "cmdgen: no perfect hash for %d names in %d slots\n", NAME_COUNT, COMMAND_HASH_SIZE);
+        return 1;
+    }
+
+    printf("// Generated by cmdgen.c from COMMAND_LIST in common.h. Do not edit.\n");
+    printf("#ifndef CMDHASH_H\n#define CMDHASH_H\n\n");
+    printf("#define COMMAND_HASH_SEED %uu\n", seed);
+    printf("#define COMMAND_HASH_SIZE %d\n\n", COMMAND_HASH_SIZE);
+    printf("static const struct {\n    const char* name;\n    int id;\n} command_hash_table[COMMAND_HASH_SIZE] = {\n");
+    for (int slot = 0; slot < COMMAND_HASH_SIZE; slot++) {
+        if (slots[slot] >= 0) {
+            printf("    [%d] = { \"%s\", %s },\n", slot, names[slots[slot]].name, names[slots[slot]].id);
+        }
+    }
+    printf("};\n\n#endif // CMDHASH_H\n");
+    return 0;
+}
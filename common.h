@@ -7,10 +7,28 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "timer_wheel.h"
+#include "ratelimit.h"
+#include "outqueue.h"
+#include "arena.h"
 
 #define DEFAULT_PORT "8080"
 #define BUFFER_SIZE 1024
+#ifndef MAX_CLIENTS
 #define MAX_CLIENTS 10
+#endif
+#define CLIENT_SNDBUF_SIZE (32 * 1024)  // Kernel send buffer per client socket
+
+// Server I/O backends (server.exe --io threads|iocp)
+#define IO_THREADS 0     // One blocking reader thread per client
+#define IO_IOCP 1        // Overlapped receives on an I/O completion port
+#define IOCP_BATCH_SIZE 64  // Completions dequeued per wakeup
+
+// Timeouts (milliseconds)
+#define TIMER_TICK_MS 100
+#define AUTH_TIMEOUT_MS 60000            // Time allowed to log in after connecting
+#define HEARTBEAT_INTERVAL_MS 30000      // Ping interval; a missed pong disconnects
+#define IDLE_TIMEOUT_MS (30 * 60 * 1000) // Disconnect after this long without activity
 
 // Message types
 #define MSG_AUTH 1
@@ -19,21 +37,174 @@
 #define MSG_COMMAND 4
 #define MSG_SYSTEM 5
 #define MSG_PRIVATE 6
+#define MSG_PING 7       // Server heartbeat
+#define MSG_PONG 8       // Client reply to MSG_PING
+#define MSG_FILE_OFFER 9   // Sender -> server: command = sender's id for the file, target = receiver,
+                           //   content = "<size> <name>". Server -> receiver: "<id> <size> <sender> <name>"
+#define MSG_FILE_ACCEPT 10 // Receiver -> server: command = id, content = offset to resume from.
+                           //   Server -> sender: "<sender's id> <id> <offset> <bytes per second>"
+#define MSG_FILE_DATA 11   // Sender -> server: command = id, content = the next bytes of the file.
+                           //   Server -> receiver: FileChunkHeader followed by the bytes
+#define MSG_PING_REPLY 12  // Server -> client: PingReply, the answer to /ping
+#define MSG_MULTICAST 13   // Server -> client: MulticastInfo, the group broadcasts can come from.
+                           //   Client -> server: command = MCAST_JOINED, or MCAST_NACK with
+                           //   content = "<first> <last>", the broadcasts to send again
+#define MSG_MULTICAST_START 14  // Server -> client: broadcasts from the header's sequence on
+                                //   come by multicast only
+#define MSG_REPAIR 15      // Server -> client: the broadcast numbered by the header's sequence,
+                           //   resent for MCAST_NACK; empty if it is gone or was the client's own
+#define MSG_BATCH 16       // Client -> server: command = number of BatchEntry records in content,
+                           //   each run as its own MSG_CHAT or MSG_COMMAND frame would be
+#define MSG_COMPLETE 17    // Client -> server: content = the start of a username.
+                           //   Server -> client: that prefix, then up to COMPLETE_MAX_RESULTS
+                           //   online users whose names start with it; all null-terminated
+#define COMPLETE_MAX_RESULTS 16
+
+// File transfers
+#define FILE_CHUNK_SIZE (64 * 1024)          // Largest MSG_FILE_DATA frame the server sends
+#define FILE_MAX_RATE (4 * 1024 * 1024)      // Bytes per second, per transfer, in each direction
+#define FILE_NAME_MAX 64
+#define FILE_SPOOL_DIR "spool"               // Server: uploads waiting to be relayed
+#define FILE_DOWNLOAD_DIR "downloads"        // Client: received files
+
+// Command argument schemas
+#define ARGS_NONE 0         // No arguments
+#define ARGS_TEXT 1         // Optional free text, sent in content
+#define ARGS_WORD 2         // One required word, sent in content
+#define ARGS_TARGET_TEXT 3  // Required username and text, sent in target and content
+
+// Command flags
+#define CMDF_LOCAL 1        // Handled by the client, never sent
+#define CMDF_BROADCAST 2    // Goes to everyone; counts against the RL_BROADCAST limit
+#define CMDF_CREDENTIALS 4  // Arguments include a password, which is used exactly as sent
 
-// Command types
-#define CMD_HELP 1
-#define CMD_USERNAME 2
-#define CMD_PASSWORD 3
-#define CMD_DELETE 4
-#define CMD_SHOUT 5
-#define CMD_WHISPER 6
-#define CMD_COLOR 7
-#define CMD_ROLL 8
-#define CMD_ONLINE 9
-#define CMD_CLEAR 10
-#define CMD_JOKE 11
+// The command table: id, name, argument schema, usage, flags, help text.
+// Ids are numbered from 1 in this order and are part of the wire protocol,
+// so new commands go at the end. Everything else about commands - the
+// client's name lookup (cmdhash.h, generated by cmdgen.c), the server's
+// handler table and /help - is derived from this list.
+#define COMMAND_LIST(X) \
+    X(CMD_HELP,     "help",     ARGS_NONE,        "",                     0,              "Show this help message") \
+    X(CMD_USERNAME, "username", ARGS_WORD,        "<new_username>",       CMDF_CREDENTIALS, "Change your username") \
+    X(CMD_PASSWORD, "password", ARGS_NONE,        "",                     CMDF_CREDENTIALS, "Change your password") \
+    X(CMD_DELETE,   "delete",   ARGS_NONE,        "",                     CMDF_CREDENTIALS, "Delete your account") \
+    X(CMD_SHOUT,    "shout",    ARGS_TEXT,        "<message>",            CMDF_BROADCAST, "Send a message in UPPERCASE") \
+    X(CMD_WHISPER,  "whisper",  ARGS_TARGET_TEXT, "<user>[,<user>...] <message>", 0,      "Send a private message") \
+    X(CMD_COLOR,    "color",    ARGS_WORD,        "<color>",              0,              "Change your message color") \
+    X(CMD_ROLL,     "roll",     ARGS_NONE,        "",                     CMDF_BROADCAST, "Roll a random number") \
+    X(CMD_ONLINE,   "online",   ARGS_NONE,        "",                     0,              "Show all online users") \
+    X(CMD_CLEAR,    "clear",    ARGS_NONE,        "",                     CMDF_LOCAL,     "Clear the chat window") \
+    X(CMD_JOKE,     "joke",     ARGS_NONE,        "",                     CMDF_BROADCAST, "Tell a random joke") \
+    X(CMD_SEND,     "send",     ARGS_TARGET_TEXT, "<username> <path>",    CMDF_LOCAL,     "Send a file to a user") \
+    X(CMD_SCROLLBACK, "scrollback", ARGS_TEXT,    "[lines]",              CMDF_LOCAL,     "Show earlier messages again") \
+    X(CMD_PING,     "ping",     ARGS_NONE,        "",                     0,              "Measure the round trip to the server")
+
+// Alternative names: alias, command id.
+#define COMMAND_ALIASES(X) \
+    X("w", CMD_WHISPER)
+
+#define COMMAND_ENUM(id, name, args, usage, flags, help) id,
+enum { CMD_NONE, COMMAND_LIST(COMMAND_ENUM) CMD_COUNT };
 #define CMD_UNKNOWN 99
 
+typedef struct {
+    const char* name;
+    int args;
+    const char* usage;
+    int flags;
+    const char* help;
+} CommandInfo;
+
+// Indexed by command id; entry 0 is empty.
+#define COMMAND_INFO(id, name, args, usage, flags, help) [id] = { name, args, usage, flags, help },
+static const CommandInfo command_info[CMD_COUNT] = { COMMAND_LIST(COMMAND_INFO) };
+
+// Seeded FNV-1a over a command name, used by the generated perfect hash.
+static __inline unsigned int command_hash(const char* name, unsigned int seed) {
+    unsigned int hash = 2166136261u ^ seed;
+    while (*name != '\0') {
+        hash = (hash ^ (unsigned char)*name++) * 16777619u;
+    }
+    return hash ^ (hash >> 16);  // Low bits alone barely depend on the seed
+}
+
+// Bumped whenever client and server stop understanding each other. Servers
+// advertise it in their discovery beacons; clients skip servers that differ.
+#define PROTOCOL_VERSION 2
+
+// Several chat lines and commands in one MSG_BATCH frame. Each entry is this
+// header followed by its target and its text, without terminators. A whisper
+// entry's target may list more recipients than Message.target holds.
+typedef struct {
+    unsigned char command;   // CMD_*; CMD_NONE for a chat line
+    unsigned char target_length;
+    unsigned short text_length;
+} BatchEntry;
+
+#define BATCH_MAX_ENTRIES 16
+#define WHISPER_MAX_RECIPIENTS 16
+#define WHISPER_TARGETS_MAX 255  // Longest recipient list, in a batch entry
+
+// Capabilities a client announces in the command field of MSG_AUTH and MSG_REGISTER.
+#define CAP_PLAIN 1          // The client cannot show ANSI escapes; send plain text
+#define CAP_COMPRESS 2       // The client accepts FRAME_COMPRESSED frames
+#define CAP_MULTICAST 4      // The client can take broadcasts from a multicast group
+
+// Multicast delivery of broadcasts (server.exe --multicast). A client that
+// joins the group gets every broadcast as one datagram shared by all
+// listeners, repairs gaps over its TCP connection with MCAST_NACK, and keeps
+// getting everything else over TCP.
+#define MCAST_JOINED 1       // MSG_MULTICAST commands
+#define MCAST_NACK 2
+#define MCAST_DATA 1         // MulticastHeader kinds
+#define MCAST_HEARTBEAT 2    // No text; 'sequence' is the newest broadcast sent
+#define MULTICAST_MAGIC 0x4d43484c  // "LHCM"
+
+// Payload of MSG_MULTICAST from the server.
+typedef struct {
+    unsigned int group;      // IPv4 address, network order
+    int port;
+    unsigned int session;    // Datagrams of other servers on the group carry another
+    int client_id;           // The client's own broadcasts are not shown to it
+} MulticastInfo;
+
+// Start of every datagram; a MCAST_DATA one is followed by the colored text,
+// then the plain text.
+typedef struct {
+    int magic;
+    int kind;                // MCAST_*
+    unsigned int session;
+    int sender_id;           // Client id of the sender; -1 for none
+    long long sequence;
+    int colored_length;
+    int plain_length;
+} MulticastHeader;
+
+// Message colors: id, name used by /color, escape sequence.
+#define COLOR_LIST(X) \
+    X(COLOR_DEFAULT, "default", "") \
+    X(COLOR_RED,     "red",     "\033[31m") \
+    X(COLOR_GREEN,   "green",   "\033[32m") \
+    X(COLOR_YELLOW,  "yellow",  "\033[33m") \
+    X(COLOR_BLUE,    "blue",    "\033[34m") \
+    X(COLOR_MAGENTA, "magenta", "\033[35m") \
+    X(COLOR_CYAN,    "cyan",    "\033[36m") \
+    X(COLOR_WHITE,   "white",   "\033[37m")
+
+#define COLOR_ENUM(id, name, code) id,
+enum { COLOR_LIST(COLOR_ENUM) COLOR_COUNT };
+#define COLOR_RESET "\033[0m"
+#define COLOR_CODE_MAX 8     // Room reserved in front of a line for its color escape
+
+typedef struct {
+    const char* name;
+    const char* code;
+    int code_length;
+} ColorInfo;
+
+#define COLOR_INFO(id, name, code) { name, code, sizeof(code) - 1 },
+static const ColorInfo color_info[COLOR_COUNT] = { COLOR_LIST(COLOR_INFO) };
+
 // Message structure
 typedef struct {
     int type;
@@ -43,13 +214,88 @@ typedef struct {
     char content[BUFFER_SIZE];
 } Message;
 
+// Receive buffer per client; holds several frames so one read can pick up
+// everything a client has pipelined. Buffers come from a shared pool and a
+// client holds one only while it has bytes waiting to be processed.
+#define INBOUND_BUFFER_SIZE (4 * (int)sizeof(Message))
+#define INBOUND_POOL_KEEP 256       // Free receive buffers kept for reuse
+
+// Stack reserved for each client's reader and writer threads. Handlers put
+// their scratch data in the client's arena, so they need little stack.
+#define CLIENT_THREAD_STACK_SIZE (128 * 1024)
+
+// Bytes of frames a connection may have handled per turn before other ready
+// connections get theirs. 64 KB is the receive window Windows gives a socket
+// by default (SO_RCVBUF), so a client that has filled its socket buffer with
+// a paste or a script - about 60 frames - is served in one turn rather than
+// re-queued thirty times, and no connection holds a worker for longer.
+#define READ_BUDGET_BYTES (64 * 1024)
+
+// Header of every frame the server sends to a client. 'type' is one of the
+// MSG_* values and 'length' bytes of payload follow the header.
+typedef struct {
+    int type;
+    int length;
+    long long sequence;  // A broadcast's place in the server-wide order; on other
+                         // frames, the newest broadcast queued for the client before it
+} FrameHeader;
+
+// Set in FrameHeader.type when the payload is compressed (clients with
+// CAP_COMPRESS only): an int with the original length, then lz.c data.
+#define FRAME_COMPRESSED 0x100
+
+// Start of the payload of a MSG_FILE_DATA frame from the server; the chunk's
+// bytes follow it.
+typedef struct {
+    int id;
+    int reserved;
+    long long offset;    // Position of the chunk in the file
+} FileChunkHeader;
+
+// Payload of MSG_PING_REPLY. /ping sends the client's clock in content; the
+// server echoes it with how long the request spent in each of its stages.
+typedef struct {
+    long long client_time;
+    int parse;           // Microseconds from recv returning to the request being decoded
+    int wait;            // Decoded to handler started (rate limits, locks)
+    int dispatch;        // Handler started to reply queued
+    int write;           // Reply queued to handed to the socket
+} PingReply;
+
+// Client.multicast
+#define MULTICAST_OFF 0      // Over TCP
+#define MULTICAST_JOINING 1  // Joined the group; switched at the next broadcast
+#define MULTICAST_ON 2       // From the group only
+
 // Client structure
 typedef struct {
     SOCKET socket;
     int id;
-    char username[32];
-    int authenticated;
-    char color[10];  // Color for messages
+    const char* username;        // Interned (names.h); "" until login
+    unsigned char authenticated;
+    unsigned char color;         // COLOR_* for the user's messages
+    unsigned char capabilities;  // CAP_* announced at login
+    unsigned char rate_notified; // Already told the client it is being limited
+    volatile LONG multicast;     // MULTICAST_*: how broadcasts reach the client
+    OutQueue outq;               // Frames waiting to be sent, by priority lane
+    HANDLE writer;               // Thread draining outq into the socket; runs only
+                                 // while frames keep coming (see outqueue_set_writer)
+    HANDLE reader;               // Thread running handle_client
+    CRITICAL_SECTION state_lock; // Held while a frame is processed
+    char* inbound;               // Received bytes not yet processed; NULL when there are none
+    int inbound_length;
+    int turn_bytes;              // Frames handled this turn, against READ_BUDGET_BYTES
+    long long received_at;       // trace_now() when the last receive completed
+    TraceStamps trace;           // Stages of the frame being processed
+    OVERLAPPED recv_overlapped;  // IO_IOCP: the pending receive
+    OVERLAPPED resume_overlapped;  // IO_IOCP: queued to continue after a used-up read budget
+    volatile LONG io_pending;    // IO_IOCP: a receive is outstanding
+    Timer auth_timer;            // Disconnects if login takes too long
+    Timer heartbeat_timer;       // Sends pings and reaps dead connections
+    Timer idle_timer;            // Disconnects inactive users
+    volatile LONG awaiting_pong;
+    TokenBucket buckets[RL_CLASS_COUNT];  // Per-connection rate limits
+    Arena arena;                 // Scratch memory for the frames being processed
 } Client;
 
 #endif // COMMON_H
@@ -0,0 +1,102 @@
+// Build step: trains the compression dictionary (lzdict.h) on a sample of
+// server output. Picks the fixed-size segments of the sample that cover the
+// most frequent byte sequences, most useful last so they get the shortest
+// offsets.
+//     dictgen.exe dict_sample.txt > lzdict.h
+// The dictionary is part of the wire protocol: regenerate it only together
+// with a client release.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DICT_SIZE 2048
+#define SEGMENT_SIZE 32
+#define GRAM_SIZE 6                  // Sequences counted when scoring segments
+#define COUNT_BITS 20
+#define MAX_SAMPLE (4 * 1024 * 1024)
+
+static unsigned int gram_hash(const unsigned char* p) {
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < GRAM_SIZE; i++) {
+        hash = (hash ^ p[i]) * 16777619u;
+    }
+    return hash >> (32 - COUNT_BITS);
+}
+
+int main(int argc, char* argv[]) {
+    static unsigned char sample[MAX_SAMPLE];
+    static unsigned char dict[DICT_SIZE];
+    unsigned int* counts;
+    int length, filled = 0;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <sample.txt>\n", argv[0]);
+        return 1;
+    }
+    FILE* file = fopen(argv[1], "rb");
+    if (file == NULL) {
+        fprintf(stderr, "dictgen: cannot open %s\n", argv[1]);
+        return 1;
+    }
+    length = (int)fread(sample, 1, sizeof(sample), file);
+    fclose(file);
+
+    counts = calloc((size_t)1 << COUNT_BITS, sizeof(unsigned int));
+    if (counts == NULL) {
+        return 1;
+    }
+    for (int i = 0; i + GRAM_SIZE <= length; i++) {
+        counts[gram_hash(sample + i)]++;
+    }
+
+    // Take the segment whose sequences are most frequent, then forget those
+    // sequences so the next pick covers something new.
+    while (filled + SEGMENT_SIZE <= DICT_SIZE) {
+        long long best_score = 0;
+        int best = -1;
+        for (int start = 0; start + SEGMENT_SIZE <= length; start++) {
+            long long score = 0;
+            for (int i = 0; i + GRAM_SIZE <= SEGMENT_SIZE; i++) {
+                score += counts[gram_hash(sample + start + i)];
+            }
+            if (score > best_score) {
+                best_score = score;
+                best = start;
+            }
+        }
+        if (best < 0) {
+            break;
+        }
+        for (int i = 0; i + GRAM_SIZE <= SEGMENT_SIZE; i++) {
+            counts[gram_hash(sample + best + i)] = 0;
+        }
+        filled += SEGMENT_SIZE;
+        memcpy(dict + DICT_SIZE - filled, sample + best, SEGMENT_SIZE);
+    }
+    free(counts);
+
+    printf("// Generated by dictgen.c from %s. Do not edit.\n", argv[1]);
+    printf("#ifndef LZDICT_H\n#define LZDICT_H\n\n");
+    printf("#define LZ_DICT_SIZE %d\n\n", filled);
+    printf("static const char lz_dictionary[LZ_DICT_SIZE + 1] =");
+    for (int i = 0; i < filled; i++) {
+        unsigned char c = dict[DICT_SIZE - filled + i];
+        if (i % 64 == 0) {
+            printf("\n    \"");
+        }
+        if (c == '"' || c == '\\') {
+            printf("\\%c", c);
+        } else if (c == '\n') {
+            printf("\\n");
+        } else if (c < ' ' || c >= 0x7F) {
+            printf("\\%03o", c);
+        } else {
+            putchar(c);
+        }
+        if (i % 64 == 63 || i == filled - 1) {
+            printf("\"");
+        }
+    }
+    printf(";\n\n#endif // LZDICT_H\n");
+    return 0;
+}
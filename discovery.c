@@ -0,0 +1,320 @@
+#include "discovery.h"
+#include <limits.h>
+
+static SOCKET group_socket = INVALID_SOCKET;   // Joined to DISCOVERY_GROUP; receives queries
+static SOCKET probe_socket = INVALID_SOCKET;   // Bound to the server's port; sends beacons, echoes probes
+static HANDLE stop_event = NULL;
+static HANDLE beacon_thread = NULL;
+static int server_port = 0;
+static char node_name[32];
+static int (*current_load)(void) = NULL;
+
+static struct sockaddr_in group_address(void) {
+    struct sockaddr_in address;
+    ZeroMemory(&address, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = inet_addr(DISCOVERY_GROUP);
+    address.sin_port = htons(DISCOVERY_PORT);
+    return address;
+}
+
+// A UDP socket bound to 'port' on every interface; joined to the discovery
+// group if 'join' is set. Sockets that join share the port with other
+// servers and clients on the same machine.
+static SOCKET open_udp(int port, int join) {
+    SOCKET s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (s == INVALID_SOCKET) {
+        return INVALID_SOCKET;
+    }
+    if (join) {
+        BOOL reuse = TRUE;
+        setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+    }
+
+    struct sockaddr_in local;
+    ZeroMemory(&local, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = htonl(INADDR_ANY);
+    local.sin_port = htons((unsigned short)port);
+    if (bind(s, (struct sockaddr*)&local, sizeof(local)) == SOCKET_ERROR) {
+        closesocket(s);
+        return INVALID_SOCKET;
+    }
+
+    if (join) {
+        struct ip_mreq membership;
+        membership.imr_multiaddr.s_addr = inet_addr(DISCOVERY_GROUP);
+        membership.imr_interface.s_addr = htonl(INADDR_ANY);
+        if (setsockopt(s, IPPROTO_IP, IP_ADD_MEMBERSHIP, (const char*)&membership, sizeof(membership)) == SOCKET_ERROR) {
+            closesocket(s);
+            return INVALID_SOCKET;
+        }
+    }
+    return s;
+}
+
+static void fill_packet(DiscoveryPacket* packet, int kind) {
+    packet->magic = DISCOVERY_MAGIC;
+    packet->kind = kind;
+    packet->version = PROTOCOL_VERSION;
+    packet->port = server_port;
+    packet->load = current_load();
+    packet->capacity = MAX_CLIENTS;
+    snprintf(packet->node, sizeof(packet->node), "%s", node_name);
+}
+
+static void send_beacon(void) {
+    DiscoveryPacket beacon;
+    ZeroMemory(&beacon, sizeof(beacon));
+    fill_packet(&beacon, DISCOVERY_BEACON);
+    struct sockaddr_in group = group_address();
+    sendto(probe_socket, (const char*)&beacon, sizeof(beacon), 0, (struct sockaddr*)&group, sizeof(group));
+}
+
+// Read one datagram; returns 1 if it is a discovery packet of this version.
+static int receive_packet(SOCKET s, DiscoveryPacket* packet, struct sockaddr_in* from) {
+    int from_length = sizeof(*from);
+    int received = recvfrom(s, (char*)packet, sizeof(*packet), 0, (struct sockaddr*)from, &from_length);
+    return received == (int)sizeof(*packet) && packet->magic == DISCOVERY_MAGIC &&
+           packet->version == PROTOCOL_VERSION;
+}
+
+// Beacons on schedule, answers queries and probes in between.
+static DWORD WINAPI beacon_loop(LPVOID param) {
+    (void)param;
+    unsigned long long last_beacon = 0;
+    unsigned long long next_beacon = 0;
+
+    while (WaitForSingleObject(stop_event, 0) == WAIT_TIMEOUT) {
+        unsigned long long now = GetTickCount64();
+        if (now >= next_beacon) {
+            send_beacon();
+            last_beacon = now;
+            next_beacon = now + BEACON_INTERVAL_MS;
+        }
+
+        fd_set readable;
+        FD_ZERO(&readable);
+        FD_SET(group_socket, &readable);
+        FD_SET(probe_socket, &readable);
+        long wait_ms = (long)(next_beacon - now);
+        struct timeval timeout = { wait_ms / 1000, (wait_ms % 1000) * 1000 };
+        if (select(0, &readable, NULL, NULL, &timeout) == SOCKET_ERROR) {
+            break;
+        }
+
+        DiscoveryPacket packet;
+        struct sockaddr_in from;
+        if (FD_ISSET(group_socket, &readable) && receive_packet(group_socket, &packet, &from) &&
+            packet.kind == DISCOVERY_QUERY && next_beacon > last_beacon + BEACON_MIN_GAP_MS) {
+            next_beacon = last_beacon + BEACON_MIN_GAP_MS;
+        }
+        if (FD_ISSET(probe_socket, &readable) && receive_packet(probe_socket, &packet, &from) &&
+            packet.kind == DISCOVERY_PROBE) {
+            unsigned int sequence = packet.sequence;
+            fill_packet(&packet, DISCOVERY_PROBE_REPLY);
+            packet.sequence = sequence;
+            sendto(probe_socket, (const char*)&packet, sizeof(packet), 0, (struct sockaddr*)&from, sizeof(from));
+        }
+    }
+    return 0;
+}
+
+// Start beaconing. Failing to is not fatal: clients can still be given the
+// address by hand.
+int discovery_start(const char* port, const char* node, int (*load)(void)) {
+    server_port = atoi(port);
+    snprintf(node_name, sizeof(node_name), "%s", node);
+    current_load = load;
+
+    group_socket = open_udp(DISCOVERY_PORT, 1);
+    probe_socket = open_udp(server_port, 0);
+    if (group_socket == INVALID_SOCKET || probe_socket == INVALID_SOCKET) {
+        fprintf(stderr, "Discovery disabled: could not open UDP sockets: %d\n", WSAGetLastError());
+        discovery_stop();
+        return 1;
+    }
+    DWORD ttl = 1;
+    setsockopt(probe_socket, IPPROTO_IP, IP_MULTICAST_TTL, (const char*)&ttl, sizeof(ttl));
+
+    stop_event = CreateEvent(NULL, TRUE, FALSE, NULL);
+    beacon_thread = CreateThread(NULL, 0, beacon_loop, NULL, 0, NULL);
+    if (beacon_thread == NULL) {
+        fprintf(stderr, "Discovery disabled: could not create beacon thread\n");
+        discovery_stop();
+        return 1;
+    }
+    printf("Server: beaconing on %s:%d\n", DISCOVERY_GROUP, DISCOVERY_PORT);
+    return 0;
+}
+
+// Stop beaconing and release the UDP port, so a new process can take it.
+void discovery_stop(void) {
+    if (stop_event != NULL) {
+        SetEvent(stop_event);
+    }
+    if (beacon_thread != NULL) {
+        WaitForSingleObject(beacon_thread, INFINITE);  // At most one beacon interval
+        CloseHandle(beacon_thread);
+        beacon_thread = NULL;
+    }
+    if (group_socket != INVALID_SOCKET) {
+        closesocket(group_socket);
+        group_socket = INVALID_SOCKET;
+    }
+    if (probe_socket != INVALID_SOCKET) {
+        closesocket(probe_socket);
+        probe_socket = INVALID_SOCKET;
+    }
+    if (stop_event != NULL) {
+        CloseHandle(stop_event);
+        stop_event = NULL;
+    }
+}
+
+// Wait until 's' is readable or 'deadline' (GetTickCount64) passes.
+static int wait_readable(SOCKET s, unsigned long long deadline) {
+    unsigned long long now = GetTickCount64();
+    if (now >= deadline) {
+        return 0;
+    }
+    fd_set readable;
+    FD_ZERO(&readable);
+    FD_SET(s, &readable);
+    long wait_ms = (long)(deadline - now);
+    struct timeval timeout = { wait_ms / 1000, (wait_ms % 1000) * 1000 };
+    return select(0, &readable, NULL, NULL, &timeout) > 0;
+}
+
+static int find_candidate(ServerCandidate* candidates, int count, struct in_addr address, int port) {
+    for (int i = 0; i < count; i++) {
+        if (candidates[i].address.sin_addr.s_addr == address.s_addr &&
+            candidates[i].address.sin_port == htons((unsigned short)port)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Collect beacons until DISCOVERY_WAIT_MS has passed since the query.
+static int listen_for_beacons(ServerCandidate* candidates, int max) {
+    SOCKET s = open_udp(DISCOVERY_PORT, 1);
+    if (s == INVALID_SOCKET) {
+        fprintf(stderr, "Could not listen for server beacons: %d\n", WSAGetLastError());
+        return 0;
+    }
+
+    DiscoveryPacket query;
+    ZeroMemory(&query, sizeof(query));
+    query.magic = DISCOVERY_MAGIC;
+    query.kind = DISCOVERY_QUERY;
+    query.version = PROTOCOL_VERSION;
+    struct sockaddr_in group = group_address();
+    sendto(s, (const char*)&query, sizeof(query), 0, (struct sockaddr*)&group, sizeof(group));
+
+    int count = 0;
+    unsigned long long deadline = GetTickCount64() + DISCOVERY_WAIT_MS;
+    while (wait_readable(s, deadline)) {
+        DiscoveryPacket beacon;
+        struct sockaddr_in from;
+        if (!receive_packet(s, &beacon, &from) || beacon.kind != DISCOVERY_BEACON) {
+            continue;
+        }
+        int index = find_candidate(candidates, count, from.sin_addr, beacon.port);
+        if (index < 0) {
+            if (count == max) {
+                continue;
+            }
+            index = count++;
+            ZeroMemory(&candidates[index], sizeof(candidates[index]));
+            candidates[index].address.sin_family = AF_INET;
+            candidates[index].address.sin_addr = from.sin_addr;
+            candidates[index].address.sin_port = htons((unsigned short)beacon.port);
+            candidates[index].rtt_us = -1;
+        }
+        snprintf(candidates[index].node, sizeof(candidates[index].node), "%s", beacon.node);
+        candidates[index].load = beacon.load;
+        candidates[index].capacity = beacon.capacity > 0 ? beacon.capacity : 1;
+    }
+    closesocket(s);
+    return count;
+}
+
+// Send PROBE_COUNT probes to every candidate at once and keep the fastest
+// reply from each. Replies also carry the latest load.
+static void probe_candidates(ServerCandidate* candidates, int count) {
+    SOCKET s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (s == INVALID_SOCKET) {
+        return;
+    }
+    LARGE_INTEGER frequency, sent[MAX_CANDIDATES * PROBE_COUNT];
+    QueryPerformanceFrequency(&frequency);
+
+    for (int k = 0; k < PROBE_COUNT; k++) {
+        for (int i = 0; i < count; i++) {
+            DiscoveryPacket probe;
+            ZeroMemory(&probe, sizeof(probe));
+            probe.magic = DISCOVERY_MAGIC;
+            probe.kind = DISCOVERY_PROBE;
+            probe.version = PROTOCOL_VERSION;
+            probe.sequence = (unsigned int)(i * PROBE_COUNT + k);
+            QueryPerformanceCounter(&sent[probe.sequence]);
+            sendto(s, (const char*)&probe, sizeof(probe), 0,
+                   (struct sockaddr*)&candidates[i].address, sizeof(candidates[i].address));
+        }
+    }
+
+    unsigned long long deadline = GetTickCount64() + PROBE_TIMEOUT_MS;
+    while (wait_readable(s, deadline)) {
+        DiscoveryPacket reply;
+        struct sockaddr_in from;
+        LARGE_INTEGER now;
+        if (!receive_packet(s, &reply, &from) || reply.kind != DISCOVERY_PROBE_REPLY ||
+            reply.sequence >= (unsigned int)(count * PROBE_COUNT)) {
+            continue;
+        }
+        QueryPerformanceCounter(&now);
+        ServerCandidate* candidate = &candidates[reply.sequence / PROBE_COUNT];
+        if (candidate->address.sin_addr.s_addr != from.sin_addr.s_addr) {
+            continue;
+        }
+        long long rtt_us = (now.QuadPart - sent[reply.sequence].QuadPart) * 1000000 / frequency.QuadPart;
+        if (candidate->rtt_us < 0 || rtt_us < candidate->rtt_us) {
+            candidate->rtt_us = rtt_us;
+        }
+        candidate->load = reply.load;
+    }
+    closesocket(s);
+}
+
+static int compare_candidates(const void* a, const void* b) {
+    const ServerCandidate* x = (const ServerCandidate*)a;
+    const ServerCandidate* y = (const ServerCandidate*)b;
+    return (x->cost_us > y->cost_us) - (x->cost_us < y->cost_us);
+}
+
+// Servers that did not answer a probe, or are full, go to the back.
+int discover_servers(ServerCandidate* candidates, int max) {
+    if (max > MAX_CANDIDATES) {
+        max = MAX_CANDIDATES;
+    }
+    int count = listen_for_beacons(candidates, max);
+    if (count == 0) {
+        return 0;
+    }
+    probe_candidates(candidates, count);
+
+    for (int i = 0; i < count; i++) {
+        ServerCandidate* candidate = &candidates[i];
+        long long penalty = (long long)candidate->load * LOAD_PENALTY_US / candidate->capacity;
+        if (candidate->rtt_us < 0) {
+            candidate->cost_us = LLONG_MAX / 2 + penalty;
+        } else if (candidate->load >= candidate->capacity) {
+            candidate->cost_us = LLONG_MAX / 4 + candidate->rtt_us;
+        } else {
+            candidate->cost_us = candidate->rtt_us + penalty;
+        }
+    }
+    qsort(candidates, count, sizeof(ServerCandidate), compare_candidates);
+    return count;
+}
@@ -0,0 +1,59 @@
+#ifndef DISCOVERY_H
+#define DISCOVERY_H
+
+#include "common.h"
+
+// Finding servers on the local network without being told their address.
+// Each server multicasts a beacon every BEACON_INTERVAL_MS with its port,
+// load and protocol version, and answers a client's query with a beacon
+// straight away. A client started without an address sends a query, listens
+// for DISCOVERY_WAIT_MS, then times a few UDP probes to every server it heard
+// and connects to the one that is closest once its load is counted in.
+//
+// Probes go to the server's own port over UDP, so several servers on one
+// machine are told apart. Beacons use TTL 1 and stay on the local segment.
+
+#define DISCOVERY_GROUP "239.255.80.80"
+#define DISCOVERY_PORT 8079
+#define DISCOVERY_MAGIC 0x4e564344              // "DCVN"
+#define DISCOVERY_QUERY 1                       // Client -> group: please beacon now
+#define DISCOVERY_BEACON 2                      // Server -> group
+#define DISCOVERY_PROBE 3                       // Client -> server port: echo this
+#define DISCOVERY_PROBE_REPLY 4                 // Server -> client: the probe, with fresh load
+
+#define BEACON_INTERVAL_MS 1000
+#define BEACON_MIN_GAP_MS 100                   // Queries never make a server beacon faster
+#define DISCOVERY_WAIT_MS 400                   // How long a client listens for beacons
+#define PROBE_COUNT 3                           // Probes per server; the fastest counts
+#define PROBE_TIMEOUT_MS 250
+#define LOAD_PENALTY_US 20000                   // A full server ranks as if 20 ms further away
+#define MAX_CANDIDATES 16
+
+typedef struct {
+    int magic;
+    int kind;                   // DISCOVERY_*
+    int version;                // PROTOCOL_VERSION
+    int port;                   // TCP port clients connect to
+    int load;                   // Clients connected
+    int capacity;               // MAX_CLIENTS
+    unsigned int sequence;      // Probes: echoed back unchanged
+    char node[32];              // Server's node name
+} DiscoveryPacket;
+
+typedef struct {
+    struct sockaddr_in address; // TCP address to connect to
+    char node[32];
+    int load;
+    int capacity;
+    long long rtt_us;           // Fastest probe; -1 if none came back
+    long long cost_us;          // rtt_us plus the load penalty; candidates sort on this
+} ServerCandidate;
+
+// Server side. 'load' is called from the beacon thread.
+int discovery_start(const char* port, const char* node, int (*load)(void));
+void discovery_stop(void);
+
+// Client side. Fills 'candidates' best first; returns how many were found.
+int discover_servers(ServerCandidate* candidates, int max);
+
+#endif // DISCOVERY_H
@@ -0,0 +1,732 @@
+#include "federation.h"
+#include "metrics.h"
+#include "lz.h"
+#include "names.h"
+
+// One TCP connection to another node.
+typedef struct {
+    SOCKET socket;
+    char node[NODE_NAME_MAX];   // The other node's name, from its LINK_HELLO
+    int ready;                  // Named and kept; its users are in remote_users
+    int outgoing;               // We connected to it
+    int peer;                   // Index into config.peers, or -1 if it connected to us
+    OutQueue outq;              // Link frames waiting for the writer
+    HANDLE writer;
+} Link;
+
+typedef struct {
+    char username[32];
+    char node[NODE_NAME_MAX];
+} RemoteUser;
+
+static FederationConfig config;
+static FederationHandlers handlers;
+static int enabled = 0;
+static Link* links[MAX_LINKS];
+static char peer_nodes[MAX_PEERS][NODE_NAME_MAX];  // Name each --peer answered with
+static RemoteUser remote_users[MAX_REMOTE_USERS];
+static int remote_user_count = 0;
+static CRITICAL_SECTION links_lock;     // Guards links, peer_nodes and remote_users
+static SOCKET link_listener = INVALID_SOCKET;
+static HANDLE stop_event = NULL;
+static HANDLE accept_thread = NULL;
+static HANDLE maintain_thread = NULL;
+
+static int link_send_all(SOCKET socket, const char* data, int length) {
+    while (length > 0) {
+        int sent = send(socket, data, length, 0);
+        if (sent == SOCKET_ERROR) {
+            return SOCKET_ERROR;
+        }
+        data += sent;
+        length -= sent;
+    }
+    return 0;
+}
+
+static int link_recv_all(SOCKET socket, char* buffer, int length) {
+    int received = 0;
+    while (received < length) {
+        int result = recv(socket, buffer + received, length - received, 0);
+        if (result <= 0) {
+            return result;
+        }
+        received += result;
+    }
+    return received;
+}
+
+// Copy a name out of a payload that need not be NUL-terminated.
+static void copy_name(char* name, int size, const char* payload, int length) {
+    int n = 0;
+    while (n < length && n < size - 1 && payload[n] != '\0') {
+        n++;
+    }
+    memcpy(name, payload, n);
+    name[n] = '\0';
+}
+
+// Queue a frame on a link. Caller holds links_lock.
+static void link_send(Link* link, int lane, int type, const char* payload, int length) {
+    if ((int)sizeof(FrameHeader) + length > LINK_FRAME_MAX) {
+        fprintf(stderr, "Link frame of %d bytes to node %s dropped\n", length, link->node);
+        return;
+    }
+    OutFrame* frame = outframe_create(type, payload, length);
+    if (frame != NULL) {
+        outqueue_push(&link->outq, lane, frame);
+    }
+}
+
+static void send_to_all(int lane, int type, const char* payload, int length) {
+    EnterCriticalSection(&links_lock);
+    for (int i = 0; i < MAX_LINKS; i++) {
+        if (links[i] != NULL && links[i]->ready) {
+            link_send(links[i], lane, type, payload, length);
+        }
+    }
+    LeaveCriticalSection(&links_lock);
+}
+
+// Presence bookkeeping, mirrored in the completion index (names.h).
+// Callers hold links_lock.
+static void remove_node_users(const char* node) {
+    int kept = 0;
+    for (int i = 0; i < remote_user_count; i++) {
+        if (strcmp(remote_users[i].node, node) != 0) {
+            remote_users[kept++] = remote_users[i];
+        } else {
+            names_online_remove(remote_users[i].username);
+        }
+    }
+    remote_user_count = kept;
+}
+
+static void remove_remote_user(const char* username, const char* node) {
+    for (int i = 0; i < remote_user_count; i++) {
+        if (strcmp(remote_users[i].username, username) == 0 && strcmp(remote_users[i].node, node) == 0) {
+            names_online_remove(username);
+            remote_users[i] = remote_users[--remote_user_count];
+            return;
+        }
+    }
+}
+
+static void add_remote_user(const char* username, const char* node) {
+    remove_remote_user(username, node);
+    if (username[0] != '\0' && remote_user_count < MAX_REMOTE_USERS) {
+        strcpy(remote_users[remote_user_count].username, username);
+        strcpy(remote_users[remote_user_count].node, node);
+        remote_user_count++;
+        names_online_add(username);
+    }
+}
+
+static const char* initiator(const Link* link) {
+    return link->outgoing ? config.node : link->node;
+}
+
+// Send our full user list on one link, or on every link if 'link' is NULL.
+static void send_presence(Link* link) {
+    char users[LINK_FRAME_MAX - sizeof(FrameHeader)];
+    int length = handlers.local_users(users, sizeof(users));
+
+    EnterCriticalSection(&links_lock);
+    for (int i = 0; i < MAX_LINKS; i++) {
+        if (links[i] != NULL && links[i]->ready && (link == NULL || links[i] == link)) {
+            link_send(links[i], PRIO_CONTROL, LINK_PRESENCE, users, length);
+        }
+    }
+    LeaveCriticalSection(&links_lock);
+}
+
+// Compare the secret a node sent (zero-padded) with ours, in the same time
+// whatever it sent.
+static int secret_matches(const char* secret) {
+    char expected[LINK_SECRET_MAX] = { 0 };
+    unsigned char difference = 0;
+
+    memcpy(expected, config.secret, strlen(config.secret));
+    for (int i = 0; i < LINK_SECRET_MAX; i++) {
+        difference |= (unsigned char)(secret[i] ^ expected[i]);
+    }
+    return difference == 0;
+}
+
+// LINK_HELLO names the link and proves the other end is one of our nodes.
+// Two nodes that list each other end up linked twice; both sides keep the
+// link started by the node whose name sorts first. Returns 0 if this link
+// should be closed.
+static int link_hello(Link* link, const char* payload, int length) {
+    char node[NODE_NAME_MAX];
+    char secret[LINK_SECRET_MAX] = { 0 };
+    int offset;
+
+    copy_name(node, sizeof(node), payload, length);
+    for (offset = 0; offset < length && payload[offset] != '\0'; offset++) {
+    }
+    offset++;
+    copy_name(secret, sizeof(secret), payload + offset, length > offset ? length - offset : 0);
+    if (!secret_matches(secret)) {
+        printf("Closing link from a node that gave the wrong link secret\n");
+        return 0;
+    }
+    if (node[0] == '\0' || strcmp(node, config.node) == 0) {
+        printf("Closing link from a node with no name or our own name (%s)\n", config.node);
+        return 0;
+    }
+
+    EnterCriticalSection(&links_lock);
+    strcpy(link->node, node);
+    if (link->peer >= 0) {
+        strcpy(peer_nodes[link->peer], node);
+    }
+    for (int i = 0; i < MAX_LINKS; i++) {
+        Link* other = links[i];
+        if (other == NULL || other == link || !other->ready || strcmp(other->node, node) != 0) {
+            continue;
+        }
+        if (strcmp(initiator(link), initiator(other)) > 0) {
+            LeaveCriticalSection(&links_lock);
+            return 0;
+        }
+        // The other link's users now belong to this one.
+        other->ready = 0;
+        shutdown(other->socket, SD_BOTH);
+    }
+    link->ready = 1;
+    LeaveCriticalSection(&links_lock);
+
+    printf("Linked with node %s\n", node);
+    send_presence(link);
+    return 1;
+}
+
+// Handle one link frame. Returns 0 if the link should be closed.
+static int link_dispatch(Link* link, int type, const char* payload, int length) {
+    char name[32];
+    LinkWhisper whisper;
+
+    if (!link->ready && type != LINK_HELLO) {
+        return 0;
+    }
+    switch (type) {
+        case LINK_HELLO:
+            return link_hello(link, payload, length);
+
+        case LINK_PRESENCE:
+            EnterCriticalSection(&links_lock);
+            remove_node_users(link->node);
+            for (int offset = 0; offset < length; ) {
+                copy_name(name, sizeof(name), payload + offset, length - offset);
+                add_remote_user(name, link->node);
+                while (offset < length && payload[offset] != '\0') {
+                    offset++;
+                }
+                offset++;
+            }
+            LeaveCriticalSection(&links_lock);
+            break;
+
+        case LINK_JOIN:
+        case LINK_LEAVE:
+            copy_name(name, sizeof(name), payload, length);
+            EnterCriticalSection(&links_lock);
+            if (type == LINK_JOIN) {
+                add_remote_user(name, link->node);
+            } else {
+                remove_remote_user(name, link->node);
+            }
+            LeaveCriticalSection(&links_lock);
+            break;
+
+        case LINK_BROADCAST: {
+            int colored_length;
+            if (length < (int)sizeof(int)) {
+                return 0;
+            }
+            memcpy(&colored_length, payload, sizeof(int));
+            if (colored_length < 0 || colored_length > length - (int)sizeof(int)) {
+                return 0;
+            }
+            handlers.broadcast(payload + sizeof(int), colored_length, payload + sizeof(int) + colored_length,
+                               length - (int)sizeof(int) - colored_length);
+            break;
+        }
+
+        case LINK_WHISPER:
+        case LINK_NOTICE:
+            if (length != (int)sizeof(LinkWhisper)) {
+                return 0;
+            }
+            memcpy(&whisper, payload, sizeof(LinkWhisper));
+            whisper.from[sizeof(whisper.from) - 1] = '\0';
+            whisper.to[sizeof(whisper.to) - 1] = '\0';
+            whisper.text[sizeof(whisper.text) - 1] = '\0';
+            if (type == LINK_NOTICE) {
+                handlers.notice(whisper.to, whisper.text);
+            } else if (!handlers.whisper(whisper.from, whisper.to, whisper.text)) {
+                // Gone since the sender's node last heard: tell the sender.
+                LinkWhisper reply;
+                strcpy(reply.from, whisper.to);
+                strcpy(reply.to, whisper.from);
+                snprintf(reply.text, sizeof(reply.text), "User '%s' is not online", whisper.to);
+                EnterCriticalSection(&links_lock);
+                link_send(link, PRIO_CONTROL, LINK_NOTICE, (const char*)&reply, sizeof(reply));
+                LeaveCriticalSection(&links_lock);
+            }
+            break;
+
+        default:
+            break;  // From a newer node; ignore
+    }
+    return 1;
+}
+
+// Unpack a LINK_BATCH and handle the frames in it. Returns 0 if it is malformed.
+static int link_batch(Link* link, int type, const char* payload, int length, char* batch) {
+    if (type & FRAME_COMPRESSED) {
+        int original;
+        if (length < (int)sizeof(int)) {
+            return 0;
+        }
+        memcpy(&original, payload, sizeof(int));
+        length = lz_decompress(payload + sizeof(int), length - (int)sizeof(int), batch, LINK_BATCH_MAX);
+        if (length < 0 || length != original) {
+            return 0;
+        }
+        payload = batch;
+    }
+
+    for (int offset = 0; offset < length; ) {
+        FrameHeader header;
+        if (length - offset < (int)sizeof(FrameHeader)) {
+            return 0;
+        }
+        memcpy(&header, payload + offset, sizeof(FrameHeader));
+        offset += sizeof(FrameHeader);
+        if (header.length < 0 || header.length > length - offset ||
+            !link_dispatch(link, header.type, payload + offset, header.length)) {
+            return 0;
+        }
+        offset += header.length;
+    }
+    return 1;
+}
+
+// Send what the writer took from the queue as one LINK_BATCH frame,
+// compressed if that makes it smaller.
+static int send_batch(Link* link, OutFrame** frames, int count, char* raw, char* packed) {
+    int prefix = (int)(sizeof(FrameHeader) + sizeof(int));
+    FrameHeader header;
+    int length = 0;
+
+    for (int i = 0; i < count; i++) {
+        memcpy(raw + length, frames[i]->data, frames[i]->length);
+        length += frames[i]->length;
+    }
+    int compressed = lz_compress(raw, length, packed + prefix, LZ_BOUND(LINK_BATCH_MAX));
+    if (compressed > 0) {
+        header.type = LINK_BATCH | FRAME_COMPRESSED;
+        header.length = (int)sizeof(int) + compressed;
+        header.sequence = 0;
+        memcpy(packed, &header, sizeof(FrameHeader));
+        memcpy(packed + sizeof(FrameHeader), &length, sizeof(int));
+        InterlockedExchangeAdd(&metrics[METRIC_COMPRESS_SAVED], length - (int)sizeof(int) - compressed);
+        return link_send_all(link->socket, packed, prefix + compressed);
+    }
+    header.type = LINK_BATCH;
+    header.length = length;
+    header.sequence = 0;
+    if (link_send_all(link->socket, (const char*)&header, sizeof(FrameHeader)) != 0) {
+        return SOCKET_ERROR;
+    }
+    return link_send_all(link->socket, raw, length);
+}
+
+// Thread that drains a link's queue. Everything that queued up while the
+// previous send was in progress goes out as one batch.
+static DWORD WINAPI link_writer(LPVOID lpParam) {
+    Link* link = (Link*)lpParam;
+    OutFrame* frames[OUTQ_SEND_BATCH];
+    char* raw = (char*)malloc(LINK_BATCH_MAX);
+    char* packed = (char*)malloc(sizeof(FrameHeader) + sizeof(int) + LZ_BOUND(LINK_BATCH_MAX));
+    int count;
+
+    while (raw != NULL && packed != NULL &&
+           (count = outqueue_pop_batch(&link->outq, frames, OUTQ_SEND_BATCH)) > 0) {
+        int result;
+        if (count == 1 && frames[0]->length < LZ_MIN_FRAME) {
+            result = link_send_all(link->socket, frames[0]->data, frames[0]->length);
+        } else {
+            result = send_batch(link, frames, count, raw, packed);
+        }
+        for (int i = 0; i < count; i++) {
+            outframe_free(frames[i]);
+        }
+        if (result == SOCKET_ERROR) {
+            shutdown(link->socket, SD_BOTH);
+            break;
+        }
+    }
+    free(raw);
+    free(packed);
+    return 0;
+}
+
+static void link_destroy(Link* link) {
+    outqueue_destroy(&link->outq);
+    closesocket(link->socket);
+    free(link);
+}
+
+// Thread that reads one link until it closes, then tears it down.
+static DWORD WINAPI link_reader(LPVOID lpParam) {
+    Link* link = (Link*)lpParam;
+    int capacity = (int)sizeof(int) + LZ_BOUND(LINK_BATCH_MAX);
+    char* payload = (char*)malloc(capacity);
+    char* batch = (char*)malloc(LINK_BATCH_MAX);
+    FrameHeader header;
+
+    while (payload != NULL && batch != NULL &&
+           link_recv_all(link->socket, (char*)&header, sizeof(FrameHeader)) > 0) {
+        if (header.length < 0 || header.length > capacity ||
+            (header.length > 0 && link_recv_all(link->socket, payload, header.length) <= 0)) {
+            break;
+        }
+        int ok;
+        if ((header.type & ~FRAME_COMPRESSED) == LINK_BATCH) {
+            ok = link_batch(link, header.type, payload, header.length, batch);
+        } else {
+            ok = link_dispatch(link, header.type, payload, header.length);
+        }
+        if (!ok) {
+            break;
+        }
+    }
+    free(payload);
+    free(batch);
+
+    EnterCriticalSection(&links_lock);
+    for (int i = 0; i < MAX_LINKS; i++) {
+        if (links[i] == link) {
+            links[i] = NULL;
+        }
+    }
+    if (link->ready) {
+        remove_node_users(link->node);
+        printf("Lost link to node %s\n", link->node);
+    }
+    LeaveCriticalSection(&links_lock);
+
+    shutdown(link->socket, SD_BOTH);
+    outqueue_close(&link->outq);
+    WaitForSingleObject(link->writer, INFINITE);
+    CloseHandle(link->writer);
+    link_destroy(link);
+    return 0;
+}
+
+// Register a connected socket as a link and start its threads.
+static void start_link(SOCKET socket, int outgoing, int peer) {
+    Link* link = (Link*)calloc(1, sizeof(Link));
+    char hello[NODE_NAME_MAX + LINK_SECRET_MAX];
+    int hello_length;
+    HANDLE reader;
+    int slot = -1;
+
+    if (link == NULL) {
+        closesocket(socket);
+        return;
+    }
+    link->socket = socket;
+    link->outgoing = outgoing;
+    link->peer = peer;
+    outqueue_init(&link->outq);
+
+    EnterCriticalSection(&links_lock);
+    for (int i = 0; i < MAX_LINKS && slot < 0; i++) {
+        if (links[i] == NULL) {
+            slot = i;
+        }
+    }
+    if (slot >= 0) {
+        links[slot] = link;
+        hello_length = snprintf(hello, sizeof(hello), "%s%c%s", config.node, '\0', config.secret) + 1;
+        link_send(link, PRIO_CONTROL, LINK_HELLO, hello, hello_length);
+    }
+    LeaveCriticalSection(&links_lock);
+    if (slot < 0) {
+        fprintf(stderr, "Too many node links, closing a new one\n");
+        link_destroy(link);
+        return;
+    }
+
+    link->writer = CreateThread(NULL, 0, link_writer, link, 0, NULL);
+    reader = link->writer != NULL ? CreateThread(NULL, 0, link_reader, link, 0, NULL) : NULL;
+    if (reader == NULL) {
+        fprintf(stderr, "Could not create link threads\n");
+        EnterCriticalSection(&links_lock);
+        links[slot] = NULL;
+        LeaveCriticalSection(&links_lock);
+        outqueue_close(&link->outq);
+        if (link->writer != NULL) {
+            WaitForSingleObject(link->writer, INFINITE);
+            CloseHandle(link->writer);
+        }
+        link_destroy(link);
+        return;
+    }
+    CloseHandle(reader);
+}
+
+// Connect to config.peers[peer] ("host:port").
+static void connect_peer(int peer) {
+    char host[256];
+    const char* colon = strrchr(config.peers[peer], ':');
+    struct addrinfo hints, *result;
+    SOCKET sock;
+
+    if (colon == NULL || colon - config.peers[peer] >= (int)sizeof(host)) {
+        return;
+    }
+    memcpy(host, config.peers[peer], colon - config.peers[peer]);
+    host[colon - config.peers[peer]] = '\0';
+
+    ZeroMemory(&hints, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    if (getaddrinfo(host, colon + 1, &hints, &result) != 0) {
+        return;
+    }
+    sock = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+    if (sock != INVALID_SOCKET && connect(sock, result->ai_addr, (int)result->ai_addrlen) == SOCKET_ERROR) {
+        closesocket(sock);
+        sock = INVALID_SOCKET;
+    }
+    freeaddrinfo(result);
+    if (sock != INVALID_SOCKET) {
+        start_link(sock, 1, peer);
+    }
+}
+
+// A peer needs connecting unless a link to it (by address, or by the name it
+// gave last time) is open.
+static int peer_linked(int peer) {
+    int linked = 0;
+    EnterCriticalSection(&links_lock);
+    for (int i = 0; i < MAX_LINKS && !linked; i++) {
+        linked = links[i] != NULL &&
+                 (links[i]->peer == peer || (peer_nodes[peer][0] != '\0' && strcmp(links[i]->node, peer_nodes[peer]) == 0));
+    }
+    LeaveCriticalSection(&links_lock);
+    return linked;
+}
+
+// Thread that keeps --peer links up and resends presence lists.
+static DWORD WINAPI maintain_links(LPVOID lpParam) {
+    unsigned long long next_presence = GetTickCount64() + PRESENCE_INTERVAL_MS;
+    (void)lpParam;
+
+    do {
+        for (int peer = 0; peer < config.peer_count; peer++) {
+            if (!peer_linked(peer)) {
+                connect_peer(peer);
+            }
+        }
+        if (GetTickCount64() >= next_presence) {
+            send_presence(NULL);
+            next_presence += PRESENCE_INTERVAL_MS;
+        }
+    } while (WaitForSingleObject(stop_event, LINK_RETRY_MS) == WAIT_TIMEOUT);
+    return 0;
+}
+
+static DWORD WINAPI accept_links(LPVOID lpParam) {
+    SOCKET sock;
+    (void)lpParam;
+
+    while ((sock = accept(link_listener, NULL, NULL)) != INVALID_SOCKET) {
+        start_link(sock, 0, -1);
+    }
+    return 0;
+}
+
+static SOCKET listen_for_links(const char* port) {
+    struct addrinfo hints, *result;
+    SOCKET sock;
+
+    ZeroMemory(&hints, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    hints.ai_flags = AI_PASSIVE;
+    if (getaddrinfo(NULL, port, &hints, &result) != 0) {
+        return INVALID_SOCKET;
+    }
+    sock = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+    if (sock != INVALID_SOCKET &&
+        (bind(sock, result->ai_addr, (int)result->ai_addrlen) == SOCKET_ERROR || listen(sock, SOMAXCONN) == SOCKET_ERROR)) {
+        closesocket(sock);
+        sock = INVALID_SOCKET;
+    }
+    freeaddrinfo(result);
+    return sock;
+}
+
+// Start linking if --link-port or --peer was given. Returns 0, or 1 if the
+// link port could not be opened.
+int federation_start(const FederationConfig* federation_config, const FederationHandlers* federation_handlers) {
+    config = *federation_config;
+    handlers = *federation_handlers;
+    if (config.link_port == NULL && config.peer_count == 0) {
+        return 0;
+    }
+    if (config.secret == NULL || config.secret[0] == '\0' || strlen(config.secret) >= LINK_SECRET_MAX) {
+        fprintf(stderr, "Not linking: --link-port and --peer need a --link-secret of 1 to %d characters, "
+                "the same on every node\n", LINK_SECRET_MAX - 1);
+        return 1;
+    }
+    InitializeCriticalSection(&links_lock);
+    stop_event = CreateEvent(NULL, TRUE, FALSE, NULL);
+    enabled = 1;
+
+    if (config.link_port != NULL) {
+        link_listener = listen_for_links(config.link_port);
+        if (link_listener == INVALID_SOCKET) {
+            fprintf(stderr, "Could not listen for node links on port %s\n", config.link_port);
+            return 1;
+        }
+        accept_thread = CreateThread(NULL, 0, accept_links, NULL, 0, NULL);
+    }
+    maintain_thread = CreateThread(NULL, 0, maintain_links, NULL, 0, NULL);
+    printf("Node %s: links on port %s, %d peers\n", config.node,
+           config.link_port ? config.link_port : "(none)", config.peer_count);
+    return 0;
+}
+
+// Stop accepting and reconnecting, and close every link.
+void federation_stop(void) {
+    if (!enabled) {
+        return;
+    }
+    SetEvent(stop_event);
+    if (link_listener != INVALID_SOCKET) {
+        closesocket(link_listener);
+        link_listener = INVALID_SOCKET;
+    }
+    if (accept_thread != NULL) {
+        WaitForSingleObject(accept_thread, INFINITE);
+        CloseHandle(accept_thread);
+    }
+    if (maintain_thread != NULL) {
+        WaitForSingleObject(maintain_thread, INFINITE);
+        CloseHandle(maintain_thread);
+    }
+    EnterCriticalSection(&links_lock);
+    for (int i = 0; i < MAX_LINKS; i++) {
+        if (links[i] != NULL) {
+            shutdown(links[i]->socket, SD_BOTH);
+        }
+    }
+    LeaveCriticalSection(&links_lock);
+    enabled = 0;
+}
+
+int federation_enabled(void) {
+    return enabled;
+}
+
+// Command line options that recreate this configuration (for a hot upgrade).
+void federation_options(char* buffer, int size) {
+    int length = 0;
+
+    buffer[0] = '\0';
+    if (!enabled) {
+        return;
+    }
+    length += snprintf(buffer + length, size - length, " --node %s", config.node);
+    if (config.link_port != NULL && length < size) {
+        length += snprintf(buffer + length, size - length, " --link-port %s", config.link_port);
+    }
+    for (int i = 0; i < config.peer_count && length < size; i++) {
+        length += snprintf(buffer + length, size - length, " --peer %s", config.peers[i]);
+    }
+    if (length < size) {
+        snprintf(buffer + length, size - length, " --link-secret %s", config.secret);
+    }
+}
+
+void federation_broadcast(const char* colored, int colored_length, const char* plain, int plain_length) {
+    char payload[LINK_FRAME_MAX];
+    int length = (int)sizeof(int) + colored_length + plain_length;
+
+    if (!enabled || length > (int)(sizeof(payload) - sizeof(FrameHeader))) {
+        return;
+    }
+    memcpy(payload, &colored_length, sizeof(int));
+    memcpy(payload + sizeof(int), colored, colored_length);
+    memcpy(payload + sizeof(int) + colored_length, plain, plain_length);
+    send_to_all(PRIO_BROADCAST, LINK_BROADCAST, payload, length);
+}
+
+// Relay a whisper to the node 'to' is on. Returns 1 if that node is known.
+int federation_whisper(const char* from, const char* to, const char* text) {
+    LinkWhisper whisper;
+    int routed = 0;
+
+    if (!enabled) {
+        return 0;
+    }
+    ZeroMemory(&whisper, sizeof(whisper));
+    snprintf(whisper.from, sizeof(whisper.from), "%s", from);
+    snprintf(whisper.to, sizeof(whisper.to), "%s", to);
+    snprintf(whisper.text, sizeof(whisper.text), "%s", text);
+
+    EnterCriticalSection(&links_lock);
+    for (int i = 0; i < remote_user_count && !routed; i++) {
+        if (strcmp(remote_users[i].username, to) != 0) {
+            continue;
+        }
+        for (int j = 0; j < MAX_LINKS; j++) {
+            if (links[j] != NULL && links[j]->ready && strcmp(links[j]->node, remote_users[i].node) == 0) {
+                link_send(links[j], PRIO_PRIVATE, LINK_WHISPER, (const char*)&whisper, sizeof(whisper));
+                routed = 1;
+                break;
+            }
+        }
+    }
+    LeaveCriticalSection(&links_lock);
+    return routed;
+}
+
+void federation_user_joined(const char* username) {
+    if (enabled) {
+        send_to_all(PRIO_CONTROL, LINK_JOIN, username, (int)strlen(username) + 1);
+    }
+}
+
+void federation_user_left(const char* username) {
+    if (enabled) {
+        send_to_all(PRIO_CONTROL, LINK_LEAVE, username, (int)strlen(username) + 1);
+    }
+}
+
+// Append ", user@node" for every user on other nodes. Returns how many.
+int federation_online(char* buffer, int size) {
+    int length = (int)strlen(buffer);
+    int count = 0;
+
+    if (!enabled) {
+        return 0;
+    }
+    EnterCriticalSection(&links_lock);
+    for (int i = 0; i < remote_user_count && length < size - 1; i++) {
+        length += snprintf(buffer + length, size - length, "%s%s@%s", length > 0 && buffer[length - 1] != ' ' ? ", " : "",
+                           remote_users[i].username, remote_users[i].node);
+        count++;
+    }
+    LeaveCriticalSection(&links_lock);
+    return count;
+}
@@ -0,0 +1,69 @@
+#ifndef FEDERATION_H
+#define FEDERATION_H
+
+#include "common.h"
+
+// Several server processes linked into one chat. Each node listens for links
+// from other nodes (--link-port) and connects to the nodes it is told about
+// (--peer host:port). Over a link, nodes announce which users they have and
+// relay broadcasts and whispers, so /online and whispers work across nodes.
+// Nodes must be fully meshed: messages are relayed to direct links only.
+// Every node is given the same --link-secret, and a link that does not
+// present it in its LINK_HELLO is closed before anything else is read from it.
+//
+// Link frames are a FrameHeader followed by a LINK_* payload. The writer
+// packs whatever has queued up into one LINK_BATCH, compressed with lz.c
+// when large enough.
+
+#define LINK_HELLO 1        // Payload: the sending node's name, then the link secret; both NUL-terminated
+#define LINK_PRESENCE 2     // Payload: every user on the sending node, NUL-separated
+#define LINK_JOIN 3         // Payload: username
+#define LINK_LEAVE 4        // Payload: username
+#define LINK_BROADCAST 5    // Payload: int colored length, colored text, plain text
+#define LINK_WHISPER 6      // Payload: LinkWhisper
+#define LINK_NOTICE 7       // Payload: LinkWhisper, shown to 'to' as a system message
+#define LINK_BATCH 8        // Payload: several link frames; may carry FRAME_COMPRESSED
+
+#define MAX_PEERS 8                     // --peer entries
+#define MAX_LINKS 16                    // Open links, including duplicates being resolved
+#define MAX_REMOTE_USERS 256
+#define NODE_NAME_MAX 32
+#define LINK_SECRET_MAX 64
+#define LINK_FRAME_MAX 4096             // Largest single link frame, header included
+#define LINK_BATCH_MAX (OUTQ_SEND_BATCH * LINK_FRAME_MAX)
+#define LINK_RETRY_MS 5000              // Reconnect interval for --peer links
+#define PRESENCE_INTERVAL_MS 30000      // Full presence lists are resent this often
+
+typedef struct {
+    char from[32];
+    char to[32];
+    char text[BUFFER_SIZE];
+} LinkWhisper;
+
+typedef struct {
+    char node[NODE_NAME_MAX];           // This node's name (--node); defaults to the port
+    const char* link_port;              // NULL: accept no links
+    const char* peers[MAX_PEERS];       // host:port of nodes to connect to
+    int peer_count;
+    const char* secret;                 // --link-secret, the same on every node
+} FederationConfig;
+
+// How the federation delivers to local users; implemented by server.c.
+typedef struct {
+    void (*broadcast)(const char* colored, int colored_length, const char* plain, int plain_length);
+    int (*whisper)(const char* from, const char* to, const char* text);  // 1 if the user is here
+    void (*notice)(const char* to, const char* text);
+    int (*local_users)(char* buffer, int size);  // NUL-separated names; returns bytes written
+} FederationHandlers;
+
+int federation_start(const FederationConfig* config, const FederationHandlers* handlers);
+void federation_stop(void);
+int federation_enabled(void);
+void federation_options(char* buffer, int size);
+void federation_broadcast(const char* colored, int colored_length, const char* plain, int plain_length);
+int federation_whisper(const char* from, const char* to, const char* text);
+void federation_user_joined(const char* username);
+void federation_user_left(const char* username);
+int federation_online(char* buffer, int size);
+
+#endif // FEDERATION_H
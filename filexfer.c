@@ -0,0 +1,339 @@
+#include "filexfer.h"
+#include "metrics.h"
+#include "netio.h"
+#include <mswsock.h>
+
+#define FILE_MAX_TRANSFERS 32
+
+static Transfer* transfers[FILE_MAX_TRANSFERS];
+static CRITICAL_SECTION transfers_lock;
+static int next_transfer_id = 1;
+
+// Uploads may run at FILE_MAX_RATE with some slack for the sender's timer;
+// a sender that ignores the advertised rate loses the transfer.
+static const RateLimit upload_limit = {
+    "file", FILE_MAX_RATE / BUFFER_SIZE * 60, FILE_CHUNK_SIZE * 4 / BUFFER_SIZE, RL_DROP
+};
+
+int filexfer_init(void) {
+    InitializeCriticalSection(&transfers_lock);
+    if (!CreateDirectory(FILE_SPOOL_DIR, NULL) && GetLastError() != ERROR_ALREADY_EXISTS) {
+        fprintf(stderr, "Could not create the %s directory: %lu\n", FILE_SPOOL_DIR, GetLastError());
+        return 1;
+    }
+    return 0;
+}
+
+static void transfer_free(Transfer* transfer) {
+    CloseHandle(transfer->spool);
+    CloseHandle(transfer->relay);
+    free(transfer);
+}
+
+void transfer_release(Transfer* transfer) {
+    if (InterlockedDecrement(&transfer->refs) == 0) {
+        transfer_free(transfer);
+    }
+}
+
+// Queue a control frame for a client. Frames are built here rather than with
+// send_frame() so this module does not depend on server.c.
+static void notify(Client* client, int type, const char* text) {
+    char line[BUFFER_SIZE];
+    if (type == MSG_SYSTEM) {
+        snprintf(line, sizeof(line), "[SYSTEM] %s", text);
+        text = line;
+    }
+    OutFrame* frame = outframe_create(type, text, (int)strlen(text));
+    if (frame != NULL) {
+        outqueue_push(&client->outq, PRIO_CONTROL, frame);
+    }
+}
+
+// Drop the table's reference. Chunks still queued keep the transfer alive
+// until they have been sent. Caller holds transfers_lock.
+static void remove_transfer(int slot) {
+    Transfer* transfer = transfers[slot];
+    transfers[slot] = NULL;
+    transfer->sender = NULL;
+    transfer->receiver = NULL;
+    transfer_release(transfer);
+}
+
+static int find_transfer(int id) {
+    for (int i = 0; i < FILE_MAX_TRANSFERS; i++) {
+        if (transfers[i] != NULL && transfers[i]->id == id) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Queue the next chunk for the receiver if it has accepted, nothing is in
+// flight and a full chunk (or the rest of the file) has been uploaded.
+// Chunks are spaced so the transfer stays under FILE_MAX_RATE.
+// Caller holds transfers_lock.
+static void queue_next_chunk(Transfer* transfer) {
+    long long available = transfer->received - transfer->queued;
+
+    if (transfer->receiver == NULL || !transfer->accepted || transfer->chunk_queued || available <= 0 ||
+        (available < FILE_CHUNK_SIZE && transfer->received < transfer->size)) {
+        return;
+    }
+    int length = available < FILE_CHUNK_SIZE ? (int)available : FILE_CHUNK_SIZE;
+    unsigned long long now = net->now_ms();
+    unsigned long long due = transfer->next_due > now ? transfer->next_due : now;
+
+    OutFrame* frame = outframe_file_chunk(transfer, transfer->id, transfer->queued, length, due);
+    if (frame == NULL) {
+        return;
+    }
+    InterlockedIncrement(&transfer->refs);
+    transfer->next_due = due + (unsigned long long)length * 1000 / FILE_MAX_RATE;
+    transfer->queued += length;
+    transfer->chunk_queued = 1;
+    outqueue_push(&transfer->receiver->outq, PRIO_BULK, frame);
+}
+
+// The receiver has everything: tell the sender and drop the spool file.
+// Caller holds transfers_lock.
+static void finish_transfer(int slot) {
+    Transfer* transfer = transfers[slot];
+    char text[BUFFER_SIZE];
+
+    printf("File transfer %d complete: %lld bytes\n", transfer->id, transfer->size);
+    if (transfer->sender != NULL) {
+        snprintf(text, sizeof(text), "%s was delivered to %s", transfer->name, transfer->receiver->username);
+        notify(transfer->sender, MSG_SYSTEM, text);
+    }
+    // Both handles allow deletion; the file goes once they are closed.
+    DeleteFile(transfer->spool_path);
+    remove_transfer(slot);
+}
+
+// Spool file for a sender, receiver, size and name. Resending the same file
+// to the same user finds the same spool file and continues where it stopped.
+static void spool_path(char* path, int size, const char* sender, const char* receiver,
+                       long long file_size, const char* name) {
+    int prefix = snprintf(path, size, "%s\\", FILE_SPOOL_DIR);
+    snprintf(path + prefix, size - prefix, "%s-%s-%lld-%s", sender, receiver, file_size, name);
+    for (char* c = path + prefix; *c != '\0'; c++) {
+        if (!((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9') ||
+              *c == '.' || *c == '-' || *c == '_')) {
+            *c = '_';
+        }
+    }
+}
+
+// MSG_FILE_OFFER from a sender. Opens (or reopens) the spool file, tells the
+// sender where to start uploading and offers the file to the receiver.
+void filexfer_offer(Client* sender, Client* receiver, const Message* msg) {
+    Transfer* transfer;
+    char text[BUFFER_SIZE];
+    char name[FILE_NAME_MAX];
+    long long size;
+    LARGE_INTEGER existing;
+
+    if (sscanf(msg->content, "%lld %63[^\n]", &size, name) != 2 || size <= 0) {
+        notify(sender, MSG_SYSTEM, "Invalid file offer");
+        return;
+    }
+    if (receiver == sender) {
+        notify(sender, MSG_SYSTEM, "You cannot send a file to yourself");
+        return;
+    }
+
+    transfer = (Transfer*)calloc(1, sizeof(Transfer));
+    if (transfer == NULL) {
+        notify(sender, MSG_SYSTEM, "Could not start the file transfer");
+        return;
+    }
+    transfer->refs = 1;
+    transfer->sender_file = msg->command;
+    transfer->sender = sender;
+    transfer->receiver = receiver;
+    strcpy(transfer->sender_name, sender->username);
+    strcpy(transfer->name, name);
+    transfer->size = size;
+    spool_path(transfer->spool_path, sizeof(transfer->spool_path), sender->username, receiver->username, size, name);
+    token_bucket_init(&transfer->upload_bucket, &upload_limit, net->now_ms());
+
+    // Only one writer at a time: a second offer of the same file fails here.
+    transfer->spool = CreateFile(transfer->spool_path, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_DELETE,
+                                 NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    transfer->relay = CreateFile(transfer->spool_path, GENERIC_READ,
+                                 FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                 NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (transfer->spool == INVALID_HANDLE_VALUE || transfer->relay == INVALID_HANDLE_VALUE ||
+        !GetFileSizeEx(transfer->spool, &existing)) {
+        notify(sender, MSG_SYSTEM, "Could not start the file transfer; is it already being sent?");
+        transfer_free(transfer);
+        return;
+    }
+    transfer->received = existing.QuadPart < size ? existing.QuadPart : size;
+    existing.QuadPart = transfer->received;
+    SetFilePointerEx(transfer->spool, existing, NULL, FILE_BEGIN);
+
+    EnterCriticalSection(&transfers_lock);
+    int slot = -1;
+    for (int i = 0; i < FILE_MAX_TRANSFERS && slot < 0; i++) {
+        if (transfers[i] == NULL) {
+            slot = i;
+        }
+    }
+    if (slot < 0) {
+        LeaveCriticalSection(&transfers_lock);
+        notify(sender, MSG_SYSTEM, "Too many file transfers in progress, try again later");
+        transfer_free(transfer);
+        return;
+    }
+    transfer->id = next_transfer_id++;
+    transfers[slot] = transfer;
+
+    snprintf(text, sizeof(text), "%d %d %lld %d", transfer->sender_file, transfer->id, transfer->received, FILE_MAX_RATE);
+    notify(sender, MSG_FILE_ACCEPT, text);
+    snprintf(text, sizeof(text), "%d %lld %s %s", transfer->id, size, sender->username, name);
+    notify(receiver, MSG_FILE_OFFER, text);
+    LeaveCriticalSection(&transfers_lock);
+
+    printf("File transfer %d: %s -> %s, %s (%lld bytes, %lld spooled)\n",
+           transfer->id, sender->username, receiver->username, name, size, transfer->received);
+}
+
+// MSG_FILE_ACCEPT from a receiver: start relaying from the offset it already has.
+void filexfer_accept(Client* receiver, const Message* msg) {
+    long long offset = strtoll(msg->content, NULL, 10);
+
+    EnterCriticalSection(&transfers_lock);
+    int slot = find_transfer(msg->command);
+    if (slot >= 0 && transfers[slot]->receiver == receiver && !transfers[slot]->accepted) {
+        Transfer* transfer = transfers[slot];
+        if (offset < 0 || offset > transfer->size) {
+            offset = 0;
+        }
+        transfer->accepted = 1;
+        transfer->queued = offset;
+        transfer->sent = offset;
+        if (offset == transfer->size) {
+            finish_transfer(slot);
+        } else {
+            queue_next_chunk(transfer);
+        }
+    }
+    LeaveCriticalSection(&transfers_lock);
+}
+
+// MSG_FILE_DATA from a sender: append to the spool file. The frame carries
+// BUFFER_SIZE bytes, or whatever is left of the file.
+void filexfer_data(Client* sender, const Message* msg) {
+    Transfer* transfer = NULL;
+    long long offset = 0;
+    int length = 0;
+
+    EnterCriticalSection(&transfers_lock);
+    int slot = find_transfer(msg->command);
+    if (slot >= 0 && transfers[slot]->sender == sender) {
+        transfer = transfers[slot];
+        if (token_bucket_take(&transfer->upload_bucket, &upload_limit, net->now_ms()) != 0) {
+            notify(sender, MSG_SYSTEM, "File transfer cancelled: sent faster than the allowed rate");
+            remove_transfer(slot);
+            transfer = NULL;
+        } else {
+            offset = transfer->received;
+            length = transfer->size - offset < BUFFER_SIZE ? (int)(transfer->size - offset) : BUFFER_SIZE;
+            InterlockedIncrement(&transfer->refs);
+        }
+    }
+    LeaveCriticalSection(&transfers_lock);
+    if (transfer == NULL) {
+        return;
+    }
+
+    // Only this client's reader writes the spool file, so the write can
+    // happen outside the lock.
+    DWORD written = 0;
+    if (length > 0 && !WriteFile(transfer->spool, msg->content, (DWORD)length, &written, NULL)) {
+        fprintf(stderr, "Spool write failed for transfer %d: %lu\n", transfer->id, GetLastError());
+    }
+
+    EnterCriticalSection(&transfers_lock);
+    if (transfers[slot] == transfer && transfer->received == offset) {
+        transfer->received += written;
+        queue_next_chunk(transfer);
+    }
+    LeaveCriticalSection(&transfers_lock);
+    transfer_release(transfer);
+}
+
+// Called by the receiver's writer thread for a file chunk frame: send the
+// headers and the chunk with one TransmitFile call, then queue the next chunk.
+// Returns 0, or SOCKET_ERROR if the connection failed.
+int filexfer_transmit(Client* receiver, OutFrame* frame) {
+    Transfer* transfer = frame->transfer;
+    TRANSMIT_FILE_BUFFERS head = { frame->data, (DWORD)frame->length, NULL, 0 };
+    LARGE_INTEGER position;
+
+    // Only this thread reads the relay handle, so its file pointer is ours.
+    position.QuadPart = frame->file_offset;
+    if (!SetFilePointerEx(transfer->relay, position, NULL, FILE_BEGIN) ||
+        !TransmitFile(receiver->socket, transfer->relay, (DWORD)frame->file_length, 0, NULL, &head, 0)) {
+        return SOCKET_ERROR;
+    }
+    metric_inc(METRIC_SEND_CALLS);
+    metric_inc(METRIC_FRAMES_SENT);
+
+    EnterCriticalSection(&transfers_lock);
+    transfer->sent = frame->file_offset + frame->file_length;
+    transfer->chunk_queued = 0;
+    int slot = find_transfer(transfer->id);
+    if (slot >= 0 && transfers[slot] == transfer) {
+        if (transfer->sent == transfer->size) {
+            finish_transfer(slot);
+        } else {
+            queue_next_chunk(transfer);
+        }
+    }
+    LeaveCriticalSection(&transfers_lock);
+    return 0;
+}
+
+// A client is going away. Transfers to it end; the spool file stays so the
+// sender can resume by sending the file again. Transfers from it continue
+// only if the whole file had already been uploaded.
+void filexfer_client_gone(Client* client) {
+    char text[BUFFER_SIZE];
+
+    EnterCriticalSection(&transfers_lock);
+    for (int i = 0; i < FILE_MAX_TRANSFERS; i++) {
+        Transfer* transfer = transfers[i];
+        if (transfer == NULL) {
+            continue;
+        }
+        if (transfer->receiver == client) {
+            if (transfer->sender != NULL) {
+                snprintf(text, sizeof(text), "%s left; send %s again to resume", client->username, transfer->name);
+                notify(transfer->sender, MSG_SYSTEM, text);
+            }
+            remove_transfer(i);
+        } else if (transfer->sender == client) {
+            transfer->sender = NULL;
+            if (transfer->received < transfer->size) {
+                snprintf(text, sizeof(text), "%s left before %s was fully sent", transfer->sender_name, transfer->name);
+                notify(transfer->receiver, MSG_SYSTEM, text);
+                remove_transfer(i);
+            }
+        }
+    }
+    LeaveCriticalSection(&transfers_lock);
+}
+
+void filexfer_shutdown(void) {
+    EnterCriticalSection(&transfers_lock);
+    for (int i = 0; i < FILE_MAX_TRANSFERS; i++) {
+        if (transfers[i] != NULL) {
+            remove_transfer(i);
+        }
+    }
+    LeaveCriticalSection(&transfers_lock);
+    DeleteCriticalSection(&transfers_lock);
+}
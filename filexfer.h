@@ -0,0 +1,44 @@
+#ifndef FILEXFER_H
+#define FILEXFER_H
+
+#include "common.h"
+
+// File transfers relayed through the server. The sender uploads into a spool
+// file; the receiver's writer thread sends it on with TransmitFile, so the
+// relayed bytes go from the file cache to the socket without being copied
+// into the server. Each transfer has at most one chunk queued, in the
+// PRIO_BULK lane and paced to FILE_MAX_RATE, so chat is never stuck behind a
+// large file. A transfer that breaks off resumes from the spool file's size
+// (upload) and the receiver's partial file (download).
+
+typedef struct Transfer {
+    volatile LONG refs;            // The table's reference plus one per queued chunk
+    int id;                        // Used on the wire
+    int sender_file;               // The sender's own id for the file
+    Client* sender;                // NULL once the sender has gone
+    Client* receiver;
+    char sender_name[32];
+    char name[FILE_NAME_MAX];
+    char spool_path[MAX_PATH];
+    long long size;
+    long long received;            // Bytes in the spool file
+    long long queued;              // Bytes handed to the receiver's queue
+    long long sent;                // Bytes the receiver's writer has sent
+    int accepted;
+    int chunk_queued;
+    unsigned long long next_due;   // Earliest time the next chunk may go out
+    TokenBucket upload_bucket;     // Paces MSG_FILE_DATA from the sender
+    HANDLE spool;                  // Written by the sender's reader
+    HANDLE relay;                  // Read by the receiver's writer
+} Transfer;
+
+int filexfer_init(void);
+void filexfer_shutdown(void);
+void filexfer_offer(Client* sender, Client* receiver, const Message* msg);
+void filexfer_accept(Client* receiver, const Message* msg);
+void filexfer_data(Client* sender, const Message* msg);
+int filexfer_transmit(Client* receiver, OutFrame* frame);
+void filexfer_client_gone(Client* client);
+void transfer_release(Transfer* transfer);
+
+#endif // FILEXFER_H
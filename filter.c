@@ -0,0 +1,431 @@
+#include "filter.h"
+#include "auth.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define FILTER_BLOCK 1
+#define FILTER_HIGHLIGHT 2
+#define FILTER_MAX_RANGES 64
+#define HIGHLIGHT_ON "\033[1m"
+#define HIGHLIGHT_OFF "\033[22m"
+
+typedef struct {
+    char text[FILTER_MAX_PATTERN + 1];
+    int length;
+    int kind;        // FILTER_BLOCK or FILTER_HIGHLIGHT
+} Pattern;
+
+typedef struct {
+    Pattern* items;
+    int count;
+    int capacity;
+} PatternList;
+
+// Last seen modification time and size of a watched file.
+typedef struct {
+    time_t mtime;
+    long size;
+} FileStamp;
+
+static Filter* volatile active_filter = NULL;
+static CRITICAL_SECTION filter_lock;    // Held by readers while taking a reference
+static FileStamp filter_stamp, users_stamp;
+static HANDLE reload_thread = NULL;
+static HANDLE reload_wanted = NULL;     // Auto-reset; set when the files changed
+static volatile BOOL reload_running = FALSE;
+
+static unsigned char fold(unsigned char c) {
+    return (c >= 'A' && c <= 'Z') ? (unsigned char)(c + ('a' - 'A')) : c;
+}
+
+static int is_word_byte(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+           c == '_' || c >= 0x80;
+}
+
+static void add_pattern(PatternList* list, const char* text, int kind) {
+    int length = (int)strlen(text);
+
+    if (length == 0) {
+        return;
+    }
+    if (length > FILTER_MAX_PATTERN) {
+        printf("Filter pattern too long, ignored: %.20s...\n", text);
+        return;
+    }
+    if (list->count == list->capacity) {
+        int capacity = list->capacity ? list->capacity * 2 : 64;
+        Pattern* items = realloc(list->items, capacity * sizeof(Pattern));
+        if (items == NULL) {
+            return;
+        }
+        list->items = items;
+        list->capacity = capacity;
+    }
+    Pattern* pattern = &list->items[list->count++];
+    for (int i = 0; i <= length; i++) {
+        pattern->text[i] = (char)fold((unsigned char)text[i]);
+    }
+    pattern->length = length;
+    pattern->kind = kind;
+}
+
+// Read lines of the form "block <word or phrase>" or "highlight <word or phrase>".
+// Lines starting with '#' are comments.
+static void read_filter_file(PatternList* list) {
+    FILE* file = fopen(FILTER_FILE, "r");
+    char line[256], kind[16];
+    int offset;
+
+    if (file == NULL) {
+        return;
+    }
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (line[0] == '#' || sscanf(line, "%15s %n", kind, &offset) != 1) {
+            continue;
+        }
+        char* text = line + offset;
+        int length = (int)strlen(text);
+        while (length > 0 && (text[length - 1] == '\n' || text[length - 1] == '\r' || text[length - 1] == ' ')) {
+            text[--length] = '\0';
+        }
+        if (strcmp(kind, "block") == 0) {
+            add_pattern(list, text, FILTER_BLOCK);
+        } else if (strcmp(kind, "highlight") == 0) {
+            add_pattern(list, text, FILTER_HIGHLIGHT);
+        } else {
+            printf("Unknown filter rule in %s: %s\n", FILTER_FILE, kind);
+        }
+    }
+    fclose(file);
+}
+
+static void add_username(const char* username, void* list) {
+    add_pattern(list, username, FILTER_HIGHLIGHT);
+}
+
+// Every registered username is highlighted when mentioned.
+static void read_usernames(PatternList* list) {
+    auth_for_each_user(add_username, list);
+}
+
+static void filter_free(Filter* filter) {
+    free(filter->next);
+    free(filter->outputs);
+    free(filter);
+}
+
+// Compile the patterns into a DFA. Bytes are first mapped to classes (bytes
+// that appear in no pattern share class 0), which keeps each state's row of
+// transitions short enough that the whole table stays in cache.
+static Filter* filter_build(const PatternList* list) {
+    Filter* filter = calloc(1, sizeof(Filter));
+    int max_states = 1;
+    int* fail = NULL;
+    int* queue = NULL;
+
+    if (filter == NULL) {
+        return NULL;
+    }
+    filter->refs = 1;
+    filter->pattern_count = list->count;
+    filter->class_count = 1;
+    for (int i = 0; i < list->count; i++) {
+        max_states += list->items[i].length;
+        for (int j = 0; j < list->items[i].length; j++) {
+            unsigned char c = (unsigned char)list->items[i].text[j];
+            if (filter->classes[c] == 0) {
+                filter->classes[c] = (unsigned char)filter->class_count;
+                if (c >= 'a' && c <= 'z') {
+                    filter->classes[c - ('a' - 'A')] = (unsigned char)filter->class_count;
+                }
+                filter->class_count++;
+            }
+        }
+    }
+    int width = filter->class_count;
+    filter->next = malloc((size_t)max_states * width * sizeof(int));
+    filter->outputs = calloc(max_states, sizeof(FilterOutput));
+    fail = malloc(max_states * sizeof(int));
+    queue = malloc(max_states * sizeof(int));
+    if (filter->next == NULL || filter->outputs == NULL || fail == NULL || queue == NULL) {
+        free(fail);
+        free(queue);
+        filter_free(filter);
+        return NULL;
+    }
+    memset(filter->next, 0xFF, (size_t)max_states * width * sizeof(int));
+
+    // Build the trie.
+    filter->state_count = 1;
+    for (int i = 0; i < list->count; i++) {
+        const Pattern* pattern = &list->items[i];
+        int state = 0;
+        for (int j = 0; j < pattern->length; j++) {
+            int* slot = &filter->next[state * width + filter->classes[(unsigned char)pattern->text[j]]];
+            if (*slot < 0) {
+                *slot = filter->state_count++;
+            }
+            state = *slot;
+        }
+        FilterOutput* output = &filter->outputs[state];
+        if (pattern->kind == FILTER_BLOCK && pattern->length > output->block_len) {
+            output->block_len = (unsigned char)pattern->length;
+        } else if (pattern->kind == FILTER_HIGHLIGHT && pattern->length > output->highlight_len) {
+            output->highlight_len = (unsigned char)pattern->length;
+        }
+    }
+
+    // Breadth-first: fill in failure links and turn missing edges into the
+    // edges of the failure state, so scanning is one lookup per byte.
+    int head = 0, tail = 0;
+    for (int c = 0; c < width; c++) {
+        int child = filter->next[c];
+        if (child < 0) {
+            filter->next[c] = 0;
+        } else {
+            fail[child] = 0;
+            queue[tail++] = child;
+        }
+    }
+    while (head < tail) {
+        int state = queue[head++];
+        const FilterOutput* suffix = &filter->outputs[fail[state]];
+        filter->outputs[state].link = (suffix->block_len | suffix->highlight_len) != 0 ? fail[state] : suffix->link;
+
+        for (int c = 0; c < width; c++) {
+            int* slot = &filter->next[state * width + c];
+            int fallback = filter->next[fail[state] * width + c];
+            if (*slot < 0) {
+                *slot = fallback;
+            } else {
+                fail[*slot] = fallback;
+                queue[tail++] = *slot;
+            }
+        }
+    }
+
+    free(fail);
+    free(queue);
+    return filter;
+}
+
+static Filter* filter_load(void) {
+    PatternList list = { NULL, 0, 0 };
+    Filter* filter;
+
+    read_filter_file(&list);
+    read_usernames(&list);
+    filter = filter_build(&list);
+    free(list.items);
+    return filter;
+}
+
+static void get_stamp(const char* filename, FileStamp* stamp) {
+    struct stat info;
+    if (stat(filename, &info) == 0) {
+        stamp->mtime = info.st_mtime;
+        stamp->size = (long)info.st_size;
+    } else {
+        stamp->mtime = 0;
+        stamp->size = -1;
+    }
+}
+
+// Load the filter. Returns the number of patterns.
+int filter_init(void) {
+    InitializeCriticalSection(&filter_lock);
+    get_stamp(FILTER_FILE, &filter_stamp);
+    get_stamp(USERS_FILE, &users_stamp);
+    active_filter = filter_load();
+    return active_filter ? active_filter->pattern_count : 0;
+}
+
+void filter_shutdown(void) {
+    filter_release(active_filter);
+    active_filter = NULL;
+    DeleteCriticalSection(&filter_lock);
+}
+
+// Build a filter from the files and make it the active one. Messages being
+// checked keep using the old one until they finish. Returns the new number
+// of patterns, or -1 if the filter could not be built.
+static int filter_reload(void) {
+    Filter* filter = filter_load();
+    if (filter == NULL) {
+        return -1;
+    }
+    Filter* old = (Filter*)InterlockedExchangePointer((void* volatile*)&active_filter, filter);
+
+    // A reader that saw the old pointer takes its reference under the lock,
+    // so once we have been through the lock it holds one.
+    EnterCriticalSection(&filter_lock);
+    LeaveCriticalSection(&filter_lock);
+    filter_release(old);
+    return filter->pattern_count;
+}
+
+static DWORD WINAPI reload_worker(LPVOID arg) {
+    (void)arg;
+    while (WaitForSingleObject(reload_wanted, INFINITE) == WAIT_OBJECT_0 && reload_running) {
+        int patterns = filter_reload();
+        if (patterns >= 0) {
+            printf("Reloaded chat filter: %d patterns\n", patterns);
+        }
+    }
+    return 0;
+}
+
+// Start the thread that rebuilds the filter. Returns 0 on success.
+int filter_start(void) {
+    reload_wanted = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (reload_wanted == NULL) {
+        return 1;
+    }
+    reload_running = TRUE;
+    reload_thread = CreateThread(NULL, 0, reload_worker, NULL, 0, NULL);
+    if (reload_thread == NULL) {
+        reload_running = FALSE;
+        CloseHandle(reload_wanted);
+        reload_wanted = NULL;
+        return 1;
+    }
+    return 0;
+}
+
+// Stop the reload thread, after any rebuild it is doing.
+void filter_stop(void) {
+    if (reload_thread == NULL) {
+        return;
+    }
+    reload_running = FALSE;
+    SetEvent(reload_wanted);
+    WaitForSingleObject(reload_thread, INFINITE);
+    CloseHandle(reload_thread);
+    CloseHandle(reload_wanted);
+    reload_thread = NULL;
+    reload_wanted = NULL;
+}
+
+// Check whether the filter file or the user list changed since the last
+// load. Only looks at the files' stamps, so it is cheap enough for a timer
+// callback; the rebuild is handed to the reload thread, or done here if
+// there is none (the simulator).
+void filter_check_files(void) {
+    FileStamp filter_now, users_now;
+
+    get_stamp(FILTER_FILE, &filter_now);
+    get_stamp(USERS_FILE, &users_now);
+    if (memcmp(&filter_now, &filter_stamp, sizeof(FileStamp)) == 0 &&
+        memcmp(&users_now, &users_stamp, sizeof(FileStamp)) == 0) {
+        return;
+    }
+    filter_stamp = filter_now;
+    users_stamp = users_now;
+
+    if (reload_thread != NULL) {
+        SetEvent(reload_wanted);
+    } else {
+        int patterns = filter_reload();
+        if (patterns >= 0) {
+            printf("Reloaded chat filter: %d patterns\n", patterns);
+        }
+    }
+}
+
+// Take a reference to the current filter; pair with filter_release.
+Filter* filter_acquire(void) {
+    Filter* filter;
+
+    EnterCriticalSection(&filter_lock);
+    filter = active_filter;
+    if (filter != NULL) {
+        InterlockedIncrement(&filter->refs);
+    }
+    LeaveCriticalSection(&filter_lock);
+    return filter;
+}
+
+void filter_release(Filter* filter) {
+    if (filter != NULL && InterlockedDecrement(&filter->refs) == 0) {
+        filter_free(filter);
+    }
+}
+
+static int append(char* out, int out_size, int pos, const char* text, int length) {
+    if (length > out_size - 1 - pos) {
+        length = out_size - 1 - pos;
+    }
+    memcpy(out + pos, text, length);
+    return pos + length;
+}
+
+// Check a message in one pass. Returns FILTER_BLOCKED if it contains a blocked
+// word; otherwise writes it to 'out' with highlighted words in bold and
+// returns the length written.
+int filter_apply(const Filter* filter, const char* text, char* out, int out_size) {
+    int starts[FILTER_MAX_RANGES], ends[FILTER_MAX_RANGES];
+    int ranges = 0;
+    int state = 0;
+    int length = 0;
+    int pos = 0;
+
+    if (filter != NULL && filter->pattern_count > 0) {
+        const unsigned char* s = (const unsigned char*)text;
+        for (; s[length] != '\0'; length++) {
+            state = filter->next[state * filter->class_count + filter->classes[s[length]]];
+            const FilterOutput* output = &filter->outputs[state];
+            if (((output->block_len | output->highlight_len) == 0 && output->link == 0) ||
+                is_word_byte(s[length + 1])) {
+                continue;
+            }
+
+            // Every pattern ending here, longest first; each must start a word.
+            int highlighted = 0;
+            for (int match = state; match != 0; match = filter->outputs[match].link) {
+                output = &filter->outputs[match];
+                int start = length + 1 - output->block_len;
+                if (output->block_len > 0 && (start == 0 || !is_word_byte(s[start - 1]))) {
+                    return FILTER_BLOCKED;
+                }
+                start = length + 1 - output->highlight_len;
+                if (output->highlight_len > 0 && !highlighted && (start == 0 || !is_word_byte(s[start - 1]))) {
+                    // Merge with earlier ranges this one overlaps.
+                    while (ranges > 0 && start <= ends[ranges - 1]) {
+                        if (starts[ranges - 1] < start) {
+                            start = starts[ranges - 1];
+                        }
+                        ranges--;
+                    }
+                    if (ranges < FILTER_MAX_RANGES) {
+                        starts[ranges] = start;
+                        ends[ranges] = length + 1;
+                        ranges++;
+                    }
+                    highlighted = 1;
+                }
+            }
+        }
+    } else {
+        length = (int)strlen(text);
+    }
+
+    int copied = 0;
+    for (int i = 0; i < ranges; i++) {
+        int range_length = ends[i] - starts[i];
+        pos = append(out, out_size, pos, text + copied, starts[i] - copied);
+        if (pos + range_length + (int)(sizeof(HIGHLIGHT_ON) + sizeof(HIGHLIGHT_OFF)) - 2 < out_size) {
+            pos = append(out, out_size, pos, HIGHLIGHT_ON, sizeof(HIGHLIGHT_ON) - 1);
+            pos = append(out, out_size, pos, text + starts[i], range_length);
+            pos = append(out, out_size, pos, HIGHLIGHT_OFF, sizeof(HIGHLIGHT_OFF) - 1);
+        } else {
+            pos = append(out, out_size, pos, text + starts[i], range_length);
+        }
+        copied = ends[i];
+    }
+    pos = append(out, out_size, pos, text + copied, length - copied);
+    out[pos] = '\0';
+    return pos;
+}
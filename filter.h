@@ -0,0 +1,55 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <windows.h>
+
+// Chat filter: words that block a message and words (plus every registered
+// username) that get highlighted. All patterns are compiled into one
+// Aho-Corasick automaton, so a message is checked in a single pass no matter
+// how many patterns there are. Matching ignores ASCII case and only counts
+// whole words.
+//
+// The files are checked from a timer, which only compares their stamps. A
+// change wakes a reload thread that builds the new automaton and publishes
+// it with an atomic pointer swap. The simulator runs without the thread, and
+// the check rebuilds in place.
+
+#define FILTER_FILE "filter.txt"
+#define FILTER_CHECK_MS 5000       // How often the files are checked for changes
+#define FILTER_MAX_PATTERN 64
+
+// filter_apply result for a message that must not be sent
+#define FILTER_BLOCKED -1
+
+// The block and highlight pattern that end exactly in a state, and the next
+// state down its failure chain that ends a pattern (0 for none). Following
+// 'link' gives every pattern ending at a byte, longest first, so a shorter
+// whole word is still found when a longer match is not a whole word.
+typedef struct {
+    unsigned char block_len;
+    unsigned char highlight_len;
+    int link;
+} FilterOutput;
+
+// An immutable compiled filter. Readers hold a reference while scanning, so a
+// reload can swap in a new one without waiting for them.
+typedef struct {
+    volatile LONG refs;
+    int pattern_count;
+    int state_count;
+    int class_count;                // Width of a row in 'next'
+    unsigned char classes[256];     // Byte -> column; 0 for bytes in no pattern
+    int* next;                      // DFA: next[state * class_count + class]
+    FilterOutput* outputs;          // Per state
+} Filter;
+
+int filter_init(void);
+void filter_shutdown(void);
+int filter_start(void);
+void filter_stop(void);
+void filter_check_files(void);
+Filter* filter_acquire(void);
+void filter_release(Filter* filter);
+int filter_apply(const Filter* filter, const char* text, char* out, int out_size);
+
+#endif // FILTER_H
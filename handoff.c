@@ -0,0 +1,77 @@
+#include "handoff.h"
+
+// Start a new server process from our own executable with the child ends of
+// two pipes. The child is told about them with "--takeover <in> <out>".
+// Returns 0 on success.
+int handoff_spawn(const char* port, const char* options, HANDLE* to_child, HANDLE* from_child, PROCESS_INFORMATION* process) {
+    SECURITY_ATTRIBUTES sa;
+    HANDLE child_in = NULL, child_out = NULL;
+    char exe_path[MAX_PATH];
+    char command_line[MAX_PATH + 640];
+    STARTUPINFO startup;
+
+    sa.nLength = sizeof(sa);
+    sa.lpSecurityDescriptor = NULL;
+    sa.bInheritHandle = TRUE;
+
+    if (!CreatePipe(&child_in, to_child, &sa, 0)) {
+        return 1;
+    }
+    if (!CreatePipe(from_child, &child_out, &sa, 0)) {
+        CloseHandle(child_in);
+        CloseHandle(*to_child);
+        return 1;
+    }
+    // Only the child's ends may be inherited.
+    SetHandleInformation(*to_child, HANDLE_FLAG_INHERIT, 0);
+    SetHandleInformation(*from_child, HANDLE_FLAG_INHERIT, 0);
+
+    GetModuleFileName(NULL, exe_path, sizeof(exe_path));
+    snprintf(command_line, sizeof(command_line), "\"%s\" %s %s --takeover %llu %llu",
+        exe_path, port, options,
+        (unsigned long long)(ULONG_PTR)child_in,
+        (unsigned long long)(ULONG_PTR)child_out);
+
+    ZeroMemory(&startup, sizeof(startup));
+    startup.cb = sizeof(startup);
+    BOOL created = CreateProcess(NULL, command_line, NULL, NULL, TRUE, 0, NULL, NULL, &startup, process);
+
+    // Our copies of the child's ends are no longer needed; closing them lets
+    // reads fail instead of hanging if the child dies.
+    CloseHandle(child_in);
+    CloseHandle(child_out);
+    if (!created) {
+        CloseHandle(*to_child);
+        CloseHandle(*from_child);
+        return 1;
+    }
+    return 0;
+}
+
+// Write a whole buffer to a pipe. Returns 0 on success.
+int handoff_write(HANDLE pipe, const void* data, int length) {
+    const char* bytes = (const char*)data;
+    while (length > 0) {
+        DWORD written;
+        if (!WriteFile(pipe, bytes, (DWORD)length, &written, NULL)) {
+            return 1;
+        }
+        bytes += written;
+        length -= (int)written;
+    }
+    return 0;
+}
+
+// Read a whole buffer from a pipe. Returns 0 on success.
+int handoff_read(HANDLE pipe, void* data, int length) {
+    char* bytes = (char*)data;
+    while (length > 0) {
+        DWORD read;
+        if (!ReadFile(pipe, bytes, (DWORD)length, &read, NULL) || read == 0) {
+            return 1;
+        }
+        bytes += read;
+        length -= (int)read;
+    }
+    return 0;
+}
@@ -0,0 +1,47 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include "common.h"
+
+// Hot upgrade: the running server starts a new copy of itself and passes it
+// the listening socket and every client connection over a pair of pipes.
+//
+// Phase 1 (old -> new): HandoffHeader, then per client a HandoffClient
+//                       followed by its unsent outbound frames.
+// Ack     (new -> old): one byte, HANDOFF_ACK, once all sockets are adopted.
+// Phase 2 (old -> new): an int count, then that many HandoffInbound records,
+//                       each followed by bytes the old process read from the
+//                       client but did not process.
+
+#define HANDOFF_MAGIC 0x464F4843  // "CHOF"
+#define HANDOFF_ACK 1
+#define HANDOFF_WRITER_WAIT_MS 500
+
+typedef struct {
+    int magic;
+    int client_count;
+    long long sequence;   // Last broadcast sequence number issued
+    WSAPROTOCOL_INFO listen_info;
+} HandoffHeader;
+
+typedef struct {
+    WSAPROTOCOL_INFO socket_info;
+    int id;
+    int authenticated;
+    char username[32];
+    int color;
+    int capabilities;
+    int multicast;        // MULTICAST_*
+    int outbound_length;  // Bytes of queued frames that follow this record
+} HandoffClient;
+
+typedef struct {
+    int id;
+    int length;
+} HandoffInbound;
+
+int handoff_spawn(const char* port, const char* options, HANDLE* to_child, HANDLE* from_child, PROCESS_INFORMATION* process);
+int handoff_write(HANDLE pipe, const void* data, int length);
+int handoff_read(HANDLE pipe, void* data, int length);
+
+#endif // HANDOFF_H
@@ -0,0 +1,277 @@
+// Load generator: connects many clients to a running server over TCP, logs
+// them in, has each one chat at a steady rate and reads everything the
+// server sends. The traffic is the same whichever --io backend the server
+// runs, so two runs compare the backends:
+//     server.exe 8080 --io threads        (sim.exe for more than 10 clients)
+//     loadgen.exe 127.0.0.1 8080 10 30
+// then stop the server with Ctrl+C and note its last [io] line, and repeat
+// with --io iocp. Accounts are named load<n> with the password "loadtest".
+#include "common.h"
+
+#define LOAD_GROUP_SIZE 60          // Connections per thread; select() takes up to 64
+#define LOAD_BUFFER_SIZE (sizeof(FrameHeader) + FILE_CHUNK_SIZE + 1024)
+#define LOAD_DEFAULT_SECONDS 30
+#define LOAD_DEFAULT_CHAT_MS 1000
+#define LOAD_PASSWORD "loadtest"
+
+typedef struct {
+    SOCKET socket;
+    int index;
+    int logged_in;
+    unsigned long long next_chat;   // GetTickCount64 time of the next chat line
+    int buffered;
+    char buffer[LOAD_BUFFER_SIZE];
+} LoadClient;
+
+// The connections one thread serves, and what happened to them.
+typedef struct {
+    LoadClient* clients;
+    int count;
+    long long chat_sent;
+    long long lines_received;
+    long long logins;
+    long long closed;
+} LoadGroup;
+
+static volatile LONG stopping = 0;
+static int chat_ms = LOAD_DEFAULT_CHAT_MS;
+
+static int send_all(SOCKET socket, const Message* msg) {
+    const char* data = (const char*)msg;
+    int remaining = sizeof(Message);
+    while (remaining > 0) {
+        int sent = send(socket, data, remaining, 0);
+        if (sent == SOCKET_ERROR) {
+            return SOCKET_ERROR;
+        }
+        data += sent;
+        remaining -= sent;
+    }
+    return 0;
+}
+
+static int send_simple(LoadClient* client, int type, const char* content) {
+    Message msg;
+    ZeroMemory(&msg, sizeof(Message));
+    msg.type = type;
+    msg.command = CAP_PLAIN;
+    snprintf(msg.username, sizeof(msg.username), "load%d", client->index);
+    snprintf(msg.content, BUFFER_SIZE, "%s", content);
+    return send_all(client->socket, &msg);
+}
+
+static SOCKET connect_to(const struct addrinfo* address) {
+    SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (s == INVALID_SOCKET) {
+        return INVALID_SOCKET;
+    }
+    if (connect(s, address->ai_addr, (int)address->ai_addrlen) == SOCKET_ERROR) {
+        closesocket(s);
+        return INVALID_SOCKET;
+    }
+    return s;
+}
+
+static void drop_client(LoadGroup* group, LoadClient* client) {
+    closesocket(client->socket);
+    client->socket = INVALID_SOCKET;
+    group->closed++;
+}
+
+// One whole frame from the server.
+static void handle_frame(LoadGroup* group, LoadClient* client, const FrameHeader* header, const char* payload) {
+    switch (header->type) {
+        case MSG_PING:
+            if (send_simple(client, MSG_PONG, "") != 0) {
+                drop_client(group, client);
+            }
+            break;
+        case MSG_AUTH:
+            if (!client->logged_in && header->length >= 16 && memcmp(payload, "Login successful", 16) == 0) {
+                client->logged_in = 1;
+                client->next_chat = GetTickCount64() + (unsigned long long)(rand() % chat_ms);
+                group->logins++;
+            }
+            break;
+        case MSG_CHAT:
+            group->lines_received++;
+            break;
+        default:
+            break;
+    }
+}
+
+// Read what has arrived and handle every complete frame in it.
+static void read_client(LoadGroup* group, LoadClient* client) {
+    int received = recv(client->socket, client->buffer + client->buffered,
+                        (int)LOAD_BUFFER_SIZE - client->buffered, 0);
+    if (received <= 0) {
+        drop_client(group, client);
+        return;
+    }
+    client->buffered += received;
+
+    int offset = 0;
+    while (client->socket != INVALID_SOCKET && client->buffered - offset >= (int)sizeof(FrameHeader)) {
+        FrameHeader header;
+        memcpy(&header, client->buffer + offset, sizeof(FrameHeader));
+        int length = (int)sizeof(FrameHeader) + header.length;
+        if (header.length < 0 || length > (int)LOAD_BUFFER_SIZE) {
+            drop_client(group, client);
+            return;
+        }
+        if (client->buffered - offset < length) {
+            break;
+        }
+        handle_frame(group, client, &header, client->buffer + offset + sizeof(FrameHeader));
+        offset += length;
+    }
+    memmove(client->buffer, client->buffer + offset, client->buffered - offset);
+    client->buffered -= offset;
+}
+
+static DWORD WINAPI run_group(LPVOID param) {
+    LoadGroup* group = (LoadGroup*)param;
+
+    while (!stopping) {
+        fd_set readable;
+        struct timeval timeout = { 0, 10000 };
+        int open = 0;
+        FD_ZERO(&readable);
+        for (int i = 0; i < group->count; i++) {
+            if (group->clients[i].socket != INVALID_SOCKET) {
+                FD_SET(group->clients[i].socket, &readable);
+                open++;
+            }
+        }
+        if (open == 0) {
+            break;
+        }
+        if (select(0, &readable, NULL, NULL, &timeout) == SOCKET_ERROR) {
+            break;
+        }
+
+        unsigned long long now = GetTickCount64();
+        for (int i = 0; i < group->count; i++) {
+            LoadClient* client = &group->clients[i];
+            if (client->socket != INVALID_SOCKET && FD_ISSET(client->socket, &readable)) {
+                read_client(group, client);
+            }
+            if (client->socket != INVALID_SOCKET && client->logged_in && client->next_chat <= now) {
+                char line[64];
+                snprintf(line, sizeof(line), "load test line %lld from load%d", group->chat_sent, client->index);
+                if (send_simple(client, MSG_CHAT, line) != 0) {
+                    drop_client(group, client);
+                    continue;
+                }
+                group->chat_sent++;
+                client->next_chat += chat_ms;
+            }
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    WSADATA wsa;
+    struct addrinfo hints, *address;
+    int seconds = LOAD_DEFAULT_SECONDS;
+
+    if (argc < 4) {
+        fprintf(stderr, "Usage: %s <Server IP> <Port> <clients> [seconds] [ms between lines]\n", argv[0]);
+        return 1;
+    }
+    int count = atoi(argv[3]);
+    if (argc > 4) {
+        seconds = atoi(argv[4]);
+    }
+    if (argc > 5) {
+        chat_ms = atoi(argv[5]);
+    }
+    if (count <= 0 || seconds <= 0 || chat_ms <= 0) {
+        fprintf(stderr, "Nothing to do\n");
+        return 1;
+    }
+
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
+        fprintf(stderr, "WSAStartup failed\n");
+        return 1;
+    }
+    ZeroMemory(&hints, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    if (getaddrinfo(argv[1], argv[2], &hints, &address) != 0) {
+        fprintf(stderr, "Could not resolve %s\n", argv[1]);
+        WSACleanup();
+        return 1;
+    }
+
+    int group_count = (count + LOAD_GROUP_SIZE - 1) / LOAD_GROUP_SIZE;
+    LoadClient* clients = (LoadClient*)calloc(count, sizeof(LoadClient));
+    LoadGroup* groups = (LoadGroup*)calloc(group_count, sizeof(LoadGroup));
+    HANDLE* threads = (HANDLE*)calloc(group_count, sizeof(HANDLE));
+    if (clients == NULL || groups == NULL || threads == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    // Connect and ask to log in; the accounts are created on the first run.
+    int connected = 0;
+    srand(GetCurrentProcessId());
+    for (int i = 0; i < count; i++) {
+        clients[i].index = i;
+        clients[i].socket = connect_to(address);
+        if (clients[i].socket == INVALID_SOCKET) {
+            continue;
+        }
+        if (send_simple(&clients[i], MSG_REGISTER, LOAD_PASSWORD) != 0 ||
+            send_simple(&clients[i], MSG_AUTH, LOAD_PASSWORD) != 0) {
+            closesocket(clients[i].socket);
+            clients[i].socket = INVALID_SOCKET;
+            continue;
+        }
+        connected++;
+    }
+    freeaddrinfo(address);
+    printf("Connected %d of %d clients; chatting for %d s, a line every %d ms each\n",
+           connected, count, seconds, chat_ms);
+
+    unsigned long long started = GetTickCount64();
+    for (int g = 0; g < group_count; g++) {
+        groups[g].clients = clients + g * LOAD_GROUP_SIZE;
+        groups[g].count = count - g * LOAD_GROUP_SIZE < LOAD_GROUP_SIZE ? count - g * LOAD_GROUP_SIZE : LOAD_GROUP_SIZE;
+        threads[g] = CreateThread(NULL, 0, run_group, &groups[g], 0, NULL);
+    }
+    Sleep((DWORD)seconds * 1000);
+    InterlockedExchange(&stopping, 1);
+
+    long long chat_sent = 0, lines_received = 0, logins = 0, closed = 0;
+    for (int g = 0; g < group_count; g++) {
+        if (threads[g] != NULL) {
+            WaitForSingleObject(threads[g], INFINITE);
+            CloseHandle(threads[g]);
+        }
+        chat_sent += groups[g].chat_sent;
+        lines_received += groups[g].lines_received;
+        logins += groups[g].logins;
+        closed += groups[g].closed;
+    }
+    double elapsed = (GetTickCount64() - started) / 1000.0;
+
+    printf("Logged in %lld, closed by the server %lld\n", logins, closed);
+    printf("Chat sent %lld (%.0f/s), lines received %lld (%.0f/s)\n",
+           chat_sent, chat_sent / elapsed, lines_received, lines_received / elapsed);
+    printf("The server's [io] line gives its system calls per frame for this traffic.\n");
+
+    for (int i = 0; i < count; i++) {
+        if (clients[i].socket != INVALID_SOCKET) {
+            closesocket(clients[i].socket);
+        }
+    }
+    free(threads);
+    free(groups);
+    free(clients);
+    WSACleanup();
+    return 0;
+}
@@ -0,0 +1,178 @@
+#include "lz.h"
+#include "lzdict.h"
+#include <string.h>
+
+#define LZ_HASH_BITS 12
+#define LZ_HASH_SIZE (1 << LZ_HASH_BITS)
+#define LZ_MAX_OFFSET 65535
+
+// Positions count from the start of the dictionary: 0 .. LZ_DICT_SIZE-1 are
+// dictionary bytes, LZ_DICT_SIZE onwards the data being compressed.
+static int dict_table[LZ_HASH_SIZE];    // Hash table pre-filled with the dictionary
+
+static unsigned int hash4(const unsigned char* p) {
+    unsigned int value;
+    memcpy(&value, p, sizeof(value));
+    return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static unsigned char byte_at(const unsigned char* src, int position) {
+    return position < LZ_DICT_SIZE ? (unsigned char)lz_dictionary[position] : src[position - LZ_DICT_SIZE];
+}
+
+// Hash every position of the dictionary once, so each frame starts with it.
+void lz_init(void) {
+    const unsigned char* dict = (const unsigned char*)lz_dictionary;
+
+    for (int i = 0; i < LZ_HASH_SIZE; i++) {
+        dict_table[i] = -1;
+    }
+    for (int i = 0; i + LZ_MIN_MATCH <= LZ_DICT_SIZE; i++) {
+        dict_table[hash4(dict + i)] = i;
+    }
+}
+
+// Lengths that do not fit in a token nibble continue in bytes of up to 255.
+static unsigned char* put_length(unsigned char* out, const unsigned char* end, int value) {
+    while (value >= 255 && out < end) {
+        *out++ = 255;
+        value -= 255;
+    }
+    if (out >= end) {
+        return NULL;
+    }
+    *out++ = (unsigned char)value;
+    return out;
+}
+
+// Write one sequence: literals, then a match unless 'match_length' is 0 (the last sequence).
+static unsigned char* put_sequence(unsigned char* out, const unsigned char* end, const unsigned char* literals,
+                                   int literal_length, int offset, int match_length) {
+    int match_code = match_length ? match_length - LZ_MIN_MATCH : 0;
+
+    if (out >= end) {
+        return NULL;
+    }
+    *out++ = (unsigned char)(((literal_length < 15 ? literal_length : 15) << 4) | (match_code < 15 ? match_code : 15));
+    if (literal_length >= 15 && (out = put_length(out, end, literal_length - 15)) == NULL) {
+        return NULL;
+    }
+    if (literal_length > end - out) {
+        return NULL;
+    }
+    memcpy(out, literals, literal_length);
+    out += literal_length;
+    if (match_length == 0) {
+        return out;
+    }
+    if (end - out < 2) {
+        return NULL;
+    }
+    *out++ = (unsigned char)offset;
+    *out++ = (unsigned char)(offset >> 8);
+    if (match_code >= 15) {
+        out = put_length(out, end, match_code - 15);
+    }
+    return out;
+}
+
+// Greedy parse: at each position take the most recent earlier occurrence of
+// the next four bytes, in the data or the dictionary, and extend it.
+int lz_compress(const char* src, int length, char* dst, int capacity) {
+    const unsigned char* in = (const unsigned char*)src;
+    unsigned char* out = (unsigned char*)dst;
+    const unsigned char* end = out + (capacity < length ? capacity : length);
+    int table[LZ_HASH_SIZE];
+    int anchor = 0;
+    int i = 0;
+
+    memcpy(table, dict_table, sizeof(table));
+    while (i + LZ_MIN_MATCH <= length) {
+        unsigned int hash = hash4(in + i);
+        int candidate = table[hash];
+        int position = LZ_DICT_SIZE + i;
+        table[hash] = position;
+        if (candidate < 0 || position - candidate > LZ_MAX_OFFSET) {
+            i++;
+            continue;
+        }
+
+        int match_length = 0;
+        while (i + match_length < length && byte_at(in, candidate + match_length) == in[i + match_length]) {
+            match_length++;
+        }
+        if (match_length < LZ_MIN_MATCH) {
+            i++;
+            continue;
+        }
+
+        out = put_sequence(out, end, in + anchor, i - anchor, position - candidate, match_length);
+        if (out == NULL) {
+            return 0;
+        }
+        i += match_length;
+        anchor = i;
+    }
+
+    out = put_sequence(out, end, in + anchor, length - anchor, 0, 0);
+    if (out == NULL || out >= end) {
+        return 0;
+    }
+    return (int)(out - (unsigned char*)dst);
+}
+
+static int get_length(const unsigned char** in, const unsigned char* end, int value) {
+    unsigned char byte;
+    do {
+        if (*in >= end) {
+            return -1;
+        }
+        byte = *(*in)++;
+        value += byte;
+    } while (byte == 255);
+    return value;
+}
+
+int lz_decompress(const char* src, int length, char* dst, int capacity) {
+    const unsigned char* in = (const unsigned char*)src;
+    const unsigned char* in_end = in + length;
+    unsigned char* out = (unsigned char*)dst;
+    int produced = 0;
+
+    while (in < in_end) {
+        int token = *in++;
+        int literal_length = token >> 4;
+        if (literal_length == 15 && (literal_length = get_length(&in, in_end, 15)) < 0) {
+            return -1;
+        }
+        if (literal_length > in_end - in || literal_length > capacity - produced) {
+            return -1;
+        }
+        memcpy(out + produced, in, literal_length);
+        in += literal_length;
+        produced += literal_length;
+        if (in == in_end) {
+            break;  // The last sequence has no match
+        }
+
+        if (in_end - in < 2) {
+            return -1;
+        }
+        int offset = in[0] | (in[1] << 8);
+        in += 2;
+        int match_length = token & 15;
+        if (match_length == 15 && (match_length = get_length(&in, in_end, 15)) < 0) {
+            return -1;
+        }
+        match_length += LZ_MIN_MATCH;
+        if (offset == 0 || offset > produced + LZ_DICT_SIZE || match_length > capacity - produced) {
+            return -1;
+        }
+        // Byte by byte: the match may overlap the bytes it produces.
+        for (int k = 0; k < match_length; k++, produced++) {
+            int from = produced - offset;
+            out[produced] = from < 0 ? (unsigned char)lz_dictionary[LZ_DICT_SIZE + from] : out[from];
+        }
+    }
+    return produced;
+}
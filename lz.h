@@ -0,0 +1,26 @@
+#ifndef LZ_H
+#define LZ_H
+
+// Small LZ77 codec for server-to-client frames, in the style of LZ4: a token
+// byte holding a literal count and a match length, the literals, then a
+// two-byte back offset. Matches may also point into a fixed dictionary of
+// common chat text (lzdict.h) that both sides treat as coming before the
+// data, so even a single short frame compresses well.
+
+#define LZ_MIN_MATCH 4
+#define LZ_MIN_FRAME 256          // Smaller payloads are sent as they are
+
+// Worst-case output size for 'length' input bytes.
+#define LZ_BOUND(length) ((length) + (length) / 255 + 16)
+
+void lz_init(void);
+
+// Returns the compressed size, or 0 if the result would not be smaller than
+// the input or would not fit in 'capacity'.
+int lz_compress(const char* src, int length, char* dst, int capacity);
+
+// Returns the decompressed size, or -1 if the data is malformed or does not
+// fit in 'capacity'.
+int lz_decompress(const char* src, int length, char* dst, int capacity);
+
+#endif // LZ_H
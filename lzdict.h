@@ -0,0 +1,41 @@
+// Generated by dictgen.c from dict_sample.txt. Do not edit.
+#ifndef LZDICT_H
+#define LZDICT_H
+
+#define LZ_DICT_SIZE 2048
+
+static const char lz_dictionary[LZ_DICT_SIZE + 1] =
+    "ame> <message> - Send a private n: what time is the standup tomo"
+    " the download is taking forever\033ive minutes\033[0m\nkim: welcome to "
+    "ssages are being slowed down\n\033[3ordan] I think the server needs "
+    ": let's talk about it after lunc let me check and get back to yo"
+    "at noon?\n[PM to alex] I will sen4mjordan: I pushed the fix, can "
+    " who is working on the release nm\n\033[36mrobin: sounds good to me\033"
+    "mmand. Type /help for a list of the shared folder\033[0m\n\033[37msam: "
+    " chris] the printer is out of pame> - Change your username\n/pass"
+    "nyone see the email from IT?\033[0m] Why don't scientists trust ato"
+    "mmax: the tests are passing now\033mcasey: the screenshot is in the"
+    "toms? Because they make up everyppy birthday!\033[0m\nkim: lunch at "
+    "rsion\033[0m\nchris: good morning\n\033[ds a restart\033[0m\nmorgan SHOUTS: "
+    ", jamie, sam, kim, casey, pat, mTEM] Password changed successful"
+    "I'm going home, see you tomorrowmriley: I'll be there in five mi"
+    " Delete your account\n/shout <mesmjamie: meeting moved to 3pm\033[0m"
+    "oor is really slow today\033[0m\nrobit works on my machine\033[0m\n\033[35m"
+    "e, devon, riley, alex, taylor, m] can you send me the log file?\n"
+    "ken\n\033[33mdevon: please update tosword for the guest network?\033[0m"
+    " I am not sure, ask the team lea' is not online\n[JOKE from robin"
+    " rolled 87 (1-100)\n\033[34mmorgan: TEM] You are sending too fast, y"
+    "ndom joke\n/send <username> <pathage\n/username <new_username> - C"
+    " is the build server down again? the chat window\n/joke - Tell a "
+    "l send you the file now\033[0m\n[PM : the wifi on the second floor i"
+    "malex: does anyone know the pass - Send a file to a user\n/w <use"
+    "nd a message in UPPERCASE\n/whispr\n[SYSTEM] Available commands:\n/"
+    "te to the latest version\n[PM to  morgan.log was delivered to ril"
+    "vate message\n/color <color> - Chsword\n/delete - Delete your acco"
+    "your message color\n/roll - Roll users\n/clear - Clear the chat wi"
+    "ds:\n/help - Show this help messaTEM] User jordan is now known as"
+    " Shorthand for whisper\n[PM from ll a random number\n/online - Sho"
+    "em\033[0m\n\033[32mtaylor: ok\033[0m\n\033[31m/password - Change your password"
+    "r <username> <message> - Send a ain?\033[0m\n[SYSTEM] Online users: ";
+
+#endif // LZDICT_H
@@ -0,0 +1,156 @@
+#include "metrics.h"
+#include "netio.h"
+#include <stdio.h>
+#include <limits.h>
+
+volatile LONG metrics[METRIC_COUNT];
+
+static const char* metric_names[METRIC_COUNT] = {
+    "frames_received",
+    "limited_frame",
+    "limited_chat",
+    "limited_broadcast",
+    "limited_auth",
+    "rate_delayed",
+    "broadcast_dropped",
+    "recv_calls",
+    "send_calls",
+    "frames_sent",
+    "text_rewritten",
+    "filter_blocked",
+    "heap_allocs",
+    "compress_saved",
+    "read_yields",
+    "writer_starts",
+};
+
+static const char* stage_names[STAGE_COUNT] = {
+    "parse",
+    "wait",
+    "dispatch",
+    "write",
+    "total",
+    "read",
+};
+
+static volatile LONG stage_buckets[STAGE_COUNT][HISTOGRAM_BUCKETS];
+static volatile LONG64 stage_max[STAGE_COUNT];
+
+// Longest read wait since the last report, in the upper bits, and the client
+// that waited, in the low 16; a larger value is always a longer wait.
+static volatile LONG64 read_wait_max;
+
+// Microseconds on the server's clock; only differences mean anything.
+long long trace_now(void) {
+    return net->now_us();
+}
+
+static int bucket_of(long long value) {
+    int top = 4;
+    if (value < 16) {
+        return value < 0 ? 0 : (int)value;
+    }
+    while ((value >> (top + 1)) != 0) {
+        top++;
+    }
+    // The top bit picks the power of two, the three bits below it the step.
+    int bucket = 16 + (top - 4) * HISTOGRAM_STEPS + (int)(value >> (top - 3)) - HISTOGRAM_STEPS;
+    return bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS - 1;
+}
+
+// Largest value that lands in a bucket. The last one takes everything above.
+static long long bucket_limit(int bucket) {
+    if (bucket == HISTOGRAM_BUCKETS - 1) {
+        return LLONG_MAX;
+    }
+    if (bucket < 16) {
+        return bucket;
+    }
+    int top = 4 + (bucket - 16) / HISTOGRAM_STEPS;
+    long long step = 1LL << (top - 3);
+    return (HISTOGRAM_STEPS + (bucket - 16) % HISTOGRAM_STEPS + 1) * step - 1;
+}
+
+void stage_record(int stage, long long microseconds) {
+    LONG64 max = stage_max[stage];
+    InterlockedIncrement(&stage_buckets[stage][bucket_of(microseconds)]);
+    while (microseconds > max) {
+        LONG64 seen = InterlockedCompareExchange64(&stage_max[stage], microseconds, max);
+        if (seen == max) {
+            break;
+        }
+        max = seen;
+    }
+}
+
+// Time a frame waited between arriving and being decoded, which grows when
+// other connections are taking the server's attention.
+void read_wait_record(int client_id, long long microseconds) {
+    LONG64 packed = (microseconds < 0 ? 0 : microseconds) << 16 | (client_id & 0xFFFF);
+    LONG64 max = read_wait_max;
+
+    stage_record(STAGE_READ, microseconds);
+    while (packed > max) {
+        LONG64 seen = InterlockedCompareExchange64(&read_wait_max, packed, max);
+        if (seen == max) {
+            break;
+        }
+        max = seen;
+    }
+}
+
+// Print one stage's percentiles since the last report and start over.
+static void stage_report(int stage) {
+    LONG counts[HISTOGRAM_BUCKETS];
+    long long total = 0;
+    long long max = InterlockedExchange64(&stage_max[stage], 0);
+    static const int percentiles[] = { 50, 90, 99 };
+
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        counts[i] = InterlockedExchange(&stage_buckets[stage][i], 0);
+        total += counts[i];
+    }
+    if (total == 0) {
+        return;
+    }
+    printf("[latency] %s n=%lld", stage_names[stage], total);
+    for (int p = 0; p < 3; p++) {
+        long long rank = (total * percentiles[p] + 99) / 100;
+        long long seen = counts[0];
+        int i = 0;
+        while (seen < rank) {
+            seen += counts[++i];
+        }
+        long long limit = bucket_limit(i);
+        printf(" p%d=%lldus", percentiles[p], limit < max ? limit : max);
+    }
+    printf(" max=%lldus\n", max);
+}
+
+void metric_inc(int metric) {
+    InterlockedIncrement(&metrics[metric]);
+}
+
+// Print all counters on one line and the system calls per frame they add up
+// to, then the stage latencies traced since the last report and the client
+// that waited longest for its frames to be read.
+void metrics_report(void) {
+    LONG64 worst = InterlockedExchange64(&read_wait_max, 0);
+
+    printf("[metrics]");
+    for (int i = 0; i < METRIC_COUNT; i++) {
+        printf(" %s=%ld", metric_names[i], (long)metrics[i]);
+    }
+    printf("\n");
+    if (metrics[METRIC_FRAMES_RECEIVED] > 0 && metrics[METRIC_FRAMES_SENT] > 0) {
+        printf("[io] %.2f recv calls per frame received, %.2f send calls per frame sent\n",
+               (double)metrics[METRIC_RECV_CALLS] / metrics[METRIC_FRAMES_RECEIVED],
+               (double)metrics[METRIC_SEND_CALLS] / metrics[METRIC_FRAMES_SENT]);
+    }
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        stage_report(i);
+    }
+    if ((worst >> 16) != 0) {
+        printf("[fairness] longest read wait: client %d, %lldus\n", (int)(worst & 0xFFFF), (long long)(worst >> 16));
+    }
+}
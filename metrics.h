@@ -0,0 +1,51 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <windows.h>
+
+#define METRICS_INTERVAL_MS 60000
+
+// Counters. The METRIC_LIMITED_* entries follow the order of the RL_* classes.
+#define METRIC_FRAMES_RECEIVED 0
+#define METRIC_LIMITED_FRAME 1
+#define METRIC_LIMITED_CHAT 2
+#define METRIC_LIMITED_BROADCAST 3
+#define METRIC_LIMITED_AUTH 4
+#define METRIC_RATE_DELAYED 5
+#define METRIC_BROADCAST_DROPPED 6  // Broadcasts dropped for slow consumers
+#define METRIC_RECV_CALLS 7        // recv/WSARecv calls on client sockets
+#define METRIC_SEND_CALLS 8        // WSASend calls on client sockets
+#define METRIC_FRAMES_SENT 9
+#define METRIC_TEXT_REWRITTEN 10    // Messages that had escapes, control bytes or bad UTF-8
+#define METRIC_FILTER_BLOCKED 11
+#define METRIC_HEAP_ALLOCS 12       // Frame and scratch buffers that had to come from the heap
+#define METRIC_COMPRESS_SAVED 13    // Bytes saved by compressing frames
+#define METRIC_READ_YIELDS 14       // Turns that ended with frames left over (READ_BUDGET_BYTES)
+#define METRIC_WRITER_STARTS 15     // Writer threads started for queues that had gone idle
+#define METRIC_COUNT 16
+
+extern volatile LONG metrics[METRIC_COUNT];
+
+// Trace mode (server.exe --trace): time spent in each server stage, in
+// microseconds, kept in histograms that are reported and cleared with the
+// counters.
+#define STAGE_PARSE 0       // recv returned -> frame decoded
+#define STAGE_WAIT 1        // Decoded -> handler started (rate limits, state_lock)
+#define STAGE_DISPATCH 2    // Handler started -> reply or broadcast queued
+#define STAGE_WRITE 3       // Queued -> handed to the socket
+#define STAGE_TOTAL 4       // recv returned -> handed to the socket
+#define STAGE_READ 5        // recv returned -> frame decoded, for every frame even without --trace
+#define STAGE_COUNT 6
+
+// Values below 16 get a bucket each; above that every power of two is split
+// into HISTOGRAM_STEPS buckets, so a percentile is off by at most 1/8.
+#define HISTOGRAM_STEPS 8
+#define HISTOGRAM_BUCKETS 200
+
+void metric_inc(int metric);
+void metrics_report(void);
+long long trace_now(void);
+void stage_record(int stage, long long microseconds);
+void read_wait_record(int client_id, long long microseconds);
+
+#endif // METRICS_H
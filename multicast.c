@@ -0,0 +1,146 @@
+#include "multicast.h"
+#include "metrics.h"
+
+static SOCKET send_socket = INVALID_SOCKET;
+static struct sockaddr_in group_address;
+static unsigned int current_session = 0;
+static volatile LONG64 last_sent = 0;       // Newest sequence sent to the group
+
+// The datagrams of the last MULTICAST_HISTORY broadcasts, by sequence, each
+// in a MULTICAST_DATAGRAM_MAX entry of one block allocated at start.
+static char* history = NULL;
+static CRITICAL_SECTION history_lock;
+
+static char* history_entry(long long sequence) {
+    return history + (sequence & (MULTICAST_HISTORY - 1)) * (size_t)MULTICAST_DATAGRAM_MAX;
+}
+
+int multicast_start(const char* group, int port, unsigned int session) {
+    send_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (send_socket == INVALID_SOCKET) {
+        fprintf(stderr, "Multicast disabled: could not open a UDP socket: %d\n", WSAGetLastError());
+        return 1;
+    }
+    history = (char*)calloc(MULTICAST_HISTORY, MULTICAST_DATAGRAM_MAX);
+    if (history == NULL) {
+        fprintf(stderr, "Multicast disabled: no memory for the repair history\n");
+        closesocket(send_socket);
+        send_socket = INVALID_SOCKET;
+        return 1;
+    }
+    DWORD ttl = 1;
+    setsockopt(send_socket, IPPROTO_IP, IP_MULTICAST_TTL, (const char*)&ttl, sizeof(ttl));
+
+    ZeroMemory(&group_address, sizeof(group_address));
+    group_address.sin_family = AF_INET;
+    group_address.sin_addr.s_addr = inet_addr(group);
+    group_address.sin_port = htons((unsigned short)port);
+
+    // Any value will do as long as two servers are unlikely to pick the same.
+    current_session = session != 0 ? session :
+        (unsigned int)(GetTickCount64() * 2654435761u) ^ GetCurrentProcessId() ^ 1;
+    InitializeCriticalSection(&history_lock);
+    printf("Server: multicasting broadcasts to %s:%d\n", group, port);
+    return 0;
+}
+
+void multicast_stop(void) {
+    if (send_socket == INVALID_SOCKET) {
+        return;
+    }
+    closesocket(send_socket);
+    send_socket = INVALID_SOCKET;
+    free(history);
+    history = NULL;
+    DeleteCriticalSection(&history_lock);
+}
+
+int multicast_enabled(void) {
+    return send_socket != INVALID_SOCKET;
+}
+
+unsigned int multicast_session(void) {
+    return current_session;
+}
+
+void multicast_info(MulticastInfo* info, int client_id) {
+    info->group = group_address.sin_addr.s_addr;
+    info->port = ntohs(group_address.sin_port);
+    info->session = current_session;
+    info->client_id = client_id;
+}
+
+// Send a broadcast to the group and keep it for repairs. The entry it goes
+// in is only ever written here, on the fan-out thread, so it can be sent
+// from once filled in.
+void multicast_send(const Broadcast* broadcast) {
+    int text_length = broadcast->colored_length + broadcast->plain_length;
+    int length = (int)sizeof(MulticastHeader) + text_length;
+    char* datagram = history_entry(broadcast->sequence);
+    MulticastHeader header;
+
+    header.magic = MULTICAST_MAGIC;
+    header.kind = MCAST_DATA;
+    header.session = current_session;
+    header.sender_id = broadcast->sender_id;
+    header.sequence = broadcast->sequence;
+    header.colored_length = broadcast->colored_length;
+    header.plain_length = broadcast->plain_length;
+
+    EnterCriticalSection(&history_lock);
+    if (length <= MULTICAST_DATAGRAM_MAX) {
+        memcpy(datagram, &header, sizeof(header));
+        memcpy(datagram + sizeof(header), broadcast->text, text_length);
+    } else {
+        ZeroMemory(datagram, sizeof(header));  // Too long to keep; repairs come back empty
+        datagram = NULL;
+    }
+    LeaveCriticalSection(&history_lock);
+
+    if (datagram == NULL) {
+        datagram = (char*)malloc(length);
+        if (datagram == NULL) {
+            return;  // Clients ask for it, and get an empty repair
+        }
+        metric_inc(METRIC_HEAP_ALLOCS);
+        memcpy(datagram, &header, sizeof(header));
+        memcpy(datagram + sizeof(header), broadcast->text, text_length);
+        sendto(send_socket, datagram, length, 0, (struct sockaddr*)&group_address, sizeof(group_address));
+        free(datagram);
+    } else {
+        sendto(send_socket, datagram, length, 0, (struct sockaddr*)&group_address, sizeof(group_address));
+    }
+    InterlockedExchange64(&last_sent, broadcast->sequence);
+}
+
+void multicast_heartbeat(void) {
+    MulticastHeader header;
+    ZeroMemory(&header, sizeof(header));
+    header.magic = MULTICAST_MAGIC;
+    header.kind = MCAST_HEARTBEAT;
+    header.session = current_session;
+    header.sender_id = -1;
+    header.sequence = last_sent;
+    if (header.sequence != 0) {
+        sendto(send_socket, (const char*)&header, sizeof(header), 0,
+               (struct sockaddr*)&group_address, sizeof(group_address));
+    }
+}
+
+int multicast_repair(long long sequence, int plain, char* buffer, int size, int* sender_id) {
+    MulticastHeader header;
+    int length = -1;
+
+    EnterCriticalSection(&history_lock);
+    const char* datagram = history_entry(sequence);
+    memcpy(&header, datagram, sizeof(header));
+    if (header.magic == MULTICAST_MAGIC && header.sequence == sequence) {
+        const char* text = datagram + sizeof(header) + (plain ? header.colored_length : 0);
+        length = plain ? header.plain_length : header.colored_length;
+        length = length < size ? length : size;
+        memcpy(buffer, text, length);
+        *sender_id = header.sender_id;
+    }
+    LeaveCriticalSection(&history_lock);
+    return length;
+}
@@ -0,0 +1,36 @@
+#ifndef MULTICAST_H
+#define MULTICAST_H
+
+#include "common.h"
+#include "sequencer.h"
+
+// Server side of multicast delivery (server.exe --multicast). Every broadcast
+// goes out once as a datagram to the group, whatever the number of clients
+// listening, and is kept for a while so a client that missed it can ask for
+// it again over TCP. Clients that did not join keep getting broadcasts over
+// TCP. Datagrams use TTL 1 and stay on the local segment.
+
+#define MULTICAST_GROUP "239.255.80.81"
+#define MULTICAST_PORT 8078
+#define MULTICAST_HISTORY 1024              // Broadcasts kept for repairs; power of two
+#define MULTICAST_REPAIR_MAX 64             // Broadcasts resent per MCAST_NACK
+#define MULTICAST_HEARTBEAT_MS 1000         // Lets clients notice a lost last datagram
+#define MULTICAST_DATAGRAM_MAX ((int)sizeof(MulticastHeader) + SEQ_POOLED_TEXT)  // Room in each kept entry
+
+// 'session' tells this server's datagrams from other servers' on the same
+// group; 0 picks a new one. Returns 0 on success.
+int multicast_start(const char* group, int port, unsigned int session);
+void multicast_stop(void);
+int multicast_enabled(void);
+unsigned int multicast_session(void);
+void multicast_info(MulticastInfo* info, int client_id);
+
+// Fan-out thread only.
+void multicast_send(const Broadcast* broadcast);
+void multicast_heartbeat(void);
+
+// Copy the variant of a kept broadcast into 'buffer'. Returns its length, or
+// -1 if it is no longer kept.
+int multicast_repair(long long sequence, int plain, char* buffer, int size, int* sender_id);
+
+#endif // MULTICAST_H
@@ -0,0 +1,228 @@
+#include "names.h"
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+
+static const char** table = NULL;       // Open addressing, by hash
+static int capacity = 0;
+static int count = 0;
+static CRITICAL_SECTION names_lock;
+
+// A trie node; the path from the root spells a name prefix.
+typedef struct NameNode {
+    struct NameNode* child;     // First child; children are sorted by byte
+    struct NameNode* sibling;
+    const char* name;           // Interned name ending here, while sessions > 0
+    int sessions;               // Sessions online with exactly this name
+    int below;                  // Sessions ending here or anywhere beneath
+    unsigned char byte;
+} NameNode;
+
+static NameNode online_root;
+static CRITICAL_SECTION online_lock;
+
+static unsigned int hash_name(const char* name) {
+    unsigned int hash = 2166136261u;
+    while (*name) {
+        hash = (hash ^ (unsigned char)*name++) * 16777619u;
+    }
+    return hash;
+}
+
+static const char** find_slot(const char** slots, int size, const char* name) {
+    int mask = size - 1;
+    int i = hash_name(name) & mask;
+    while (slots[i] != NULL && strcmp(slots[i], name) != 0) {
+        i = (i + 1) & mask;
+    }
+    return &slots[i];
+}
+
+// Double the table. Returns 0 on success.
+static int grow(void) {
+    int size = capacity * 2;
+    const char** slots = calloc(size, sizeof(const char*));
+    if (slots == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < capacity; i++) {
+        if (table[i] != NULL) {
+            *find_slot(slots, size, table[i]) = table[i];
+        }
+    }
+    free(table);
+    table = slots;
+    capacity = size;
+    return 0;
+}
+
+void names_init(void) {
+    InitializeCriticalSection(&names_lock);
+    InitializeCriticalSection(&online_lock);
+    memset(&online_root, 0, sizeof(online_root));
+    table = calloc(NAMES_MIN_CAPACITY, sizeof(const char*));
+    capacity = table != NULL ? NAMES_MIN_CAPACITY : 0;
+    count = 0;
+}
+
+static void free_nodes(NameNode* node) {
+    while (node != NULL) {
+        NameNode* next = node->sibling;
+        free_nodes(node->child);
+        free(node);
+        node = next;
+    }
+}
+
+void names_destroy(void) {
+    free_nodes(online_root.child);
+    memset(&online_root, 0, sizeof(online_root));
+    DeleteCriticalSection(&online_lock);
+    for (int i = 0; i < capacity; i++) {
+        free((char*)table[i]);
+    }
+    free(table);
+    table = NULL;
+    capacity = 0;
+    count = 0;
+    DeleteCriticalSection(&names_lock);
+}
+
+const char* name_intern(const char* name) {
+    const char* stored = "";
+
+    if (name[0] == '\0') {
+        return stored;
+    }
+    EnterCriticalSection(&names_lock);
+    if (capacity > 0 && ((count + 1) * 4 <= capacity * 3 || grow() == 0)) {
+        const char** slot = find_slot(table, capacity, name);
+        if (*slot == NULL) {
+            size_t length = strlen(name) + 1;
+            char* copy = malloc(length);
+            if (copy != NULL) {
+                memcpy(copy, name, length);
+                *slot = copy;
+                count++;
+            }
+        }
+        if (*slot != NULL) {
+            stored = *slot;
+        }
+    }
+    LeaveCriticalSection(&names_lock);
+    return stored;
+}
+
+// The link to the child of 'node' for 'byte', or to where it would go.
+static NameNode** child_link(NameNode* node, unsigned char byte) {
+    NameNode** link = &node->child;
+    while (*link != NULL && (*link)->byte < byte) {
+        link = &(*link)->sibling;
+    }
+    return link;
+}
+
+void names_online_add(const char* name) {
+    const char* stored = name_intern(name);
+    NameNode* path[NAMES_MAX_LENGTH + 1];
+    int depth = 0;
+
+    if (stored[0] == '\0' || strlen(stored) > NAMES_MAX_LENGTH) {
+        return;
+    }
+    EnterCriticalSection(&online_lock);
+    NameNode* node = &online_root;
+    path[depth++] = node;
+    for (const unsigned char* c = (const unsigned char*)stored; *c != '\0'; c++) {
+        NameNode** link = child_link(node, *c);
+        if (*link == NULL || (*link)->byte != *c) {
+            NameNode* added = (NameNode*)calloc(1, sizeof(NameNode));
+            if (added == NULL) {
+                LeaveCriticalSection(&online_lock);
+                return;  // Only completion misses the name
+            }
+            added->byte = *c;
+            added->sibling = *link;
+            *link = added;
+        }
+        node = *link;
+        path[depth++] = node;
+    }
+    for (int i = 0; i < depth; i++) {
+        path[i]->below++;
+    }
+    node->name = stored;
+    node->sessions++;
+    LeaveCriticalSection(&online_lock);
+}
+
+void names_online_remove(const char* name) {
+    NameNode* path[NAMES_MAX_LENGTH + 1];
+    NameNode** links[NAMES_MAX_LENGTH + 1];
+    int depth = 0;
+
+    EnterCriticalSection(&online_lock);
+    NameNode* node = &online_root;
+    path[depth] = node;
+    links[depth++] = NULL;
+    for (const unsigned char* c = (const unsigned char*)name; *c != '\0'; c++) {
+        NameNode** link = depth <= NAMES_MAX_LENGTH ? child_link(node, *c) : NULL;
+        if (link == NULL || *link == NULL || (*link)->byte != *c) {
+            LeaveCriticalSection(&online_lock);
+            return;
+        }
+        node = *link;
+        path[depth] = node;
+        links[depth++] = link;
+    }
+    if (node->sessions == 0) {
+        LeaveCriticalSection(&online_lock);
+        return;
+    }
+
+    node->sessions--;
+    for (int i = 0; i < depth; i++) {
+        path[i]->below--;
+    }
+    // Cut off the highest branch nobody is online under.
+    for (int i = 1; i < depth; i++) {
+        if (path[i]->below == 0) {
+            *links[i] = path[i]->sibling;
+            path[i]->sibling = NULL;
+            free_nodes(path[i]);
+            break;
+        }
+    }
+    LeaveCriticalSection(&online_lock);
+}
+
+// Collect the names under 'node' in byte order. Every node visited leads to
+// at least one name, since empty branches are pruned.
+static int collect(const NameNode* node, const char** results, int count, int max) {
+    if (node->sessions > 0 && count < max) {
+        results[count++] = node->name;
+    }
+    for (const NameNode* child = node->child; child != NULL && count < max; child = child->sibling) {
+        count = collect(child, results, count, max);
+    }
+    return count;
+}
+
+int names_complete(const char* prefix, const char** results, int max) {
+    int count = 0;
+
+    EnterCriticalSection(&online_lock);
+    const NameNode* node = &online_root;
+    for (const unsigned char* c = (const unsigned char*)prefix; *c != '\0' && node != NULL; c++) {
+        node = *child_link((NameNode*)node, *c);
+        if (node != NULL && node->byte != *c) {
+            node = NULL;
+        }
+    }
+    if (node != NULL) {
+        count = collect(node, results, 0, max);
+    }
+    LeaveCriticalSection(&online_lock);
+    return count;
+}
@@ -0,0 +1,31 @@
+#ifndef NAMES_H
+#define NAMES_H
+
+// Usernames are interned: every distinct name is stored once, for the life
+// of the process, and a connection keeps a pointer to it instead of a copy.
+// Replacing a connection's name is then a single pointer store, and readers
+// on other threads never see a half-copied name.
+
+#define NAMES_MIN_CAPACITY 256   // Power of two
+#define NAMES_MAX_LENGTH 31      // Longest name the online trie holds
+
+void names_init(void);
+void names_destroy(void);
+
+// The stored copy of 'name', added if it is new; "" if memory runs out.
+const char* name_intern(const char* name);
+
+// The names of the users online here and on linked nodes, in a trie for
+// completion. A name counts once however many sessions use it, and stays
+// until the last of them ends. Branches with nobody online are pruned, so
+// a query walks the prefix and then only nodes that lead to a result:
+// O(prefix length + results), with no look at the client list.
+void names_online_add(const char* name);
+void names_online_remove(const char* name);
+
+// Fill 'results' with up to 'max' online names starting with 'prefix', in
+// byte order. The pointers stay valid for the life of the process.
+// Returns the number found.
+int names_complete(const char* prefix, const char** results, int max);
+
+#endif // NAMES_H
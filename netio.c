@@ -0,0 +1,36 @@
+#include "netio.h"
+
+static unsigned long long tick_ms(void) {
+    return GetTickCount64();
+}
+
+static LONGLONG counter_frequency;
+
+static long long counter_us(void) {
+    LARGE_INTEGER counter;
+    if (counter_frequency == 0) {
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+        counter_frequency = frequency.QuadPart;
+    }
+    QueryPerformanceCounter(&counter);
+    return (long long)(counter.QuadPart / counter_frequency * 1000000 +
+                       counter.QuadPart % counter_frequency * 1000000 / counter_frequency);
+}
+
+static int winsock_send(Client* client, WSABUF* buffers, int count) {
+    DWORD sent;
+    // A blocking WSASend returns once everything has been sent.
+    return WSASend(client->socket, buffers, (DWORD)count, &sent, 0, NULL, NULL);
+}
+
+static void winsock_shutdown(Client* client) {
+    shutdown(client->socket, SD_BOTH);
+}
+
+static void winsock_close(Client* client) {
+    closesocket(client->socket);
+}
+
+const NetIO winsock_io = { tick_ms, counter_us, winsock_send, winsock_shutdown, winsock_close };
+const NetIO* net = &winsock_io;
@@ -0,0 +1,21 @@
+#ifndef NETIO_H
+#define NETIO_H
+
+#include "common.h"
+
+// Where the server gets the time and how it writes to and closes client
+// connections. Normally that is the system clock and Winsock; the simulator
+// (sim.c) swaps in a virtual clock and in-memory connections, so the client
+// pipeline runs unchanged against either.
+typedef struct {
+    unsigned long long (*now_ms)(void);     // Like GetTickCount64
+    long long (*now_us)(void);              // Finer, for tracing; only differences mean anything
+    int (*send)(Client* client, WSABUF* buffers, int count);  // Returns once all is sent, or SOCKET_ERROR
+    void (*shutdown)(Client* client);       // Both directions; the reader then sees the end
+    void (*close)(Client* client);
+} NetIO;
+
+extern const NetIO winsock_io;
+extern const NetIO* net;
+
+#endif // NETIO_H
@@ -0,0 +1,613 @@
+#include "common.h"
+#include "outqueue.h"
+#include "metrics.h"
+#include "filexfer.h"
+#include "lz.h"
+#include "netio.h"
+#include <stddef.h>
+
+static OutFrame* frame_pool = NULL;    // Free pooled frames, linked through next
+static int frame_pool_count = 0;
+static int frame_pool_keep = OUTFRAME_POOL_MAX;
+static CRITICAL_SECTION frame_pool_lock;
+
+// Top the pool up to 'count' free frames.
+static void outframe_pool_fill(int count) {
+    EnterCriticalSection(&frame_pool_lock);
+    while (frame_pool_count < count) {
+        OutFrame* frame = (OutFrame*)malloc(sizeof(OutFrame) + OUTFRAME_POOL_CAPACITY);
+        if (frame == NULL) {
+            break;
+        }
+        frame->capacity = OUTFRAME_POOL_CAPACITY;
+        frame->next = frame_pool;
+        frame_pool = frame;
+        frame_pool_count++;
+    }
+    LeaveCriticalSection(&frame_pool_lock);
+}
+
+void outframe_pool_init(void) {
+    InitializeCriticalSection(&frame_pool_lock);
+    frame_pool_keep = OUTFRAME_POOL_MAX;
+    outframe_pool_fill(OUTFRAME_POOL_PRELOAD);
+}
+
+// For a load known in advance: preload 'frames' frames and keep that many.
+void outframe_pool_reserve(int frames) {
+    EnterCriticalSection(&frame_pool_lock);
+    if (frames > frame_pool_keep) {
+        frame_pool_keep = frames;
+    }
+    LeaveCriticalSection(&frame_pool_lock);
+    outframe_pool_fill(frames);
+}
+
+void outframe_pool_destroy(void) {
+    while (frame_pool != NULL) {
+        OutFrame* frame = frame_pool;
+        frame_pool = frame->next;
+        free(frame);
+    }
+    frame_pool_count = 0;
+    DeleteCriticalSection(&frame_pool_lock);
+}
+
+// Get a frame with room for 'size' bytes of data, from the pool if it fits.
+static OutFrame* outframe_alloc(int size) {
+    OutFrame* frame = NULL;
+
+    if (size <= OUTFRAME_POOL_CAPACITY) {
+        EnterCriticalSection(&frame_pool_lock);
+        frame = frame_pool;
+        if (frame != NULL) {
+            frame_pool = frame->next;
+            frame_pool_count--;
+        }
+        LeaveCriticalSection(&frame_pool_lock);
+        if (frame == NULL) {
+            size = OUTFRAME_POOL_CAPACITY;
+        }
+    }
+
+    if (frame == NULL) {
+        frame = (OutFrame*)malloc(sizeof(OutFrame) + size);
+        if (frame == NULL) {
+            return NULL;
+        }
+        frame->capacity = size;
+        metric_inc(METRIC_HEAP_ALLOCS);
+    }
+    frame->not_before = 0;
+    frame->transfer = NULL;
+    frame->file_offset = 0;
+    frame->file_length = 0;
+    frame->shared = NULL;
+    frame->trace.receive = 0;
+    frame->write_stamp = 0;
+    frame->pinned = 0;
+    return frame;
+}
+
+// Return a frame to the pool, or to the heap if it is oversized or the pool is full.
+void outframe_free(OutFrame* frame) {
+    if (frame->transfer != NULL) {
+        transfer_release(frame->transfer);
+        frame->transfer = NULL;
+    }
+    if (frame->shared != NULL) {
+        shared_payload_release(frame->shared);
+        frame->shared = NULL;
+    }
+    if (frame->capacity == OUTFRAME_POOL_CAPACITY) {
+        EnterCriticalSection(&frame_pool_lock);
+        if (frame_pool_count < frame_pool_keep) {
+            frame->next = frame_pool;
+            frame_pool = frame;
+            frame_pool_count++;
+            frame = NULL;
+        }
+        LeaveCriticalSection(&frame_pool_lock);
+    }
+    free(frame);
+}
+
+// A file chunk frame: FrameHeader and FileChunkHeader, followed on the wire by
+// 'length' bytes of the transfer's spool file from 'offset'. Takes over one
+// reference to the transfer.
+OutFrame* outframe_file_chunk(struct Transfer* transfer, int id, long long offset, int length,
+                              unsigned long long not_before) {
+    OutFrame* frame = outframe_alloc((int)(sizeof(FrameHeader) + sizeof(FileChunkHeader)));
+    FrameHeader header;
+    FileChunkHeader chunk;
+
+    if (frame == NULL) {
+        return NULL;
+    }
+    header.type = MSG_FILE_DATA;
+    header.length = (int)sizeof(FileChunkHeader) + length;
+    header.sequence = 0;
+    chunk.id = id;
+    chunk.reserved = 0;
+    chunk.offset = offset;
+    frame->next = NULL;
+    frame->length = (int)(sizeof(FrameHeader) + sizeof(FileChunkHeader));
+    frame->not_before = not_before;
+    frame->transfer = transfer;
+    frame->file_offset = offset;
+    frame->file_length = length;
+    memcpy(frame->data, &header, sizeof(FrameHeader));
+    memcpy(frame->data + sizeof(FrameHeader), &chunk, sizeof(FileChunkHeader));
+    return frame;
+}
+
+// Build a frame holding a FrameHeader followed by the payload.
+OutFrame* outframe_create(int type, const char* payload, int length) {
+    OutFrame* frame = outframe_alloc((int)sizeof(FrameHeader) + length);
+    FrameHeader header;
+
+    if (frame == NULL) {
+        return NULL;
+    }
+    header.type = type;
+    header.length = length;
+    header.sequence = 0;
+    frame->next = NULL;
+    frame->length = (int)sizeof(FrameHeader) + length;
+    memcpy(frame->data, &header, sizeof(FrameHeader));
+    if (length > 0) {
+        memcpy(frame->data + sizeof(FrameHeader), payload, length);
+    }
+    return frame;
+}
+
+// A frame already serialized (FrameHeader + payload), copied as it is.
+OutFrame* outframe_copy(const char* data, int length) {
+    OutFrame* frame = outframe_alloc(length);
+
+    if (frame == NULL) {
+        return NULL;
+    }
+    frame->next = NULL;
+    frame->length = length;
+    memcpy(frame->data, data, length);
+    return frame;
+}
+
+// A payload that frames for several clients can share. It lives in the data
+// of a frame from the pool, so it costs no heap allocation when it fits one.
+// Starts with one reference, which the caller releases once it has created
+// the frames.
+SharedPayload* shared_payload_create(const char* data, int length) {
+    OutFrame* holder = outframe_alloc((int)sizeof(SharedPayload) + length);
+    if (holder == NULL) {
+        return NULL;
+    }
+    SharedPayload* payload = (SharedPayload*)holder->data;
+    payload->references = 1;
+    payload->length = length;
+    memcpy(payload->data, data, length);
+    return payload;
+}
+
+void shared_payload_release(SharedPayload* payload) {
+    if (InterlockedDecrement(&payload->references) == 0) {
+        outframe_free((OutFrame*)((char*)payload - offsetof(OutFrame, data)));
+    }
+}
+
+// A frame whose payload is shared rather than copied; takes a reference.
+OutFrame* outframe_create_shared(int type, SharedPayload* payload) {
+    OutFrame* frame = outframe_alloc((int)sizeof(FrameHeader));
+    FrameHeader header;
+
+    if (frame == NULL) {
+        return NULL;
+    }
+    header.type = type;
+    header.length = payload->length;
+    header.sequence = 0;
+    frame->next = NULL;
+    frame->length = (int)sizeof(FrameHeader);
+    memcpy(frame->data, &header, sizeof(FrameHeader));
+    InterlockedIncrement(&payload->references);
+    frame->shared = payload;
+    return frame;
+}
+
+// Like outframe_create, but the payload is compressed straight into the
+// frame. Falls back to a plain frame if compression does not make it smaller.
+OutFrame* outframe_create_compressed(int type, const char* payload, int length) {
+    int prefix = (int)(sizeof(FrameHeader) + sizeof(int));
+    OutFrame* frame = outframe_alloc(prefix + LZ_BOUND(length));
+    FrameHeader header;
+
+    if (frame == NULL) {
+        return NULL;
+    }
+    int packed = lz_compress(payload, length, frame->data + prefix, frame->capacity - prefix);
+    if (packed == 0) {
+        outframe_free(frame);
+        return outframe_create(type, payload, length);
+    }
+    header.type = type | FRAME_COMPRESSED;
+    header.length = (int)sizeof(int) + packed;
+    header.sequence = 0;
+    frame->next = NULL;
+    frame->length = prefix + packed;
+    memcpy(frame->data, &header, sizeof(FrameHeader));
+    memcpy(frame->data + sizeof(FrameHeader), &length, sizeof(int));
+    InterlockedExchangeAdd(&metrics[METRIC_COMPRESS_SAVED], length - (int)sizeof(int) - packed);
+    return frame;
+}
+
+// Set the sequence number in a frame's header.
+void outframe_set_sequence(OutFrame* frame, long long sequence) {
+    memcpy(frame->data + offsetof(FrameHeader, sequence), &sequence, sizeof(sequence));
+}
+
+OutFrame* outframe_shutdown_marker(void) {
+    OutFrame* frame = outframe_alloc(0);
+    if (frame != NULL) {
+        frame->next = NULL;
+        frame->length = 0;
+    }
+    return frame;
+}
+
+void outqueue_init(OutQueue* queue) {
+    for (int lane = 0; lane < PRIO_COUNT; lane++) {
+        queue->head[lane] = NULL;
+        queue->tail[lane] = NULL;
+        queue->depth[lane] = 0;
+        queue->skipped[lane] = 0;
+    }
+    queue->closed = 0;
+    queue->paused = 0;
+    queue->busy = 0;
+    queue->writer_running = 0;
+    queue->start_writer = NULL;
+    queue->writer_context = NULL;
+    InitializeCriticalSection(&queue->lock);
+    queue->ready = CreateEvent(NULL, TRUE, FALSE, NULL);
+}
+
+// Free any frames still queued and release the queue's resources.
+void outqueue_destroy(OutQueue* queue) {
+    for (int lane = 0; lane < PRIO_COUNT; lane++) {
+        while (queue->head[lane] != NULL) {
+            OutFrame* frame = queue->head[lane];
+            queue->head[lane] = frame->next;
+            outframe_free(frame);
+        }
+    }
+    CloseHandle(queue->ready);
+    DeleteCriticalSection(&queue->lock);
+}
+
+// Start a writer only while there is something to send: 'start_writer' is
+// called, with the queue locked, whenever a frame arrives and no writer is
+// running, and the writer's outqueue_pop() returns NULL once the queue has
+// been empty for OUTQ_WRITER_IDLE_MS. An idle connection then holds no
+// thread. Frames already queued start a writer now.
+void outqueue_set_writer(OutQueue* queue, int (*start_writer)(void* context), void* context) {
+    EnterCriticalSection(&queue->lock);
+    queue->start_writer = start_writer;
+    queue->writer_context = context;
+    for (int lane = 0; lane < PRIO_COUNT && !queue->closed; lane++) {
+        if (queue->head[lane] != NULL) {
+            queue->writer_running = start_writer(context);
+            break;
+        }
+    }
+    LeaveCriticalSection(&queue->lock);
+}
+
+// Queue a frame on a lane. The queue takes ownership of the frame.
+// Returns OUTQ_QUEUED, OUTQ_DROPPED_OLDEST if an older frame was dropped
+// to make room, or OUTQ_CLOSED if the frame was discarded because the
+// queue is closed.
+int outqueue_push(OutQueue* queue, int lane, OutFrame* frame) {
+    int result = OUTQ_QUEUED;
+
+    EnterCriticalSection(&queue->lock);
+    if (queue->closed) {
+        LeaveCriticalSection(&queue->lock);
+        outframe_free(frame);
+        return OUTQ_CLOSED;
+    }
+
+    // A slow consumer loses its oldest broadcasts rather than growing without
+    // bound. Pinned frames stay where they are.
+    if (lane == PRIO_BROADCAST && queue->depth[lane] >= OUTQ_MAX_BROADCAST) {
+        OutFrame** link = &queue->head[lane];
+        OutFrame* previous = NULL;
+        while (*link != NULL && (*link)->pinned) {
+            previous = *link;
+            link = &(*link)->next;
+        }
+        OutFrame* oldest = *link;
+        if (oldest != NULL) {
+            *link = oldest->next;
+            if (queue->tail[lane] == oldest) {
+                queue->tail[lane] = previous;
+            }
+            queue->depth[lane]--;
+            outframe_free(oldest);
+            result = OUTQ_DROPPED_OLDEST;
+        }
+    }
+
+    frame->next = NULL;
+    if (queue->tail[lane] == NULL) {
+        queue->head[lane] = frame;
+        queue->tail[lane] = frame;
+    } else if (frame->not_before >= queue->tail[lane]->not_before) {
+        queue->tail[lane]->next = frame;
+        queue->tail[lane] = frame;
+    } else {
+        // Keep delayed frames ordered by the time they become due.
+        OutFrame** link = &queue->head[lane];
+        while ((*link)->not_before <= frame->not_before) {
+            link = &(*link)->next;
+        }
+        frame->next = *link;
+        *link = frame;
+    }
+    queue->depth[lane]++;
+    SetEvent(queue->ready);
+    if (!queue->writer_running && queue->start_writer != NULL) {
+        queue->writer_running = queue->start_writer(queue->writer_context);
+    }
+    LeaveCriticalSection(&queue->lock);
+    return result;
+}
+
+// A lane can be served if its first frame is due.
+static int lane_ready(OutQueue* queue, int lane, unsigned long long now) {
+    return queue->head[lane] != NULL && queue->head[lane]->not_before <= now;
+}
+
+// Pick the lane to serve next: the highest ready lane, unless a lower one
+// has been passed over OUTQ_STARVATION_LIMIT times. Caller holds the lock.
+static int pick_lane(OutQueue* queue) {
+    unsigned long long now = net->now_ms();
+    int lane = -1;
+
+    for (int i = PRIO_COUNT - 1; i > 0; i--) {
+        if (lane_ready(queue, i, now) && queue->skipped[i] >= OUTQ_STARVATION_LIMIT) {
+            lane = i;
+            break;
+        }
+    }
+    if (lane < 0) {
+        for (int i = 0; i < PRIO_COUNT; i++) {
+            if (lane_ready(queue, i, now)) {
+                lane = i;
+                break;
+            }
+        }
+    }
+    if (lane < 0) {
+        return -1;
+    }
+
+    queue->skipped[lane] = 0;
+    for (int i = lane + 1; i < PRIO_COUNT; i++) {
+        if (lane_ready(queue, i, now)) {
+            queue->skipped[i]++;
+        }
+    }
+    return lane;
+}
+
+// How long the writer may sleep before a delayed frame becomes due.
+// Caller holds the lock.
+static DWORD next_due_ms(OutQueue* queue) {
+    unsigned long long now = net->now_ms();
+    DWORD wait = INFINITE;
+
+    for (int i = 0; i < PRIO_COUNT; i++) {
+        if (queue->head[i] != NULL && queue->head[i]->not_before > now &&
+            queue->head[i]->not_before - now < wait) {
+            wait = (DWORD)(queue->head[i]->not_before - now);
+        }
+    }
+    return wait;
+}
+
+// Unlink the first frame of a lane. Caller holds the lock.
+static OutFrame* take_head(OutQueue* queue, int lane) {
+    OutFrame* frame = queue->head[lane];
+    queue->head[lane] = frame->next;
+    if (queue->head[lane] == NULL) {
+        queue->tail[lane] = NULL;
+    }
+    queue->depth[lane]--;
+    return frame;
+}
+
+// Add frames that may go out in the same send call as the 'count' already
+// taken, up to 'max'. Caller holds the lock.
+static int take_more(OutQueue* queue, OutFrame** frames, int count, int max) {
+    while (count < max && !queue->paused && !queue->closed) {
+        int lane = pick_lane(queue);
+        if (lane < 0 || queue->head[lane]->length == 0 || queue->head[lane]->transfer != NULL) {
+            break;
+        }
+        frames[count++] = take_head(queue, lane);
+    }
+    return count;
+}
+
+// Nothing queued on any lane, due or not. Caller holds the lock.
+static int queue_empty(OutQueue* queue) {
+    for (int lane = 0; lane < PRIO_COUNT; lane++) {
+        if (queue->head[lane] != NULL) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Wait for the next frame to send. Returns NULL once the queue is closed,
+// or for a writer the queue started, once it has been idle for
+// OUTQ_WRITER_IDLE_MS.
+OutFrame* outqueue_pop(OutQueue* queue) {
+    int timed_out = 0;
+
+    for (;;) {
+        EnterCriticalSection(&queue->lock);
+        queue->busy = 0;  // Coming back here means the last frame is done
+        if (queue->closed) {
+            LeaveCriticalSection(&queue->lock);
+            return NULL;
+        }
+
+        int lane = queue->paused ? -1 : pick_lane(queue);
+        if (lane >= 0) {
+            queue->busy = 1;
+            OutFrame* frame = take_head(queue, lane);
+            LeaveCriticalSection(&queue->lock);
+            return frame;
+        }
+
+        DWORD wait = queue->paused ? INFINITE : next_due_ms(queue);
+        if (queue->start_writer != NULL && !queue->paused && queue_empty(queue)) {
+            if (timed_out) {
+                // The next frame starts another writer.
+                queue->writer_running = 0;
+                LeaveCriticalSection(&queue->lock);
+                return NULL;
+            }
+            wait = OUTQ_WRITER_IDLE_MS;
+        }
+        ResetEvent(queue->ready);
+        LeaveCriticalSection(&queue->lock);
+        timed_out = WaitForSingleObject(queue->ready, wait) == WAIT_TIMEOUT;
+    }
+}
+
+// Wait for frames and take up to 'max' of them, in scheduling order. A
+// shutdown marker or a file chunk is always returned on its own. Returns the
+// number of frames taken, or 0 when outqueue_pop() returns NULL.
+int outqueue_pop_batch(OutQueue* queue, OutFrame** frames, int max) {
+    int count = 0;
+
+    frames[count++] = outqueue_pop(queue);
+    if (frames[0] == NULL) {
+        return 0;
+    }
+    if (frames[0]->length == 0 || frames[0]->transfer != NULL) {
+        return 1;
+    }
+
+    EnterCriticalSection(&queue->lock);
+    count = take_more(queue, frames, count, max);
+    LeaveCriticalSection(&queue->lock);
+    return count;
+}
+
+// Take up to 'max' frames that are due, like outqueue_pop_batch() but
+// without waiting, for a caller that runs the writer's part itself (the
+// simulator). Returns 0 if nothing is due or the queue is closed.
+int outqueue_take_batch(OutQueue* queue, OutFrame** frames, int max) {
+    int count = 0;
+
+    EnterCriticalSection(&queue->lock);
+    int lane = (queue->paused || queue->closed) ? -1 : pick_lane(queue);
+    if (lane >= 0) {
+        frames[count++] = take_head(queue, lane);
+        if (frames[0]->length != 0 && frames[0]->transfer == NULL) {
+            count = take_more(queue, frames, count, max);
+        }
+    }
+    LeaveCriticalSection(&queue->lock);
+    return count;
+}
+
+// Stop the queue. Pending and future frames are discarded and the writer
+// blocked in outqueue_pop() wakes up.
+void outqueue_close(OutQueue* queue) {
+    EnterCriticalSection(&queue->lock);
+    queue->closed = 1;
+    SetEvent(queue->ready);
+    LeaveCriticalSection(&queue->lock);
+}
+
+// Stop the writer from taking new frames and wait for it to finish the one
+// it is sending, so the byte stream is between frames. Returns 1 once the
+// writer is idle, 0 if it is still busy after timeout_ms.
+int outqueue_pause(OutQueue* queue, unsigned int timeout_ms) {
+    ULONGLONG deadline = GetTickCount64() + timeout_ms;
+
+    EnterCriticalSection(&queue->lock);
+    queue->paused = 1;
+    LeaveCriticalSection(&queue->lock);
+
+    for (;;) {
+        EnterCriticalSection(&queue->lock);
+        int busy = queue->busy;
+        LeaveCriticalSection(&queue->lock);
+        if (!busy) {
+            return 1;
+        }
+        if (GetTickCount64() >= deadline) {
+            return 0;
+        }
+        Sleep(1);
+    }
+}
+
+void outqueue_resume(OutQueue* queue) {
+    EnterCriticalSection(&queue->lock);
+    queue->paused = 0;
+    SetEvent(queue->ready);
+    LeaveCriticalSection(&queue->lock);
+}
+
+// Total size of the frames waiting in the queue, in lane order. File chunks
+// are not counted; transfers do not survive a handoff.
+int outqueue_pending_bytes(OutQueue* queue) {
+    int total = 0;
+
+    EnterCriticalSection(&queue->lock);
+    for (int lane = 0; lane < PRIO_COUNT; lane++) {
+        for (OutFrame* frame = queue->head[lane]; frame != NULL; frame = frame->next) {
+            if (frame->transfer == NULL) {
+                total += frame->length + (frame->shared != NULL ? frame->shared->length : 0);
+            }
+        }
+    }
+    LeaveCriticalSection(&queue->lock);
+    return total;
+}
+
+// Copy the queued frames (highest lane first) into a buffer, stopping at the
+// first frame that does not fit. Shutdown markers and file chunks are skipped.
+// Returns the number of bytes copied.
+int outqueue_copy_pending(OutQueue* queue, char* buffer, int size) {
+    int offset = 0;
+
+    EnterCriticalSection(&queue->lock);
+    for (int lane = 0; lane < PRIO_COUNT; lane++) {
+        for (OutFrame* frame = queue->head[lane]; frame != NULL; frame = frame->next) {
+            if (frame->transfer != NULL) {
+                continue;
+            }
+            int shared = frame->shared != NULL ? frame->shared->length : 0;
+            if (offset + frame->length + shared > size) {
+                LeaveCriticalSection(&queue->lock);
+                return offset;
+            }
+            memcpy(buffer + offset, frame->data, frame->length);
+            offset += frame->length;
+            if (shared > 0) {
+                memcpy(buffer + offset, frame->shared->data, shared);
+                offset += shared;
+            }
+        }
+    }
+    LeaveCriticalSection(&queue->lock);
+    return offset;
+}
@@ -0,0 +1,124 @@
+#ifndef OUTQUEUE_H
+#define OUTQUEUE_H
+
+#include <windows.h>
+
+// Outbound priority lanes. Lower numbers are drained first.
+#define PRIO_CONTROL 0      // Auth replies, system messages, pings
+#define PRIO_PRIVATE 1      // Whispers and their confirmations
+#define PRIO_BROADCAST 2    // Chat and other broadcast traffic
+#define PRIO_BULK 3         // File transfer chunks, one per transfer at a time
+#define PRIO_COUNT 4
+
+// A lower lane that has been passed over this many times in a row gets the
+// next turn, so bulk traffic keeps moving while control traffic is busy.
+#define OUTQ_STARVATION_LIMIT 8
+
+// Most frames handed to the writer for one send call.
+#define OUTQ_SEND_BATCH 16
+
+// A writer started by the queue (outqueue_set_writer) stops after the queue
+// has been empty this long; the next frame starts a new one.
+#define OUTQ_WRITER_IDLE_MS 5000
+
+// Broadcast frames queued for one client beyond this are dropped (oldest first).
+#define OUTQ_MAX_BROADCAST 512
+
+// outqueue_push() results.
+#define OUTQ_QUEUED 0
+#define OUTQ_DROPPED_OLDEST 1       // Queued, after dropping the lane's oldest frame
+#define OUTQ_CLOSED -1              // Discarded: the queue is closed
+
+// Frames are recycled through a shared pool instead of the heap. A pooled
+// frame holds this many bytes (header included); larger frames use the heap.
+// The pool starts with OUTFRAME_POOL_PRELOAD frames and keeps up to
+// OUTFRAME_POOL_MAX, enough for a broadcast or two to every client in flight;
+// outframe_pool_reserve() raises both for a load known in advance.
+#define OUTFRAME_POOL_CAPACITY 1280
+#define OUTFRAME_POOL_PRELOAD 1024
+#define OUTFRAME_POOL_MAX (4 * MAX_CLIENTS > OUTFRAME_POOL_PRELOAD ? 4 * MAX_CLIENTS : OUTFRAME_POOL_PRELOAD)
+
+struct Transfer;
+
+// When each server stage of the request behind a frame happened, in
+// trace_now() microseconds. 'receive' is zero for untraced frames.
+typedef struct {
+    long long receive;          // recv returned the request's last bytes
+    long long parse;            // Request decoded
+    long long dispatch;         // Handler started
+    long long enqueue;          // This frame queued
+} TraceStamps;
+
+// A payload sent unchanged to several clients, e.g. a whisper to many users.
+// Each frame carrying it holds a reference; the last one frees it.
+typedef struct {
+    volatile LONG references;
+    int length;
+    char data[];
+} SharedPayload;
+
+// One serialized frame (FrameHeader + payload) waiting to be sent.
+// A frame with length 0 is a marker asking the writer to shut the connection down.
+// A file chunk frame holds only the headers in data; the writer sends
+// file_length bytes of the transfer's spool file after them. A frame with
+// a shared payload holds only the header; the payload goes out after it.
+typedef struct OutFrame {
+    struct OutFrame* next;
+    int length;
+    int capacity;               // Size of data; OUTFRAME_POOL_CAPACITY if pooled
+    unsigned long long not_before;  // GetTickCount64 time before which it is not sent
+    struct Transfer* transfer;  // File chunk: the transfer it belongs to (holds a reference)
+    long long file_offset;
+    int file_length;
+    SharedPayload* shared;      // Sent after data (holds a reference)
+    TraceStamps trace;
+    int write_stamp;            // If nonzero, offset in data where the writer stores
+                                // (as an int) the microseconds the frame spent queued
+    int pinned;                 // Never dropped to make room in its lane
+    char data[];
+} OutFrame;
+
+typedef struct {
+    OutFrame* head[PRIO_COUNT];
+    OutFrame* tail[PRIO_COUNT];
+    int depth[PRIO_COUNT];
+    int skipped[PRIO_COUNT];    // Times each lane was passed over while non-empty
+    int closed;
+    int paused;                 // Writer must not take frames (during a handoff)
+    int busy;                   // Writer is sending a frame it popped
+    int writer_running;         // A writer started by start_writer has not stopped
+    int (*start_writer)(void* context);  // Starts a writer thread; 1 on success
+    void* writer_context;
+    CRITICAL_SECTION lock;
+    HANDLE ready;               // Signaled while frames are queued or the queue is closed
+} OutQueue;
+
+void outframe_pool_init(void);
+void outframe_pool_reserve(int frames);
+void outframe_pool_destroy(void);
+OutFrame* outframe_create(int type, const char* payload, int length);
+OutFrame* outframe_create_compressed(int type, const char* payload, int length);
+OutFrame* outframe_create_shared(int type, SharedPayload* payload);
+OutFrame* outframe_copy(const char* data, int length);
+OutFrame* outframe_shutdown_marker(void);
+void outframe_set_sequence(OutFrame* frame, long long sequence);
+OutFrame* outframe_file_chunk(struct Transfer* transfer, int id, long long offset, int length,
+                              unsigned long long not_before);
+void outframe_free(OutFrame* frame);
+SharedPayload* shared_payload_create(const char* data, int length);
+void shared_payload_release(SharedPayload* payload);
+
+void outqueue_init(OutQueue* queue);
+void outqueue_destroy(OutQueue* queue);
+void outqueue_set_writer(OutQueue* queue, int (*start_writer)(void* context), void* context);
+int outqueue_push(OutQueue* queue, int lane, OutFrame* frame);
+OutFrame* outqueue_pop(OutQueue* queue);
+int outqueue_pop_batch(OutQueue* queue, OutFrame** frames, int max);
+int outqueue_take_batch(OutQueue* queue, OutFrame** frames, int max);
+void outqueue_close(OutQueue* queue);
+int outqueue_pause(OutQueue* queue, unsigned int timeout_ms);
+void outqueue_resume(OutQueue* queue);
+int outqueue_pending_bytes(OutQueue* queue);
+int outqueue_copy_pending(OutQueue* queue, char* buffer, int size);
+
+#endif // OUTQUEUE_H
@@ -0,0 +1,30 @@
+#include <stdio.h>
+#include "probes.h"
+
+#ifdef PROBES_ENABLED
+
+// The GUID is the one ETW derives from the name (as EventSource does), so
+// tools can also enable the provider as *LanChat-Server.
+TRACELOGGING_DEFINE_PROVIDER(chat_provider, "LanChat-Server",
+    (0x7f9a5430, 0x5f60, 0x5d45, 0x9d, 0xd5, 0xd7, 0x93, 0xe2, 0xa7, 0x3c, 0x9d));
+
+void probes_register(void) {
+    HRESULT result = TraceLoggingRegister(chat_provider);
+    if (FAILED(result)) {
+        fprintf(stderr, "Could not register the trace provider: 0x%08lx\n", (unsigned long)result);
+    }
+}
+
+void probes_unregister(void) {
+    TraceLoggingUnregister(chat_provider);
+}
+
+#else
+
+void probes_register(void) {
+}
+
+void probes_unregister(void) {
+}
+
+#endif // PROBES_ENABLED
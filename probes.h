@@ -0,0 +1,88 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+// Static tracepoints for profiling a production server. Each probe is an ETW
+// TraceLogging event of the "LanChat-Server" provider. While no trace session
+// has the provider enabled a probe is one test of a flag and its arguments
+// are not evaluated, so the probes stay compiled in. Record them with logman,
+// WPR or xperf and view them in WPA, or run trace_commands.ps1 for a
+// per-command latency histogram.
+//
+// Event            Fields
+// Accept           ClientId, Address, Port
+// AuthStart        Username
+// AuthFinish       Username, Result (AUTH_*)
+// Decode           ClientId, Type, Command
+// CommandStart     ClientId, Command, Name
+// CommandFinish    ClientId, Command, Name
+// BroadcastStart   Sequence, SenderId
+// BroadcastFinish  Sequence, Recipients
+// SendComplete     ClientId, Frames, Bytes, Result
+// Disconnect       ClientId, Username
+//
+// Start and finish events of a pair come from the same thread.
+// Build with -DNO_PROBES, or without the TraceLogging header, and the probes
+// compile to nothing.
+
+#if !defined(NO_PROBES) && defined(__has_include)
+#if __has_include(<TraceLoggingProvider.h>)
+#define PROBES_ENABLED 1
+#include <windows.h>
+#include <TraceLoggingProvider.h>
+#endif
+#endif
+
+#ifdef PROBES_ENABLED
+
+TRACELOGGING_DECLARE_PROVIDER(chat_provider);
+
+#define PROBE_ACCEPT(client_id, address, port) \
+    TraceLoggingWrite(chat_provider, "Accept", TraceLoggingInt32(client_id, "ClientId"), \
+                      TraceLoggingIPv4Address(address, "Address"), TraceLoggingPort(port, "Port"))
+#define PROBE_AUTH_START(username) \
+    TraceLoggingWrite(chat_provider, "AuthStart", TraceLoggingString(username, "Username"))
+#define PROBE_AUTH_FINISH(username, result) \
+    TraceLoggingWrite(chat_provider, "AuthFinish", TraceLoggingString(username, "Username"), \
+                      TraceLoggingInt32(result, "Result"))
+#define PROBE_DECODE(client_id, type, command) \
+    TraceLoggingWrite(chat_provider, "Decode", TraceLoggingInt32(client_id, "ClientId"), \
+                      TraceLoggingInt32(type, "Type"), TraceLoggingInt32(command, "Command"))
+#define PROBE_COMMAND_START(client_id, command, name) \
+    TraceLoggingWrite(chat_provider, "CommandStart", TraceLoggingInt32(client_id, "ClientId"), \
+                      TraceLoggingInt32(command, "Command"), TraceLoggingString(name, "Name"))
+#define PROBE_COMMAND_FINISH(client_id, command, name) \
+    TraceLoggingWrite(chat_provider, "CommandFinish", TraceLoggingInt32(client_id, "ClientId"), \
+                      TraceLoggingInt32(command, "Command"), TraceLoggingString(name, "Name"))
+#define PROBE_BROADCAST_START(sequence, sender_id) \
+    TraceLoggingWrite(chat_provider, "BroadcastStart", TraceLoggingInt64(sequence, "Sequence"), \
+                      TraceLoggingInt32(sender_id, "SenderId"))
+#define PROBE_BROADCAST_FINISH(sequence, recipients) \
+    TraceLoggingWrite(chat_provider, "BroadcastFinish", TraceLoggingInt64(sequence, "Sequence"), \
+                      TraceLoggingInt32(recipients, "Recipients"))
+#define PROBE_SEND_COMPLETE(client_id, frames, bytes, result) \
+    TraceLoggingWrite(chat_provider, "SendComplete", TraceLoggingInt32(client_id, "ClientId"), \
+                      TraceLoggingInt32(frames, "Frames"), TraceLoggingInt32(bytes, "Bytes"), \
+                      TraceLoggingInt32(result, "Result"))
+#define PROBE_DISCONNECT(client_id, username) \
+    TraceLoggingWrite(chat_provider, "Disconnect", TraceLoggingInt32(client_id, "ClientId"), \
+                      TraceLoggingString(username, "Username"))
+
+#else
+
+#define PROBE_ACCEPT(client_id, address, port) ((void)0)
+#define PROBE_AUTH_START(username) ((void)0)
+#define PROBE_AUTH_FINISH(username, result) ((void)0)
+#define PROBE_DECODE(client_id, type, command) ((void)0)
+#define PROBE_COMMAND_START(client_id, command, name) ((void)0)
+#define PROBE_COMMAND_FINISH(client_id, command, name) ((void)0)
+#define PROBE_BROADCAST_START(sequence, sender_id) ((void)0)
+#define PROBE_BROADCAST_FINISH(sequence, recipients) ((void)0)
+#define PROBE_SEND_COMPLETE(client_id, frames, bytes, result) ((void)0)
+#define PROBE_DISCONNECT(client_id, username) ((void)0)
+
+#endif // PROBES_ENABLED
+
+void probes_register(void);
+void probes_unregister(void);
+
+#endif // PROBES_H
@@ -0,0 +1,76 @@
+#include "ratelimit.h"
+#include <stdio.h>
+#include <string.h>
+
+// Defaults, used for any class the limits file does not mention.
+RateLimit rate_limits[RL_CLASS_COUNT] = {
+    { "frame",     600, 40, RL_DELAY },
+    { "chat",      120, 10, RL_DELAY },
+    { "broadcast",  12,  3, RL_DROP  },
+    { "auth",       10,  3, RL_DELAY },
+};
+
+// Load limits from a file with lines of the form:
+//     <class> <per_minute> <burst> <drop|delay>
+// Lines starting with '#' are comments. A missing file is not an error. Returns the number of classes configured.
+int rate_limits_load(const char* filename) {
+    FILE* file = fopen(filename, "r");
+    char line[128], name[32], policy[16];
+    int per_minute, burst;
+    int loaded = 0;
+
+    if (file == NULL) {
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        int found = 0;
+        if (line[0] == '#' ||
+            sscanf(line, "%31s %d %d %15s", name, &per_minute, &burst, policy) != 4) {
+            continue;
+        }
+        for (int i = 0; i < RL_CLASS_COUNT; i++) {
+            if (strcmp(rate_limits[i].name, name) == 0) {
+                rate_limits[i].per_minute = per_minute > 0 ? per_minute : 1;
+                rate_limits[i].burst = burst > 0 ? burst : 1;
+                rate_limits[i].policy = (strcmp(policy, "drop") == 0) ? RL_DROP : RL_DELAY;
+                loaded++;
+                found = 1;
+                break;
+            }
+        }
+        if (!found) {
+            printf("Unknown rate limit class in %s: %s\n", filename, name);
+        }
+    }
+
+    fclose(file);
+    return loaded;
+}
+
+// Start a bucket full.
+void token_bucket_init(TokenBucket* bucket, const RateLimit* limit, unsigned long long now_ms) {
+    bucket->tokens = (long long)limit->burst * 1000;
+    bucket->last_ms = now_ms;
+}
+
+// Take one token. Returns 0 if a token was available, otherwise the number
+// of milliseconds until one will be (nothing is taken in that case).
+unsigned int token_bucket_take(TokenBucket* bucket, const RateLimit* limit, unsigned long long now_ms) {
+    long long capacity = (long long)limit->burst * 1000;
+
+    if (now_ms > bucket->last_ms) {
+        // per_minute tokens per 60000 ms is per_minute / 60 thousandths per ms.
+        bucket->tokens += (long long)(now_ms - bucket->last_ms) * limit->per_minute / 60;
+        if (bucket->tokens > capacity) {
+            bucket->tokens = capacity;
+        }
+        bucket->last_ms = now_ms;
+    }
+
+    if (bucket->tokens >= 1000) {
+        bucket->tokens -= 1000;
+        return 0;
+    }
+    return (unsigned int)(((1000 - bucket->tokens) * 60 + limit->per_minute - 1) / limit->per_minute);
+}
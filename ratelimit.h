@@ -0,0 +1,38 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#define LIMITS_FILE "limits.txt"
+
+// Traffic classes, each with its own token bucket per connection.
+#define RL_FRAME 0       // Every frame from the connection
+#define RL_CHAT 1        // MSG_CHAT
+#define RL_BROADCAST 2   // Commands that broadcast to everyone (/shout, /joke, /roll)
+#define RL_AUTH 3        // Login and registration attempts
+#define RL_CLASS_COUNT 4
+
+// What to do with a frame that is over the limit.
+#define RL_DROP 0        // Discard it
+#define RL_DELAY 1       // Hold it until a token is available (up to RL_MAX_DELAY_MS)
+
+#define RL_MAX_DELAY_MS 2000
+
+typedef struct {
+    const char* name;    // Name used in the limits file
+    int per_minute;      // Refill rate in tokens per minute
+    int burst;           // Bucket capacity in tokens
+    int policy;          // RL_DROP or RL_DELAY
+} RateLimit;
+
+// Token bucket; tokens are kept in thousandths so refill stays in integers.
+typedef struct {
+    long long tokens;
+    unsigned long long last_ms;
+} TokenBucket;
+
+extern RateLimit rate_limits[RL_CLASS_COUNT];
+
+int rate_limits_load(const char* filename);
+void token_bucket_init(TokenBucket* bucket, const RateLimit* limit, unsigned long long now_ms);
+unsigned int token_bucket_take(TokenBucket* bucket, const RateLimit* limit, unsigned long long now_ms);
+
+#endif // RATELIMIT_H
@@ -0,0 +1,188 @@
+#include "sequencer.h"
+#include "bufpool.h"
+#include "metrics.h"
+
+// A slot is free for the producer that claims position p when its turn is
+// p, and holds that producer's broadcast once its turn is p + 1. Taking the
+// broadcast out hands the slot on to position p + SEQ_RING_SIZE.
+typedef struct {
+    volatile LONG64 turn;
+    Broadcast* broadcast;
+} SequencerSlot;
+
+static SequencerSlot ring[SEQ_RING_SIZE];
+static volatile LONG64 claim_position;  // Next position to claim; its sequence is one more
+static volatile LONG64 take_position;   // Next position the fan-out takes (fan-out only writes it)
+static BroadcastDelivery deliver_broadcast = NULL;
+static HANDLE published = NULL;         // Auto-reset; set after each publish
+static HANDLE fanout_thread = NULL;
+static volatile BOOL running = FALSE;
+static BufferPool broadcast_pool;       // Broadcasts of up to SEQ_POOLED_TEXT bytes
+static BOOL pool_ready = FALSE;
+
+// Start numbering after 'last' (0 for a fresh server, or where the previous
+// process stopped after a handoff). Nothing may be published yet.
+void sequencer_init(long long last, BroadcastDelivery deliver) {
+    claim_position = last;
+    take_position = last;
+    for (long long position = last; position < last + SEQ_RING_SIZE; position++) {
+        ring[position & SEQ_RING_MASK].turn = position;
+        ring[position & SEQ_RING_MASK].broadcast = NULL;
+    }
+    deliver_broadcast = deliver;
+    if (!pool_ready) {
+        buffer_pool_init(&broadcast_pool, (int)sizeof(Broadcast) + SEQ_POOLED_TEXT, SEQ_POOL_KEEP);
+        pool_ready = TRUE;
+    }
+}
+
+static Broadcast* broadcast_alloc(int text_length) {
+    if (text_length <= SEQ_POOLED_TEXT) {
+        return (Broadcast*)buffer_pool_get(&broadcast_pool);
+    }
+    metric_inc(METRIC_HEAP_ALLOCS);
+    return (Broadcast*)malloc(sizeof(Broadcast) + text_length);
+}
+
+static void broadcast_free(Broadcast* broadcast) {
+    if (broadcast->colored_length + broadcast->plain_length <= SEQ_POOLED_TEXT) {
+        buffer_pool_put(&broadcast_pool, broadcast);
+    } else {
+        free(broadcast);
+    }
+}
+
+// Number a broadcast and queue it for the fan-out. 'trace' may be NULL.
+// Returns its sequence number, or 0 if it could not be stored.
+long long sequencer_publish(int sender_id, const char* colored, int colored_length,
+                            const char* plain, int plain_length, const TraceStamps* trace) {
+    Broadcast* broadcast = broadcast_alloc(colored_length + plain_length);
+    SequencerSlot* slot;
+    LONG64 position;
+
+    if (broadcast == NULL) {
+        return 0;
+    }
+    broadcast->sender_id = sender_id;
+    broadcast->colored_length = colored_length;
+    broadcast->plain_length = plain_length;
+    broadcast->trace.receive = 0;
+    if (trace != NULL) {
+        broadcast->trace = *trace;
+    }
+    memcpy(broadcast->text, colored, colored_length);
+    memcpy(broadcast->text + colored_length, plain, plain_length);
+
+    position = claim_position;
+    for (;;) {
+        slot = &ring[position & SEQ_RING_MASK];
+        LONG64 turn = slot->turn;
+        if (turn == position) {
+            LONG64 seen = InterlockedCompareExchange64(&claim_position, position + 1, position);
+            if (seen == position) {
+                break;
+            }
+            position = seen;
+        } else if (turn < position) {
+            // Full: the fan-out has not taken the slot's previous broadcast yet.
+            SwitchToThread();
+            position = claim_position;
+        } else {
+            position = claim_position;  // Another producer got there first
+        }
+    }
+
+    broadcast->sequence = position + 1;
+    slot->broadcast = broadcast;
+    InterlockedExchange64(&slot->turn, position + 1);  // Publish, with a full barrier
+    if (published != NULL) {
+        SetEvent(published);
+    }
+    return broadcast->sequence;
+}
+
+// Deliver every broadcast that is ready, in order. Stops at the first
+// position whose producer has claimed it but not finished, so nothing is
+// ever delivered ahead of a lower number. Only one thread may drain.
+// Returns how many were delivered.
+int sequencer_drain(void) {
+    int count = 0;
+
+    for (;;) {
+        LONG64 position = take_position;
+        SequencerSlot* slot = &ring[position & SEQ_RING_MASK];
+        if (slot->turn != position + 1) {
+            return count;
+        }
+        Broadcast* broadcast = slot->broadcast;
+        slot->broadcast = NULL;
+        deliver_broadcast(broadcast);
+        broadcast_free(broadcast);
+        InterlockedExchange64(&slot->turn, position + SEQ_RING_SIZE);
+        InterlockedExchange64(&take_position, position + 1);
+        count++;
+    }
+}
+
+static DWORD WINAPI fanout(LPVOID arg) {
+    (void)arg;
+    // Broadcasts published before the thread started have set no event.
+    while (running) {
+        sequencer_drain();
+        WaitForSingleObject(published, INFINITE);
+    }
+    sequencer_drain();
+    return 0;
+}
+
+// Start the fan-out thread. Returns 0 on success.
+int sequencer_start(void) {
+    published = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (published == NULL) {
+        return 1;
+    }
+    running = TRUE;
+    fanout_thread = CreateThread(NULL, 0, fanout, NULL, 0, NULL);
+    if (fanout_thread == NULL) {
+        running = FALSE;
+        CloseHandle(published);
+        published = NULL;
+        return 1;
+    }
+    return 0;
+}
+
+// Deliver what is left and stop the fan-out thread.
+void sequencer_stop(void) {
+    if (fanout_thread == NULL) {
+        return;
+    }
+    running = FALSE;
+    SetEvent(published);
+    WaitForSingleObject(fanout_thread, INFINITE);
+    CloseHandle(fanout_thread);
+    CloseHandle(published);
+    fanout_thread = NULL;
+    published = NULL;
+}
+
+// Free the kept broadcast buffers, once nothing is published or drained.
+void sequencer_destroy(void) {
+    if (pool_ready) {
+        buffer_pool_destroy(&broadcast_pool);
+        pool_ready = FALSE;
+    }
+}
+
+// Wait until everything published so far has been delivered. Producers must
+// be held off by the caller, or this may never return.
+void sequencer_wait_idle(void) {
+    while (take_position != claim_position) {
+        Sleep(1);
+    }
+}
+
+// Sequence number of the newest broadcast handed to the recipients' queues.
+long long sequencer_delivered(void) {
+    return take_position;
+}
@@ -0,0 +1,44 @@
+#ifndef SEQUENCER_H
+#define SEQUENCER_H
+
+#include "common.h"
+
+// Puts every broadcast in one order. Handler threads publish broadcasts into
+// a lock-free multi-producer ring; claiming a slot assigns the broadcast the
+// next 64-bit sequence number. A single fan-out thread takes them out in
+// sequence order and queues each for every recipient, so all clients see
+// broadcasts in the same order, and publishers never wait for one another
+// or for the fan-out unless the ring is full.
+//
+// The simulator runs without the thread and calls sequencer_drain() itself.
+
+#define SEQ_RING_SIZE 4096              // Power of two
+#define SEQ_RING_MASK (SEQ_RING_SIZE - 1)
+
+// Broadcasts are stored in pooled buffers with room for this much text (both
+// variants); longer ones come from the heap and count in METRIC_HEAP_ALLOCS.
+#define SEQ_POOLED_TEXT (2 * (BUFFER_SIZE + 256))
+#define SEQ_POOL_KEEP 256               // Free broadcast buffers kept for reuse
+
+typedef struct {
+    long long sequence;
+    int sender_id;                      // Gets no copy; -1 for none
+    int colored_length;
+    int plain_length;
+    TraceStamps trace;                  // --trace: the request that caused it
+    char text[];                        // Colored variant, then plain
+} Broadcast;
+
+typedef void (*BroadcastDelivery)(const Broadcast* broadcast);
+
+void sequencer_init(long long last, BroadcastDelivery deliver);
+int sequencer_start(void);
+void sequencer_stop(void);
+void sequencer_destroy(void);
+long long sequencer_publish(int sender_id, const char* colored, int colored_length,
+                            const char* plain, int plain_length, const TraceStamps* trace);
+int sequencer_drain(void);
+void sequencer_wait_idle(void);
+long long sequencer_delivered(void);
+
+#endif // SEQUENCER_H
@@ -12,12 +12,28 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>   // offsetof
 #include <winsock2.h>
 #include <ws2tcpip.h>
 #include <windows.h>
 #include <time.h>     // Add time.h for time() function
 #include "auth.h"
 #include "common.h"
+#include "metrics.h"
+#include "handoff.h"
+#include "textproc.h"
+#include "filter.h"
+#include "filexfer.h"
+#include "lz.h"
+#include "federation.h"
+#include "discovery.h"
+#include "netio.h"
+#include "sim.h"
+#include "sequencer.h"
+#include "probes.h"
+#include "multicast.h"
+#include "bufpool.h"
+#include "names.h"
 
 // Remove pragma comment - we're using -lws2_32 in the Makefile
 
@@ -28,12 +44,40 @@
 Client *clients[MAX_CLIENTS] = { 0 };
 CRITICAL_SECTION clients_mutex;  // To synchronize access to the clients array.
 volatile BOOL server_running = TRUE;  // Flag to control the server loop.
+TimerWheel timer_wheel;          // Auth deadlines, heartbeats and idle timeouts.
+CRITICAL_SECTION timers_mutex;   // Guards timer_wheel; timer callbacks run holding it.
+Timer metrics_timer;             // Periodic metrics report.
+Timer filter_timer;              // Periodic check for filter changes.
+Timer snapshot_timer;            // Periodic snapshot of the user index.
+Timer multicast_timer;           // Multicast heartbeat.
+SOCKET server_socket = INVALID_SOCKET;  // The listening socket.
+const char* server_port = DEFAULT_PORT;
+volatile BOOL handoff_in_progress = FALSE;  // No new clients while a handoff runs.
+volatile BOOL handed_off = FALSE;  // Connections now belong to a new process.
+int io_backend = IO_THREADS;     // How client sockets are read (--io). IOCP stays opt-in until measured.
+HANDLE completion_port = NULL;   // IO_IOCP only.
+BufferPool inbound_pool;         // Receive buffers of clients with bytes waiting.
+FederationConfig federation;     // Links to other server nodes (--node, --link-port, --peer).
+BOOL beacon_enabled = TRUE;      // Advertise this server on the LAN (--no-beacon turns it off).
+BOOL trace_enabled = FALSE;      // Time every request through the server's stages (--trace).
+BOOL multicast_wanted = FALSE;  // Send broadcasts to a multicast group (--multicast).
+const char* multicast_group = MULTICAST_GROUP;  // --multicast-group
+int multicast_port = MULTICAST_PORT;            // --multicast-port
+unsigned int multicast_session_in = 0;  // --multicast-session: kept across a hot upgrade
+__thread const TraceStamps* current_trace;  // --trace: stamps of the frame this thread is handling
+__thread const char* batch_recipients;      // Whisper list of the MSG_BATCH entry being handled
 
-// Handler for Ctrl+C (SIGINT) to allow graceful shutdown.
+void upgrade_server(void);
+
+// Handler for Ctrl+C (SIGINT) to allow graceful shutdown, and Ctrl+Break
+// to hand everything over to a freshly started server.exe.
 BOOL WINAPI ConsoleHandler(DWORD signal) {
     if (signal == CTRL_C_EVENT) {
         printf("\nCtrl+C caught, shutting down server...\n");
         server_running = FALSE;
+    } else if (signal == CTRL_BREAK_EVENT) {
+        printf("\nCtrl+Break caught, upgrading server...\n");
+        upgrade_server();
     }
     return TRUE;
 }
@@ -102,21 +146,237 @@ SOCKET create_listening_socket(const char* port) {
     return listen_socket;
 }
 
-// Broadcast a message to all clients except the sender.
-void broadcast_message(int sender_id, const char* message) {
+// Send a buffer completely, retrying on partial sends.
+static int send_all(SOCKET socket, const char* data, int length) {
+    while (length > 0) {
+        int sent = send(socket, data, length, 0);
+        if (sent == SOCKET_ERROR) {
+            return SOCKET_ERROR;
+        }
+        data += sent;
+        length -= sent;
+    }
+    return 0;
+}
+
+// Outbound lane for each frame type.
+int frame_priority(int type) {
+    switch (type) {
+        case MSG_PRIVATE:
+            return PRIO_PRIVATE;
+        case MSG_CHAT:
+        case MSG_MULTICAST_START:  // Must stay behind the broadcasts sent over TCP
+        case MSG_REPAIR:
+            return PRIO_BROADCAST;
+        default:
+            return PRIO_CONTROL;  // Auth replies, system messages, pings
+    }
+}
+
+// Put a frame built for a client into the outbound lane for its type.
+int push_frame(Client* client, int type, OutFrame* frame, long long sequence) {
+    if (frame == NULL) {
+        fprintf(stderr, "Memory allocation failed for frame to client %d\n", client->id);
+        return SOCKET_ERROR;
+    }
+    outframe_set_sequence(frame, sequence);
+    if (current_trace != NULL) {
+        frame->trace = *current_trace;
+        frame->trace.enqueue = trace_now();
+    }
+    if (type == MSG_MULTICAST_START) {
+        frame->pinned = 1;  // Without it the client would hold every broadcast after it
+    }
+    if (outqueue_push(&client->outq, frame_priority(type), frame) == OUTQ_DROPPED_OLDEST) {
+        metric_inc(METRIC_BROADCAST_DROPPED);
+    }
+    return 0;
+}
+
+// send_frame() with the sequence number for the frame header given.
+int queue_frame(Client* client, int type, const char* payload, int length, long long sequence) {
+    OutFrame* frame;
+    if ((client->capabilities & CAP_COMPRESS) && length >= LZ_MIN_FRAME) {
+        frame = outframe_create_compressed(type, payload, length);
+    } else {
+        frame = outframe_create(type, payload, length);
+    }
+    return push_frame(client, type, frame, sequence);
+}
+
+// Queue one framed message (header + payload) for a client. The client's
+// writer thread sends it; higher priority lanes go first. Large payloads are
+// compressed for clients that support it.
+int send_frame(Client* client, int type, const char* payload, int length) {
+    return queue_frame(client, type, payload, length, sequencer_delivered());
+}
+
+// Queue a frame whose payload other clients' frames share; it is sent as
+// it is, never compressed.
+int send_shared_frame(Client* client, int type, SharedPayload* payload) {
+    return push_frame(client, type, outframe_create_shared(type, payload), sequencer_delivered());
+}
+
+// Fill in the time frames spent queued where they ask for it, and with
+// --trace, record the stages of the requests behind them once sent.
+void stamp_frames(OutFrame** frames, int count, long long now, int sent) {
+    for (int i = 0; i < count; i++) {
+        const TraceStamps* trace = &frames[i]->trace;
+        if (!sent && frames[i]->write_stamp != 0) {
+            int queued = (int)(now - trace->enqueue);
+            memcpy(frames[i]->data + frames[i]->write_stamp, &queued, sizeof(queued));
+        }
+        if (sent && trace_enabled && trace->receive != 0) {
+            stage_record(STAGE_PARSE, trace->parse - trace->receive);
+            stage_record(STAGE_WAIT, trace->dispatch - trace->parse);
+            stage_record(STAGE_DISPATCH, trace->enqueue - trace->dispatch);
+            stage_record(STAGE_WRITE, now - trace->enqueue);
+            stage_record(STAGE_TOTAL, now - trace->receive);
+        }
+    }
+}
+
+// Total size of a batch of frames, for the SendComplete probe.
+int frames_length(OutFrame** frames, int count) {
+    int length = 0;
+    for (int i = 0; i < count; i++) {
+        length += frames[i]->length + (frames[i]->shared != NULL ? frames[i]->shared->length : 0);
+    }
+    return length;
+}
+
+// Send a batch taken from a client's queue and free it. Frames queued
+// together go out in one gathering send call; file chunks go out on their
+// own through filexfer_transmit. Returns SOCKET_ERROR if the send failed.
+int send_frames(Client* client, OutFrame** frames, int count) {
+    WSABUF buffers[2 * OUTQ_SEND_BATCH];  // Header and shared payload for each frame at most
+    int result = 0;
+
+    if (frames[0]->length == 0) {
+        // Everything queued before the marker has been sent.
+        net->shutdown(client);
+    } else if (frames[0]->transfer != NULL) {
+        result = filexfer_transmit(client, frames[0]);
+    } else {
+        int used = 0;
+        for (int i = 0; i < count; i++) {
+            buffers[used].buf = frames[i]->data;
+            buffers[used++].len = (ULONG)frames[i]->length;
+            if (frames[i]->shared != NULL) {
+                buffers[used].buf = frames[i]->shared->data;
+                buffers[used++].len = (ULONG)frames[i]->shared->length;
+            }
+        }
+        stamp_frames(frames, count, trace_now(), 0);
+        result = net->send(client, buffers, used);
+        stamp_frames(frames, count, trace_now(), 1);
+        PROBE_SEND_COMPLETE(client->id, count, frames_length(frames, count), result);
+        metric_inc(METRIC_SEND_CALLS);
+        InterlockedExchangeAdd(&metrics[METRIC_FRAMES_SENT], count);
+    }
+    for (int i = 0; i < count; i++) {
+        outframe_free(frames[i]);
+    }
+    if (result == SOCKET_ERROR) {
+        fprintf(stderr, "send failed to client %d: %d\n", client->id, WSAGetLastError());
+    }
+    return result;
+}
+
+// Thread that drains a client's outbound queue into its socket.
+DWORD WINAPI client_writer(LPVOID lpParam) {
+    Client* client = (Client*)lpParam;
+    OutFrame* frames[OUTQ_SEND_BATCH];
+    int count;
+
+    while ((count = outqueue_pop_batch(&client->outq, frames, OUTQ_SEND_BATCH)) > 0) {
+        if (send_frames(client, frames, count) == SOCKET_ERROR) {
+            break;
+        }
+    }
+    return 0;
+}
+
+// OutQueue callback, with the queue locked: start a writer for a client
+// whose queue has just got a frame. The previous writer, if any, has left
+// its loop; only its handle remains.
+int start_writer(void* context) {
+    Client* client = (Client*)context;
+
+    if (client->writer != NULL) {
+        CloseHandle(client->writer);
+    }
+    client->writer = CreateThread(NULL, CLIENT_THREAD_STACK_SIZE, client_writer, (LPVOID)client,
+                                  STACK_SIZE_PARAM_IS_A_RESERVATION, NULL);
+    if (client->writer == NULL) {
+        return 0;  // The next frame tries again
+    }
+    metric_inc(METRIC_WRITER_STARTS);
+    return 1;
+}
+
+// Sequencer callback, on the fan-out thread: queue a broadcast for all local
+// clients except the sender. Clients that announced CAP_PLAIN get the plain
+// variant, everyone else the colored one. With --multicast the broadcast
+// goes to the group once, and clients that joined it get no TCP copy.
+void deliver_broadcast(const Broadcast* broadcast) {
+    const char* colored = broadcast->text;
+    const char* plain = broadcast->text + broadcast->colored_length;
+    int recipients = 0;
+
+    PROBE_BROADCAST_START(broadcast->sequence, broadcast->sender_id);
+    if (multicast_enabled()) {
+        multicast_send(broadcast);
+    }
+    current_trace = broadcast->trace.receive != 0 ? &broadcast->trace : NULL;
     EnterCriticalSection(&clients_mutex);
     for (int i = 0; i < MAX_CLIENTS; i++) {
         if (clients[i] != NULL && clients[i]->socket != INVALID_SOCKET) {
             // Optionally, skip sending back to the sender.
-            if (clients[i]->id == sender_id)
+            if (clients[i]->id == broadcast->sender_id)
                 continue;
-            int sendResult = send(clients[i]->socket, message, (int)strlen(message), 0);
-            if (sendResult == SOCKET_ERROR) {
-                fprintf(stderr, "send failed to client %d: %d\n", clients[i]->id, WSAGetLastError());
+            if (clients[i]->multicast == MULTICAST_JOINING) {
+                // Everything before this broadcast went over TCP.
+                queue_frame(clients[i], MSG_MULTICAST_START, "", 0, broadcast->sequence);
+                clients[i]->multicast = MULTICAST_ON;
             }
+            if (clients[i]->multicast == MULTICAST_ON) {
+                recipients++;
+                continue;
+            }
+            if (clients[i]->capabilities & CAP_PLAIN) {
+                queue_frame(clients[i], MSG_CHAT, plain, broadcast->plain_length, broadcast->sequence);
+            } else {
+                queue_frame(clients[i], MSG_CHAT, colored, broadcast->colored_length, broadcast->sequence);
+            }
+            recipients++;
         }
     }
     LeaveCriticalSection(&clients_mutex);
+    current_trace = NULL;
+    PROBE_BROADCAST_FINISH(broadcast->sequence, recipients);
+}
+
+// Broadcast to all local clients except the sender, in the one order the
+// sequencer gives every broadcast.
+void broadcast_local(int sender_id, const char* colored, int colored_length,
+                     const char* plain, int plain_length) {
+    if (sequencer_publish(sender_id, colored, colored_length, plain, plain_length, current_trace) == 0) {
+        fprintf(stderr, "Memory allocation failed for a broadcast\n");
+    }
+}
+
+// Broadcast to everyone except the sender, on this node and linked nodes.
+void broadcast_variants(int sender_id, const char* colored, int colored_length,
+                        const char* plain, int plain_length) {
+    broadcast_local(sender_id, colored, colored_length, plain, plain_length);
+    federation_broadcast(colored, colored_length, plain, plain_length);
+}
+
+// Broadcast a message to all clients except the sender.
+void broadcast_message(int sender_id, const char* message) {
+    int length = (int)strlen(message);
+    broadcast_variants(sender_id, message, length, message, length);
 }
 
 // Find client by username
@@ -134,42 +394,88 @@ Client* find_client_by_username(const char* username) {
 void send_system_message(Client* client, const char* message) {
     char system_msg[BUFFER_SIZE];
     snprintf(system_msg, BUFFER_SIZE, "[SYSTEM] %s", message);
-    send(client->socket, system_msg, strlen(system_msg), 0);
+    send_frame(client, MSG_SYSTEM, system_msg, (int)strlen(system_msg));
 }
 
-// Send private message
-void send_private_message(Client* sender, Client* receiver, const char* message) {
+// Federation handlers: deliver what linked nodes relay to local users.
+void node_broadcast(const char* colored, int colored_length, const char* plain, int plain_length) {
+    broadcast_local(-1, colored, colored_length, plain, plain_length);
+}
+
+int node_whisper(const char* from, const char* to, const char* text) {
     char private_msg[BUFFER_SIZE];
-    
-    // Format for receiver
-    snprintf(private_msg, BUFFER_SIZE, "[PM from %s] %s", sender->username, message);
-    send(receiver->socket, private_msg, strlen(private_msg), 0);
-    
-    // Format for sender (confirmation)
-    snprintf(private_msg, BUFFER_SIZE, "[PM to %s] %s", receiver->username, message);
-    send(sender->socket, private_msg, strlen(private_msg), 0);
+
+    EnterCriticalSection(&clients_mutex);
+    Client* target = find_client_by_username(to);
+    if (target != NULL) {
+        snprintf(private_msg, BUFFER_SIZE, "[PM from %s] %s", from, text);
+        send_frame(target, MSG_PRIVATE, private_msg, (int)strlen(private_msg));
+    }
+    LeaveCriticalSection(&clients_mutex);
+    return target != NULL;
+}
+
+void node_notice(const char* to, const char* text) {
+    EnterCriticalSection(&clients_mutex);
+    Client* target = find_client_by_username(to);
+    if (target != NULL) {
+        send_system_message(target, text);
+    }
+    LeaveCriticalSection(&clients_mutex);
+}
+
+int node_local_users(char* buffer, int size) {
+    int length = 0;
+
+    EnterCriticalSection(&clients_mutex);
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i] != NULL && clients[i]->authenticated) {
+            int name_length = (int)strlen(clients[i]->username) + 1;
+            if (length + name_length > size) {
+                break;
+            }
+            memcpy(buffer + length, clients[i]->username, name_length);
+            length += name_length;
+        }
+    }
+    LeaveCriticalSection(&clients_mutex);
+    return length;
 }
 
-// Get a list of online users
-void get_online_users(char* buffer) {
+// Connected clients, for discovery beacons.
+int server_load(void) {
     int count = 0;
-    strcpy(buffer, "Online users: ");
-    
+
     EnterCriticalSection(&clients_mutex);
     for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i] != NULL) {
+            count++;
+        }
+    }
+    LeaveCriticalSection(&clients_mutex);
+    return count;
+}
+
+// Get a list of online users, here and on linked nodes. A list longer than
+// 'size' is cut short and ends in "...".
+void get_online_users(char* buffer, int size) {
+    int count = 0;
+    int length = snprintf(buffer, size, "Online users: ");
+
+    EnterCriticalSection(&clients_mutex);
+    for (int i = 0; i < MAX_CLIENTS && length < size - 1; i++) {
         if (clients[i] != NULL && clients[i]->authenticated) {
+            length += snprintf(buffer + length, size - length, "%s%s", count > 0 ? ", " : "", clients[i]->username);
             count++;
-            strcat(buffer, clients[i]->username);
-            strcat(buffer, ", ");
         }
     }
     LeaveCriticalSection(&clients_mutex);
-    
-    // Remove the trailing comma and space
-    if (count > 0) {
-        buffer[strlen(buffer) - 2] = '\0';
-    } else {
-        strcat(buffer, "No users online");
+
+    count += federation_online(buffer, size);
+    if (count == 0) {
+        snprintf(buffer + length, size - length, "No users online");
+    } else if ((int)strlen(buffer) >= size - 1) {
+        memcpy(buffer + size - 4, "...", 4);  // More than fit
     }
 }
 
@@ -191,421 +497,1961 @@ void get_random_joke(char* buffer, const char* username) {
     snprintf(buffer, BUFFER_SIZE, "[JOKE from %s] %s", username, jokes[random_index]);
 }
 
-// Apply ANSI color to a message
-void apply_color(char* colored_msg, const char* original_msg, const char* color, int max_size) {
-    const char* color_code;
-    
-    if (strcmp(color, "red") == 0) color_code = "\033[31m";
-    else if (strcmp(color, "green") == 0) color_code = "\033[32m";
-    else if (strcmp(color, "yellow") == 0) color_code = "\033[33m";
-    else if (strcmp(color, "blue") == 0) color_code = "\033[34m";
-    else if (strcmp(color, "magenta") == 0) color_code = "\033[35m";
-    else if (strcmp(color, "cyan") == 0) color_code = "\033[36m";
-    else color_code = "\033[0m"; // default/white
-    
-    snprintf(colored_msg, max_size, "%s%s\033[0m", color_code, original_msg);
+// Look up a color by its /color name. Returns -1 if there is no such color.
+int find_color(const char* name) {
+    for (int i = 0; i < COLOR_COUNT; i++) {
+        if (strcmp(color_info[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
 }
 
-// Process commands from clients
-void process_command(Client* client, Message* msg) {
-    char response[BUFFER_SIZE];
-    
-    switch (msg->command) {
-        case CMD_HELP:
-            snprintf(response, BUFFER_SIZE, 
-                "Available commands:\n"
-                "/help - Show this help message\n"
-                "/username <new_username> - Change your username\n"
-                "/password <new_password> - Change your password\n"
-                "/delete - Delete your account\n"
-                "/shout <message> - Send a message in UPPERCASE\n"
-                "/whisper <username> <message> - Send a private message\n"
-                "/w <username> <message> - Shorthand for whisper\n"
-                "/color <color> - Change your message color (not implemented in console)\n"
-                "/roll - Roll a random number\n"
-                "/online - Show all online users\n"
-                "/clear - Clear the chat window\n"
-                "/joke - Tell a random joke"
-            );
-            send_system_message(client, response);
-            break;
-            
-        case CMD_USERNAME:
-            {
-                char new_username[32];
-                char current_password[32];
-                
-                // Split the content into new_username and current_password
-                // Format expected: "new_username current_password"
-                if (sscanf(msg->content, "%s %s", new_username, current_password) != 2) {
-                    send_system_message(client, "Usage: /username <new_username> <current_password>");
-                    break;
-                }
-                
-                if (strlen(new_username) < 3) {
-                    send_system_message(client, "Username must be at least 3 characters");
-                    break;
-                }
-                
-                // Check if name is taken by another online user
-                if (find_client_by_username(new_username) != NULL) {
-                    send_system_message(client, "Username already taken");
-                    break;
-                }
-                
-                // Verify the current password before changing the username
-                if (authenticate_user(client->username, current_password) != AUTH_SUCCESS) {
-                    send_system_message(client, "Current password is incorrect");
-                    break;
-                }
-                
-                int result = update_username(client->username, current_password, new_username);
-                
-                if (result == AUTH_SUCCESS) {
-                    snprintf(response, BUFFER_SIZE, "Username changed from %s to %s", client->username, new_username);
-                    send_system_message(client, response);
-                    
-                    // Broadcast the name change
-                    snprintf(response, BUFFER_SIZE, "User %s is now known as %s", client->username, new_username);
-                    broadcast_message(-1, response);
-                    
-                    // Update client's username
-                    strcpy(client->username, new_username);
-                } else if (result == AUTH_USER_EXISTS) {
-                    send_system_message(client, "Username already exists");
-                } else {
-                    send_system_message(client, "Failed to change username");
-                }
-            }
-            break;
-            
-        case CMD_PASSWORD:
-            {
-                char new_password[32];
-                char current_password[32];
-                
-                // Split the content into current_password and new_password
-                // Format expected: "current_password new_password"
-                if (sscanf(msg->content, "%s %s", current_password, new_password) != 2) {
-                    send_system_message(client, "Usage: /password <current_password> <new_password>");
-                    break;
-                }
-                
-                if (strlen(new_password) < 4) {
-                    send_system_message(client, "New password must be at least 4 characters");
-                    break;
-                }
-                
-                int result = update_password(client->username, current_password, new_password);
-                
-                if (result == AUTH_SUCCESS) {
-                    send_system_message(client, "Password changed successfully");
-                } else {
-                    send_system_message(client, "Failed to change password. Check your current password.");
-                }
-            }
-            break;
-            
-        case CMD_DELETE:
-            {
-                char password[32];
-                strcpy(password, msg->content);
-                
-                int result = delete_account(client->username, password);
-                
-                if (result == AUTH_SUCCESS) {
-                    send_system_message(client, "Your account has been deleted. You will be disconnected.");
-                    // Force disconnect
-                    client->authenticated = 0;
-                } else {
-                    send_system_message(client, "Failed to delete account. Check your password.");
-                }
-            }
-            break;
-            
-        case CMD_SHOUT:
-            {
-                char shout_msg[BUFFER_SIZE];
-                // Convert message to uppercase
-                strncpy(shout_msg, msg->content, BUFFER_SIZE-1);
-                shout_msg[BUFFER_SIZE-1] = '\0';
-                for (int i = 0; shout_msg[i]; i++) {
-                    shout_msg[i] = toupper((unsigned char)shout_msg[i]);
-                }
-                
-                // Format the message
-                snprintf(response, BUFFER_SIZE, "%s SHOUTS: %s", client->username, shout_msg);
-                broadcast_message(-1, response);
-                
-                // Send back to the sender too
-                send(client->socket, response, strlen(response), 0);
-            }
-            break;
-            
-        case CMD_WHISPER:
-            {
-                Client* target = find_client_by_username(msg->target);
-                
-                if (target != NULL) {
-                    send_private_message(client, target, msg->content);
-                } else {
-                    sprintf(response, "User '%s' is not online", msg->target);
-                    send_system_message(client, response);
-                }
-            }
-            break;
-            
-        case CMD_COLOR:
-            {
-                strncpy(client->color, msg->content, 9);
-                client->color[9] = '\0'; // Ensure null-termination
-                
-                // List of supported colors
-                const char* supported_colors = "red, green, blue, yellow, magenta, cyan, white";
-                
-                snprintf(response, BUFFER_SIZE, 
-                    "Your message color has been set to %s. Supported colors: %s", 
-                    client->color, supported_colors);
-                send_system_message(client, response);
-                
-                // Send a sample colored message
-                char colored_msg[BUFFER_SIZE];
-                snprintf(response, BUFFER_SIZE, "This is a sample message in your chosen color.");
-                apply_color(colored_msg, response, client->color, BUFFER_SIZE);
-                send(client->socket, colored_msg, strlen(colored_msg), 0);
-            }
-            break;
-            
-        case CMD_ROLL:
-            {
-                int roll = rand() % 100 + 1;
-                snprintf(response, BUFFER_SIZE, "%s rolled %d (1-100)", client->username, roll);
-                broadcast_message(-1, response);
-            }
-            break;
-            
-        case CMD_ONLINE:
-            {
-                get_online_users(response);
-                send_system_message(client, response);
-            }
-            break;
-            
-        case CMD_JOKE:
-            {
-                get_random_joke(response, client->username);
-                broadcast_message(-1, response);
-                send(client->socket, response, strlen(response), 0);
-            }
-            break;
-            
-        default:
-            send_system_message(client, "Unknown command. Type /help for a list of commands.");
-            break;
+// Wrap a line in a color's escape and a reset, in place. 'body' must have
+// COLOR_CODE_MAX bytes free in front of it and room for COLOR_RESET after
+// 'length'. Returns the start of the colored line and stores its length.
+char* render_color(char* body, int length, int color, int* colored_length) {
+    const ColorInfo* info = &color_info[color];
+
+    if (info->code_length == 0) {
+        *colored_length = length;
+        return body;
     }
+    memcpy(body - info->code_length, info->code, info->code_length);
+    memcpy(body + length, COLOR_RESET, sizeof(COLOR_RESET) - 1);
+    *colored_length = info->code_length + length + (int)sizeof(COLOR_RESET) - 1;
+    return body - info->code_length;
 }
 
-// Thread function to handle an individual client.
-DWORD WINAPI handle_client(LPVOID lpParam) {
-    Client* client = (Client*)lpParam;
-    Message msg, response;
-    int recvResult;
-    client->authenticated = 0;
-    strcpy(client->username, "");
-    strcpy(client->color, "default"); // Default message color
+// A local user logged in or out: update the completion index and tell
+// linked nodes.
+void user_joined(const char* username) {
+    names_online_add(username);
+    federation_user_joined(username);
+}
 
-    printf("Client %d connected.\n", client->id);
-    while (server_running) {
-        ZeroMemory(&msg, sizeof(Message));
-        recvResult = recv(client->socket, (char*)&msg, sizeof(Message), 0);
-        
-        if (recvResult > 0) {
-            printf("Received message type: %d from client %d\n", msg.type, client->id);
-            
-            // Skip commands from unauthenticated clients, except auth commands
-            if (!client->authenticated && msg.type != MSG_AUTH && msg.type != MSG_REGISTER) {
-                ZeroMemory(&response, sizeof(Message));
-                strcpy(response.content, "Please login first");
-                send(client->socket, (char*)&response, sizeof(Message), 0);
-                continue;
-            }
+void user_left(const char* username) {
+    names_online_remove(username);
+    federation_user_left(username);
+}
 
-            switch (msg.type) {
-                case MSG_AUTH:
-                    printf("Auth attempt with username: %s\n", msg.username);
-                    ZeroMemory(&response, sizeof(Message));
-                    
-                    if (authenticate_user(msg.username, msg.content) == AUTH_SUCCESS) {
-                        strcpy(client->username, msg.username);
-                        client->authenticated = 1;
-                        strcpy(response.content, "Login successful");
-                        send(client->socket, (char*)&response, sizeof(Message), 0);
-                        printf("Client %d authenticated as %s\n", client->id, client->username);
-                    } else {
-                        strcpy(response.content, "Login failed");
-                        send(client->socket, (char*)&response, sizeof(Message), 0);
-                        printf("Authentication failed for username: %s\n", msg.username);
-                    }
-                    break;
+// Answer MSG_COMPLETE: the prefix, then each online user whose name starts
+// with it, all null-terminated. Names come from the index, not the client list.
+void complete_names(Client* client, const Message* msg) {
+    char prefix[NAMES_MAX_LENGTH + 1];
+    const char* names[COMPLETE_MAX_RESULTS];
+    char* reply = arena_alloc(&client->arena, BUFFER_SIZE);
 
-                case MSG_REGISTER:
-                    printf("Registration attempt for username: %s\n", msg.username);
-                    ZeroMemory(&response, sizeof(Message));
-                    
-                    int regResult = register_user(msg.username, msg.content);
-                    if (regResult == AUTH_SUCCESS) {
-                        strcpy(response.content, "Registration successful");
-                        send(client->socket, (char*)&response, sizeof(Message), 0);
-                        printf("New user registered: %s\n", msg.username);
-                    } else if (regResult == AUTH_USER_EXISTS) {
-                        strcpy(response.content, "Username already exists");
-                        send(client->socket, (char*)&response, sizeof(Message), 0);
-                        printf("Registration failed - username exists: %s\n", msg.username);
-                    } else {
-                        strcpy(response.content, "Registration failed");
-                        send(client->socket, (char*)&response, sizeof(Message), 0);
-                        printf("Registration failed for username: %s\n", msg.username);
-                    }
-                    break;
+    snprintf(prefix, sizeof(prefix), "%.*s", NAMES_MAX_LENGTH, msg->content);
+    int length = (int)strlen(prefix) + 1;
+    memcpy(reply, prefix, length);
+    int count = names_complete(prefix, names, COMPLETE_MAX_RESULTS);
+    for (int i = 0; i < count; i++) {
+        int name_length = (int)strlen(names[i]) + 1;
+        memcpy(reply + length, names[i], name_length);
+        length += name_length;
+    }
+    send_frame(client, MSG_COMPLETE, reply, length);
+}
 
-                case MSG_CHAT:
-                    if (client->authenticated) {
-                        char formatted_msg[BUFFER_SIZE + 50];
-                        char colored_msg[BUFFER_SIZE + 100];  // Extra space for color codes
-                        
-                        snprintf(formatted_msg, sizeof(formatted_msg), "%s: %s", client->username, msg.content);
-                        printf("%s\n", formatted_msg);
-                        
-                        // Apply the client's preferred color if set
-                        if (strcmp(client->color, "default") != 0) {
-                            apply_color(colored_msg, formatted_msg, client->color, sizeof(colored_msg));
-                            broadcast_message(client->id, colored_msg);
-                        } else {
-                            broadcast_message(client->id, formatted_msg);
-                        }
-                    }
-                    break;
-                
-                case MSG_COMMAND:
-                    if (client->authenticated) {
-                        process_command(client, &msg);
-                    }
-                    break;
-                
-                default:
-                    // Unknown message type
-                    printf("Unknown message type: %d\n", msg.type);
-                    break;
+// Send a private message to every user in 'recipients', names separated by
+// commas. Local users are found in one pass over the client list and share
+// one encoded frame; the others are tried on linked nodes. The sender gets
+// one reply that covers every name.
+void whisper(Client* client, const char* recipients, const char* text) {
+    char names[WHISPER_MAX_RECIPIENTS][32];
+    int reached[WHISPER_MAX_RECIPIENTS] = { 0 };
+    int count = 0;
+
+    // Split the list, leaving out empty and repeated names.
+    for (const char* name = recipients; *name != '\0' && count < WHISPER_MAX_RECIPIENTS;) {
+        int length = (int)strcspn(name, ",");
+        if (length > 0 && length < 32) {
+            memcpy(names[count], name, length);
+            names[count][length] = '\0';
+            int repeated = 0;
+            for (int j = 0; j < count && !repeated; j++) {
+                repeated = strcmp(names[j], names[count]) == 0;
             }
-        } else if (recvResult == 0) {
-            // Connection closed by client.
-            printf("Client %d disconnected.\n", client->id);
-            break;
-        } else {
-            fprintf(stderr, "recv failed from client %d: %d\n", client->id, WSAGetLastError());
-            break;
+            count += !repeated;
         }
+        name += length + (name[length] == ',');
+    }
+    if (count == 0) {
+        send_system_message(client, "Usage: /whisper <user>[,<user>...] <message>");
+        return;
     }
 
-    // Remove the client from the global list.
+    char* line = arena_alloc(&client->arena, BUFFER_SIZE);
+    snprintf(line, BUFFER_SIZE, "[PM from %s] %s", client->username, text);
+    SharedPayload* payload = shared_payload_create(line, (int)strlen(line));
+    if (payload == NULL) {
+        fprintf(stderr, "Memory allocation failed for a whisper\n");
+        return;
+    }
+
+    // Hold the list lock so no recipient can disconnect mid-send.
     EnterCriticalSection(&clients_mutex);
     for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (clients[i] == client) {
-            clients[i] = NULL;
-            break;
+        if (clients[i] == NULL || !clients[i]->authenticated) {
+            continue;
+        }
+        for (int j = 0; j < count; j++) {
+            if (!reached[j] && strcmp(clients[i]->username, names[j]) == 0) {
+                send_shared_frame(clients[i], MSG_PRIVATE, payload);
+                reached[j] = 1;
+                break;
+            }
         }
     }
     LeaveCriticalSection(&clients_mutex);
+    shared_payload_release(payload);
 
-    closesocket(client->socket);
-    free(client);
-    return 0;
-}
+    // The rest may be on linked nodes.
+    for (int j = 0; j < count; j++) {
+        if (!reached[j]) {
+            reached[j] = federation_whisper(client->username, names[j], text);
+        }
+    }
 
-int main(int argc, char *argv[]) {
-    const char* port = DEFAULT_PORT;
-    if (argc > 1) {
-        port = argv[1];  // Use port provided as argument.
+    // "[PM to a, b] text", then the names nobody answered to.
+    char* sent = arena_alloc(&client->arena, 2 * BUFFER_SIZE);
+    char* missing = arena_alloc(&client->arena, BUFFER_SIZE);
+    int sent_length = 0, missing_length = 0;
+    for (int j = 0; j < count; j++) {
+        if (reached[j]) {
+            sent_length += snprintf(sent + sent_length, BUFFER_SIZE - sent_length, "%s%s",
+                                    sent_length > 0 ? ", " : "[PM to ", names[j]);
+        } else {
+            missing_length += snprintf(missing + missing_length, BUFFER_SIZE - missing_length, "%s%s",
+                                       missing_length > 0 ? ", " : "", names[j]);
+        }
+    }
+    if (sent_length > 0) {
+        sent_length += snprintf(sent + sent_length, 2 * BUFFER_SIZE - sent_length, "] %s", text);
+        if (missing_length > 0) {
+            snprintf(sent + sent_length, 2 * BUFFER_SIZE - sent_length, " (not online: %s)", missing);
+        }
+        send_frame(client, MSG_PRIVATE, sent, (int)strlen(sent));
+    } else if (count == 1) {
+        snprintf(sent, BUFFER_SIZE, "User '%.31s' is not online", names[0]);
+        send_system_message(client, sent);
+    } else {
+        snprintf(sent, BUFFER_SIZE, "Not online: %s", missing);
+        send_system_message(client, sent);
     }
+}
 
-    // Seed random number generator for dice rolls and jokes
-    srand(time(NULL));
+// Command handlers. Each receives an authenticated client and its MSG_COMMAND.
+// Scratch buffers come from the client's arena, which is reset after each batch.
+typedef void (*CommandHandler)(Client* client, Message* msg);
 
-    // Set up the Ctrl+C handler.
-    if (!SetConsoleCtrlHandler(ConsoleHandler, TRUE)) {
-        fprintf(stderr, "Could not set control handler\n");
-        return 1;
-    }
+// /help text, built from the command table.
+void command_help(Client* client, Message* msg) {
+    char* response = arena_alloc(&client->arena, BUFFER_SIZE);
+    int length = snprintf(response, BUFFER_SIZE, "Available commands:");
+    (void)msg;
 
-    if (initialize_winsock() != 0) {
-        return 1;
+    for (int id = 1; id < CMD_COUNT && length < BUFFER_SIZE; id++) {
+        const CommandInfo* info = &command_info[id];
+        length += snprintf(response + length, BUFFER_SIZE - length, "\n/%s%s%s - %s",
+            info->name, info->usage[0] ? " " : "", info->usage, info->help);
     }
+#define ALIAS_HELP(alias, id) \
+    if (length < BUFFER_SIZE) { \
+        length += snprintf(response + length, BUFFER_SIZE - length, "\n/%s%s%s - Shorthand for %s", \
+            alias, command_info[id].usage[0] ? " " : "", command_info[id].usage, command_info[id].name); \
+    }
+    COMMAND_ALIASES(ALIAS_HELP)
+#undef ALIAS_HELP
+    send_system_message(client, response);
+}
 
-    SOCKET listen_socket = create_listening_socket(port);
-    if (listen_socket == INVALID_SOCKET) {
-        WSACleanup();
-        return 1;
+void command_username(Client* client, Message* msg) {
+    char* response = arena_alloc(&client->arena, BUFFER_SIZE);
+    char new_username[32];
+    char current_password[32];
+    
+    // Split the content into new_username and current_password
+    // Format expected: "new_username current_password"
+    if (sscanf(msg->content, "%31s %31s", new_username, current_password) != 2) {
+        send_system_message(client, "Usage: /username <new_username> <current_password>");
+        return;
+    }
+    
+    if (strlen(new_username) < 3) {
+        send_system_message(client, "Username must be at least 3 characters");
+        return;
     }
 
-    // Initialize critical section for managing client list.
-    InitializeCriticalSection(&clients_mutex);
+    if (!text_is_clean(new_username, sizeof(new_username))) {
+        send_system_message(client, "Usernames cannot contain control characters or invalid UTF-8");
+        return;
+    }
+    
+    // Check if name is taken by another online user
+    if (find_client_by_username(new_username) != NULL) {
+        send_system_message(client, "Username already taken");
+        return;
+    }
+    
+    // Verify the current password before changing the username
+    if (authenticate_user(client->username, current_password) != AUTH_SUCCESS) {
+        send_system_message(client, "Current password is incorrect");
+        return;
+    }
+    
+    int result = update_username(client->username, current_password, new_username);
+    
+    if (result == AUTH_SUCCESS) {
+        snprintf(response, BUFFER_SIZE, "Username changed from %s to %s", client->username, new_username);
+        send_system_message(client, response);
+        
+        // Broadcast the name change
+        snprintf(response, BUFFER_SIZE, "User %s is now known as %s", client->username, new_username);
+        broadcast_message(-1, response);
+        
+        // Update client's username
+        user_left(client->username);
+        client->username = name_intern(new_username);
+        user_joined(client->username);
+    } else if (result == AUTH_USER_EXISTS) {
+        send_system_message(client, "Username already exists");
+    } else {
+        send_system_message(client, "Failed to change username");
+    }
+}
 
-    printf("Server: Listening on port %s...\n", port);
+void command_password(Client* client, Message* msg) {
+    char new_password[32];
+    char current_password[32];
+    
+    // Split the content into current_password and new_password
+    // Format expected: "current_password new_password"
+    if (sscanf(msg->content, "%31s %31s", current_password, new_password) != 2) {
+        send_system_message(client, "Usage: /password <current_password> <new_password>");
+        return;
+    }
+    
+    if (strlen(new_password) < 4) {
+        send_system_message(client, "New password must be at least 4 characters");
+        return;
+    }
+    
+    int result = update_password(client->username, current_password, new_password);
+    
+    if (result == AUTH_SUCCESS) {
+        send_system_message(client, "Password changed successfully");
+    } else {
+        send_system_message(client, "Failed to change password. Check your current password.");
+    }
+}
+
+void command_delete(Client* client, Message* msg) {
+    char password[32];
+    strncpy(password, msg->content, sizeof(password) - 1);
+    password[sizeof(password) - 1] = '\0';
+    
+    int result = delete_account(client->username, password);
+    
+    if (result == AUTH_SUCCESS) {
+        send_system_message(client, "Your account has been deleted. You will be disconnected.");
+        // Force disconnect
+        user_left(client->username);
+        client->authenticated = 0;
+    } else {
+        send_system_message(client, "Failed to delete account. Check your password.");
+    }
+}
+
+void command_shout(Client* client, Message* msg) {
+    char* response = arena_alloc(&client->arena, BUFFER_SIZE);
+    char* shout_msg = arena_alloc(&client->arena, BUFFER_SIZE);
+    // Convert message to uppercase
+    int length = text_length(msg->content, BUFFER_SIZE - 1);
+    memcpy(shout_msg, msg->content, length);
+    shout_msg[length] = '\0';
+    text_to_upper(shout_msg, length);
+    
+    // Format the message
+    snprintf(response, BUFFER_SIZE, "%s SHOUTS: %s", client->username, shout_msg);
+    broadcast_message(-1, response);
+    
+    // Send back to the sender too
+    send_frame(client, MSG_CHAT, response, (int)strlen(response));
+}
+
+void command_whisper(Client* client, Message* msg) {
+    whisper(client, batch_recipients != NULL ? batch_recipients : msg->target, msg->content);
+}
+
+void command_color(Client* client, Message* msg) {
+    char* response = arena_alloc(&client->arena, BUFFER_SIZE);
+    char supported_colors[128];
+    int length = 0;
+
+    // List of supported colors
+    for (int i = 0; i < COLOR_COUNT; i++) {
+        length += snprintf(supported_colors + length, sizeof(supported_colors) - length,
+            "%s%s", i ? ", " : "", color_info[i].name);
+    }
+
+    int color = find_color(msg->content);
+    if (color < 0) {
+        snprintf(response, BUFFER_SIZE, "Unknown color '%.20s'. Supported colors: %s",
+            msg->content, supported_colors);
+        send_system_message(client, response);
+        return;
+    }
+    client->color = color;
+    
+    snprintf(response, BUFFER_SIZE, 
+        "Your message color has been set to %s. Supported colors: %s", 
+        color_info[color].name, supported_colors);
+    send_system_message(client, response);
+    
+    // Send a sample colored message
+    char sample[COLOR_CODE_MAX + 64];
+    char* body = sample + COLOR_CODE_MAX;
+    int sample_length = snprintf(body, 48, "This is a sample message in your chosen color.");
+    char* colored = body;
+    if (!(client->capabilities & CAP_PLAIN)) {
+        colored = render_color(body, sample_length, color, &sample_length);
+    }
+    send_frame(client, MSG_CHAT, colored, sample_length);
+}
+
+void command_roll(Client* client, Message* msg) {
+    char* response = arena_alloc(&client->arena, BUFFER_SIZE);
+    int roll = rand() % 100 + 1;
+    (void)msg;
+    snprintf(response, BUFFER_SIZE, "%s rolled %d (1-100)", client->username, roll);
+    broadcast_message(-1, response);
+}
+
+void command_online(Client* client, Message* msg) {
+    char* response = arena_alloc(&client->arena, BUFFER_SIZE);
+    (void)msg;
+    get_online_users(response, BUFFER_SIZE);
+    send_system_message(client, response);
+}
+
+// /ping: echo the client's clock with the time the request spent in each
+// stage. The writer fills in how long the reply waited in the queue.
+void command_ping(Client* client, Message* msg) {
+    PingReply reply;
+    OutFrame* frame;
+    long long now = trace_now();
+
+    reply.client_time = strtoll(msg->content, NULL, 10);
+    reply.parse = (int)(client->trace.parse - client->trace.receive);
+    reply.wait = (int)(client->trace.dispatch - client->trace.parse);
+    reply.dispatch = (int)(now - client->trace.dispatch);
+    reply.write = 0;
+    frame = outframe_create(MSG_PING_REPLY, (const char*)&reply, (int)sizeof(reply));
+    if (frame == NULL) {
+        return;
+    }
+    frame->trace = client->trace;
+    frame->trace.enqueue = now;
+    frame->write_stamp = (int)(sizeof(FrameHeader) + offsetof(PingReply, write));
+    outframe_set_sequence(frame, sequencer_delivered());
+    outqueue_push(&client->outq, PRIO_CONTROL, frame);
+}
+
+void command_joke(Client* client, Message* msg) {
+    char* response = arena_alloc(&client->arena, BUFFER_SIZE);
+    (void)msg;
+    get_random_joke(response, client->username);
+    broadcast_message(-1, response);
+    send_frame(client, MSG_CHAT, response, (int)strlen(response));
+}
+
+// Dense dispatch table indexed by command id. Commands the client handles
+// locally (CMDF_LOCAL) have no entry.
+CommandHandler command_handlers[CMD_COUNT] = {
+    [CMD_HELP] = command_help,
+    [CMD_USERNAME] = command_username,
+    [CMD_PASSWORD] = command_password,
+    [CMD_DELETE] = command_delete,
+    [CMD_SHOUT] = command_shout,
+    [CMD_WHISPER] = command_whisper,
+    [CMD_COLOR] = command_color,
+    [CMD_ROLL] = command_roll,
+    [CMD_ONLINE] = command_online,
+    [CMD_JOKE] = command_joke,
+    [CMD_PING] = command_ping,
+};
+
+// A multicast client has joined the group, or asks for broadcasts it missed.
+void multicast_request(Client* client, Message* msg) {
+    if (msg->command == MCAST_JOINED) {
+        printf("Client %d joined the multicast group\n", client->id);
+        InterlockedCompareExchange(&client->multicast, MULTICAST_JOINING, MULTICAST_OFF);
+        return;
+    }
+
+    long long first, last;
+    if (msg->command != MCAST_NACK || sscanf(msg->content, "%lld %lld", &first, &last) != 2) {
+        return;
+    }
+    if (last - first >= MULTICAST_REPAIR_MAX) {
+        last = first + MULTICAST_REPAIR_MAX - 1;
+    }
+    char* text = arena_alloc(&client->arena, 2 * BUFFER_SIZE);
+    for (long long sequence = first; sequence <= last; sequence++) {
+        int sender_id;
+        int length = multicast_repair(sequence, client->capabilities & CAP_PLAIN, text, 2 * BUFFER_SIZE, &sender_id);
+        if (length < 0 || sender_id == client->id) {
+            length = 0;
+        }
+        queue_frame(client, MSG_REPAIR, text, length, sequence);
+    }
+}
+
+// Process commands from clients
+void process_command(Client* client, Message* msg) {
+    if (msg->command > CMD_NONE && msg->command < CMD_COUNT && command_handlers[msg->command] != NULL) {
+        PROBE_COMMAND_START(client->id, msg->command, command_info[msg->command].name);
+        command_handlers[msg->command](client, msg);
+        PROBE_COMMAND_FINISH(client->id, msg->command, command_info[msg->command].name);
+    } else {
+        send_system_message(client, "Unknown command. Type /help for a list of commands.");
+    }
+}
+
+// Arm (or re-arm) a timer to fire after the given number of milliseconds.
+void arm_timer(Timer* timer, unsigned int delay_ms) {
+    EnterCriticalSection(&timers_mutex);
+    timer_schedule(&timer_wheel, timer, (delay_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS);
+    LeaveCriticalSection(&timers_mutex);
+}
+
+// Cancel a timer. Once this returns its callback is not running and won't run.
+void disarm_timer(Timer* timer) {
+    EnterCriticalSection(&timers_mutex);
+    timer_cancel(&timer_wheel, timer);
+    LeaveCriticalSection(&timers_mutex);
+}
+
+// Force a client off once the frames already queued for it (such as the
+// reason for the disconnect) have gone out. The blocked recv in its thread
+// then fails and the thread does the normal cleanup.
+void disconnect_client(Client* client) {
+    OutFrame* marker = outframe_shutdown_marker();
+    if (marker == NULL || outqueue_push(&client->outq, PRIO_CONTROL, marker) == OUTQ_CLOSED) {
+        net->shutdown(client);
+    }
+}
+
+// Timer callback: the client connected but never logged in.
+void on_auth_timeout(void* arg) {
+    Client* client = (Client*)arg;
+    if (!client->authenticated) {
+        printf("Client %d did not log in in time, disconnecting.\n", client->id);
+        send_system_message(client, "Login timed out");
+        disconnect_client(client);
+    }
+}
+
+// Timer callback: ping the client, or drop it if the last ping went unanswered.
+void on_heartbeat(void* arg) {
+    Client* client = (Client*)arg;
+    if (client->awaiting_pong) {
+        // Don't wait behind a writer that may be stuck on a dead connection.
+        printf("Client %d missed a heartbeat, disconnecting.\n", client->id);
+        net->shutdown(client);
+        return;
+    }
+    client->awaiting_pong = 1;
+    send_frame(client, MSG_PING, NULL, 0);
+    timer_schedule(&timer_wheel, &client->heartbeat_timer, HEARTBEAT_INTERVAL_MS / TIMER_TICK_MS);
+}
+
+// Timer callback: the user has been inactive for too long.
+void on_idle_timeout(void* arg) {
+    Client* client = (Client*)arg;
+    printf("Client %d idle, disconnecting.\n", client->id);
+    send_system_message(client, "Disconnected for inactivity");
+    disconnect_client(client);
+}
+
+// Timer callback: print the server metrics.
+void on_metrics_report(void* arg) {
+    (void)arg;
+    metrics_report();
+    timer_schedule(&timer_wheel, &metrics_timer, METRICS_INTERVAL_MS / TIMER_TICK_MS);
+}
+
+// Timer callback: tell multicast clients the newest broadcast, so they can
+// ask for one lost at the end of a burst.
+void on_multicast_heartbeat(void* arg) {
+    (void)arg;
+    multicast_heartbeat();
+    timer_schedule(&timer_wheel, &multicast_timer, MULTICAST_HEARTBEAT_MS / TIMER_TICK_MS);
+}
+
+// Timer callback: have the chat filter rebuilt if its files changed.
+void on_filter_check(void* arg) {
+    (void)arg;
+    filter_check_files();
+    timer_schedule(&timer_wheel, &filter_timer, FILTER_CHECK_MS / TIMER_TICK_MS);
+}
+
+// Timer callback: write the user index out if accounts changed.
+void on_user_snapshot(void* arg) {
+    (void)arg;
+    auth_snapshot();
+    timer_schedule(&timer_wheel, &snapshot_timer, USER_SNAPSHOT_INTERVAL_MS / TIMER_TICK_MS);
+}
+
+// Rate limit class of a frame, besides RL_FRAME which covers every frame.
+// Returns -1 if only the connection-wide limit applies.
+int message_rate_class(const Message* msg) {
+    switch (msg->type) {
+        case MSG_AUTH:
+        case MSG_REGISTER:
+            return RL_AUTH;
+        case MSG_CHAT:
+            return RL_CHAT;
+        case MSG_COMMAND:
+            if (msg->command > CMD_NONE && msg->command < CMD_COUNT &&
+                (command_info[msg->command].flags & CMDF_BROADCAST)) {
+                return RL_BROADCAST;
+            }
+            return -1;
+        default:
+            return -1;
+    }
+}
+
+// Apply the connection-wide and per-class token buckets to a frame. Frames
+// over a RL_DELAY limit are held in this thread until a token is available,
+// unless may_delay is 0 (shared I/O workers must not block), in which case
+// they are dropped like RL_DROP frames.
+// Returns 1 if the frame may be processed, 0 if it was dropped.
+// File data is paced per transfer by filexfer_data instead.
+int check_rate_limit(Client* client, const Message* msg, int may_delay) {
+    int classes[2] = { msg->type == MSG_FILE_DATA ? -1 : RL_FRAME, message_rate_class(msg) };
+    int limited = 0;
+
+    for (int i = 0; i < 2; i++) {
+        int rl = classes[i];
+        if (rl < 0) {
+            continue;
+        }
+
+        const RateLimit* limit = &rate_limits[rl];
+        unsigned int wait = token_bucket_take(&client->buckets[rl], limit, net->now_ms());
+        if (wait == 0) {
+            continue;
+        }
+
+        limited = 1;
+        if (may_delay && limit->policy == RL_DELAY && wait <= RL_MAX_DELAY_MS) {
+            metric_inc(METRIC_RATE_DELAYED);
+            if (!client->rate_notified) {
+                send_system_message(client, "You are sending too fast, your messages are being slowed down");
+                client->rate_notified = 1;
+            }
+            do {
+                Sleep(wait);
+                wait = token_bucket_take(&client->buckets[rl], limit, net->now_ms());
+            } while (wait != 0 && server_running);
+            continue;
+        }
+
+        metric_inc(METRIC_LIMITED_FRAME + rl);
+        if (!client->rate_notified) {
+            send_system_message(client, "You are sending too fast, message dropped");
+            client->rate_notified = 1;
+        }
+        return 0;
+    }
+
+    if (!limited) {
+        client->rate_notified = 0;
+    }
+    return 1;
+}
+
+// Thread that drives the timer wheel.
+DWORD WINAPI timer_thread(LPVOID lpParam) {
+    (void)lpParam;
+    while (server_running) {
+        Sleep(TIMER_TICK_MS);
+        EnterCriticalSection(&timers_mutex);
+        timer_wheel_advance(&timer_wheel, net->now_ms() / TIMER_TICK_MS);
+        LeaveCriticalSection(&timers_mutex);
+    }
+    return 0;
+}
+
+// Allocate and initialize a Client for a connected socket.
+Client* create_client(SOCKET socket) {
+    Client* client = (Client*)malloc(sizeof(Client));
+    if (client == NULL) {
+        return NULL;
+    }
+    client->socket = socket;
+    client->id = 0;
+    client->authenticated = 0;
+    client->username = "";
+    client->color = COLOR_DEFAULT;
+    client->capabilities = 0;
+    client->multicast = MULTICAST_OFF;
+    client->awaiting_pong = 0;
+    client->writer = NULL;
+    client->reader = NULL;
+    client->inbound = NULL;
+    client->inbound_length = 0;
+    client->received_at = trace_now();
+    client->io_pending = 0;
+    arena_init(&client->arena);
+    InitializeCriticalSection(&client->state_lock);
+    outqueue_init(&client->outq);
+    timer_init(&client->auth_timer, on_auth_timeout, client);
+    timer_init(&client->heartbeat_timer, on_heartbeat, client);
+    timer_init(&client->idle_timer, on_idle_timeout, client);
+    client->rate_notified = 0;
+    for (int i = 0; i < RL_CLASS_COUNT; i++) {
+        token_bucket_init(&client->buckets[i], &rate_limits[i], net->now_ms());
+    }
+
+    // Let TCP keepalive help reap half-open connections.
+    BOOL keepalive = TRUE;
+    setsockopt(socket, SOL_SOCKET, SO_KEEPALIVE, (const char*)&keepalive, sizeof(keepalive));
+
+    // Keep the kernel send buffer small so a backlog stays in our priority
+    // lanes instead of in front of control frames inside the kernel.
+    int sndbuf = CLIENT_SNDBUF_SIZE;
+    setsockopt(socket, SOL_SOCKET, SO_SNDBUF, (const char*)&sndbuf, sizeof(sndbuf));
+    return client;
+}
+
+// Free a client whose threads have stopped (or never started).
+void destroy_client(Client* client) {
+    if (client->inbound != NULL) {
+        buffer_pool_put(&inbound_pool, client->inbound);
+    }
+    outqueue_destroy(&client->outq);
+    arena_destroy(&client->arena);
+    DeleteCriticalSection(&client->state_lock);
+    free(client);
+}
+
+// Process one frame from an authenticated or authenticating client.
+// Called with client->state_lock held.
+void handle_frame(Client* client, Message* msg) {
+    // Skip commands from unauthenticated clients, except auth commands
+    if (!client->authenticated && msg->type != MSG_AUTH && msg->type != MSG_REGISTER) {
+        send_system_message(client, "Please login first");
+        return;
+    }
+
+    if (client->authenticated) {
+        arm_timer(&client->idle_timer, IDLE_TIMEOUT_MS);
+    }
+
+    // Text that gets shown to other users must not carry terminal escapes or broken UTF-8.
+    // Passwords are compared as sent, so commands that carry one are left alone;
+    // a username is refused rather than rewritten into someone else's.
+    if ((msg->type == MSG_AUTH || msg->type == MSG_REGISTER) &&
+        !text_is_clean(msg->username, sizeof(msg->username))) {
+        const char* reply = msg->type == MSG_AUTH ? "Login failed" : "Registration failed: invalid username";
+        send_frame(client, MSG_AUTH, reply, (int)strlen(reply));
+        printf("Client %d sent a username with control bytes or invalid UTF-8\n", client->id);
+        return;
+    }
+    if (msg->type == MSG_CHAT ||
+        (msg->type == MSG_COMMAND && !(msg->command < CMD_COUNT && (command_info[msg->command].flags & CMDF_CREDENTIALS)))) {
+        int changed;
+        text_sanitize(msg->content, BUFFER_SIZE, &changed);
+        if (changed) {
+            metric_inc(METRIC_TEXT_REWRITTEN);
+        }
+    }
+
+    switch (msg->type) {
+        case MSG_AUTH:
+            printf("Auth attempt with username: %s\n", msg->username);
+            client->capabilities = msg->command;
+            
+            if (authenticate_user(msg->username, msg->content) == AUTH_SUCCESS) {
+                if (client->authenticated) {
+                    user_left(client->username);  // Logging in again, maybe as someone else
+                }
+                client->username = name_intern(msg->username);
+                client->authenticated = 1;
+                disarm_timer(&client->auth_timer);
+                arm_timer(&client->idle_timer, IDLE_TIMEOUT_MS);
+                send_frame(client, MSG_AUTH, "Login successful", (int)strlen("Login successful"));
+                printf("Client %d authenticated as %s\n", client->id, client->username);
+                if (multicast_enabled() && (client->capabilities & CAP_MULTICAST)) {
+                    MulticastInfo info;
+                    multicast_info(&info, client->id);
+                    send_frame(client, MSG_MULTICAST, (const char*)&info, sizeof(info));
+                }
+                user_joined(client->username);
+            } else {
+                send_frame(client, MSG_AUTH, "Login failed", (int)strlen("Login failed"));
+                printf("Authentication failed for username: %s\n", msg->username);
+            }
+            break;
+
+        case MSG_REGISTER:
+            printf("Registration attempt for username: %s\n", msg->username);
+            client->capabilities = msg->command;
+            
+            int regResult = register_user(msg->username, msg->content);
+            if (regResult == AUTH_SUCCESS) {
+                send_frame(client, MSG_AUTH, "Registration successful", (int)strlen("Registration successful"));
+                printf("New user registered: %s\n", msg->username);
+            } else if (regResult == AUTH_USER_EXISTS) {
+                send_frame(client, MSG_AUTH, "Username already exists", (int)strlen("Username already exists"));
+                printf("Registration failed - username exists: %s\n", msg->username);
+            } else {
+                send_frame(client, MSG_AUTH, "Registration failed", (int)strlen("Registration failed"));
+                printf("Registration failed for username: %s\n", msg->username);
+            }
+            break;
+
+        case MSG_CHAT:
+            if (client->authenticated) {
+                // "name: text" is written once, with room in front for the
+                // color escape and behind for the reset, so the plain and the
+                // colored variant share one buffer.
+                char* line = arena_alloc(&client->arena, COLOR_CODE_MAX + 32 + BUFFER_SIZE + sizeof(COLOR_RESET));
+                char* plain_line = arena_alloc(&client->arena, 32 + BUFFER_SIZE);
+                char* body = line + COLOR_CODE_MAX;
+                int name_length = text_length(client->username, MAX_USERNAME_LEN - 1);
+                int content_length = text_length(msg->content, BUFFER_SIZE);
+
+                memcpy(body, client->username, name_length);
+                memcpy(body + name_length, ": ", 2);
+                Filter* filter = filter_acquire();
+                int length = filter_apply(filter, msg->content, body + name_length + 2, BUFFER_SIZE);
+                filter_release(filter);
+                if (length == FILTER_BLOCKED) {
+                    metric_inc(METRIC_FILTER_BLOCKED);
+                    send_system_message(client, "Your message was blocked by the chat filter");
+                    break;
+                }
+                int body_length = name_length + 2 + length;
+
+                // Highlights are escapes too; plain clients get the text without them.
+                const char* plain = body;
+                int plain_length = body_length;
+                if (length != content_length) {
+                    memcpy(plain_line, body, name_length + 2);
+                    memcpy(plain_line + name_length + 2, msg->content, content_length);
+                    plain = plain_line;
+                    plain_length = name_length + 2 + content_length;
+                }
+                printf("%.*s\n", plain_length, plain);
+
+                int colored_length;
+                char* colored = render_color(body, body_length, client->color, &colored_length);
+                broadcast_variants(client->id, colored, colored_length, plain, plain_length);
+            }
+            break;
+        
+        case MSG_COMMAND:
+            if (client->authenticated) {
+                process_command(client, msg);
+            }
+            break;
+
+        case MSG_FILE_OFFER:
+            EnterCriticalSection(&clients_mutex);
+            Client* receiver = find_client_by_username(msg->target);
+            if (receiver != NULL) {
+                filexfer_offer(client, receiver, msg);
+            }
+            LeaveCriticalSection(&clients_mutex);
+            if (receiver == NULL) {
+                char* response = arena_alloc(&client->arena, BUFFER_SIZE);
+                snprintf(response, BUFFER_SIZE, "User '%.31s' is not online", msg->target);
+                send_system_message(client, response);
+            }
+            break;
+
+        case MSG_COMPLETE:
+            complete_names(client, msg);
+            break;
+
+        case MSG_MULTICAST:
+            if (client->authenticated && multicast_enabled()) {
+                multicast_request(client, msg);
+            }
+            break;
+
+        case MSG_FILE_ACCEPT:
+            filexfer_accept(client, msg);
+            break;
+
+        case MSG_FILE_DATA:
+            filexfer_data(client, msg);
+            break;
+        
+        default:
+            // Unknown message type
+            printf("Unknown message type: %d\n", msg->type);
+            break;
+    }
+}
+
+// Timers and bookkeeping for a client whose threads or I/O just started.
+void client_connected(Client* client) {
+    printf("Client %d connected.\n", client->id);
+    if (client->authenticated) {
+        arm_timer(&client->idle_timer, IDLE_TIMEOUT_MS);
+    } else {
+        arm_timer(&client->auth_timer, AUTH_TIMEOUT_MS);
+    }
+    arm_timer(&client->heartbeat_timer, HEARTBEAT_INTERVAL_MS);
+}
+
+// Run the entries of a MSG_BATCH frame in order, each checked against the
+// rate limits as a frame of its own would be. They all run under one hold of
+// state_lock, so a handoff finds the batch either done or not started.
+// Returns 0, or -1 if the connection has been handed over.
+int process_batch(Client* client, const Message* batch, int may_delay) {
+    BatchEntry entries[BATCH_MAX_ENTRIES];
+    const char* targets[BATCH_MAX_ENTRIES];  // Each followed by the entry's text
+    int allowed[BATCH_MAX_ENTRIES];
+    int count = 0;
+    int offset = 0;
+    Message* msg = arena_alloc(&client->arena, sizeof(Message));
+
+    // Decode every entry first; the batch ends at the first one that does not fit.
+    while (count < batch->command && count < BATCH_MAX_ENTRIES &&
+           offset + (int)sizeof(BatchEntry) <= BUFFER_SIZE) {
+        BatchEntry* entry = &entries[count];
+        memcpy(entry, batch->content + offset, sizeof(BatchEntry));
+        offset += sizeof(BatchEntry);
+        if (offset + entry->target_length + entry->text_length > BUFFER_SIZE) {
+            break;
+        }
+        targets[count] = batch->content + offset;
+        offset += entry->target_length + entry->text_length;
+        count++;
+    }
+
+    for (int i = 0; i < count; i++) {
+        msg->type = entries[i].command == CMD_NONE ? MSG_CHAT : MSG_COMMAND;
+        msg->command = entries[i].command;
+        allowed[i] = check_rate_limit(client, msg, may_delay);
+    }
+
+    EnterCriticalSection(&client->state_lock);
+    if (handed_off) {
+        LeaveCriticalSection(&client->state_lock);
+        return -1;
+    }
+    client->trace.dispatch = trace_now();
+    current_trace = trace_enabled ? &client->trace : NULL;
+    for (int i = 0; i < count; i++) {
+        if (!allowed[i]) {
+            continue;
+        }
+        int target_length = entries[i].target_length;
+        ZeroMemory(msg, sizeof(Message));
+        msg->type = entries[i].command == CMD_NONE ? MSG_CHAT : MSG_COMMAND;
+        msg->command = entries[i].command;
+        snprintf(msg->target, sizeof(msg->target), "%.*s", target_length, targets[i]);
+        memcpy(msg->content, targets[i] + target_length, entries[i].text_length);
+
+        // A recipient list too long for msg->target reaches command_whisper() aside.
+        char* recipients = NULL;
+        if (msg->command == CMD_WHISPER && target_length >= (int)sizeof(msg->target)) {
+            recipients = arena_alloc(&client->arena, target_length + 1);
+            memcpy(recipients, targets[i], target_length);
+            recipients[target_length] = '\0';
+        }
+        batch_recipients = recipients;
+        handle_frame(client, msg);
+        batch_recipients = NULL;
+    }
+    current_trace = NULL;
+    LeaveCriticalSection(&client->state_lock);
+    return 0;
+}
+
+// Give the client a receive buffer if it has none. Returns 0 on success.
+int hold_inbound(Client* client) {
+    if (client->inbound == NULL) {
+        client->inbound = (char*)buffer_pool_get(&inbound_pool);
+    }
+    return client->inbound == NULL;
+}
+
+// Return the receive buffer of a client that has no bytes waiting.
+void release_inbound(Client* client) {
+    if (client->inbound != NULL && client->inbound_length == 0) {
+        buffer_pool_put(&inbound_pool, client->inbound);
+        client->inbound = NULL;
+    }
+}
+
+// Process the complete frames in the client's inbound buffer, up to what is
+// left of its read budget (READ_BUDGET_BYTES); a partial frame stays buffered for the
+// next read. may_delay is passed on to check_rate_limit(). Returns 0 once
+// the buffer holds no complete frame, 1 if the budget ran out first, or -1
+// if the connection has been handed over, in which case the unprocessed
+// bytes stay buffered for the handoff.
+int process_inbound(Client* client, int may_delay) {
+    int offset = 0;
+    int result = 0;
+
+    while (client->inbound_length - offset >= (int)sizeof(Message)) {
+        if (client->turn_bytes >= READ_BUDGET_BYTES) {
+            // Let other connections have a turn before the rest.
+            metric_inc(METRIC_READ_YIELDS);
+            client->turn_bytes = 0;
+            result = 1;
+            break;
+        }
+        client->turn_bytes += sizeof(Message);
+
+        // Decode into scratch memory; the inbound buffer has no alignment guarantee.
+        Message* msg = arena_alloc(&client->arena, sizeof(Message));
+        memcpy(msg, client->inbound + offset, sizeof(Message));
+        client->trace.receive = client->received_at;
+        client->trace.parse = trace_now();
+        read_wait_record(client->id, client->trace.parse - client->received_at);
+        PROBE_DECODE(client->id, msg->type, msg->command);
+
+        // Any traffic proves the connection is alive.
+        client->awaiting_pong = 0;
+        if (msg->type == MSG_PONG) {
+            offset += sizeof(Message);
+            continue;
+        }
+
+        if (msg->type != MSG_FILE_DATA) {
+            printf("Received message type: %d from client %d\n", msg->type, client->id);
+        }
+        metric_inc(METRIC_FRAMES_RECEIVED);
+
+        if (msg->type == MSG_BATCH) {
+            if (process_batch(client, msg, may_delay) < 0) {
+                result = -1;
+                break;
+            }
+            offset += sizeof(Message);
+            continue;
+        }
+
+        if (!check_rate_limit(client, msg, may_delay)) {
+            offset += sizeof(Message);
+            continue;
+        }
+
+        // Frames are processed under state_lock, so a handoff sees every
+        // client either between frames or holding one it has not started.
+        EnterCriticalSection(&client->state_lock);
+        if (handed_off) {
+            // Leave this frame and the rest to the new server process.
+            LeaveCriticalSection(&client->state_lock);
+            result = -1;
+            break;
+        }
+        client->trace.dispatch = trace_now();
+        current_trace = trace_enabled ? &client->trace : NULL;
+        handle_frame(client, msg);
+        current_trace = NULL;
+        LeaveCriticalSection(&client->state_lock);
+        offset += sizeof(Message);
+    }
+    arena_reset(&client->arena);
+
+    if (offset > 0) {
+        client->inbound_length -= offset;
+        memmove(client->inbound, client->inbound + offset, client->inbound_length);
+    }
+    release_inbound(client);
+    return result;
+}
+
+// Process what a client has sent, one read budget at a time (IO_THREADS
+// backend). The thread yields between budgets; SwitchToThread only gives up
+// the processor if another thread is ready to run on it. Returns 0, or -1 if
+// the connection has been handed over.
+int read_frames(Client* client) {
+    int result;
+    while ((result = process_inbound(client, 1)) > 0) {
+        SwitchToThread();
+    }
+    return result;
+}
+
+// Tear down a client whose connection is gone: stop its timers and writer,
+// remove it from the list and free it.
+void remove_client(Client* client) {
+    PROBE_DISCONNECT(client->id, client->username);
+
+    // Stop the timers before the client memory goes away.
+    disarm_timer(&client->auth_timer);
+    disarm_timer(&client->heartbeat_timer);
+    disarm_timer(&client->idle_timer);
+
+    // Remove the client from the global list.
+    EnterCriticalSection(&clients_mutex);
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i] == client) {
+            clients[i] = NULL;
+            break;
+        }
+    }
+    LeaveCriticalSection(&clients_mutex);
+    filexfer_client_gone(client);
+    if (client->authenticated) {
+        user_left(client->username);
+    }
+
+    // Stop the writer; unsent frames are discarded.
+    net->shutdown(client);
+    outqueue_close(&client->outq);
+    if (client->writer != NULL) {
+        WaitForSingleObject(client->writer, INFINITE);
+        CloseHandle(client->writer);
+    }
+    if (client->reader != NULL) {
+        CloseHandle(client->reader);
+    }
+
+    net->close(client);
+    destroy_client(client);
+}
+
+// Thread function to handle an individual client (IO_THREADS backend).
+DWORD WINAPI handle_client(LPVOID lpParam) {
+    Client* client = (Client*)lpParam;
+    int recvResult;
+
+    client_connected(client);
+
+    // Bytes handed over by the previous server process go first.
+    if (read_frames(client) != 0) {
+        return 0;
+    }
+
+    while (server_running) {
+        // Take a receive buffer only once there is something to read, so an
+        // idle connection holds none. A failed select is seen by recv.
+        if (client->inbound == NULL) {
+            fd_set readable;
+            FD_ZERO(&readable);
+            FD_SET(client->socket, &readable);
+            select(0, &readable, NULL, NULL, NULL);
+        }
+        if (hold_inbound(client) != 0) {
+            fprintf(stderr, "No receive buffer for client %d\n", client->id);
+            break;
+        }
+        recvResult = recv(client->socket, client->inbound + client->inbound_length,
+                          INBOUND_BUFFER_SIZE - client->inbound_length, 0);
+        metric_inc(METRIC_RECV_CALLS);
+        
+        if (recvResult > 0) {
+            client->received_at = trace_now();
+            client->inbound_length += recvResult;
+            if (read_frames(client) != 0) {
+                return 0;
+            }
+        } else if (handed_off) {
+            // Our copy of the socket was closed after handing it over.
+            return 0;
+        } else if (recvResult == 0) {
+            // Connection closed by client.
+            printf("Client %d disconnected.\n", client->id);
+            break;
+        } else {
+            fprintf(stderr, "recv failed from client %d: %d\n", client->id, WSAGetLastError());
+            break;
+        }
+    }
+
+    // After a handoff the upgrade code owns the client; don't touch the connection.
+    if (handed_off) {
+        return 0;
+    }
+    remove_client(client);
+    return 0;
+}
+
+// Post an overlapped receive into the free part of the client's inbound
+// buffer (IO_IOCP backend). A client with no bytes waiting has no buffer;
+// it gets a zero-byte receive that completes once data arrives, and a
+// buffer only then (complete_recv). Returns 0 if the receive is pending or
+// done.
+int post_recv(Client* client) {
+    WSABUF buffer;
+    DWORD flags = 0;
+
+    release_inbound(client);
+    buffer.buf = client->inbound != NULL ? client->inbound + client->inbound_length : NULL;
+    buffer.len = client->inbound != NULL ? (ULONG)(INBOUND_BUFFER_SIZE - client->inbound_length) : 0;
+    ZeroMemory(&client->recv_overlapped, sizeof(client->recv_overlapped));
+    client->io_pending = 1;
+    metric_inc(METRIC_RECV_CALLS);
+    if (WSARecv(client->socket, &buffer, 1, NULL, &flags, &client->recv_overlapped, NULL) == SOCKET_ERROR &&
+        WSAGetLastError() != WSA_IO_PENDING) {
+        client->io_pending = 0;
+        return 1;
+    }
+    return 0;
+}
+
+// Process one read budget of what a client has sent (IO_IOCP backend). A
+// client with frames left goes to the back of the completion port's queue,
+// behind every connection that became ready meanwhile. One that has caught
+// up reads on from the socket while its turn lasts, and otherwise gets its
+// next receive posted. io_pending stays set while either waits.
+void continue_reading(Client* client) {
+    int result;
+    ULONG waiting;
+
+    for (;;) {
+        while ((result = process_inbound(client, 0)) > 0) {
+            ZeroMemory(&client->resume_overlapped, sizeof(client->resume_overlapped));
+            if (PostQueuedCompletionStatus(completion_port, 0, (ULONG_PTR)client, &client->resume_overlapped)) {
+                return;
+            }
+        }
+        if (result < 0) {
+            client->io_pending = 0;
+            return;
+        }
+        // A turn shorter than one full buffer most likely took everything the
+        // client sent, so only then is the socket asked for more.
+        if (client->turn_bytes < INBOUND_BUFFER_SIZE || client->turn_bytes >= READ_BUDGET_BYTES ||
+            ioctlsocket(client->socket, FIONREAD, &waiting) != 0 || waiting == 0 ||
+            hold_inbound(client) != 0) {
+            break;
+        }
+        int received = recv(client->socket, client->inbound + client->inbound_length,
+                            INBOUND_BUFFER_SIZE - client->inbound_length, 0);
+        metric_inc(METRIC_RECV_CALLS);
+        if (received <= 0) {
+            break;  // The posted receive reports the error or the end
+        }
+        client->received_at = trace_now();
+        client->inbound_length += received;
+    }
+    client->turn_bytes = 0;
+    if (post_recv(client) != 0) {
+        fprintf(stderr, "recv failed from client %d: %d\n", client->id, WSAGetLastError());
+        remove_client(client);
+    }
+}
+
+// Handle one finished receive (IO_IOCP backend).
+void complete_recv(Client* client, DWORD bytes, BOOL ok) {
+    if (handed_off) {
+        // Our copy of the socket was closed after handing it over.
+        client->io_pending = 0;
+        return;
+    }
+    if (ok && bytes == 0 && client->inbound == NULL) {
+        // The zero-byte receive: data (or the end of the stream) is waiting.
+        int received = -1;
+        if (hold_inbound(client) == 0) {
+            received = recv(client->socket, client->inbound, INBOUND_BUFFER_SIZE, 0);
+            metric_inc(METRIC_RECV_CALLS);
+        }
+        ok = received > 0;
+        bytes = ok ? (DWORD)received : 0;
+    }
+    if (!ok || bytes == 0) {
+        client->io_pending = 0;
+        printf("Client %d disconnected.\n", client->id);
+        remove_client(client);
+        return;
+    }
+
+    client->received_at = trace_now();
+    client->inbound_length += (int)bytes;
+    continue_reading(client);
+}
+
+// Worker thread for the IO_IOCP backend. Each wakeup dequeues a batch of
+// completions, and each completion may carry several frames.
+DWORD WINAPI iocp_worker(LPVOID lpParam) {
+    OVERLAPPED_ENTRY entries[IOCP_BATCH_SIZE];
+    ULONG count;
+    (void)lpParam;
+
+    while (GetQueuedCompletionStatusEx(completion_port, entries, IOCP_BATCH_SIZE, &count, INFINITE, FALSE)) {
+        for (ULONG i = 0; i < count; i++) {
+            Client* client = (Client*)entries[i].lpCompletionKey;
+            if (client == NULL) {
+                return 0;  // Shutdown request
+            }
+            if (entries[i].lpOverlapped == &client->resume_overlapped) {
+                // The client's turn has come round again.
+                if (handed_off) {
+                    client->io_pending = 0;
+                } else {
+                    continue_reading(client);
+                }
+                continue;
+            }
+            // Internal holds the I/O status; zero means success.
+            complete_recv(client, entries[i].dwNumberOfBytesTransferred, entries[i].Internal == 0);
+        }
+    }
+    return 0;
+}
+
+// Start serving a client already in the clients array: a handler thread
+// (IO_THREADS) or a first overlapped receive (IO_IOCP). Its writer thread
+// starts with the first frame queued. Caller holds clients_mutex. Returns 0
+// on success.
+int start_client(Client* client) {
+    outqueue_set_writer(&client->outq, start_writer, client);
+
+    if (io_backend == IO_IOCP) {
+        if (CreateIoCompletionPort((HANDLE)client->socket, completion_port, (ULONG_PTR)client, 0) != NULL) {
+            client_connected(client);
+            // Bytes handed over by the previous server process go first. The
+            // client is already live, so a failure is cleaned up as a disconnect.
+            client->io_pending = 1;
+            continue_reading(client);
+            return 0;
+        }
+    } else {
+        client->reader = CreateThread(NULL, CLIENT_THREAD_STACK_SIZE, handle_client, (LPVOID)client,
+                                      STACK_SIZE_PARAM_IS_A_RESERVATION, NULL);
+        if (client->reader != NULL) {
+            return 0;
+        }
+    }
+
+    outqueue_close(&client->outq);
+    if (client->writer != NULL) {
+        WaitForSingleObject(client->writer, INFINITE);
+        CloseHandle(client->writer);
+        client->writer = NULL;
+    }
+    return 1;
+}
+
+// Send phase 1 of a handoff: the listening socket, then each client's
+// socket, state and unsent frames. Returns 0 on success.
+int send_handoff_snapshot(HANDLE pipe, DWORD child_pid, Client** snapshot, int count) {
+    HandoffHeader header;
+
+    ZeroMemory(&header, sizeof(header));
+    header.magic = HANDOFF_MAGIC;
+    header.client_count = count;
+    header.sequence = sequencer_delivered();
+    if (WSADuplicateSocket(server_socket, child_pid, &header.listen_info) != 0 ||
+        handoff_write(pipe, &header, sizeof(header)) != 0) {
+        return 1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        Client* client = snapshot[i];
+        HandoffClient record;
+        char* outbound = NULL;
+
+        ZeroMemory(&record, sizeof(record));
+        if (WSADuplicateSocket(client->socket, child_pid, &record.socket_info) != 0) {
+            return 1;
+        }
+        record.id = client->id;
+        record.authenticated = client->authenticated;
+        strcpy(record.username, client->username);
+        record.color = client->color;
+        record.capabilities = client->capabilities;
+        record.multicast = client->multicast;
+
+        int pending = outqueue_pending_bytes(&client->outq);
+        if (pending > 0) {
+            outbound = (char*)malloc(pending);
+            if (outbound == NULL) {
+                return 1;
+            }
+            record.outbound_length = outqueue_copy_pending(&client->outq, outbound, pending);
+        }
+
+        int result = handoff_write(pipe, &record, sizeof(record));
+        if (result == 0 && record.outbound_length > 0) {
+            result = handoff_write(pipe, outbound, record.outbound_length);
+        }
+        free(outbound);
+        if (result != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Hand the listening socket and every live connection to a new server
+// process started from the same executable, then shut this one down.
+// Clients stay connected throughout.
+void upgrade_server(void) {
+    LARGE_INTEGER start, end, frequency;
+    HANDLE to_child, from_child;
+    PROCESS_INFORMATION process;
+    Client* snapshot[MAX_CLIENTS];
+    int count = 0;
+    int failed = 0;
+    char ack = 0;
+
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&start);
+
+    // From here on no new clients are added.
+    EnterCriticalSection(&clients_mutex);
+    if (handoff_in_progress || handed_off) {
+        LeaveCriticalSection(&clients_mutex);
+        return;
+    }
+    handoff_in_progress = TRUE;
+    LeaveCriticalSection(&clients_mutex);
+
+    // The new process reopens the node links itself, so it needs the link
+    // port; other nodes see this node leave and rejoin.
+    char options[512];
+    federation_options(options, sizeof(options));
+    if (io_backend == IO_IOCP) {
+        strncat(options, " --io iocp", sizeof(options) - strlen(options) - 1);
+    }
+    if (!beacon_enabled) {
+        strncat(options, " --no-beacon", sizeof(options) - strlen(options) - 1);
+    }
+    if (trace_enabled) {
+        strncat(options, " --trace", sizeof(options) - strlen(options) - 1);
+    }
+    if (multicast_enabled()) {
+        // Same group and session, so joined clients keep listening.
+        char multicast_options[128];
+        snprintf(multicast_options, sizeof(multicast_options),
+                 " --multicast-group %s --multicast-port %d --multicast-session %u",
+                 multicast_group, multicast_port, multicast_session());
+        strncat(options, multicast_options, sizeof(options) - strlen(options) - 1);
+    }
+    federation_stop();
+    discovery_stop();  // The new process binds the same UDP port
+    auth_snapshot();   // So the new process starts from an up-to-date index
+    if (handoff_spawn(server_port, options, &to_child, &from_child, &process) != 0) {
+        fprintf(stderr, "Could not start the new server process: %lu\n", GetLastError());
+        if (beacon_enabled) {
+            discovery_start(server_port, federation.node, server_load);
+        }
+        handoff_in_progress = FALSE;
+        return;
+    }
+
+    // Freeze: no frames being processed, no timers firing, and every writer
+    // between frames.
+    EnterCriticalSection(&clients_mutex);
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i] != NULL) {
+            snapshot[count++] = clients[i];
+        }
+    }
+    LeaveCriticalSection(&clients_mutex);
+
+    for (int i = 0; i < count; i++) {
+        EnterCriticalSection(&snapshot[i]->state_lock);
+    }
+    EnterCriticalSection(&timers_mutex);
+    sequencer_wait_idle();  // Broadcasts already numbered reach the queues first
+    for (int i = 0; i < count && !failed; i++) {
+        if (!outqueue_pause(&snapshot[i]->outq, HANDOFF_WRITER_WAIT_MS)) {
+            fprintf(stderr, "Client %d is not draining its output\n", snapshot[i]->id);
+            failed = 1;
+        }
+    }
+
+    // Phase 1, then wait until the new process has adopted every socket.
+    if (!failed) {
+        failed = send_handoff_snapshot(to_child, process.dwProcessId, snapshot, count) != 0 ||
+                 handoff_read(from_child, &ack, 1) != 0 || ack != HANDOFF_ACK;
+    }
+
+    if (failed) {
+        fprintf(stderr, "Handoff failed, this server keeps running.\n");
+        TerminateProcess(process.hProcess, 1);
+        for (int i = 0; i < count; i++) {
+            outqueue_resume(&snapshot[i]->outq);
+        }
+        LeaveCriticalSection(&timers_mutex);
+        for (int i = 0; i < count; i++) {
+            LeaveCriticalSection(&snapshot[i]->state_lock);
+        }
+        if (beacon_enabled) {
+            discovery_start(server_port, federation.node, server_load);
+        }
+        handoff_in_progress = FALSE;
+        CloseHandle(to_child);
+        CloseHandle(from_child);
+        CloseHandle(process.hThread);
+        CloseHandle(process.hProcess);
+        return;
+    }
+
+    // The new process owns the connections now. Closing our copies of the
+    // sockets only wakes our threads; the connections stay open.
+    handed_off = TRUE;
+    closesocket(server_socket);
+    for (int i = 0; i < count; i++) {
+        Client* client = snapshot[i];
+        timer_cancel(&timer_wheel, &client->auth_timer);
+        timer_cancel(&timer_wheel, &client->heartbeat_timer);
+        timer_cancel(&timer_wheel, &client->idle_timer);
+        outqueue_close(&client->outq);
+        closesocket(client->socket);
+        LeaveCriticalSection(&client->state_lock);
+    }
+    for (int i = 0; i < count; i++) {
+        if (snapshot[i]->reader != NULL) {
+            WaitForSingleObject(snapshot[i]->reader, INFINITE);
+            CloseHandle(snapshot[i]->reader);
+        }
+        while (snapshot[i]->io_pending) {
+            Sleep(1);  // IO_IOCP: the aborted receive is still being completed
+        }
+        if (snapshot[i]->writer != NULL) {
+            WaitForSingleObject(snapshot[i]->writer, INFINITE);
+            CloseHandle(snapshot[i]->writer);
+        }
+    }
+
+    // Phase 2: bytes our side read but left unprocessed.
+    int pending = 0;
+    for (int i = 0; i < count; i++) {
+        if (snapshot[i]->inbound_length > 0) {
+            pending++;
+        }
+    }
+    handoff_write(to_child, &pending, sizeof(pending));
+    for (int i = 0; i < count; i++) {
+        if (snapshot[i]->inbound_length > 0) {
+            HandoffInbound record;
+            record.id = snapshot[i]->id;
+            record.length = snapshot[i]->inbound_length;
+            handoff_write(to_child, &record, sizeof(record));
+            handoff_write(to_child, snapshot[i]->inbound, record.length);
+        }
+    }
+
+    EnterCriticalSection(&clients_mutex);
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        clients[i] = NULL;
+    }
+    LeaveCriticalSection(&clients_mutex);
+    for (int i = 0; i < count; i++) {
+        destroy_client(snapshot[i]);
+    }
+
+    server_running = FALSE;
+    LeaveCriticalSection(&timers_mutex);
+    CloseHandle(to_child);
+    CloseHandle(from_child);
+    CloseHandle(process.hThread);
+    CloseHandle(process.hProcess);
+
+    QueryPerformanceCounter(&end);
+    printf("Handed %d connections over to process %lu in %.2f ms\n", count, process.dwProcessId,
+        (double)(end.QuadPart - start.QuadPart) * 1000.0 / (double)frequency.QuadPart);
+}
+
+// Take over the listening socket and clients from the previous server
+// process (see handoff.h). Returns the listening socket, or INVALID_SOCKET.
+SOCKET adopt_handoff(HANDLE from_parent, HANDLE to_parent) {
+    HandoffHeader header;
+    Client* adopted[MAX_CLIENTS];
+    int count = 0;
+    int pending = 0;
+    char ack = HANDOFF_ACK;
+
+    if (handoff_read(from_parent, &header, sizeof(header)) != 0 || header.magic != HANDOFF_MAGIC) {
+        fprintf(stderr, "Invalid handoff from the previous server\n");
+        return INVALID_SOCKET;
+    }
+    sequencer_init(header.sequence, deliver_broadcast);  // Carry on numbering
+    SOCKET listen_socket = WSASocket(FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO,
+                                     &header.listen_info, 0, WSA_FLAG_OVERLAPPED);
+    if (listen_socket == INVALID_SOCKET) {
+        fprintf(stderr, "Could not adopt the listening socket: %d\n", WSAGetLastError());
+        return INVALID_SOCKET;
+    }
+
+    for (int i = 0; i < header.client_count && i < MAX_CLIENTS; i++) {
+        HandoffClient record;
+        char* outbound = NULL;
+
+        if (handoff_read(from_parent, &record, sizeof(record)) != 0) {
+            break;
+        }
+        if (record.outbound_length > 0) {
+            outbound = (char*)malloc(record.outbound_length);
+            if (outbound == NULL ||
+                handoff_read(from_parent, outbound, record.outbound_length) != 0) {
+                free(outbound);
+                break;
+            }
+        }
+
+        SOCKET socket = WSASocket(FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO,
+                                  &record.socket_info, 0, WSA_FLAG_OVERLAPPED);
+        Client* client = (socket != INVALID_SOCKET) ? create_client(socket) : NULL;
+        if (client == NULL) {
+            fprintf(stderr, "Could not adopt client %d\n", record.id);
+            if (socket != INVALID_SOCKET) {
+                closesocket(socket);
+            }
+            free(outbound);
+            continue;
+        }
+        client->id = record.id;
+        client->authenticated = record.authenticated;
+        client->username = name_intern(record.username);
+        client->color = (record.color >= 0 && record.color < COLOR_COUNT) ? record.color : COLOR_DEFAULT;
+        client->capabilities = record.capabilities;
+        client->multicast = record.multicast;
+
+        // Re-queue the frames the old process had not sent yet, byte for byte:
+        // they are already compressed where they should be.
+        for (int offset = 0; offset + (int)sizeof(FrameHeader) <= record.outbound_length;) {
+            FrameHeader frame_header;
+            memcpy(&frame_header, outbound + offset, sizeof(FrameHeader));
+            int length = (int)sizeof(FrameHeader) + frame_header.length;
+            if (frame_header.length < 0 || length > record.outbound_length - offset) {
+                break;
+            }
+            int type = frame_header.type & ~FRAME_COMPRESSED;
+            OutFrame* frame = outframe_copy(outbound + offset, length);
+            if (frame != NULL && type == MSG_PING_REPLY) {
+                frame->trace.enqueue = trace_now();
+                frame->write_stamp = (int)(sizeof(FrameHeader) + offsetof(PingReply, write));
+            }
+            push_frame(client, type, frame, frame_header.sequence);
+            offset += length;
+        }
+        free(outbound);
+        adopted[count++] = client;
+    }
+
+    if (count < header.client_count || handoff_write(to_parent, &ack, 1) != 0) {
+        fprintf(stderr, "Handoff incomplete, giving up\n");
+        for (int i = 0; i < count; i++) {
+            closesocket(adopted[i]->socket);
+            destroy_client(adopted[i]);
+        }
+        closesocket(listen_socket);
+        return INVALID_SOCKET;
+    }
+
+    // Phase 2: bytes the old process read but did not get to.
+    if (handoff_read(from_parent, &pending, sizeof(pending)) == 0) {
+        for (int i = 0; i < pending; i++) {
+            HandoffInbound record;
+            Client* client = NULL;
+            if (handoff_read(from_parent, &record, sizeof(record)) != 0 ||
+                record.length < 0 || record.length > INBOUND_BUFFER_SIZE) {
+                break;
+            }
+            for (int j = 0; j < count; j++) {
+                if (adopted[j]->id == record.id) {
+                    client = adopted[j];
+                    break;
+                }
+            }
+            if (client == NULL || hold_inbound(client) != 0 ||
+                handoff_read(from_parent, client->inbound, record.length) != 0) {
+                break;
+            }
+            client->inbound_length = record.length;
+        }
+    }
+    CloseHandle(from_parent);
+    CloseHandle(to_parent);
+
+    EnterCriticalSection(&clients_mutex);
+    for (int i = 0; i < count; i++) {
+        Client* client = adopted[i];
+        int slot = client->id - 1;
+        if (slot < 0 || slot >= MAX_CLIENTS || clients[slot] != NULL) {
+            closesocket(client->socket);
+            destroy_client(client);
+            continue;
+        }
+        clients[slot] = client;
+        if (client->authenticated) {
+            names_online_add(client->username);  // Linked nodes know the user already
+        }
+        if (start_client(client) != 0) {
+            fprintf(stderr, "Could not create thread for client %d\n", client->id);
+            clients[slot] = NULL;
+            if (client->authenticated) {
+                names_online_remove(client->username);
+            }
+            closesocket(client->socket);
+            destroy_client(client);
+        }
+    }
+    LeaveCriticalSection(&clients_mutex);
+
+    printf("Took over %d connections from the previous server\n", count);
+    return listen_socket;
+}
+
+// Load the configuration and set up everything frames are handled with,
+// up to an armed timer wheel that the caller then drives. Returns 0 on success.
+int init_services(void) {
+    probes_register();
+    printf("Server: text pipeline using %s\n", textproc_init());
+
+    int limits = rate_limits_load(LIMITS_FILE);
+    if (limits > 0) {
+        printf("Loaded %d rate limits from %s\n", limits, LIMITS_FILE);
+    }
+    if (auth_init() < 0) {
+        return 1;
+    }
+    printf("Loaded chat filter: %d patterns\n", filter_init());
+
+    // Initialize critical section for managing client list.
+    InitializeCriticalSection(&clients_mutex);
+    outframe_pool_init();
+    arena_pool_init();
+    buffer_pool_init(&inbound_pool, INBOUND_BUFFER_SIZE, INBOUND_POOL_KEEP);
+    names_init();
+    lz_init();
+    filexfer_init();
+
+    // Start the timer wheel.
+    InitializeCriticalSection(&timers_mutex);
+    timer_wheel_init(&timer_wheel, net->now_ms() / TIMER_TICK_MS);
+    timer_init(&metrics_timer, on_metrics_report, NULL);
+    arm_timer(&metrics_timer, METRICS_INTERVAL_MS);
+    timer_init(&filter_timer, on_filter_check, NULL);
+    arm_timer(&filter_timer, FILTER_CHECK_MS);
+    timer_init(&snapshot_timer, on_user_snapshot, NULL);
+    arm_timer(&snapshot_timer, USER_SNAPSHOT_INTERVAL_MS);
+    sequencer_init(0, deliver_broadcast);
+    return 0;
+}
+
+// Simulator hooks (--simulate): they stand in for the accept loop, the
+// reader threads and the writer threads of in-memory connections.
+Client* sim_connect(void) {
+    Client* client = create_client(SIM_SOCKET);
+    if (client == NULL) {
+        return NULL;
+    }
+    EnterCriticalSection(&clients_mutex);
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i] == NULL) {
+            client->id = i + 1;
+            clients[i] = client;
+            break;
+        }
+    }
+    LeaveCriticalSection(&clients_mutex);
+    if (client->id == 0) {
+        destroy_client(client);
+        return NULL;
+    }
+    client_connected(client);
+    return client;
+}
+
+void sim_receive(Client* client, const char* data, int length) {
+    if (hold_inbound(client) != 0) {
+        return;
+    }
+    memcpy(client->inbound + client->inbound_length, data, length);
+    client->received_at = trace_now();
+    client->inbound_length += length;
+    while (process_inbound(client, 0) > 0) {
+        // One thread serves every simulated client; the budget changes nothing.
+    }
+    sequencer_drain();  // No fan-out thread here
+}
+
+int sim_write(Client* client) {
+    OutFrame* frames[OUTQ_SEND_BATCH];
+    int count = outqueue_take_batch(&client->outq, frames, OUTQ_SEND_BATCH);
+    if (count > 0 && send_frames(client, frames, count) == SOCKET_ERROR) {
+        return SOCKET_ERROR;
+    }
+    return count;
+}
+
+void sim_disconnect(Client* client) {
+    printf("Client %d disconnected.\n", client->id);
+    remove_client(client);
+}
+
+void sim_advance(void) {
+    EnterCriticalSection(&timers_mutex);
+    timer_wheel_advance(&timer_wheel, net->now_ms() / TIMER_TICK_MS);
+    LeaveCriticalSection(&timers_mutex);
+    sequencer_drain();
+}
+
+// server.exe --simulate: run simulated clients through the server instead
+// of serving the network.
+int run_simulation(const SimConfig* config) {
+    const SimHandlers handlers = { sim_connect, sim_receive, sim_write, sim_disconnect, sim_advance };
+
+    // Limits are read here, as the simulation runs in a scratch folder.
+    rate_limits_load(LIMITS_FILE);
+    if (sim_begin(config) != 0) {
+        return 1;
+    }
+    srand(config->seed);
+    int result = init_services();
+    if (result == 0) {
+        outframe_pool_reserve(sim_frames_in_flight());
+        result = sim_run(&handlers);
+        DeleteCriticalSection(&timers_mutex);
+        filter_shutdown();
+        auth_shutdown();
+        filexfer_shutdown();
+        sequencer_destroy();
+        outframe_pool_destroy();
+        arena_pool_destroy();
+        buffer_pool_destroy(&inbound_pool);
+        names_destroy();
+        probes_unregister();
+        DeleteCriticalSection(&clients_mutex);
+    }
+    sim_end();
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    HANDLE takeover_in = NULL, takeover_out = NULL;
+    SimConfig simulation;
+
+    sim_config_defaults(&simulation);
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--takeover") == 0 && i + 2 < argc) {
+            // Started by a running server handing over its connections.
+            takeover_in = (HANDLE)(ULONG_PTR)strtoull(argv[i + 1], NULL, 10);
+            takeover_out = (HANDLE)(ULONG_PTR)strtoull(argv[i + 2], NULL, 10);
+            i += 2;
+        } else if (strcmp(argv[i], "--io") == 0 && i + 1 < argc) {
+            io_backend = (strcmp(argv[++i], "iocp") == 0) ? IO_IOCP : IO_THREADS;
+        } else if (strcmp(argv[i], "--node") == 0 && i + 1 < argc) {
+            snprintf(federation.node, sizeof(federation.node), "%s", argv[++i]);
+        } else if (strcmp(argv[i], "--link-port") == 0 && i + 1 < argc) {
+            federation.link_port = argv[++i];
+        } else if (strcmp(argv[i], "--link-secret") == 0 && i + 1 < argc) {
+            federation.secret = argv[++i];
+        } else if (strcmp(argv[i], "--peer") == 0 && i + 1 < argc) {
+            if (federation.peer_count < MAX_PEERS) {
+                federation.peers[federation.peer_count++] = argv[i + 1];
+            }
+            i++;
+        } else if (strcmp(argv[i], "--no-beacon") == 0) {
+            beacon_enabled = FALSE;
+        } else if (strcmp(argv[i], "--trace") == 0) {
+            trace_enabled = TRUE;
+        } else if (strcmp(argv[i], "--multicast") == 0) {
+            multicast_wanted = TRUE;
+        } else if (strcmp(argv[i], "--multicast-group") == 0 && i + 1 < argc) {
+            multicast_group = argv[++i];
+            multicast_wanted = TRUE;
+        } else if (strcmp(argv[i], "--multicast-port") == 0 && i + 1 < argc) {
+            multicast_port = atoi(argv[++i]);
+            multicast_wanted = TRUE;
+        } else if (strcmp(argv[i], "--multicast-session") == 0 && i + 1 < argc) {
+            multicast_session_in = (unsigned int)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--bench-text") == 0) {
+            textproc_init();
+            textproc_benchmark();
+            return 0;
+        } else if (strcmp(argv[i], "--simulate") == 0 && i + 1 < argc) {
+            simulation.clients = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--sim-seconds") == 0 && i + 1 < argc) {
+            simulation.seconds = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--sim-seed") == 0 && i + 1 < argc) {
+            simulation.seed = (unsigned int)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--sim-latency") == 0 && i + 1 < argc) {
+            simulation.latency_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--sim-bandwidth") == 0 && i + 1 < argc) {
+            simulation.bandwidth = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--sim-slow") == 0 && i + 1 < argc) {
+            simulation.slow_percent = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--sim-loss") == 0 && i + 1 < argc) {
+            simulation.loss_permille = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--sim-chat") == 0 && i + 1 < argc) {
+            simulation.chat_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--sim-idle") == 0) {
+            simulation.idle = 1;
+        } else if (strcmp(argv[i], "--sim-verbose") == 0) {
+            simulation.verbose = 1;
+        } else {
+            server_port = argv[i];  // Use port provided as argument.
+        }
+    }
+
+    if (simulation.clients > 0) {
+        return run_simulation(&simulation);
+    }
+
+    // Seed random number generator for dice rolls and jokes
+    srand(time(NULL));
+
+    // Set up the Ctrl+C handler.
+    if (!SetConsoleCtrlHandler(ConsoleHandler, TRUE)) {
+        fprintf(stderr, "Could not set control handler\n");
+        return 1;
+    }
+
+    if (initialize_winsock() != 0) {
+        return 1;
+    }
+    if (init_services() != 0) {
+        return 1;
+    }
+    if (multicast_wanted && multicast_start(multicast_group, multicast_port, multicast_session_in) == 0) {
+        timer_init(&multicast_timer, on_multicast_heartbeat, NULL);
+        arm_timer(&multicast_timer, MULTICAST_HEARTBEAT_MS);
+    }
+
+    HANDLE timerThread = CreateThread(NULL, 0, timer_thread, NULL, 0, NULL);
+    if (timerThread == NULL) {
+        fprintf(stderr, "Could not create timer thread\n");
+        DeleteCriticalSection(&timers_mutex);
+        DeleteCriticalSection(&clients_mutex);
+        WSACleanup();
+        return 1;
+    }
+
+    // IO_IOCP: one completion port shared by a worker per processor.
+    HANDLE workers[64];
+    int worker_count = 0;
+    if (io_backend == IO_IOCP) {
+        SYSTEM_INFO system_info;
+        GetSystemInfo(&system_info);
+        completion_port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 0);
+        for (DWORD i = 0; completion_port != NULL && i < system_info.dwNumberOfProcessors && worker_count < 64; i++) {
+            workers[worker_count] = CreateThread(NULL, 0, iocp_worker, NULL, 0, NULL);
+            if (workers[worker_count] != NULL) {
+                worker_count++;
+            }
+        }
+        if (worker_count == 0) {
+            fprintf(stderr, "Could not start the I/O completion port, using threads\n");
+            io_backend = IO_THREADS;
+        }
+    }
+    printf("Server: using %s I/O\n", io_backend == IO_IOCP ? "completion port" : "thread per client");
+    if (io_backend == IO_IOCP) {
+        printf("Server: --io iocp is experimental; it has not yet been measured against threads\n");
+    }
+
+    if (takeover_in != NULL) {
+        server_socket = adopt_handoff(takeover_in, takeover_out);
+    } else {
+        server_socket = create_listening_socket(server_port);
+    }
+    if (server_socket == INVALID_SOCKET) {
+        server_running = FALSE;
+        WaitForSingleObject(timerThread, INFINITE);
+        CloseHandle(timerThread);
+        DeleteCriticalSection(&timers_mutex);
+        DeleteCriticalSection(&clients_mutex);
+        WSACleanup();
+        return 1;
+    }
+
+    printf("Server: Listening on port %s...\n", server_port);
+    if (sequencer_start() != 0) {
+        fprintf(stderr, "Could not start the broadcast sequencer\n");
+        server_running = FALSE;
+    }
+    if (filter_start() != 0) {
+        fprintf(stderr, "Could not start the filter reload thread; reloading on the timer\n");
+    }
+
+    // Link up with other nodes, if any were configured.
+    const FederationHandlers node_handlers = { node_broadcast, node_whisper, node_notice, node_local_users };
+    if (federation.node[0] == '\0') {
+        snprintf(federation.node, sizeof(federation.node), "node-%s", server_port);
+    }
+    federation_start(&federation, &node_handlers);
+    if (beacon_enabled) {
+        discovery_start(server_port, federation.node, server_load);
+    }
 
     // Main loop: accept new client connections.
     while (server_running) {
         struct sockaddr_in client_addr;
         int addr_len = sizeof(client_addr);
-        SOCKET client_socket = accept(listen_socket, (struct sockaddr*)&client_addr, &addr_len);
+        SOCKET client_socket = accept(server_socket, (struct sockaddr*)&client_addr, &addr_len);
         if (client_socket == INVALID_SOCKET) {
-            if (server_running) {
+            if (server_running && !handed_off) {
                 fprintf(stderr, "accept failed: %d\n", WSAGetLastError());
             }
             break;
         }
 
         // Allocate a new Client structure.
-        Client* client = (Client*)malloc(sizeof(Client));
+        Client* client = create_client(client_socket);
         if (client == NULL) {
             fprintf(stderr, "Memory allocation failed for client.\n");
             closesocket(client_socket);
             continue;
         }
-        client->socket = client_socket;
 
-        // Assign a client id and add the client to the global array.
+        // Assign a client id, add the client to the global array and start
+        // its threads. A handoff in progress sees the client fully or not at all.
+        int started = 0;
         EnterCriticalSection(&clients_mutex);
-        for (int i = 0; i < MAX_CLIENTS; i++) {
+        for (int i = 0; i < MAX_CLIENTS && !handoff_in_progress; i++) {
             if (clients[i] == NULL) {
                 client->id = i + 1; // IDs start at 1.
                 clients[i] = client;
+                if (start_client(client) == 0) {
+                    started = 1;
+                    PROBE_ACCEPT(client->id, client_addr.sin_addr.s_addr, client_addr.sin_port);
+                } else {
+                    fprintf(stderr, "Could not create thread for client %d\n", client->id);
+                    clients[i] = NULL;
+                }
                 break;
             }
         }
         LeaveCriticalSection(&clients_mutex);
 
-        // Create a new thread to handle the client.
-        HANDLE threadHandle = CreateThread(NULL, 0, handle_client, (LPVOID)client, 0, NULL);
-        if (threadHandle == NULL) {
-            fprintf(stderr, "Could not create thread for client %d\n", client->id);
-            EnterCriticalSection(&clients_mutex);
-            // Remove client from list.
-            for (int i = 0; i < MAX_CLIENTS; i++) {
-                if (clients[i] == client) {
-                    clients[i] = NULL;
-                    break;
-                }
-            }
-            LeaveCriticalSection(&clients_mutex);
+        if (!started) {
             closesocket(client_socket);
-            free(client);
-        } else {
-            CloseHandle(threadHandle); // No need to keep the thread handle.
+            destroy_client(client);
         }
     }
 
     // Cleanup: close all client sockets.
     printf("Server shutting down...\n");
+    server_running = FALSE;
+    sequencer_stop();
+    WaitForSingleObject(timerThread, INFINITE);
+    CloseHandle(timerThread);
+    filter_stop();
+
+    // A completion with no client tells an IOCP worker to exit.
+    for (int i = 0; i < worker_count; i++) {
+        PostQueuedCompletionStatus(completion_port, 0, 0, NULL);
+    }
+    for (int i = 0; i < worker_count; i++) {
+        WaitForSingleObject(workers[i], INFINITE);
+        CloseHandle(workers[i]);
+    }
+    if (completion_port != NULL) {
+        CloseHandle(completion_port);
+    }
+
     EnterCriticalSection(&clients_mutex);
     for (int i = 0; i < MAX_CLIENTS; i++) {
         if (clients[i] != NULL) {
@@ -615,9 +2461,25 @@ int main(int argc, char *argv[]) {
         }
     }
     LeaveCriticalSection(&clients_mutex);
+    DeleteCriticalSection(&timers_mutex);
+    metrics_report();
+    discovery_stop();
+    federation_stop();
+    multicast_stop();
+    filter_shutdown();
+    auth_shutdown();
+    filexfer_shutdown();
+    sequencer_destroy();
+    outframe_pool_destroy();
+    arena_pool_destroy();
+    buffer_pool_destroy(&inbound_pool);
+    names_destroy();
+    probes_unregister();
 
     DeleteCriticalSection(&clients_mutex);
-    closesocket(listen_socket);
+    if (!handed_off) {
+        closesocket(server_socket);
+    }
     WSACleanup();
     return 0;
 }
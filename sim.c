@@ -0,0 +1,533 @@
+#include "sim.h"
+#include "netio.h"
+#include "metrics.h"
+#include "auth.h"
+#include <io.h>
+#include <psapi.h>
+
+#define SIM_START_US 1000000LL      // The virtual clock starts here; 0 means "not stamped"
+#define SIM_UPSTREAM_MAX 16         // Messages a user can have in flight to the server
+
+// One direction of a connection.
+typedef struct {
+    long long busy_until;       // When the last send has left the sender
+    long long last_arrival;     // Bytes arrive in order, so nothing lands before this
+    int bandwidth;
+} SimLink;
+
+// A message on its way to the server.
+typedef struct {
+    long long arrival;
+    int type;
+    long long written_ms;       // MSG_CHAT: virtual time the user wrote it
+} SimPacket;
+
+// A frame on its way to a user; only the ones the user reacts to are kept.
+typedef struct {
+    long long arrival;
+    int type;
+    long long written_ms;       // MSG_CHAT from a simulated user, else -1
+    int login_ok;
+} SimDelivery;
+
+typedef struct {
+    Client* client;             // NULL while not connected
+    int index;
+    int started;
+    int slow;
+    int logged_in;
+    int closing;                // The server shut the connection down
+    long long connect_at;
+    long long next_chat;
+    SimLink up;
+    SimLink down;
+    SimPacket upstream[SIM_UPSTREAM_MAX];
+    int up_head;
+    int up_count;
+    SimDelivery* inbox;         // Ring, grown as needed
+    int in_head;
+    int in_count;
+    int in_capacity;
+    long long received;         // Chat lines from other users
+} SimUser;
+
+static SimConfig config;
+static SimUser* users = NULL;
+static SimUser* users_by_slot[MAX_CLIENTS];
+static long long sim_now;                   // Virtual microseconds
+static unsigned int random_state;
+static long long latency_counts[SIM_LATENCY_BUCKETS];
+static long long latency_max;
+static long long chats_written, chats_delivered, logins, refused, disconnects;
+static long long inbox_bytes;               // Held by the users' inboxes, for --sim-idle
+static char home[MAX_PATH];
+static char sandbox[MAX_PATH];
+static FILE* report = NULL;
+
+#ifdef SIM_COUNT_ALLOCS
+// Linked with --wrap for malloc, calloc and realloc (make sim.exe), so every
+// allocation the server makes comes through here, not only the misses it
+// reports in METRIC_HEAP_ALLOCS. The simulator's own buffers are left out.
+static volatile LONGLONG heap_calls;
+static int sim_allocating;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* block, size_t size);
+
+void* __wrap_malloc(size_t size) {
+    if (!sim_allocating) {
+        InterlockedIncrement64(&heap_calls);
+    }
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+    if (!sim_allocating) {
+        InterlockedIncrement64(&heap_calls);
+    }
+    return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* block, size_t size) {
+    if (!sim_allocating) {
+        InterlockedIncrement64(&heap_calls);
+    }
+    return __real_realloc(block, size);
+}
+
+static long long heap_allocations(void) {
+    return heap_calls;
+}
+#else
+static int sim_allocating;
+
+static long long heap_allocations(void) {
+    return metrics[METRIC_HEAP_ALLOCS];
+}
+#endif
+
+// xorshift32; rand() is left to the server code.
+static unsigned int next_random(void) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
+
+static unsigned long long sim_now_ms(void) {
+    return (unsigned long long)(sim_now / 1000);
+}
+
+static long long sim_now_us(void) {
+    return sim_now;
+}
+
+// Put 'bytes' on a link now; returns when they reach the other end.
+static long long link_send(SimLink* link, int bytes) {
+    long long start = link->busy_until > sim_now ? link->busy_until : sim_now;
+    link->busy_until = start + (long long)bytes * 1000000 / link->bandwidth;
+    long long arrival = link->busy_until + config.latency_ms * 1000LL;
+    if (config.loss_permille > 0 && (int)(next_random() % 1000) < config.loss_permille) {
+        arrival += SIM_RETRANSMIT_MS * 1000LL;
+    }
+    if (arrival < link->last_arrival) {
+        arrival = link->last_arrival;
+    }
+    link->last_arrival = arrival;
+    return arrival;
+}
+
+static int inbox_push(SimUser* user, const SimDelivery* delivery) {
+    if (user->in_count == user->in_capacity) {
+        int capacity = user->in_capacity > 0 ? user->in_capacity * 2 : 64;
+        sim_allocating = 1;
+        SimDelivery* inbox = (SimDelivery*)malloc(capacity * sizeof(SimDelivery));
+        sim_allocating = 0;
+        if (inbox == NULL) {
+            return 1;
+        }
+        for (int i = 0; i < user->in_count; i++) {
+            inbox[i] = user->inbox[(user->in_head + i) % user->in_capacity];
+        }
+        free(user->inbox);
+        inbox_bytes += (long long)(capacity - user->in_capacity) * sizeof(SimDelivery);
+        user->inbox = inbox;
+        user->in_head = 0;
+        user->in_capacity = capacity;
+    }
+    user->inbox[(user->in_head + user->in_count) % user->in_capacity] = *delivery;
+    user->in_count++;
+    return 0;
+}
+
+// The "t=<ms>" a simulated user put in its chat line, or -1.
+static long long written_stamp(const char* payload, int length) {
+    for (int i = 0; i + 2 < length; i++) {
+        if (payload[i] == 't' && payload[i + 1] == '=') {
+            long long value = 0;
+            for (i += 2; i < length && payload[i] >= '0' && payload[i] <= '9'; i++) {
+                value = value * 10 + (payload[i] - '0');
+            }
+            return value;
+        }
+    }
+    return -1;
+}
+
+// NetIO send: the writer hands a batch to the user's downstream link.
+static int sim_send(Client* client, WSABUF* buffers, int count) {
+    SimUser* user = users_by_slot[client->id - 1];
+    int bytes = 0;
+
+    if (user == NULL || user->closing) {
+        WSASetLastError(WSAESHUTDOWN);
+        return SOCKET_ERROR;
+    }
+    for (int i = 0; i < count; i++) {
+        bytes += (int)buffers[i].len;
+    }
+    long long arrival = link_send(&user->down, bytes);
+
+    for (int i = 0; i < count; i++) {
+        FrameHeader header;
+        const char* payload = buffers[i].buf + sizeof(FrameHeader);
+        SimDelivery delivery;
+
+        memcpy(&header, buffers[i].buf, sizeof(header));
+        if (buffers[i].len == sizeof(FrameHeader) && header.length > 0 && i + 1 < count) {
+            payload = buffers[++i].buf;  // A shared payload follows its header
+        }
+        delivery.arrival = arrival;
+        delivery.type = header.type;
+        delivery.written_ms = -1;
+        delivery.login_ok = 0;
+        if (header.type == MSG_CHAT) {
+            delivery.written_ms = written_stamp(payload, header.length);
+        } else if (header.type == MSG_AUTH) {
+            delivery.login_ok = header.length == 16 && memcmp(payload, "Login successful", 16) == 0;
+        } else if (header.type != MSG_PING) {
+            continue;
+        }
+        if (inbox_push(user, &delivery) != 0) {
+            WSASetLastError(WSAENOBUFS);
+            return SOCKET_ERROR;
+        }
+    }
+    return 0;
+}
+
+static void sim_shutdown(Client* client) {
+    SimUser* user = users_by_slot[client->id - 1];
+    if (user != NULL) {
+        user->closing = 1;
+    }
+}
+
+static void sim_close(Client* client) {
+    SimUser* user = users_by_slot[client->id - 1];
+    if (user != NULL) {
+        user->client = NULL;
+        users_by_slot[client->id - 1] = NULL;
+    }
+}
+
+static const NetIO sim_io = { sim_now_ms, sim_now_us, sim_send, sim_shutdown, sim_close };
+
+// Queue a message to the server. Returns 0 if the user's socket buffer is full.
+static int user_send(SimUser* user, int type) {
+    if (user->up_count == SIM_UPSTREAM_MAX) {
+        return 0;
+    }
+    SimPacket* packet = &user->upstream[(user->up_head + user->up_count) % SIM_UPSTREAM_MAX];
+    packet->arrival = link_send(&user->up, (int)sizeof(Message));
+    packet->type = type;
+    packet->written_ms = sim_now / 1000;
+    user->up_count++;
+    return 1;
+}
+
+// Hand the server the messages that have reached it.
+static void deliver_upstream(SimUser* user, const SimHandlers* handlers) {
+    Message msg;
+
+    while (user->client != NULL && user->up_count > 0 && user->upstream[user->up_head].arrival <= sim_now) {
+        const SimPacket* packet = &user->upstream[user->up_head];
+        memset(&msg, 0, sizeof(msg));
+        msg.type = packet->type;
+        snprintf(msg.username, sizeof(msg.username), "sim%d", user->index);
+        if (packet->type == MSG_REGISTER || packet->type == MSG_AUTH) {
+            strcpy(msg.content, "simulated");
+        } else if (packet->type == MSG_CHAT) {
+            snprintf(msg.content, BUFFER_SIZE, "t=%lld hello from sim%d", packet->written_ms, user->index);
+        }
+        user->up_head = (user->up_head + 1) % SIM_UPSTREAM_MAX;
+        user->up_count--;
+        handlers->receive(user->client, (const char*)&msg, (int)sizeof(msg));
+    }
+}
+
+// Let the user react to what has reached it.
+static void deliver_downstream(SimUser* user) {
+    while (user->in_count > 0 && user->inbox[user->in_head].arrival <= sim_now) {
+        const SimDelivery* delivery = &user->inbox[user->in_head];
+        if (delivery->type == MSG_PING) {
+            user_send(user, MSG_PONG);
+        } else if (delivery->login_ok && !user->logged_in) {
+            user->logged_in = 1;
+            user->next_chat = sim_now + (long long)(next_random() % (2 * config.chat_ms)) * 1000;
+            logins++;
+        } else if (delivery->written_ms >= 0) {
+            long long latency = sim_now / 1000 - delivery->written_ms;
+            latency_counts[latency < SIM_LATENCY_BUCKETS ? latency : SIM_LATENCY_BUCKETS - 1]++;
+            if (latency > latency_max) {
+                latency_max = latency;
+            }
+            chats_delivered++;
+            user->received++;
+        }
+        user->in_head = (user->in_head + 1) % user->in_capacity;
+        user->in_count--;
+    }
+}
+
+static long long latency_percentile(int percent) {
+    long long rank = (chats_delivered * percent + 99) / 100;
+    long long seen = 0;
+    for (int i = 0; i < SIM_LATENCY_BUCKETS - 1; i++) {
+        seen += latency_counts[i];
+        if (seen >= rank) {
+            return i;
+        }
+    }
+    return latency_max;
+}
+
+static long long resident_bytes(void) {
+    PROCESS_MEMORY_COUNTERS counters;
+    counters.cb = sizeof(counters);
+    return GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)) ?
+           (long long)counters.WorkingSetSize : 0;
+}
+
+// --sim-idle: the server's resident bytes per connected user since
+// 'baseline', or -1 if nobody is connected.
+static long long idle_bytes_per_connection(long long baseline) {
+    int connected = 0;
+    for (int i = 0; i < config.clients; i++) {
+        connected += users[i].client != NULL && users[i].logged_in;
+    }
+    return connected > 0 ? (resident_bytes() - baseline - inbox_bytes) / connected : -1;
+}
+
+static void print_report(unsigned long long elapsed_ms) {
+    long long fast_received = 0, slow_received = 0;
+    int fast = 0, slow = 0;
+
+    for (int i = 0; i < config.clients; i++) {
+        if (users[i].slow) {
+            slow_received += users[i].received;
+            slow++;
+        } else {
+            fast_received += users[i].received;
+            fast++;
+        }
+    }
+    fprintf(report, "Simulated %d clients for %d s (seed %u) in %.2f s\n",
+            config.clients, config.seconds, config.seed, elapsed_ms / 1000.0);
+    fprintf(report, "  logins %lld, refused %lld, disconnected by the server %lld\n",
+            logins, refused, disconnects);
+    fprintf(report, "  chat written %lld, delivered %lld\n", chats_written, chats_delivered);
+    if (chats_delivered > 0) {
+        fprintf(report, "  delivery latency p50=%lldms p90=%lldms p99=%lldms max=%lldms\n",
+                latency_percentile(50), latency_percentile(90), latency_percentile(99), latency_max);
+    }
+    fprintf(report, "  lines received per client: %.1f at full speed", fast > 0 ? (double)fast_received / fast : 0.0);
+    if (slow > 0) {
+        fprintf(report, ", %.1f on slow links (%d clients)", (double)slow_received / slow, slow);
+    }
+    fprintf(report, "\n  broadcast_dropped=%ld limited_chat=%ld rate_delayed=%ld frames_sent=%ld send_calls=%ld\n",
+            (long)metrics[METRIC_BROADCAST_DROPPED], (long)metrics[METRIC_LIMITED_CHAT],
+            (long)metrics[METRIC_RATE_DELAYED], (long)metrics[METRIC_FRAMES_SENT],
+            (long)metrics[METRIC_SEND_CALLS]);
+    fflush(report);
+}
+
+void sim_config_defaults(SimConfig* settings) {
+    memset(settings, 0, sizeof(*settings));
+    settings->seconds = SIM_DEFAULT_SECONDS;
+    settings->seed = 1;
+    settings->latency_ms = SIM_DEFAULT_LATENCY_MS;
+    settings->bandwidth = SIM_DEFAULT_BANDWIDTH;
+    settings->chat_ms = SIM_DEFAULT_CHAT_MS;
+}
+
+// Set up the users, move into a scratch folder and switch the server over
+// to the virtual clock and connections. Returns 0 on success.
+int sim_begin(const SimConfig* settings) {
+    config = *settings;
+    if (config.clients > MAX_CLIENTS) {
+        fprintf(stderr, "This build serves at most %d clients; simulating that many\n", MAX_CLIENTS);
+        config.clients = MAX_CLIENTS;
+    }
+    if (config.clients <= 0 || config.seconds <= 0 || config.bandwidth <= 0 || config.chat_ms <= 0) {
+        fprintf(stderr, "Nothing to simulate\n");
+        return 1;
+    }
+
+    users = (SimUser*)calloc(config.clients, sizeof(SimUser));
+    if (users == NULL) {
+        return 1;
+    }
+    random_state = config.seed != 0 ? config.seed : 1;
+    sim_now = SIM_START_US;
+    for (int i = 0; i < config.clients; i++) {
+        SimUser* user = &users[i];
+        user->index = i;
+        user->connect_at = SIM_START_US + (long long)i * SIM_CONNECT_SPREAD_MS * 1000 / config.clients;
+        user->slow = (int)(next_random() % 100) < config.slow_percent;
+        user->up.bandwidth = config.bandwidth;
+        user->down.bandwidth = user->slow ? SIM_SLOW_BANDWIDTH : config.bandwidth;
+    }
+
+    GetCurrentDirectory(MAX_PATH, home);
+    GetTempPath(MAX_PATH, sandbox);
+    snprintf(sandbox + strlen(sandbox), MAX_PATH - strlen(sandbox), "chat-sim-%lu", GetCurrentProcessId());
+    if (!CreateDirectory(sandbox, NULL) || !SetCurrentDirectory(sandbox)) {
+        fprintf(stderr, "Could not create %s: %lu\n", sandbox, GetLastError());
+        free(users);
+        users = NULL;
+        return 1;
+    }
+
+    // The server logs every frame; keep that out of the report unless asked.
+    report = stdout;
+    if (!config.verbose) {
+        fflush(stdout);
+        FILE* saved = _fdopen(_dup(_fileno(stdout)), "w");
+        if (saved != NULL && freopen("NUL", "w", stdout) != NULL) {
+            report = saved;
+        }
+    }
+    net = &sim_io;
+    return 0;
+}
+
+// Frames the server can hold at once under this load: every slow user's
+// broadcast lane full, the broadcasts those lanes share, and a few frames
+// for everyone else. Valid after sim_begin().
+int sim_frames_in_flight(void) {
+    int slow = 0;
+    for (int i = 0; i < config.clients; i++) {
+        slow += users[i].slow;
+    }
+    return (slow + 1) * OUTQ_MAX_BROADCAST + 4 * config.clients;
+}
+
+// Run the simulation to the end and print what happened.
+int sim_run(const SimHandlers* handlers) {
+    long long end = sim_now + config.seconds * 1000000LL;
+    unsigned long long started = GetTickCount64();
+    long long baseline = resident_bytes();
+    // Warm once everyone has connected, started chatting and been pinged.
+    long long warm_at = sim_now + (SIM_CONNECT_SPREAD_MS + 2LL * config.chat_ms + HEARTBEAT_INTERVAL_MS) * 1000;
+    long long warm_allocs = -1;
+    int result = 0;
+
+    while (sim_now < end) {
+        for (int i = 0; i < config.clients; i++) {
+            SimUser* user = &users[i];
+            if (!user->started && user->connect_at <= sim_now) {
+                user->started = 1;
+                user->client = handlers->connect();
+                if (user->client == NULL) {
+                    refused++;
+                    continue;
+                }
+                users_by_slot[user->client->id - 1] = user;
+                user_send(user, MSG_REGISTER);
+                user_send(user, MSG_AUTH);
+            }
+            if (user->client == NULL) {
+                continue;
+            }
+
+            deliver_upstream(user, handlers);
+            // The writer gets the link back once its last send has left.
+            while (user->client != NULL && !user->closing && user->down.busy_until <= sim_now) {
+                int sent = handlers->write(user->client);
+                if (sent == SOCKET_ERROR) {
+                    user->closing = 1;
+                }
+                if (sent <= 0) {
+                    break;
+                }
+            }
+            deliver_downstream(user);
+
+            if (user->logged_in && !config.idle && user->next_chat <= sim_now) {
+                chats_written += user_send(user, MSG_CHAT);
+                user->next_chat = sim_now + (long long)(next_random() % (2 * config.chat_ms) + 1) * 1000;
+            }
+            if (user->client != NULL && user->closing) {
+                handlers->disconnect(user->client);
+                disconnects++;
+            }
+        }
+        handlers->advance();
+        sim_now += SIM_STEP_US;
+        if (warm_allocs < 0 && sim_now >= warm_at) {
+            warm_allocs = heap_allocations();
+        }
+    }
+    long long steady_allocs = warm_allocs >= 0 ? heap_allocations() - warm_allocs : -1;
+
+    long long idle_bytes = config.idle ? idle_bytes_per_connection(baseline) : -1;
+    for (int i = 0; i < config.clients; i++) {
+        if (users[i].client != NULL) {
+            handlers->disconnect(users[i].client);
+        }
+    }
+    print_report(GetTickCount64() - started);
+    if (steady_allocs < 0) {
+        fprintf(report, "  heap allocations not checked: the run ended during warm-up\n");
+    } else {
+        fprintf(report, "  heap allocations after warm-up: %lld\n", steady_allocs);
+        if (steady_allocs > 0) {
+            fprintf(report, "  the pools should serve steady traffic\n");
+            result = 1;
+        }
+    }
+    fflush(report);
+    if (config.idle) {
+        fprintf(report, "  idle connection: %lld bytes resident (budget %d, %lld MB for %d)\n",
+                idle_bytes, SIM_IDLE_BUDGET, idle_bytes * SIM_IDLE_TARGET / (1024 * 1024), SIM_IDLE_TARGET);
+        if (idle_bytes < 0 || idle_bytes > SIM_IDLE_BUDGET) {
+            fprintf(report, "  over budget\n");
+            result = 1;
+        }
+        fflush(report);
+    }
+    return result;
+}
+
+// Switch back to the real clock and sockets and remove the scratch folder.
+// The server must have let go of its files first.
+void sim_end(void) {
+    DeleteFile(USERS_FILE);
+    DeleteFile(USERS_SNAPSHOT);
+    RemoveDirectory(FILE_SPOOL_DIR);
+    SetCurrentDirectory(home);
+    RemoveDirectory(sandbox);
+
+    net = &winsock_io;
+    for (int i = 0; i < config.clients; i++) {
+        free(users[i].inbox);
+    }
+    free(users);
+    users = NULL;
+    if (report != stdout) {
+        fclose(report);
+    }
+    report = NULL;
+}
@@ -0,0 +1,76 @@
+#ifndef SIM_H
+#define SIM_H
+
+#include "common.h"
+
+// Deterministic simulation of many clients against the real server code
+// (server.exe --simulate <clients>). Everything runs on one thread under a
+// virtual clock: simulated users log in, chat and answer pings over
+// in-memory connections with a set latency, bandwidth and loss, while the
+// server's frame handling, broadcast, queues, rate limits and timers run
+// exactly as they do for real sockets. The same seed gives the same run, so
+// queue and scheduling policies can be compared on equal terms.
+//
+// Connections model TCP: bytes arrive in order, a send occupies the link
+// for its size over the bandwidth, and a lost packet shows up as a
+// retransmission delay rather than missing data. The server's writer is
+// only given a link once its previous send has left, as a blocking WSASend
+// would. Accounts are created in a scratch folder that is removed afterwards.
+//
+// With --sim-idle the users stay silent after logging in, and the report
+// gives the growth of the process's working set per connection, less the
+// simulator's own buffers. sim_run() returns 1 if that is over budget. The
+// simulated connections have no sockets or threads, so this measures what
+// the server itself keeps per client.
+//
+// Once every user has connected, chatted and answered a ping, the frame,
+// buffer and arena pools should serve everything: sim_run() also returns 1
+// if the heap is used after that. sim.exe (built with SIM_COUNT_ALLOCS and
+// the linker wrapping malloc, calloc and realloc) counts every allocation;
+// other builds only see the misses the pools report in METRIC_HEAP_ALLOCS.
+// The frame pool is sized with sim_frames_in_flight(), so an overloaded run
+// whose slow users fill their queues is held to the same rule.
+
+#define SIM_STEP_US 1000                    // Virtual time per simulation step
+#define SIM_DEFAULT_SECONDS 60
+#define SIM_DEFAULT_LATENCY_MS 20           // One way
+#define SIM_DEFAULT_BANDWIDTH (1024 * 1024) // Bytes per second, each direction
+#define SIM_SLOW_BANDWIDTH (4 * 1024)       // For the --sim-slow share of clients
+#define SIM_DEFAULT_CHAT_MS 10000           // Mean time between a user's messages
+#define SIM_RETRANSMIT_MS 200               // Extra delay of a lost packet
+#define SIM_CONNECT_SPREAD_MS 1000          // Clients connect over this long
+#define SIM_LATENCY_BUCKETS 10000           // Delivery latency histogram, 1 ms buckets
+#define SIM_SOCKET ((SOCKET)1)              // Stands in for the socket of a simulated client
+#define SIM_IDLE_BUDGET 2048                // Resident bytes allowed per idle connection (--sim-idle)
+#define SIM_IDLE_TARGET 100000              // Idle connections the budget is sized for
+
+typedef struct {
+    int clients;
+    int seconds;                // Virtual time to run
+    unsigned int seed;
+    int latency_ms;
+    int bandwidth;
+    int slow_percent;           // Clients limited to SIM_SLOW_BANDWIDTH
+    int loss_permille;          // Sends that need a retransmission
+    int chat_ms;
+    int idle;                   // Users only log in and answer pings; the run fails if
+                                // an idle connection costs more than SIM_IDLE_BUDGET
+    int verbose;                // Keep the server's own output
+} SimConfig;
+
+// The server's side of a simulated connection; implemented by server.c.
+typedef struct {
+    Client* (*connect)(void);                               // NULL if the server is full
+    void (*receive)(Client* client, const char* data, int length);
+    int (*write)(Client* client);                           // Send what is due; frames sent or SOCKET_ERROR
+    void (*disconnect)(Client* client);                     // The connection has ended
+    void (*advance)(void);                                  // Run timers that are due
+} SimHandlers;
+
+void sim_config_defaults(SimConfig* config);
+int sim_begin(const SimConfig* config);
+int sim_frames_in_flight(void);
+int sim_run(const SimHandlers* handlers);
+void sim_end(void);
+
+#endif // SIM_H
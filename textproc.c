@@ -0,0 +1,387 @@
+#include "textproc.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TEXTPROC_X86 1
+#include <immintrin.h>
+#endif
+
+#define BENCH_SIZE 1024
+#define BENCH_ITERATIONS 200000
+
+// One implementation of the vectorizable steps.
+typedef struct {
+    const char* name;
+    // Copy the run of printable ASCII starting at r down to w (w <= r), stopping
+    // at the first byte that needs a closer look. Returns the run length.
+    int (*plain_run)(char* text, int r, int w, int limit);
+    int (*length)(const char* text, int capacity);
+    void (*upper)(char* text, int length);
+} TextImpl;
+
+static int is_plain(unsigned char c) {
+    return c >= 0x20 && c < 0x7F;
+}
+
+static int plain_run_scalar(char* text, int r, int w, int limit) {
+    int start = r;
+    while (r < limit && is_plain((unsigned char)text[r])) {
+        text[w++] = text[r++];
+    }
+    return r - start;
+}
+
+static int length_scalar(const char* text, int capacity) {
+    int i = 0;
+    while (i < capacity && text[i] != '\0') {
+        i++;
+    }
+    return i;
+}
+
+static void upper_scalar(char* text, int length) {
+    for (int i = 0; i < length; i++) {
+        if (text[i] >= 'a' && text[i] <= 'z') {
+            text[i] -= 'a' - 'A';
+        }
+    }
+}
+
+static const TextImpl scalar_impl = { "scalar", plain_run_scalar, length_scalar, upper_scalar };
+
+#ifdef TEXTPROC_X86
+// Bytes below 0x20 and 0x80-0xFF compare below ' ' as signed chars, so one
+// compare plus one for DEL finds everything that is not printable ASCII.
+
+__attribute__((target("sse2")))
+static int plain_run_sse2(char* text, int r, int w, int limit) {
+    const __m128i space = _mm_set1_epi8(0x20);
+    const __m128i del = _mm_set1_epi8(0x7F);
+    int start = r;
+
+    while (r + 16 <= limit) {
+        __m128i block = _mm_loadu_si128((const __m128i*)(text + r));
+        __m128i special = _mm_or_si128(_mm_cmplt_epi8(block, space), _mm_cmpeq_epi8(block, del));
+        int mask = _mm_movemask_epi8(special);
+        if (mask != 0) {
+            int n = __builtin_ctz((unsigned)mask);
+            memmove(text + w, text + r, n);
+            return r + n - start;
+        }
+        // The whole block was loaded before the store, so overlap is safe.
+        _mm_storeu_si128((__m128i*)(text + w), block);
+        r += 16;
+        w += 16;
+    }
+    return r - start + plain_run_scalar(text, r, w, limit);
+}
+
+__attribute__((target("sse2")))
+static int length_sse2(const char* text, int capacity) {
+    const __m128i zero = _mm_setzero_si128();
+    int i = 0;
+
+    for (; i + 16 <= capacity; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*)(text + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, zero));
+        if (mask != 0) {
+            return i + __builtin_ctz((unsigned)mask);
+        }
+    }
+    return i + length_scalar(text + i, capacity - i);
+}
+
+__attribute__((target("sse2")))
+static void upper_sse2(char* text, int length) {
+    const __m128i before_a = _mm_set1_epi8('a' - 1);
+    const __m128i after_z = _mm_set1_epi8('z' + 1);
+    const __m128i case_bit = _mm_set1_epi8(0x20);
+    int i = 0;
+
+    for (; i + 16 <= length; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*)(text + i));
+        __m128i lower = _mm_and_si128(_mm_cmpgt_epi8(block, before_a), _mm_cmplt_epi8(block, after_z));
+        block = _mm_xor_si128(block, _mm_and_si128(lower, case_bit));
+        _mm_storeu_si128((__m128i*)(text + i), block);
+    }
+    upper_scalar(text + i, length - i);
+}
+
+__attribute__((target("avx2")))
+static int plain_run_avx2(char* text, int r, int w, int limit) {
+    const __m256i space = _mm256_set1_epi8(0x20);
+    const __m256i del = _mm256_set1_epi8(0x7F);
+    int start = r;
+
+    while (r + 32 <= limit) {
+        __m256i block = _mm256_loadu_si256((const __m256i*)(text + r));
+        __m256i special = _mm256_or_si256(_mm256_cmpgt_epi8(space, block), _mm256_cmpeq_epi8(block, del));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(special);
+        if (mask != 0) {
+            int n = __builtin_ctz(mask);
+            memmove(text + w, text + r, n);
+            return r + n - start;
+        }
+        _mm256_storeu_si256((__m256i*)(text + w), block);
+        r += 32;
+        w += 32;
+    }
+    return r - start + plain_run_sse2(text, r, w, limit);
+}
+
+__attribute__((target("avx2")))
+static int length_avx2(const char* text, int capacity) {
+    const __m256i zero = _mm256_setzero_si256();
+    int i = 0;
+
+    for (; i + 32 <= capacity; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i*)(text + i));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, zero));
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + length_sse2(text + i, capacity - i);
+}
+
+__attribute__((target("avx2")))
+static void upper_avx2(char* text, int length) {
+    const __m256i before_a = _mm256_set1_epi8('a' - 1);
+    const __m256i after_z = _mm256_set1_epi8('z' + 1);
+    const __m256i case_bit = _mm256_set1_epi8(0x20);
+    int i = 0;
+
+    for (; i + 32 <= length; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i*)(text + i));
+        __m256i lower = _mm256_and_si256(_mm256_cmpgt_epi8(block, before_a), _mm256_cmpgt_epi8(after_z, block));
+        block = _mm256_xor_si256(block, _mm256_and_si256(lower, case_bit));
+        _mm256_storeu_si256((__m256i*)(text + i), block);
+    }
+    upper_sse2(text + i, length - i);
+}
+
+static const TextImpl sse2_impl = { "SSE2", plain_run_sse2, length_sse2, upper_sse2 };
+static const TextImpl avx2_impl = { "AVX2", plain_run_avx2, length_avx2, upper_avx2 };
+#endif
+
+static const TextImpl* text_impl = &scalar_impl;
+
+// Fill 'impls' with every implementation this CPU can run, slowest first.
+static int available_impls(const TextImpl** impls) {
+    int count = 0;
+    impls[count++] = &scalar_impl;
+#ifdef TEXTPROC_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        impls[count++] = &sse2_impl;
+        if (__builtin_cpu_supports("avx2")) {
+            impls[count++] = &avx2_impl;
+        }
+    }
+#endif
+    return count;
+}
+
+const char* textproc_init(void) {
+    const TextImpl* impls[3];
+    int count = available_impls(impls);
+    text_impl = impls[count - 1];
+    return text_impl->name;
+}
+
+// Length of the well-formed UTF-8 sequence at s, or 0 if it is invalid,
+// overlong, a surrogate, above U+10FFFF or cut off by the end of the buffer.
+static int utf8_sequence_length(const unsigned char* s, int available) {
+    unsigned char lo = 0x80, hi = 0xBF;
+    int length;
+
+    if (s[0] >= 0xC2 && s[0] <= 0xDF) {
+        length = 2;
+    } else if (s[0] >= 0xE0 && s[0] <= 0xEF) {
+        length = 3;
+        if (s[0] == 0xE0) lo = 0xA0;
+        else if (s[0] == 0xED) hi = 0x9F;
+    } else if (s[0] >= 0xF0 && s[0] <= 0xF4) {
+        length = 4;
+        if (s[0] == 0xF0) lo = 0x90;
+        else if (s[0] == 0xF4) hi = 0x8F;
+    } else {
+        return 0;
+    }
+    if (length > available || s[1] < lo || s[1] > hi) {
+        return 0;
+    }
+    for (int i = 2; i < length; i++) {
+        if (s[i] < 0x80 || s[i] > 0xBF) {
+            return 0;
+        }
+    }
+    return length;
+}
+
+// Skip the escape sequence starting with the ESC at s[r]; returns the index after it.
+static int skip_escape(const unsigned char* s, int r, int limit) {
+    r++;
+    if (r >= limit) {
+        return r;
+    }
+    if (s[r] == '[') {
+        // CSI: parameter and intermediate bytes, then one final byte.
+        r++;
+        while (r < limit && s[r] >= 0x20 && s[r] <= 0x3F) {
+            r++;
+        }
+        if (r < limit && s[r] >= 0x40 && s[r] <= 0x7E) {
+            r++;
+        }
+    } else if (s[r] == ']') {
+        // OSC: runs until BEL or ESC backslash.
+        r++;
+        while (r < limit && s[r] != '\0' && s[r] != 0x07) {
+            if (s[r] == 0x1B && r + 1 < limit && s[r + 1] == '\\') {
+                return r + 2;
+            }
+            r++;
+        }
+        if (r < limit && s[r] == 0x07) {
+            r++;
+        }
+    } else if (s[r] >= 0x20 && s[r] <= 0x7E) {
+        r++;
+    }
+    return r;
+}
+
+static int sanitize_with(const TextImpl* impl, char* text, int capacity, int* changed) {
+    unsigned char* s = (unsigned char*)text;
+    int limit = capacity - 1;
+    int r = 0, w = 0;
+
+    *changed = 0;
+    if (capacity <= 0) {
+        return 0;
+    }
+    while (r < limit) {
+        int n = impl->plain_run(text, r, w, limit);
+        r += n;
+        w += n;
+        if (r >= limit || s[r] == '\0') {
+            break;
+        }
+
+        unsigned char c = s[r];
+        if (c == 0x1B) {
+            r = skip_escape(s, r, limit);
+            *changed = 1;
+        } else if (c < 0x80) {
+            // Control byte or DEL.
+            if (c == '\t') {
+                s[w++] = ' ';
+            }
+            r++;
+            *changed = 1;
+        } else {
+            int length = utf8_sequence_length(s + r, limit - r);
+            if (length == 0) {
+                s[w++] = '?';
+                r++;
+                *changed = 1;
+            } else if (length == 2 && c == 0xC2 && s[r + 1] < 0xA0) {
+                // U+0080-U+009F are C1 controls; some terminals act on them.
+                r += 2;
+                *changed = 1;
+            } else {
+                memmove(s + w, s + r, length);
+                r += length;
+                w += length;
+            }
+        }
+    }
+    s[w] = '\0';
+    return w;
+}
+
+int text_sanitize(char* text, int capacity, int* changed) {
+    return sanitize_with(text_impl, text, capacity, changed);
+}
+
+int text_is_clean(const char* text, int capacity) {
+    const unsigned char* s = (const unsigned char*)text;
+    int limit = text_length(text, capacity);
+
+    for (int r = 0; r < limit; ) {
+        if (s[r] < 0x20 || s[r] == 0x7F) {
+            return 0;
+        }
+        if (s[r] < 0x80) {
+            r++;
+            continue;
+        }
+        int length = utf8_sequence_length(s + r, limit - r);
+        if (length == 0 || (length == 2 && s[r] == 0xC2 && s[r + 1] < 0xA0)) {
+            return 0;
+        }
+        r += length;
+    }
+    return 1;
+}
+
+int text_length(const char* text, int capacity) {
+    return text_impl->length(text, capacity);
+}
+
+void text_to_upper(char* text, int length) {
+    text_impl->upper(text, length);
+}
+
+static double megabytes_per_second(clock_t start, clock_t end) {
+    double seconds = (double)(end - start) / CLOCKS_PER_SEC;
+    double megabytes = (double)BENCH_SIZE * BENCH_ITERATIONS / (1024.0 * 1024.0);
+    return seconds > 0 ? megabytes / seconds : 0;
+}
+
+void textproc_benchmark(void) {
+    static const char pattern[] = "The quick brown fox jumps over the lazy dog at the caf\xC3\xA9 again! ";
+    char sample[BENCH_SIZE];
+    char work[BENCH_SIZE];
+    const TextImpl* impls[3];
+    int count = available_impls(impls);
+    volatile int sink = 0;
+    clock_t start;
+
+    for (int i = 0; i < BENCH_SIZE - 1; i++) {
+        sample[i] = pattern[i % (sizeof(pattern) - 1)];
+    }
+    sample[BENCH_SIZE - 1] = '\0';
+
+    printf("Text pipeline, %d bytes x %d messages:\n", BENCH_SIZE, BENCH_ITERATIONS);
+
+    // The per-message work the server did before: strlen plus a toupper loop.
+    start = clock();
+    for (int n = 0; n < BENCH_ITERATIONS; n++) {
+        memcpy(work, sample, BENCH_SIZE);
+        int length = (int)strlen(work);
+        for (int i = 0; i < length; i++) {
+            work[i] = toupper((unsigned char)work[i]);
+        }
+        sink += work[n % length];
+    }
+    printf("  %-8s %8.0f MB/s (strlen + toupper only)\n", "old", megabytes_per_second(start, clock()));
+
+    for (int k = 0; k < count; k++) {
+        start = clock();
+        for (int n = 0; n < BENCH_ITERATIONS; n++) {
+            int changed;
+            memcpy(work, sample, BENCH_SIZE);
+            int length = sanitize_with(impls[k], work, BENCH_SIZE, &changed);
+            impls[k]->length(work, BENCH_SIZE);
+            impls[k]->upper(work, length);
+            sink += work[n % length];
+        }
+        printf("  %-8s %8.0f MB/s (sanitize + length + upper)\n", impls[k]->name, megabytes_per_second(start, clock()));
+    }
+    (void)sink;
+}
@@ -0,0 +1,33 @@
+#ifndef TEXTPROC_H
+#define TEXTPROC_H
+
+// Text pipeline for message content coming from clients. The common case -
+// plain printable ASCII - is checked 16 (SSE2) or 32 (AVX2) bytes at a time;
+// only blocks containing control bytes, escapes or multi-byte UTF-8 drop to
+// the byte-by-byte path. The implementation is picked once by textproc_init.
+
+// Select the fastest implementation for this CPU; returns its name.
+const char* textproc_init(void);
+
+// Clean up a possibly unterminated buffer in place:
+// - ANSI escape sequences (ESC [ ..., ESC ] ... BEL, ESC x) are removed
+// - other control bytes are removed, tabs become spaces
+// - invalid or truncated UTF-8 bytes become '?', C1 controls are removed
+// The result is always NUL-terminated within capacity. Returns its length.
+// *changed is set to 1 if anything was rewritten.
+int text_sanitize(char* text, int capacity, int* changed);
+
+// 1 if text_sanitize would leave the string as it is: no control bytes,
+// escapes, C1 controls or invalid UTF-8 before the NUL or capacity.
+int text_is_clean(const char* text, int capacity);
+
+// Length of a NUL-terminated string, looking at no more than capacity bytes.
+int text_length(const char* text, int capacity);
+
+// ASCII uppercase in place; multi-byte UTF-8 sequences are left untouched.
+void text_to_upper(char* text, int length);
+
+// Time the pipeline against the old strlen/toupper loop and print MB/s.
+void textproc_benchmark(void);
+
+#endif // TEXTPROC_H
@@ -0,0 +1,146 @@
+#include "timer_wheel.h"
+#include <stddef.h>
+
+#define TIMER_WHEEL_SPAN (1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+static void list_init(Timer* head) {
+    head->next = head;
+    head->prev = head;
+}
+
+static void list_append(Timer* head, Timer* timer) {
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static void list_unlink(Timer* timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+// Move every timer of one list onto another, leaving the source empty.
+static void list_splice(Timer* from, Timer* to) {
+    list_init(to);
+    if (from->next == from) {
+        return;
+    }
+    to->next = from->next;
+    to->prev = from->prev;
+    to->next->prev = to;
+    to->prev->next = to;
+    list_init(from);
+}
+
+// Put a timer into the slot matching how far away it expires.
+static void wheel_place(TimerWheel* wheel, Timer* timer) {
+    unsigned long long delta;
+    int level = 0;
+
+    if (timer->expires < wheel->now) {
+        timer->expires = wheel->now;
+    }
+    delta = timer->expires - wheel->now;
+    if (delta >= TIMER_WHEEL_SPAN) {
+        // Clamp far-away timers to the top of the wheel.
+        timer->expires = wheel->now + TIMER_WHEEL_SPAN - 1;
+        delta = TIMER_WHEEL_SPAN - 1;
+    }
+    while (level < TIMER_WHEEL_LEVELS - 1 &&
+           delta >= (1ULL << (TIMER_WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+
+    int slot = (int)((timer->expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK);
+    list_append(&wheel->slots[level][slot], timer);
+}
+
+// Redistribute one slot of a higher level into the levels below it.
+// Returns the slot index so the caller knows whether to cascade further up.
+static int wheel_cascade(TimerWheel* wheel, int level) {
+    int slot = (int)((wheel->now >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK);
+    Timer pending;
+
+    list_splice(&wheel->slots[level][slot], &pending);
+    while (pending.next != &pending) {
+        Timer* timer = pending.next;
+        list_unlink(timer);
+        wheel_place(wheel, timer);
+    }
+    return slot;
+}
+
+void timer_wheel_init(TimerWheel* wheel, unsigned long long now) {
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+            list_init(&wheel->slots[level][slot]);
+        }
+    }
+    wheel->now = now;
+    wheel->count = 0;
+}
+
+void timer_init(Timer* timer, TimerCallback callback, void* arg) {
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->expires = 0;
+    timer->callback = callback;
+    timer->arg = arg;
+}
+
+// Arm (or re-arm) a timer to fire after the given number of ticks.
+void timer_schedule(TimerWheel* wheel, Timer* timer, unsigned long long ticks) {
+    if (timer_pending(timer)) {
+        list_unlink(timer);
+    } else {
+        wheel->count++;
+    }
+    timer->expires = wheel->now + ticks;
+    wheel_place(wheel, timer);
+}
+
+void timer_cancel(TimerWheel* wheel, Timer* timer) {
+    if (timer_pending(timer)) {
+        list_unlink(timer);
+        wheel->count--;
+    }
+}
+
+int timer_pending(const Timer* timer) {
+    return timer->next != NULL;
+}
+
+// Process every tick up to and including 'now', running expired callbacks.
+// Callbacks may schedule or cancel timers, including their own.
+// Returns the number of timers that fired.
+int timer_wheel_advance(TimerWheel* wheel, unsigned long long now) {
+    int fired = 0;
+
+    while (wheel->now <= now) {
+        int slot = (int)(wheel->now & TIMER_WHEEL_MASK);
+        Timer expired;
+
+        if (slot == 0) {
+            for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+                if (wheel_cascade(wheel, level) != 0) {
+                    break;
+                }
+            }
+        }
+
+        list_splice(&wheel->slots[0][slot], &expired);
+        wheel->now++;
+
+        while (expired.next != &expired) {
+            Timer* timer = expired.next;
+            list_unlink(timer);
+            wheel->count--;
+            fired++;
+            timer->callback(timer->arg);
+        }
+    }
+    return fired;
+}
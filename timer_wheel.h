@@ -0,0 +1,38 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+// Hierarchical timing wheel: 4 levels of 64 slots, so a timer can be up to
+// 64^4 ticks away. Scheduling and cancelling are O(1); each tick only touches
+// the slot that expires (plus an occasional cascade from the level above).
+// The wheel does no locking of its own - the owner must serialize access.
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS 4
+
+typedef void (*TimerCallback)(void* arg);
+
+// A timer is embedded in its owner and linked into one wheel slot while armed.
+typedef struct Timer {
+    struct Timer* next;
+    struct Timer* prev;
+    unsigned long long expires;  // Absolute tick at which the timer fires
+    TimerCallback callback;
+    void* arg;
+} Timer;
+
+typedef struct {
+    unsigned long long now;  // Next tick to be processed
+    Timer slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];  // List heads
+    int count;               // Number of armed timers
+} TimerWheel;
+
+void timer_wheel_init(TimerWheel* wheel, unsigned long long now);
+void timer_init(Timer* timer, TimerCallback callback, void* arg);
+void timer_schedule(TimerWheel* wheel, Timer* timer, unsigned long long ticks);
+void timer_cancel(TimerWheel* wheel, Timer* timer);
+int timer_pending(const Timer* timer);
+int timer_wheel_advance(TimerWheel* wheel, unsigned long long now);
+
+#endif // TIMER_WHEEL_H
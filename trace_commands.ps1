@@ -0,0 +1,77 @@
+# trace_commands.ps1
+#
+# Records the server's trace events (see probes.h) for a while and prints a
+# latency histogram per command, from each CommandStart to the CommandFinish
+# on the same thread. Run it from an elevated prompt while server.exe runs:
+#
+#     powershell -ExecutionPolicy Bypass -File trace_commands.ps1 -Seconds 30
+#
+# The .etl file it leaves behind can also be opened in WPA.
+
+param(
+    [int]$Seconds = 30,
+    [string]$Output = "chat_trace"
+)
+
+$provider = "{7f9a5430-5f60-5d45-9dd5-d793e2a73c9d}"   # LanChat-Server
+$session = "LanChatServerTrace"
+
+logman create trace $session -p $provider 0xffffffffffffffff 0xff -o "$Output.etl" -ets | Out-Null
+if ($LASTEXITCODE -ne 0) {
+    Write-Error "Could not start the trace session (is the prompt elevated?)"
+    exit 1
+}
+Write-Host "Tracing for $Seconds seconds..."
+Start-Sleep -Seconds $Seconds
+logman stop $session -ets | Out-Null
+
+tracerpt "$Output.etl" -o "$Output.xml" -of XML -y | Out-Null
+[xml]$events = Get-Content "$Output.xml"
+
+$started = @{}      # Thread id -> start time in 100 ns ticks
+$samples = @{}      # Command name -> latencies in microseconds
+
+foreach ($event in $events.Events.Event) {
+    $name = $event.RenderingInfo.Task
+    if ($name -ne "CommandStart" -and $name -ne "CommandFinish") {
+        continue
+    }
+    $thread = $event.System.Execution.ThreadID
+    $ticks = [DateTimeOffset]::Parse($event.System.TimeCreated.SystemTime).UtcTicks
+    if ($name -eq "CommandStart") {
+        $started[$thread] = $ticks
+    } elseif ($started.ContainsKey($thread)) {
+        $command = ($event.EventData.Data | Where-Object { $_.Name -eq "Name" }).'#text'
+        if (-not $samples.ContainsKey($command)) {
+            $samples[$command] = New-Object System.Collections.Generic.List[double]
+        }
+        $samples[$command].Add(($ticks - $started[$thread]) / 10.0)
+        $started.Remove($thread)
+    }
+}
+
+if ($samples.Count -eq 0) {
+    Write-Host "No commands were handled while tracing."
+    exit 0
+}
+
+# Power of two buckets in microseconds, as in the server's [latency] lines.
+foreach ($command in $samples.Keys | Sort-Object) {
+    $values = $samples[$command] | Sort-Object
+    $count = $values.Count
+    $p50 = $values[[int][Math]::Floor(($count - 1) * 0.50)]
+    $p99 = $values[[int][Math]::Floor(($count - 1) * 0.99)]
+    Write-Host ("/{0}  n={1} p50={2:N1}us p99={3:N1}us max={4:N1}us" -f $command, $count, $p50, $p99, $values[$count - 1])
+
+    $buckets = @{}
+    foreach ($value in $values) {
+        $bucket = [Math]::Max(0, [int][Math]::Floor([Math]::Log([Math]::Max($value, 1), 2)))
+        $buckets[$bucket] = 1 + $(if ($buckets.ContainsKey($bucket)) { $buckets[$bucket] } else { 0 })
+    }
+    $largest = ($buckets.Values | Measure-Object -Maximum).Maximum
+    foreach ($bucket in $buckets.Keys | Sort-Object) {
+        $low = [Math]::Pow(2, $bucket)
+        $bar = "#" * [Math]::Max(1, [int](40 * $buckets[$bucket] / $largest))
+        Write-Host ("  {0,8} - {1,-8} {2,6} {3}" -f $low, (2 * $low), $buckets[$bucket], $bar)
+    }
+}